@@ -2,69 +2,805 @@
 """
 Bridge Server for Search Engine
 Connects the C backend with the HTML frontend via HTTP
-No modifications needed to either searchEngine.c or index.html
+Runs the engine as searchCLI.exe processes, built from searchCLI.c and
+searchEngine.c, or in process through a shared library build of
+searchEngine.c (SEARCH_ENGINE_LIBRARY)
 """
 
-from http.server import HTTPServer, BaseHTTPRequestHandler
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
 import json
 import subprocess
 import os
-import tempfile
 import re
 import urllib.request
 import urllib.error
+import urllib.parse
+import threading
+import hashlib
+import atexit
+import struct
+import shlex
+import socket
+import queue
+import contextlib
+import ctypes
+from concurrent.futures import Future, ThreadPoolExecutor
+from concurrent.futures import TimeoutError as FutureTimeoutError
 
 # Configuration
 PORT = 8080
 OLLAMA_API_URL = "http://localhost:11434/api/generate"
 OLLAMA_MODEL = "gemma:2b"  # Better quality model
-C_EXECUTABLE = "./search_engine"  # Path to compiled C program
+CLI_TIMEOUT = 10  # Seconds to wait for one searchCLI response
+# The corpus is split by document across this many resident searchCLI
+# processes, or across the ';'-separated commands in SEARCH_SHARD_COMMANDS
+# (each one running 'searchCLI serve', locally or e.g. through ssh)
+SEARCH_SHARDS = int(os.environ.get('SEARCH_SHARDS', '1'))
+SEARCH_SHARD_COMMANDS = os.environ.get('SEARCH_SHARD_COMMANDS', '')
+# Local shards run 'searchCLI listen' and are reached through this many
+# persistent connections each, with at most ENGINE_IN_FLIGHT requests
+# outstanding per connection (the engine's own limit is 32)
+ENGINE_CONNECTIONS = int(os.environ.get('SEARCH_ENGINE_CONNECTIONS', '4'))
+ENGINE_IN_FLIGHT = int(os.environ.get('SEARCH_ENGINE_IN_FLIGHT', '32'))
+# searchCLI processes /api/analyze requests take turns on
+ANALYZE_PROCESSES = int(os.environ.get('SEARCH_ANALYZE_PROCESSES', '2'))
+PREFIX_TOP_K = 100  # Most completions one prefix query returns
+# Engine settings sent to every searchCLI process it starts: 'default',
+# 'none' or a list of stop words, and 'on' to write dense terms as bitmaps
+SEARCH_STOP_WORDS = os.environ.get('SEARCH_STOP_WORDS', '')
+SEARCH_BITMAP_TERMS = os.environ.get('SEARCH_BITMAP_TERMS', '')
+# A shared library build of searchEngine.c (see searchEngine.h); when set,
+# local shards run their engines in this process, one handle each, instead
+# of in 'searchCLI listen' processes. Analyses still use searchCLI processes
+SEARCH_ENGINE_LIBRARY = os.environ.get('SEARCH_ENGINE_LIBRARY', '')
+
+# Binary query results of 'searchCLI serve' (see searchEngine.h)
+RESULT_SEARCH, RESULT_FREQ, RESULT_MULTI, RESULT_RANK, RESULT_PREFIX = range(1, 6)
+RESULT_BATCH = 6
+RESULT_PHRASE, RESULT_NEAR = 7, 8
+RESULT_BOOLEAN, RESULT_FUZZY = 9, 10
+
+def engine_settings():
+    """Requests that configure a fresh engine from the environment"""
+    settings = []
+    if SEARCH_STOP_WORDS:
+        settings.append(('stopwords', SEARCH_STOP_WORDS))
+    if SEARCH_BITMAP_TERMS:
+        settings.append(('bitmaps', SEARCH_BITMAP_TERMS))
+    return [(command, payload.encode('utf-8'))
+            for command, payload in settings]
+
+def decode_response(body):
+    """A response body: JSON, or a binary record"""
+    if body.startswith(b'{'):
+        return json.loads(body)
+    return decode_result(body)
+
+def decode_batch(body):
+    """Rebuild the JSON form of a binary batch record"""
+    _, count = struct.unpack_from('=2I', body)
+    results, offset = [], 8
+    for _ in range(count):
+        length, = struct.unpack_from('=I', body, offset)
+        offset += 4
+        results.append(decode_response(body[offset:offset + length]))
+        offset += length
+    return {'success': True, 'count': count, 'results': results}
+
+def decode_result(body):
+    """Rebuild the JSON form of a binary query result record"""
+    if struct.unpack_from('=I', body)[0] == RESULT_BATCH:
+        return decode_batch(body)
+    kind, found, count, total_freq = struct.unpack_from('=4I', body)
+    words = memoryview(body)[16:16 + 4 * (4 * count + 2)].cast('I')
+    doc_ids = words[0:count]
+    values = words[count:2 * count]
+    word_counts = words[2 * count:3 * count]
+    offsets = words[3 * count:4 * count + 2]
+    strings = body[16 + 4 * len(words):]
+    text = [strings[offsets[i]:offsets[i + 1]].decode('utf-8', 'replace')
+            for i in range(count + 1)]
+    query, names = text[0], text[1:]
+    suggestion = strings[offsets[count + 1]:].decode('utf-8', 'replace')
+
+    if kind == RESULT_PREFIX:
+        return {'success': True, 'prefix': query, 'found': bool(found),
+                'words': [{'word': names[i], 'frequency': values[i],
+                           'doc_count': word_counts[i]}
+                          for i in range(count)]}
+    if kind == RESULT_FUZZY:
+        return {'success': True, 'word': query, 'found': bool(found),
+                'words': [{'word': names[i], 'distance': doc_ids[i],
+                           'frequency': values[i],
+                           'doc_count': word_counts[i]}
+                          for i in range(count)]}
+    if kind == RESULT_FREQ:
+        return {'success': True, 'word': query, 'found': bool(found),
+                'total_freq': total_freq,
+                'documents': [{'doc_id': doc_ids[i], 'filename': names[i],
+                               'frequency': values[i]}
+                              for i in range(count)]}
+
+    if kind == RESULT_RANK:
+        scores = [value / 10000 for value in values]  # Ten-thousandths
+        score_field = 'score'
+    else:
+        scores = values
+        score_field = ('score' if kind in (RESULT_MULTI, RESULT_BOOLEAN)
+                       else 'frequency')
+    results = [{'doc_id': doc_ids[i], 'filename': names[i],
+                score_field: scores[i], 'word_count': word_counts[i]}
+               for i in range(count)]
+    if kind == RESULT_SEARCH:
+        result = {'success': True, 'keyword': query, 'found': bool(found)}
+        if found:
+            result['total_freq'] = total_freq
+    elif kind == RESULT_BOOLEAN:
+        result = {'success': True, 'query': query, 'found': bool(found)}
+    else:
+        keywords = query.split(' ') if query else []
+        result = {'success': True, 'keywords': keywords, 'found': bool(found)}
+    result['results'] = results
+    if suggestion:
+        result['did_you_mean'] = suggestion
+    return result
+
+class SearchCLIConnection:
+    """Persistent 'searchCLI serve' process speaking the framed protocol"""
+    def __init__(self, cli_path, command=None):
+        self.cli_path = cli_path
+        self.command = command or [cli_path, 'serve']
+        self.proc = None
+        self.loaded_digest = None  # Content currently indexed in the process
+        self.setup_pending = False
+        self.executor = None  # Runs submitted requests, one at a time
+
+    def _start(self):
+        self.proc = subprocess.Popen(
+            self.command,
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.DEVNULL
+        )
+        self.loaded_digest = None
+        self.setup_pending = True
+
+    def start(self):
+        self.close()
+        self._start()
+
+    def alive(self):
+        return self.proc is not None and self.proc.poll() is None
+
+    def _setup_requests(self):
+        """Requests that configure a fresh process; query results come back
+        as binary records, with no JSON to parse"""
+        return [('format', b'binary')] + engine_settings()
+
+    def _read_response(self, proc):
+        """One framed response: a length line, then that many bytes"""
+        header = proc.stdout.readline()
+        if not header.endswith(b'\n'):
+            return None
+        body = proc.stdout.read(int(header))
+        if len(body) != int(header):
+            return None
+        return body
+
+    def close(self):
+        """Stop the process; the next request starts a fresh one"""
+        if self.proc is not None:
+            if self.proc.poll() is None:
+                self.proc.kill()
+            self.proc.wait()
+            self.proc = None
+
+    def request(self, command, payload=b''):
+        """Send one framed request and return the parsed JSON response"""
+        if self.proc is None or self.proc.poll() is not None:
+            self._start()
+
+        # A hung engine would block readline() forever
+        expired = threading.Event()
+        proc = self.proc
+        def on_timeout():
+            expired.set()
+            proc.kill()
+        watchdog = threading.Timer(CLI_TIMEOUT, on_timeout)
+        watchdog.start()
+        try:
+            request = f"{command} {len(payload)}\n".encode() + payload
+            setup = self._setup_requests() if self.setup_pending else []
+            # Sent ahead in the same write; from the format response on,
+            # every response is framed
+            request = b''.join(f"{name} {len(data)}\n".encode() + data
+                               for name, data in setup) + request
+            proc.stdin.write(request)
+            proc.stdin.flush()
+            for _ in setup:
+                self._read_response(proc)
+            self.setup_pending = False
+            body = self._read_response(proc)
+        except (OSError, ValueError):
+            body = None
+        finally:
+            watchdog.cancel()
+
+        if body is None:
+            self.close()
+            if expired.is_set():
+                raise subprocess.TimeoutExpired(self.cli_path, CLI_TIMEOUT)
+            raise ValueError("C engine exited unexpectedly")
+        return decode_response(body)
+
+    def submit(self, command, payload=b''):
+        """request() on a thread of the connection's own; returns a Future
+        of the response. The pipe still carries one request at a time"""
+        if self.executor is None:
+            self.executor = ThreadPoolExecutor(max_workers=1)
+        return self.executor.submit(self.request, command, payload)
+
+    def batch(self, queries):
+        """Answer (command, argument) queries in one round trip; returns
+        their responses in order"""
+        payload = '\n'.join(f"{command} {argument}"
+                            for command, argument in queries)
+        return self.request('batch', payload.encode('utf-8'))['results']
+
+    def analyze(self, content, action, query):
+        """Run one query against content, re-indexing only when it changed"""
+        data = content.encode('utf-8')
+        digest = hashlib.sha1(data).digest()
+        if digest != self.loaded_digest:
+            self.request('reset')
+            self.request('index', b'uploaded_doc\n' + data)
+            self.loaded_digest = digest
+        return self.request(action, query.encode('utf-8'))
+
+class EngineConnection:
+    """One TCP connection to a 'searchCLI listen' process. Requests carry
+    ids and are pipelined; a reader thread resolves each response's Future
+    as it arrives, in whatever order the engine finishes them"""
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.pending = {}  # Request id -> Future
+        self.next_id = 0
+        self.closed = False
+        self.in_flight = 0  # Counted by the EngineServer
+        self.lock = threading.Lock()  # Guards pending, next_id and closed
+        # Held while a request is written, which blocks while the engine
+        # pushes back; responses are still read meanwhile
+        self.send_lock = threading.Lock()
+        threading.Thread(target=self._read_responses,
+                         args=(self.sock.makefile('rb'),),
+                         daemon=True).start()
+
+    def send(self, command, payload=b''):
+        """Send one request; returns a Future of the parsed response"""
+        future = Future()
+        with self.lock:
+            if self.closed:
+                raise ConnectionError("C engine exited unexpectedly")
+            self.next_id += 1
+            request_id = self.next_id
+            self.pending[request_id] = future
+        request = f"{request_id} {command} {len(payload)}\n".encode() + payload
+        try:
+            with self.send_lock:
+                self.sock.sendall(request)
+        except OSError:
+            self.close()
+        return future
+
+    def _read_responses(self, stream):
+        """Framed responses: '<id> <length>' lines, then that many bytes"""
+        try:
+            while True:
+                header = stream.readline()
+                if not header.endswith(b'\n'):
+                    break
+                request_id, length = (int(field) for field in header.split())
+                body = stream.read(length)
+                if len(body) != length:
+                    break
+                with self.lock:
+                    future = self.pending.pop(request_id, None)
+                if future is None:
+                    continue  # Its caller gave up waiting
+                try:
+                    future.set_result(decode_response(body))
+                except (ValueError, struct.error) as e:
+                    future.set_exception(e)
+        except (OSError, ValueError):
+            pass
+        self.close()
+
+    def close(self):
+        """Fail whatever is still waiting for a response"""
+        with self.lock:
+            self.closed = True
+            pending, self.pending = self.pending, {}
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+        self.sock.close()
+        for future in pending.values():
+            future.set_exception(ConnectionError("C engine exited unexpectedly"))
+
+class EngineServer:
+    """A resident 'searchCLI listen' process reached through a pool of
+    persistent connections, so concurrent web requests share a few engine
+    connections and a slow query holds up no one else's. Each request goes
+    to the connection with the fewest outstanding; when every connection
+    has ENGINE_IN_FLIGHT, it waits for room, up to CLI_TIMEOUT"""
+    def __init__(self, cli_path):
+        self.cli_path = cli_path
+        self.proc = None
+        self.connections = []
+        self.room = threading.Condition()  # Guards the in_flight counts
+
+    def start(self):
+        self.close()
+        self.proc = subprocess.Popen(
+            [self.cli_path, 'listen', '127.0.0.1:0'],
+            stdin=subprocess.DEVNULL,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.DEVNULL
+        )
+        line = self.proc.stdout.readline()
+        ready = json.loads(line) if line.startswith(b'{') else {}
+        if not ready.get('success'):
+            self.close()
+            raise ValueError("C engine did not start")
+        self.connections = [EngineConnection(ready['port'])
+                            for _ in range(max(ENGINE_CONNECTIONS, 1))]
+        # Query results come back as binary records, with no JSON to parse
+        setup = [conn.send('format', b'binary') for conn in self.connections]
+        setup += [self.connections[0].send(command, payload)
+                  for command, payload in engine_settings()]
+        for future in setup:
+            future.result(timeout=CLI_TIMEOUT)
+
+    def alive(self):
+        return (self.proc is not None and self.proc.poll() is None and
+                not any(conn.closed for conn in self.connections))
+
+    def _release(self, conn):
+        with self.room:
+            conn.in_flight -= 1
+            self.room.notify()
+
+    def submit(self, command, payload=b''):
+        """Send a request; returns a Future of the parsed response"""
+        connections = self.connections
+        with self.room:
+            if not self.room.wait_for(
+                    lambda: min(c.in_flight for c in connections)
+                    < ENGINE_IN_FLIGHT, CLI_TIMEOUT):
+                raise subprocess.TimeoutExpired(self.cli_path, CLI_TIMEOUT)
+            conn = min(connections, key=lambda c: c.in_flight)
+            conn.in_flight += 1
+        try:
+            future = conn.send(command, payload)
+        except ConnectionError:
+            self._release(conn)
+            raise
+        future.add_done_callback(lambda _: self._release(conn))
+        return future
+
+    def close(self):
+        for conn in self.connections:
+            conn.close()
+        self.connections = []
+        if self.proc is not None:
+            if self.proc.poll() is None:
+                self.proc.kill()
+            self.proc.wait()
+            self.proc = None
+
+class LibraryEngine:
+    """An engine of a shared library build of searchEngine.c, called in
+    process through ctypes on a handle of its own. Calls on one handle must
+    not overlap, so its requests take turns on one thread of its own, while
+    other shards' handles work at the same time; ctypes lets go of the GIL
+    while the engine works"""
+    def __init__(self, path):
+        self.path = path
+        self.lib = None
+        self.handle = None
+        self.executor = None
+
+    def start(self):
+        self.close()
+        lib = ctypes.CDLL(os.path.abspath(self.path))
+        lib.search_open.argtypes = [ctypes.c_char_p]
+        lib.search_open.restype = ctypes.c_void_p
+        lib.search_request.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                                       ctypes.c_char_p, ctypes.c_size_t,
+                                       ctypes.POINTER(ctypes.c_size_t)]
+        lib.search_request.restype = ctypes.c_void_p
+        lib.search_free.argtypes = [ctypes.c_void_p]
+        lib.search_free.restype = None
+        lib.search_close.argtypes = [ctypes.c_void_p]
+        lib.search_close.restype = None
+        handle = lib.search_open(None)
+        if not handle:
+            raise MemoryError("C engine ran out of memory")
+        self.lib = lib
+        self.handle = handle
+        self.executor = ThreadPoolExecutor(max_workers=1)
+        # Query results come back as binary records, with no JSON to parse
+        for command, payload in [('format', b'binary')] + engine_settings():
+            self._request(command, payload)
+
+    def alive(self):
+        return self.lib is not None
+
+    def _request(self, command, payload):
+        length = ctypes.c_size_t()
+        response = self.lib.search_request(self.handle, command.encode(),
+                                           payload, len(payload),
+                                           ctypes.byref(length))
+        if not response:
+            raise MemoryError("C engine ran out of memory")
+        try:
+            return decode_response(ctypes.string_at(response, length.value))
+        finally:
+            self.lib.search_free(response)
+
+    def submit(self, command, payload=b''):
+        """Answer a request on the engine's thread; returns a Future of the
+        parsed response"""
+        return self.executor.submit(self._request, command, payload)
+
+    def close(self):
+        if self.lib is not None:
+            self.executor.shutdown(wait=True)
+            self.lib.search_close(self.handle)
+            self.lib = None
+            self.handle = None
+
+class SearchCLIPool:
+    """A few persistent 'searchCLI serve' processes for analyses, each used
+    by one request at a time; a request waits up to CLI_TIMEOUT for one to
+    come free"""
+    def __init__(self, cli_path, size=ANALYZE_PROCESSES):
+        self.cli_path = cli_path
+        self.connections = [SearchCLIConnection(cli_path)
+                            for _ in range(max(size, 1))]
+        self.idle = queue.LifoQueue()  # The last one used likely has the content
+        for conn in self.connections:
+            self.idle.put(conn)
+        atexit.register(self.close_all)
+
+    @contextlib.contextmanager
+    def get(self):
+        try:
+            conn = self.idle.get(timeout=CLI_TIMEOUT)
+        except queue.Empty:
+            raise subprocess.TimeoutExpired(self.cli_path, CLI_TIMEOUT)
+        try:
+            yield conn
+        finally:
+            self.idle.put(conn)
+
+    def close_all(self):
+        for conn in self.connections:
+            conn.close()
 
 class SearchEngineState:
-    """Maintains search engine state across requests"""
-    def __init__(self):
-        self.documents = {}  # doc_id -> {name, content, words}
-        self.doc_counter = 0
-        self.temp_dir = tempfile.mkdtemp()
-        
+    """One shard of the corpus: its documents are indexed and searched by one
+    resident searchCLI process, and kept here only to list them and re-index
+    them if that process has to be restarted. A local shard is an
+    EngineServer, or the LibraryEngine of library; a shard started from a
+    command speaks 'searchCLI serve' over its pipes, one request at a time"""
+    def __init__(self, cli_path, command=None, library=None):
+        self.documents = {}  # doc_id -> {id, name, content, words}
+        if library:
+            self.engine = LibraryEngine(library)
+        elif command is None:
+            self.engine = EngineServer(cli_path)
+        else:
+            self.engine = SearchCLIConnection(cli_path, command)
+        self.lock = threading.Lock()
+        atexit.register(self.engine.close)
+
+    def submit(self, command, payload=b''):
+        """Send a request; returns a Future of the parsed response"""
+        with self.lock:
+            if not self.engine.alive():
+                # A new process starts empty; doc ids follow insertion order
+                self.engine.start()
+                for doc_id in sorted(self.documents):
+                    doc = self.documents[doc_id]
+                    self.result(self.engine.submit('index',
+                                                   self._index_payload(doc)))
+            return self.engine.submit(command, payload)
+
+    @staticmethod
+    def result(future):
+        """Wait for a submitted request's response"""
+        try:
+            return future.result(timeout=CLI_TIMEOUT)
+        except FutureTimeoutError:
+            raise subprocess.TimeoutExpired('searchCLI', CLI_TIMEOUT)
+
+    def _request(self, command, payload=b''):
+        return self.result(self.submit(command, payload))
+
+    @staticmethod
+    def _index_payload(doc):
+        name = doc['name'].replace('\n', ' ')
+        return f"{name}\n{doc['content']}".encode('utf-8')
+
     def add_document(self, name, content):
-        """Add document and return its ID"""
-        doc_id = self.doc_counter
-        self.documents[doc_id] = {
-            'id': doc_id,
-            'name': name,
-            'content': content,
-            'words': len(content.split())
-        }
-        self.doc_counter += 1
-        return doc_id
-    
+        """Index a document; returns the engine's index response"""
+        doc = {'id': None, 'name': name, 'content': content, 'words': 0}
+        result = self._request('index', self._index_payload(doc))
+        doc['id'] = result['doc_id']
+        doc['words'] = result['word_count']
+        with self.lock:
+            self.documents[doc['id']] = doc
+        return result
+
     def get_document(self, doc_id):
         """Get document by ID"""
         return self.documents.get(doc_id)
-    
+
     def get_all_documents(self):
         """Get all documents"""
         return list(self.documents.values())
-    
+
     def get_stats(self):
         """Get search engine statistics"""
-        all_words = []
-        total_words = 0
-        for doc in self.documents.values():
-            words = doc['content'].lower().split()
-            all_words.extend(words)
-            total_words += len(words)
-        
-        unique_words = len(set(all_words))
-        return {
-            'totalDocs': len(self.documents),
-            'uniqueWords': unique_words,
-            'totalIndexed': total_words
+        stats = self._request('stats')
+        result = {
+            'totalDocs': stats['documents'],
+            'uniqueWords': stats['terms'],
+            'totalIndexed': stats['words']
         }
+        if 'metrics' in stats:  # Unless searchCLI was built without them
+            result['engineMetrics'] = stats['metrics']
+        return result
+
+    def query(self, command, argument):
+        """One search, prefix, fuzzy, multi, rank, freq, phrase, near or
+        boolean query on the corpus"""
+        return self._request(command, argument.encode('utf-8'))
+
+    def submit_query(self, command, argument):
+        """query() without waiting; returns a Future of the response"""
+        return self.submit(command, argument.encode('utf-8'))
+
+def split_prefix_query(argument):
+    """The prefix and limit of a "<prefix> [limit]" query, split as
+    searchCLI splits it"""
+    prefix = re.match(r'[^ \t\r\n]*', argument).group()
+    match = re.match(r'\s*([+-]?\d+)', argument[len(prefix):])
+    limit = int(match.group(1)) if match else 0
+    return prefix, limit if 0 < limit <= PREFIX_TOP_K else PREFIX_TOP_K
+
+class ShardedSearchEngine:
+    """The corpus partitioned by document across shards. Documents are dealt
+    to the shards in turn, and each global doc id maps to its shard and its
+    doc id there. Queries are sent to every shard at once and their answers
+    merged into what a single engine holding every document would return:
+    document lists in global doc id order, and BM25 scores computed from the
+    whole corpus's statistics, which the shards report and are then given
+    back. Prefix and fuzzy words are merged from each shard's best with
+    their exact totals, so a word that ranks high overall without ranking
+    high on any shard can be missed."""
+    def __init__(self, cli_path, count=1, commands=None, library=None):
+        commands = commands or [None] * count
+        if library and any(commands):
+            # The library runs engines in this process, not elsewhere
+            print("⚠️  SEARCH_ENGINE_LIBRARY serves local shards only; "
+                  "using SEARCH_SHARD_COMMANDS")
+            library = None
+        self.shards = [SearchEngineState(cli_path, command, library)
+                       for command in commands]
+        self.locations = {}  # Global doc id -> (shard, doc id there)
+        self.global_ids = [{} for _ in self.shards]  # Per shard, the reverse
+        self.next_id = 0
+        self.lock = threading.Lock()
+
+    @property
+    def documents(self):
+        """Global doc id -> document"""
+        with self.lock:
+            return {doc_id: self._document(doc_id)
+                    for doc_id in self.locations}
+
+    def _document(self, doc_id):
+        shard, local_id = self.locations[doc_id]
+        doc = self.shards[shard].get_document(local_id)
+        return doc and dict(doc, id=doc_id)
+
+    def _scatter(self, command, arguments):
+        """Send command to every shard, with one argument per shard or the
+        same one to all; returns their responses in shard order"""
+        if isinstance(arguments, str):
+            arguments = [arguments] * len(self.shards)
+        futures = [shard.submit_query(command, argument)
+                   for shard, argument in zip(self.shards, arguments)]
+        return [shard.result(future)
+                for shard, future in zip(self.shards, futures)]
+
+    def _global_docs(self, shard, docs):
+        """Move a shard's documents onto global doc ids"""
+        ids = self.global_ids[shard]
+        return [dict(doc, doc_id=ids[doc['doc_id']]) for doc in docs]
+
+    def add_document(self, name, content):
+        """Index a document on the next shard; returns the index response,
+        with the global doc id"""
+        with self.lock:
+            doc_id = self.next_id
+            self.next_id += 1
+        shard = doc_id % len(self.shards)
+        result = self.shards[shard].add_document(name, content)
+        with self.lock:
+            self.locations[doc_id] = (shard, result['doc_id'])
+            self.global_ids[shard][result['doc_id']] = doc_id
+        return dict(result, doc_id=doc_id)
+
+    def get_document(self, doc_id):
+        """Get document by (global) ID"""
+        with self.lock:
+            return self._document(doc_id) if doc_id in self.locations else None
+
+    def get_all_documents(self):
+        """Get all documents"""
+        return list(self.documents.values())
+
+    def get_stats(self):
+        """Search engine statistics summed over the shards, with each
+        shard's engine metrics; distinct words are counted over the union
+        of the shards' vocabularies, as a word can be on several"""
+        stats = [shard.get_stats() for shard in self.shards]
+        if len(stats) == 1:
+            return stats[0]
+        result = {key: sum(s[key] for s in stats)
+                  for key in ('totalDocs', 'totalIndexed')}
+        words = set()
+        for vocabulary in self._scatter('vocabulary', ''):
+            words.update(vocabulary['terms'])
+        result['uniqueWords'] = len(words)
+        if 'engineMetrics' in stats[0]:
+            result['engineMetrics'] = [s['engineMetrics'] for s in stats]
+        return result
+
+    def _term_stats(self, shard, words):
+        """Exact total frequency and document count on a shard per word"""
+        words = list(dict.fromkeys(words))
+        totals = {}
+        for i in range(0, len(words), 32):  # MAX_QUERY_TERMS per request
+            chunk = ' '.join(words[i:i + 32])
+            for term in self.shards[shard].query('term_stats',
+                                                 chunk)['terms']:
+                totals[term['word']] = (term['total_freq'], term['doc_freq'])
+        return totals
+
+    def _keywords_found(self, keywords):
+        """Whether every keyword is indexed on at least one shard"""
+        if not keywords:
+            return False
+        found = set()
+        for stats in self._scatter('term_stats', ' '.join(keywords)):
+            found.update(term['word'] for term in stats['terms']
+                         if term['doc_freq'] > 0)
+        return all(word in found for word in keywords)
+
+    def _merge_words(self, responses, complete):
+        """Sum each word's frequency and document count over the shards'
+        word lists; a shard whose list was cut short by its limit (not
+        complete) is asked for the words it did not list"""
+        words = {}
+        for response in responses:
+            for entry in response['words']:
+                words.setdefault(entry['word'], dict(entry, frequency=0,
+                                                     doc_count=0))
+        for shard, response in enumerate(responses):
+            listed = {entry['word']: entry for entry in response['words']}
+            missing = [word for word in words if word not in listed]
+            if missing and not complete[shard]:
+                for word, (freq, docs) in self._term_stats(shard,
+                                                           missing).items():
+                    listed[word] = {'frequency': freq, 'doc_count': docs}
+            for word, entry in listed.items():
+                words[word]['frequency'] += entry['frequency']
+                words[word]['doc_count'] += entry['doc_count']
+        return list(words.values())
+
+    def _prefix(self, argument):
+        prefix, limit = split_prefix_query(argument)
+        responses = self._scatter('prefix', f"{prefix} {PREFIX_TOP_K}")
+        words = self._merge_words(
+            responses, [len(r['words']) < PREFIX_TOP_K for r in responses])
+        words.sort(key=lambda w: (-w['frequency'], w['word']))
+        return {'success': True, 'prefix': responses[0]['prefix'],
+                'found': bool(words), 'words': words[:limit]}
+
+    def _fuzzy(self, argument):
+        responses = self._scatter('fuzzy', argument)
+        words = self._merge_words(
+            responses, [len(r['words']) < 10 for r in responses])
+        words.sort(key=lambda w: (w['distance'], -w['frequency'], w['word']))
+        return {'success': True, 'word': responses[0]['word'],
+                'found': bool(words), 'words': words[:10]}
+
+    def _rank(self, argument):
+        # Score every shard's documents with the whole corpus's statistics
+        keywords = ' '.join(argument.split())
+        stats = self._scatter('term_stats', keywords)
+        doc_freqs = [sum(s['terms'][i]['doc_freq'] for s in stats)
+                     for i in range(len(stats[0]['terms']))]
+        corpus = ' '.join(str(n) for n in
+                          [sum(s['documents'] for s in stats),
+                           sum(s['words'] for s in stats)] + doc_freqs)
+        responses = self._scatter('rank', f"{keywords}\n{corpus}")
+        results = [doc for shard, r in enumerate(responses)
+                   for doc in self._global_docs(shard, r['results'])]
+        # Each shard ranks on the reported score, then doc id, as here
+        results.sort(key=lambda doc: (-doc['score'], doc['doc_id']))
+        return {'success': True, 'keywords': responses[0]['keywords'],
+                'found': any(r['found'] for r in responses),
+                'results': results[:10]}
+
+    def _documents(self, command, argument):
+        """A query answered with documents: every shard's, in doc id order"""
+        responses = self._scatter(command, argument)
+        failed = [r for r in responses if not r['success']]
+        if failed:
+            return failed[0]
+        field = 'documents' if command == 'freq' else 'results'
+        docs = [doc for shard, r in enumerate(responses)
+                for doc in self._global_docs(shard, r[field])]
+        docs.sort(key=lambda doc: doc['doc_id'])
+        result = dict(responses[0], found=any(r['found'] for r in responses))
+        if command in ('multi', 'phrase', 'near') and not result['found']:
+            # A shard missing one keyword reports not found; the corpus has
+            # the query's words if each of them is on some shard
+            result['found'] = self._keywords_found(result['keywords'])
+        result[field] = docs
+        result.pop('did_you_mean', None)
+        if command in ('search', 'freq'):
+            found = [r for r in responses if r['found']]
+            result.pop('total_freq', None)
+            if found or command == 'freq':
+                result['total_freq'] = sum(r['total_freq'] for r in found)
+            elif any('did_you_mean' in r for r in responses):
+                # Every shard missed, and some know a close word
+                suggestions = self._fuzzy(result['keyword'])['words']
+                if suggestions:
+                    result['did_you_mean'] = suggestions[0]['word']
+        return result
+
+    def query(self, command, argument):
+        """One search, prefix, fuzzy, multi, rank, freq, phrase, near or
+        boolean query on the corpus"""
+        if len(self.shards) == 1:
+            result = self.shards[0].query(command, argument)
+            return dict(result, **{field: self._global_docs(0, result[field])
+                                   for field in ('results', 'documents')
+                                   if field in result})
+        if command == 'prefix':
+            return self._prefix(argument)
+        if command == 'fuzzy':
+            return self._fuzzy(argument)
+        if command == 'rank':
+            return self._rank(argument)
+        return self._documents(command, argument)
 
 # Global state
-engine_state = SearchEngineState()
+cli_pool = SearchCLIPool(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'searchCLI.exe'))
+engine_state = ShardedSearchEngine(
+    cli_pool.cli_path, SEARCH_SHARDS,
+    [shlex.split(command) for command in SEARCH_SHARD_COMMANDS.split(';')
+     if command.strip()],
+    SEARCH_ENGINE_LIBRARY)
 
 def load_documents_from_folder():
     """Load all .txt files from documents folder on startup"""
@@ -86,8 +822,8 @@ def load_documents_from_folder():
         try:
             with open(filepath, 'r', encoding='utf-8') as f:
                 content = f.read()
-                doc_id = engine_state.add_document(filename, content)
-                print(f"  ✓ Indexed: {filename} (ID: {doc_id})")
+                result = engine_state.add_document(filename, content)
+                print(f"  ✓ Indexed: {filename} (ID: {result['doc_id']})")
         except Exception as e:
             print(f"  ✗ Error loading {filename}: {e}")
     
@@ -187,11 +923,13 @@ class BridgeHandler(BaseHTTPRequestHandler):
             name = data.get('name', 'untitled.txt')
             content = data.get('content', '')
             
-            # Add to state
-            doc_id = engine_state.add_document(name, content)
-            
-            # Simulate C backend processing
-            result = self._simulate_c_indexing(name, content, doc_id)
+            indexed = engine_state.add_document(name, content)
+            result = {
+                'success': True,
+                'doc_id': indexed['doc_id'],
+                'name': name,
+                'words_indexed': indexed['word_count']
+            }
             
             self._set_headers()
             self.wfile.write(json.dumps(result).encode())
@@ -220,21 +958,21 @@ class BridgeHandler(BaseHTTPRequestHandler):
             self._set_headers(500)
             self.wfile.write(json.dumps({'error': str(e)}).encode())
     
+    def _query_params(self):
+        """The parameters of the request's query string, percent-decoded
+        and with '+' as a space; the first value of each"""
+        query_string = urllib.parse.urlsplit(self.path).query
+        params = urllib.parse.parse_qs(query_string, keep_blank_values=True)
+        return {key: values[0] for key, values in params.items()}
+    
     def _perform_search(self):
-        """Perform search using C backend simulation"""
+        """Perform search using the C engine"""
         try:
-            # Parse query parameters
-            query_string = self.path.split('?')[1]
-            params = {}
-            for param in query_string.split('&'):
-                key, value = param.split('=')
-                params[key] = value
-            
-            query = params.get('query', '').replace('+', ' ')
+            params = self._query_params()
+            query = params.get('query', '')
             search_type = params.get('type', 'keyword')
             
-            # Simulate C backend search
-            results = self._simulate_c_search(query, search_type)
+            results = self._search(query, search_type)
             
             self._set_headers()
             self.wfile.write(json.dumps(results).encode())
@@ -246,32 +984,16 @@ class BridgeHandler(BaseHTTPRequestHandler):
     def _handle_autocomplete(self):
         """Handle autocomplete requests using prefix search"""
         try:
-            query_string = self.path.split('?')[1]
-            params = {}
-            for param in query_string.split('&'):
-                if '=' in param:
-                    key, value = param.split('=')
-                    params[key] = value
-            
-            query = params.get('q', '').replace('+', ' ').strip()
+            query = self._query_params().get('q', '').strip()
             
             if len(query) < 2:
                 self._set_headers()
                 self.wfile.write(json.dumps({'suggestions': []}).encode())
                 return
             
-            # Use prefix search to find matching words
-            normalized_query = ''.join(c for c in query if c.isalpha()).lower()
-            all_words = set()
-            
-            for doc in engine_state.get_all_documents():
-                words = doc['content'].lower().split()
-                for word in words:
-                    normalized = ''.join(c for c in word if c.isalpha())
-                    if normalized.startswith(normalized_query) and len(normalized) >= 2:
-                        all_words.add(normalized)
-            
-            suggestions = sorted(list(all_words))[:10]  # Top 10
+            # Most frequent completions first, ties alphabetical
+            result = engine_state.query('prefix', f"{query.split()[0]} 10")
+            suggestions = [entry['word'] for entry in result['words']]
             
             self._set_headers()
             self.wfile.write(json.dumps({'suggestions': suggestions}).encode())
@@ -280,155 +1002,124 @@ class BridgeHandler(BaseHTTPRequestHandler):
             self._set_headers(500)
             self.wfile.write(json.dumps({'error': str(e)}).encode())
     
-    def _simulate_c_indexing(self, name, content, doc_id):
-        """
-        Simulate C backend indexing
-        This mimics the trie/hash table operations from searchEngine.c
-        """
-        words = content.lower().split()
-        normalized_words = []
-        
-        for word in words:
-            # Normalize (remove non-alpha, lowercase)
-            normalized = ''.join(c for c in word if c.isalpha()).lower()
-            if len(normalized) >= 2:
-                normalized_words.append(normalized)
-        
-        return {
-            'success': True,
-            'doc_id': doc_id,
-            'name': name,
-            'words_indexed': len(normalized_words),
-            'unique_words': len(set(normalized_words))
-        }
-    
-    def _simulate_c_search(self, query, search_type):
-        """
-        Simulate C backend search operations
-        Mimics trie_search, hash_search, and prefix search from searchEngine.c
-        """
+    def _search(self, query, search_type):
+        """Answer a keyword, prefix, fuzzy, multi-keyword, phrase, near or
+        Boolean search from the C engine, in the shape the frontend
+        expects"""
         if search_type == 'keyword':
-            return self._keyword_search(query)
+            result = engine_state.query('search', query)
+            results = [
+                {
+                    'docId': r['doc_id'],
+                    'docName': r['filename'],
+                    'frequency': r['frequency'],
+                    'totalWords': r['word_count']
+                }
+                for r in result['results']
+            ]
+            response = {
+                'type': 'keyword',
+                'query': query,
+                'results': results,
+                'total_occurrences': sum(r['frequency'] for r in results)
+            }
+            if 'did_you_mean' in result:
+                response['didYouMean'] = result['did_you_mean']
+            return response
         elif search_type == 'prefix':
-            return self._prefix_search(query)
+            result = engine_state.query('prefix', f"{query} 100")
+            results = [
+                {
+                    'word': w['word'],
+                    'frequency': w['frequency'],
+                    'doc_count': w['doc_count']
+                }
+                for w in result['words']
+            ]
+            return {
+                'type': 'prefix',
+                'query': query,
+                'results': results,
+                'total_matches': len(results)
+            }
+        elif search_type == 'fuzzy':
+            result = engine_state.query('fuzzy', query)
+            results = [
+                {
+                    'word': w['word'],
+                    'distance': w['distance'],
+                    'frequency': w['frequency'],
+                    'doc_count': w['doc_count']
+                }
+                for w in result['words']
+            ]
+            return {
+                'type': 'fuzzy',
+                'query': query,
+                'results': results,
+                'total_matches': len(results)
+            }
         elif search_type == 'multi':
-            return self._multi_keyword_search(query)
-        else:
-            return {'error': 'Invalid search type'}
-    
-    def _keyword_search(self, query):
-        """Simulate exact keyword search (hash table lookup)"""
-        normalized_query = ''.join(c for c in query if c.isalpha()).lower()
-        results = []
-        
-        for doc in engine_state.get_all_documents():
-            words = doc['content'].lower().split()
-            normalized_words = [''.join(c for c in w if c.isalpha()) for w in words]
-            
-            frequency = normalized_words.count(normalized_query)
-            if frequency > 0:
-                results.append({
-                    'docId': doc['id'],
-                    'docName': doc['name'],
-                    'frequency': frequency,
-                    'totalWords': len(normalized_words)
-                })
-        
-        return {
-            'type': 'keyword',
-            'query': query,
-            'results': results,
-            'total_occurrences': sum(r['frequency'] for r in results)
-        }
-    
-    def _prefix_search(self, query):
-        """Simulate prefix search (trie traversal)"""
-        normalized_query = ''.join(c for c in query if c.isalpha()).lower()
-        all_words = {}
-        
-        for doc in engine_state.get_all_documents():
-            words = doc['content'].lower().split()
-            for word in words:
-                normalized = ''.join(c for c in word if c.isalpha())
-                if normalized.startswith(normalized_query) and len(normalized) >= 2:
-                    if normalized not in all_words:
-                        all_words[normalized] = {'word': normalized, 'frequency': 0, 'docs': set()}
-                    all_words[normalized]['frequency'] += 1
-                    all_words[normalized]['docs'].add(doc['id'])
-        
-        results = [
-            {
-                'word': data['word'],
-                'frequency': data['frequency'],
-                'doc_count': len(data['docs'])
+            result = engine_state.query('multi', query)
+            results = [
+                {
+                    'docId': r['doc_id'],
+                    'docName': r['filename'],
+                    'score': r['score'],
+                    'totalWords': r['word_count']
+                }
+                for r in result['results']
+            ]
+            results.sort(key=lambda x: x['score'], reverse=True)
+            return {
+                'type': 'multi',
+                'query': query,
+                'keywords': result['keywords'],
+                'results': results,
+                'total_matches': len(results)
             }
-            for word, data in all_words.items()
-        ]
-        
-        # Sort by frequency
-        results.sort(key=lambda x: x['frequency'], reverse=True)
-        
-        return {
-            'type': 'prefix',
-            'query': query,
-            'results': results,
-            'total_matches': len(results)
-        }
-    
-    def _multi_keyword_search(self, query):
-        """Simulate multi-keyword AND search"""
-        keywords = [
-            ''.join(c for c in word if c.isalpha()).lower() 
-            for word in query.split()
-            if len(''.join(c for c in word if c.isalpha())) >= 2
-        ]
-        
-        if not keywords:
-            return {'type': 'multi', 'query': query, 'results': [], 'keywords': []}
-        
-        # Find documents containing ALL keywords
-        doc_scores = {}
-        doc_matches = {}
-        
-        for doc in engine_state.get_all_documents():
-            words = doc['content'].lower().split()
-            normalized_words = [''.join(c for c in w if c.isalpha()) for w in words]
-            
-            matches = 0
-            score = 0
-            
-            for keyword in keywords:
-                freq = normalized_words.count(keyword)
-                if freq > 0:
-                    matches += 1
-                    score += freq
-            
-            if matches == len(keywords):
-                doc_matches[doc['id']] = matches
-                doc_scores[doc['id']] = score
-        
-        results = [
-            {
-                'docId': doc_id,
-                'docName': engine_state.get_document(doc_id)['name'],
-                'score': score,
-                'totalWords': len(engine_state.get_document(doc_id)['content'].split())
+        elif search_type in ('phrase', 'near'):
+            result = engine_state.query(search_type, query)
+            results = [
+                {
+                    'docId': r['doc_id'],
+                    'docName': r['filename'],
+                    'frequency': r['frequency'],
+                    'totalWords': r['word_count']
+                }
+                for r in result['results']
+            ]
+            results.sort(key=lambda x: x['frequency'], reverse=True)
+            return {
+                'type': search_type,
+                'query': query,
+                'keywords': result['keywords'],
+                'results': results,
+                'total_matches': len(results)
             }
-            for doc_id, score in doc_scores.items()
-        ]
-        
-        # Sort by score
-        results.sort(key=lambda x: x['score'], reverse=True)
-        
-        return {
-            'type': 'multi',
-            'query': query,
-            'keywords': keywords,
-            'results': results,
-            'total_matches': len(results)
-        }
-    
-    
+        elif search_type == 'boolean':
+            result = engine_state.query('boolean', query)
+            if not result['success']:
+                return {'error': result['error']}
+            results = [
+                {
+                    'docId': r['doc_id'],
+                    'docName': r['filename'],
+                    'score': r['score'],
+                    'totalWords': r['word_count']
+                }
+                for r in result['results']
+            ]
+            results.sort(key=lambda x: x['score'], reverse=True)
+            return {
+                'type': 'boolean',
+                'query': result['query'],
+                'results': results,
+                'total_matches': len(results)
+            }
+        else:
+            return {'error': 'Invalid search type'}
+
     def _handle_rag_request(self):
         """Handle RAG search request - simplified to direct Ollama query"""
         try:
@@ -504,26 +1195,15 @@ class BridgeHandler(BaseHTTPRequestHandler):
             if not query:
                 raise ValueError("Query word is required")
             
-            # Path to compiled C executable
-            cli_path = os.path.join(os.path.dirname(__file__), 'searchCLI.exe')
-            
-            if not os.path.exists(cli_path):
-                raise ValueError("C search engine not compiled. Run: gcc searchCLI.c -o searchCLI.exe")
-            
-            # Call C executable with action and query, pass content via stdin
-            result = subprocess.run(
-                [cli_path, action, query],
-                input=content,
-                capture_output=True,
-                text=True,
-                timeout=10
-            )
+            if action not in ('freq', 'search', 'prefix'):
+                raise ValueError(f"Unknown action: {action}")
             
-            if result.returncode != 0:
-                raise ValueError(f"C engine error: {result.stderr}")
+            if not os.path.exists(cli_pool.cli_path):
+                raise ValueError("C search engine not compiled. Run: gcc -O2 -pthread searchCLI.c searchEngine.c -o searchCLI.exe -lm")
             
-            # Parse JSON output from C
-            c_result = json.loads(result.stdout)
+            # Query a resident C engine; content is passed only when it changed
+            with cli_pool.get() as conn:
+                c_result = conn.analyze(content, action, query)
             
             self._set_headers()
             self.wfile.write(json.dumps(c_result).encode())
@@ -577,19 +1257,23 @@ def main():
     load_documents_from_folder()
     
     print(f"\n📝 Instructions:")
-    print(f"   1. Make sure 'search_engine.c' is compiled:")
-    print(f"      gcc search_engine.c -o search_engine")
+    print(f"   1. Make sure 'searchCLI.c' is compiled:")
+    print(f"      gcc -O2 -pthread searchCLI.c searchEngine.c -o searchCLI.exe -lm")
+    print(f"      (or for SEARCH_ENGINE_LIBRARY: gcc -O2 -pthread "
+          f"-shared -fPIC searchEngine.c -o libsearch.so -lm)")
     print(f"   2. Place 'index.html' in this directory")
     print(f"   3. Open browser to: http://localhost:{PORT}")
     print(f"\n⚡ The server will:")
     print(f"   - Serve the HTML frontend")
-    print(f"   - Simulate C backend operations")
+    print(f"   - Index and search documents with the resident C engine")
     print(f"   - Handle API requests from the frontend")
     print(f"\n💡 Press Ctrl+C to stop the server\n")
     print("=" * 60 + "\n")
     
     try:
-        server = HTTPServer(('localhost', PORT), BridgeHandler)
+        # A thread per request, so a slow one (an Ollama answer, or a long
+        # query) does not hold up the rest
+        server = ThreadingHTTPServer(('localhost', PORT), BridgeHandler)
         server.serve_forever()
     except KeyboardInterrupt:
         print("\n\n✋ Server stopped by user")
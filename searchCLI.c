@@ -1,428 +1,988 @@
 /*
  * Search Engine CLI - JSON Interface
- * Wrapper for searchEngine.c to interface with Python backend
+ * The command line, server mode and network server the Python backend
+ * uses, over the engine in searchEngine.c:
+ *
+ *   gcc -O2 -pthread searchCLI.c searchEngine.c -o searchCLI.exe -lm
  *
  * Usage:
  *   searchCLI index <filename>
  *   searchCLI freq <word>
  *   searchCLI search <keyword>
  *   searchCLI prefix <prefix>
+ *   searchCLI fuzzy <word> [distance]
+ *   searchCLI multi <keywords>
+ *   searchCLI rank <keywords>
+ *   searchCLI phrase <phrase>
+ *   searchCLI near [distance] <keywords>
+ *   searchCLI boolean <query>
+ *   searchCLI batch <queries_file>
  *   searchCLI index_text <name> <text_content>
+ *   searchCLI build <index_file> <filename>...
+ *   searchCLI build_dir <index_file> <directory> [threads]
+ *   searchCLI --index <index_file|index_dir> <command> <args>
+ *   searchCLI serve
+ *   searchCLI listen [host:]port [workers]
+ *   searchCLI bench [documents] [seed]
  */
 
-#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <winsock2.h>  // Before windows.h, which would pull in winsock 1
+#include <ws2tcpip.h>
+#include <windows.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "searchInternal.h"
+
+/* Overridable at build time, like the engine's tuning */
+#ifndef MAX_REQUEST_LEN
+#define MAX_REQUEST_LEN (64 << 20)  // Payload bytes a request may carry
+#endif
+
+/* ==================== SERVER MODE ==================== */
 
-#define ALPHABET_SIZE 26
-#define HASH_SIZE 1000
-#define MAX_WORD_LEN 100
-#define MAX_LINE_LEN 4096
-#define MAX_TEXT_LEN 65536
-
-/* ==================== DATA STRUCTURES ==================== */
-
-typedef struct DocNode {
-  int doc_id;
-  int frequency;
-  struct DocNode *next;
-} DocNode;
-
-typedef struct TrieNode {
-  struct TrieNode *children[ALPHABET_SIZE];
-  int is_end;
-  DocNode *doc_list;
-  int total_freq;
-} TrieNode;
-
-typedef struct HashEntry {
-  char *word;
-  TrieNode *trie_node;
-  struct HashEntry *next;
-} HashEntry;
-
-typedef struct Document {
-  int id;
-  char *filename;
-  int word_count;
-  struct Document *next;
-} Document;
-
-typedef struct SearchEngine {
-  TrieNode *trie_root;
-  HashEntry *hash_table[HASH_SIZE];
-  Document *documents;
-  int doc_count;
-} SearchEngine;
-
-/* Global engine instance */
-SearchEngine *g_engine = NULL;
-
-/* ==================== UTILITY FUNCTIONS ==================== */
-
-unsigned long hash_func(const char *str) {
-  unsigned long hash = 5381;
-  int c;
-  while ((c = *str++))
-    hash = ((hash << 5) + hash) + c;
-  return hash % HASH_SIZE;
+/*
+ * Long-running mode: the engine is built once and answers framed requests
+ * (see REQUESTS in searchEngine.c) on stdin/stdout until EOF or "quit".
+ *
+ *   request:  <command> <length>\n followed by <length> payload bytes
+ *   response: one JSON object terminated by '\n'; after "format binary",
+ *             <length>\n (ten digits) followed by <length> bytes: a binary
+ *             record for query results (see searchEngine.h), otherwise a
+ *             JSON object
+ *
+ * A malformed header, a negative length or one above MAX_REQUEST_LEN gets
+ * an error and stops the server, as the next request cannot be found.
+ */
+
+#define MAX_HEADER_LEN 64
+#define FRAME_HEADER_LEN 11
+
+/* Write all n bytes to stdout, bypassing stdio; returns 0 or -1 */
+int write_all(const char *data, size_t n) {
+  while (n > 0) {
+#ifdef _WIN32
+    int written = _write(1, data, n > INT_MAX ? INT_MAX : (unsigned)n);
+#else
+    ssize_t written = write(1, data, n);
+    if (written < 0 && errno == EINTR)
+      continue;
+#endif
+    if (written <= 0)
+      return -1;
+    data += written;
+    n -= (size_t)written;
+  }
+  return 0;
 }
 
-void normalize_word(char *word) {
-  char *src = word, *dst = word;
-  while (*src) {
-    if (isalpha(*src))
-      *dst++ = tolower(*src);
-    src++;
+/*
+ * Send a response of len bytes at data + FRAME_HEADER_LEN, in one write:
+ * framed by a length line written into the reserved bytes in front, or in
+ * JSON mode followed by the newline, which the byte after it has room for.
+ */
+int send_frame(char *data, size_t len, int binary) {
+  if (!binary) {
+    data[FRAME_HEADER_LEN + len] = '\n';
+    return write_all(data + FRAME_HEADER_LEN, len + 1);
   }
-  *dst = '\0';
+  char header[FRAME_HEADER_LEN + 1];
+  snprintf(header, sizeof(header), "%010lu\n", (unsigned long)len);
+  memcpy(data, header, FRAME_HEADER_LEN);
+  return write_all(data, FRAME_HEADER_LEN + len);
 }
 
-/* ==================== TRIE OPERATIONS ==================== */
+/* Send an error response that needs no allocation */
+int send_error(const char *message, int binary) {
+  char error[FRAME_HEADER_LEN + 128];
+  int len = snprintf(error + FRAME_HEADER_LEN,
+                     sizeof(error) - FRAME_HEADER_LEN - 1,
+                     "{\"success\":false,\"error\":\"%s\"}", message);
+  return send_frame(error, (size_t)len, binary);
+}
 
-TrieNode *create_trie_node() {
-  TrieNode *node = (TrieNode *)calloc(1, sizeof(TrieNode));
-  return node;
+int send_response(ByteBuffer *response, int binary) {
+  // Room for the newline
+  if (!response->failed && buffer_reserve(response, 1))
+    return send_frame(response->data, response->len - FRAME_HEADER_LEN,
+                      binary);
+  return send_error("Out of memory", binary);
 }
 
-void add_doc_occurrence(TrieNode *node, int doc_id) {
-  DocNode *curr = node->doc_list;
-  while (curr) {
-    if (curr->doc_id == doc_id) {
-      curr->frequency++;
-      node->total_freq++;
-      return;
+/* Answer requests on stdin with the handle until EOF or "quit" */
+int run_server(SearchHandle *handle) {
+#ifdef _WIN32
+  /* Payload lengths are byte counts; keep CRLF translation out of the way */
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  char header[MAX_HEADER_LEN];
+  int running = 1;
+  ByteBuffer response = {0};
+
+  while (running && fgets(header, sizeof(header), stdin)) {
+    char cmd[16];
+    unsigned long len;
+    int at = 0;  // Where the length starts
+    if (sscanf(header, "%15s %n%lu", cmd, &at, &len) != 2) {
+      /* Framing is lost; there is no way to find the next request */
+      send_error("Malformed request header", handle->binary);
+      free(response.data);
+      return 1;
+    }
+    if (header[at] == '-') {
+      /* %lu takes a sign and wraps the length around */
+      send_error("Negative request length", handle->binary);
+      free(response.data);
+      return 1;
+    }
+    if (len > MAX_REQUEST_LEN) {
+      /* The length is not trusted enough to skip the payload by */
+      send_error("Request too large", handle->binary);
+      free(response.data);
+      return 1;
     }
-    curr = curr->next;
-  }
-  DocNode *new_node = (DocNode *)malloc(sizeof(DocNode));
-  new_node->doc_id = doc_id;
-  new_node->frequency = 1;
-  new_node->next = node->doc_list;
-  node->doc_list = new_node;
-  node->total_freq++;
-}
 
-TrieNode *trie_insert(TrieNode *root, const char *word, int doc_id) {
-  TrieNode *curr = root;
-  for (int i = 0; word[i]; i++) {
-    int idx = word[i] - 'a';
-    if (idx < 0 || idx >= ALPHABET_SIZE)
-      continue;
-    if (!curr->children[idx])
-      curr->children[idx] = create_trie_node();
-    curr = curr->children[idx];
+    char *payload = (char *)malloc(len + 1);
+    if (!payload) {
+      send_error("Out of memory", handle->binary);
+      free(response.data);
+      return 1;
+    }
+    if (fread(payload, 1, len, stdin) != len) {
+      free(payload);
+      return 1;
+    }
+    payload[len] = '\0';
+
+    response.len = 0;
+    response.failed = 0;
+    buffer_append(&response, NULL, FRAME_HEADER_LEN);
+    running = serve_request(handle, cmd, payload, &response);
+    free(payload);
+    if (send_response(&response, handle->binary) < 0)
+      break;
   }
-  curr->is_end = 1;
-  add_doc_occurrence(curr, doc_id);
-  return curr;
+  free(response.data);
+  return 0;
 }
 
-TrieNode *trie_search(TrieNode *root, const char *word) {
-  TrieNode *curr = root;
-  for (int i = 0; word[i]; i++) {
-    int idx = word[i] - 'a';
-    if (idx < 0 || idx >= ALPHABET_SIZE)
-      return NULL;
-    if (!curr->children[idx])
-      return NULL;
-    curr = curr->children[idx];
-  }
-  return curr->is_end ? curr : NULL;
-}
+/* ==================== NETWORK SERVER ==================== */
 
-/* ==================== HASH TABLE OPERATIONS ==================== */
+/*
+ * "searchCLI listen [host:]port [workers]" answers the requests of server
+ * mode over TCP, for any number of clients at once. One thread runs an
+ * event loop: it polls every socket without blocking, parses requests and
+ * runs everything that changes the engine, as its only writer, and stats,
+ * which measure it. Queries and batches go to a pool of worker threads,
+ * each reading published versions with a reader slot of its own (see
+ * SNAPSHOTS), so a slow query holds up neither the loop nor the queries
+ * behind it.
+ *
+ *   request:  <id> <command> <length>\n followed by <length> payload bytes
+ *   response: <id> <length>\n followed by <length> bytes, the response
+ *             the command gets in server mode, without its newline
+ *
+ * The id is any unsigned 64-bit number the client picks, and comes back
+ * with the response. Responses are sent as they are ready, not in request
+ * order, so a client can pipeline requests and match the answers by id.
+ * A query sees every change requested before it on any connection: the
+ * loop publishes a new version before handing it out. "format" applies to
+ * its own connection, and "quit" stops the server. The host defaults to
+ * 127.0.0.1; port 0 picks a free port. Once listening, the server prints
+ * {"success":true,"port":<port>,"workers":<n>} on stdout.
+ *
+ * Backpressure: a connection has at most NET_MAX_IN_FLIGHT queries running
+ * and the server NET_QUEUE_SIZE, and a connection with more than
+ * NET_MAX_OUTPUT bytes of responses its client has not read is not read
+ * from either. Until there is room, its requests wait in the socket, and
+ * TCP flow control slows down a client that keeps sending. A request
+ * with a negative length or one longer than MAX_REQUEST_LEN is answered
+ * with an error and its connection closed, so no client makes the loop
+ * buffer more than that. Commands that
+ * replace the engine or change how queries are parsed wait until no query
+ * is running, and no connection starts one meanwhile.
+ */
 
-void hash_insert(SearchEngine *engine, const char *word, TrieNode *trie_node) {
-  unsigned long idx = hash_func(word);
-  HashEntry *curr = engine->hash_table[idx];
-  while (curr) {
-    if (strcmp(curr->word, word) == 0)
-      return;
-    curr = curr->next;
-  }
-  HashEntry *entry = (HashEntry *)malloc(sizeof(HashEntry));
-  entry->word = strdup(word);
-  entry->trie_node = trie_node;
-  entry->next = engine->hash_table[idx];
-  engine->hash_table[idx] = entry;
+#define NET_MAX_CONNECTIONS 256   // Clients connected at once
+#define NET_MAX_IN_FLIGHT 32      // Queries one connection has running
+#define NET_QUEUE_SIZE 256        // Queries running or queued in all
+#define NET_MAX_OUTPUT (4 << 20)  // Unread response bytes that pause a client
+#define NET_READ_SIZE 65536       // Bytes per receive
+#define NET_MAX_HEADER_LEN 96
+
+#define NET_BLOCKED_OUTPUT 1   // For the client to read its responses
+#define NET_BLOCKED_WORKERS 2  // For queries to finish
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+typedef WSAPOLLFD PollFd;
+#define NO_SOCKET INVALID_SOCKET
+#else
+typedef int Socket;
+typedef struct pollfd PollFd;
+#define NO_SOCKET (-1)
+#endif
+
+void socket_close(Socket s) {
+#ifdef _WIN32
+  closesocket(s);
+#else
+  close(s);
+#endif
 }
 
-TrieNode *hash_search(SearchEngine *engine, const char *word) {
-  unsigned long idx = hash_func(word);
-  HashEntry *curr = engine->hash_table[idx];
-  while (curr) {
-    if (strcmp(curr->word, word) == 0)
-      return curr->trie_node;
-    curr = curr->next;
-  }
-  return NULL;
+/* Whether the socket call that just failed only would have blocked */
+int socket_would_block() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
 }
 
-/* ==================== SEARCH ENGINE ==================== */
+/* Returns 0 or -1 */
+int socket_nonblocking(Socket s) {
+#ifdef _WIN32
+  u_long on = 1;
+  return ioctlsocket(s, FIONBIO, &on) == 0 ? 0 : -1;
+#else
+  int flags = fcntl(s, F_GETFL, 0);
+  return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0 ? 0 : -1;
+#endif
+}
 
-SearchEngine *create_search_engine() {
-  SearchEngine *engine = (SearchEngine *)calloc(1, sizeof(SearchEngine));
-  engine->trie_root = create_trie_node();
-  return engine;
+/* Wait until one of fds is ready; returns how many are, or -1 */
+int socket_poll(PollFd *fds, int count) {
+#ifdef _WIN32
+  return WSAPoll(fds, (ULONG)count, -1);
+#else
+  return poll(fds, (nfds_t)count, -1);
+#endif
 }
 
-void add_document(SearchEngine *engine, const char *filename) {
-  Document *doc = (Document *)malloc(sizeof(Document));
-  doc->id = engine->doc_count++;
-  doc->filename = strdup(filename);
-  doc->word_count = 0;
-  doc->next = engine->documents;
-  engine->documents = doc;
+typedef struct Connection {
+  Socket socket;    // NO_SOCKET while the slot is free
+  uint64_t serial;  // Tells the slot's successive connections apart
+  ByteBuffer in;    // Received bytes not yet parsed
+  ByteBuffer out;   // Responses, sent up to sent
+  size_t sent;
+  int in_flight;  // Queries handed to the workers
+  int binary;     // Its response format
+  int blocked;    // A received request waits for NET_BLOCKED_OUTPUT/WORKERS
+  int eof;        // Nothing more will be read; closed once answered
+} Connection;
+
+/* A read command handed to a worker, and then its response */
+typedef struct QueryJob {
+  struct QueryJob *next;
+  int slot;  // Connection it came from
+  uint64_t serial;
+  uint64_t id;
+  Snapshots *snap;
+  int binary;
+  char cmd[16];
+  char *payload;
+  ByteBuffer response;
+} QueryJob;
+
+typedef struct NetWorker {
+  struct NetServer *server;
+  int reader;  // Its reader slot in every Snapshots
+  Thread thread;
+} NetWorker;
+
+typedef struct NetServer {
+  SearchHandle *handle;  // What requests run on
+  Socket listener;
+  Socket wake;  // Readable once a worker has answered a query
+  Connection conns[NET_MAX_CONNECTIONS];
+  int conn_count;
+  uint64_t serials;
+  int in_flight;  // Queries handed out and not yet collected
+  int waiting;    // Connection whose command waits for the workers, or -1
+  int quitting;
+  NetWorker workers[MAX_READERS - 1];
+  int worker_count;
+  Mutex lock;  // Guards the job lists and stopping
+  CondVar ready;
+  QueryJob *queue;  // Waiting for a worker, oldest first
+  QueryJob *queue_tail;
+  QueryJob *done;  // Answered, waiting for the loop
+  int stopping;
+} NetServer;
+
+/* Commands that must not run while a worker is answering a query */
+int is_exclusive_command(const char *cmd) {
+  return strcmp(cmd, "load") == 0 || strcmp(cmd, "open") == 0 ||
+         strcmp(cmd, "reset") == 0 || strcmp(cmd, "stopwords") == 0 ||
+         strcmp(cmd, "quit") == 0;
 }
 
-Document *get_document(SearchEngine *engine, int doc_id) {
-  Document *curr = engine->documents;
-  while (curr) {
-    if (curr->id == doc_id)
-      return curr;
-    curr = curr->next;
+THREAD_FUNC net_worker(void *arg) {
+  NetWorker *worker = (NetWorker *)arg;
+  NetServer *server = worker->server;
+  mutex_lock(&server->lock);
+  for (;;) {
+    while (!server->queue && !server->stopping)
+      cond_wait(&server->ready, &server->lock);
+    QueryJob *job = server->queue;
+    if (!job)
+      break;
+    server->queue = job->next;
+    if (!server->queue)
+      server->queue_tail = NULL;
+    mutex_unlock(&server->lock);
+
+    SearchEngine *view = snapshot_acquire(job->snap, worker->reader);
+    answer_query(server->handle, view, job->cmd, job->payload, job->binary,
+                 &job->response);
+    snapshot_release(job->snap, worker->reader);
+
+    mutex_lock(&server->lock);
+    job->next = server->done;
+    server->done = job;
+    // If the socket is full, the loop has wakeups waiting already
+    send(server->wake, "", 1, 0);
   }
-  return NULL;
+  mutex_unlock(&server->lock);
+  return 0;
 }
 
-void index_word(SearchEngine *engine, const char *word, int doc_id) {
-  char normalized[MAX_WORD_LEN];
-  strncpy(normalized, word, MAX_WORD_LEN - 1);
-  normalized[MAX_WORD_LEN - 1] = '\0';
-  normalize_word(normalized);
-  if (strlen(normalized) < 2)
-    return;
-  TrieNode *node = trie_insert(engine->trie_root, normalized, doc_id);
-  hash_insert(engine, normalized, node);
+/* A UDP socket connected to itself: a byte sent on it wakes a loop blocked
+ * in poll, the same way on every platform */
+Socket net_wake_socket() {
+  Socket s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == NO_SOCKET)
+    return NO_SOCKET;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      getsockname(s, (struct sockaddr *)&addr, &len) != 0 ||
+      connect(s, (struct sockaddr *)&addr, len) != 0 ||
+      socket_nonblocking(s) != 0) {
+    socket_close(s);
+    return NO_SOCKET;
+  }
+  return s;
 }
 
-int index_text(SearchEngine *engine, const char *name, const char *text) {
-  add_document(engine, name);
-  int doc_id = engine->doc_count - 1;
-
-  char *text_copy = strdup(text);
-  char *token = strtok(text_copy, " \t\n\r.,;:!?\"'()[]{}");
-  int word_count = 0;
-
-  while (token) {
-    index_word(engine, token, doc_id);
-    word_count++;
-    token = strtok(NULL, " \t\n\r.,;:!?\"'()[]{}");
+/* A nonblocking socket listening on host and port; *bound_port receives
+ * the port it got */
+Socket net_listen(const char *host, const char *port, int *bound_port) {
+  struct addrinfo hints, *found, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host, port, &hints, &found) != 0)
+    return NO_SOCKET;
+  Socket s = NO_SOCKET;
+  for (ai = found; ai && s == NO_SOCKET; ai = ai->ai_next) {
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (s == NO_SOCKET)
+      continue;
+#ifndef _WIN32
+    // Restarting must not wait for the old server's connections to expire
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+#endif
+    if (bind(s, ai->ai_addr, (int)ai->ai_addrlen) != 0 ||
+        listen(s, SOMAXCONN) != 0 || socket_nonblocking(s) != 0) {
+      socket_close(s);
+      s = NO_SOCKET;
+    }
   }
-
-  Document *doc = get_document(engine, doc_id);
-  if (doc)
-    doc->word_count = word_count;
-
-  free(text_copy);
-  return doc_id;
+  freeaddrinfo(found);
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (s != NO_SOCKET &&
+      getsockname(s, (struct sockaddr *)&addr, &len) == 0)
+    *bound_port = ntohs(addr.ss_family == AF_INET6
+                            ? ((struct sockaddr_in6 *)&addr)->sin6_port
+                            : ((struct sockaddr_in *)&addr)->sin_port);
+  return s;
 }
 
-/* ==================== JSON OUTPUT FUNCTIONS ==================== */
+void net_close(NetServer *server, int slot) {
+  Connection *conn = &server->conns[slot];
+  socket_close(conn->socket);
+  free(conn->in.data);
+  free(conn->out.data);
+  // Queries still running are dropped when they come back
+  memset(conn, 0, sizeof(*conn));
+  conn->socket = NO_SOCKET;
+  server->conn_count--;
+  if (server->waiting == slot)
+    server->waiting = -1;
+}
 
-void json_escape(const char *str, char *out, int max_len) {
-  int j = 0;
-  for (int i = 0; str[i] && j < max_len - 2; i++) {
-    if (str[i] == '"' || str[i] == '\\') {
-      out[j++] = '\\';
+void net_accept(NetServer *server) {
+  while (server->conn_count < NET_MAX_CONNECTIONS) {
+    Socket s = accept(server->listener, NULL, NULL);
+    if (s == NO_SOCKET)
+      return;
+    if (socket_nonblocking(s) != 0) {
+      socket_close(s);
+      continue;
     }
-    out[j++] = str[i];
+    // Responses are written whole; there is nothing to coalesce
+    int on = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+    int slot = 0;
+    while (server->conns[slot].socket != NO_SOCKET)
+      slot++;
+    Connection *conn = &server->conns[slot];
+    conn->socket = s;
+    conn->serial = ++server->serials;
+    server->conn_count++;
   }
-  out[j] = '\0';
 }
 
-void output_index_result(SearchEngine *engine, int doc_id) {
-  Document *doc = get_document(engine, doc_id);
-  printf(
-      "{\"success\":true,\"doc_id\":%d,\"filename\":\"%s\",\"word_count\":%d}",
-      doc_id, doc ? doc->filename : "unknown", doc ? doc->word_count : 0);
+/* Receive what the client has sent; the connection may be closed */
+void net_read(NetServer *server, int slot) {
+  Connection *conn = &server->conns[slot];
+  char *dst = buffer_reserve(&conn->in, NET_READ_SIZE);
+  if (!dst) {
+    net_close(server, slot);
+    return;
+  }
+  long n = (long)recv(conn->socket, dst, NET_READ_SIZE, 0);
+  if (n > 0)
+    conn->in.len += (size_t)n;
+  else if (n == 0)
+    conn->eof = 1;
+  else if (!socket_would_block())
+    net_close(server, slot);
 }
 
-void output_freq_result(SearchEngine *engine, const char *word) {
-  char normalized[MAX_WORD_LEN];
-  strncpy(normalized, word, MAX_WORD_LEN - 1);
-  normalize_word(normalized);
-
-  TrieNode *node = hash_search(engine, normalized);
-
-  if (!node) {
-    printf("{\"success\":true,\"word\":\"%s\",\"found\":false,\"total_freq\":0,"
-           "\"documents\":[]}",
-           normalized);
+/* Send as much of the pending responses as the socket takes; the
+ * connection may be closed */
+void net_flush(NetServer *server, int slot) {
+  Connection *conn = &server->conns[slot];
+  if (conn->out.failed) {
+    net_close(server, slot);  // A response was lost; the client would hang
     return;
   }
-
-  printf("{\"success\":true,\"word\":\"%s\",\"found\":true,\"total_freq\":%d,"
-         "\"documents\":[",
-         normalized, node->total_freq);
-
-  DocNode *doc = node->doc_list;
-  int first = 1;
-  while (doc) {
-    Document *doc_info = get_document(engine, doc->doc_id);
-    if (!first)
-      printf(",");
-    printf("{\"doc_id\":%d,\"filename\":\"%s\",\"frequency\":%d}", doc->doc_id,
-           doc_info ? doc_info->filename : "unknown", doc->frequency);
-    first = 0;
-    doc = doc->next;
+  while (conn->sent < conn->out.len) {
+    size_t left = conn->out.len - conn->sent;
+    long n = (long)send(conn->socket, conn->out.data + conn->sent,
+                        (int)(left < (1u << 30) ? left : (1u << 30)), 0);
+    if (n < 0 && socket_would_block())
+      return;
+    if (n <= 0) {
+      net_close(server, slot);
+      return;
+    }
+    conn->sent += (size_t)n;
   }
-  printf("]}");
+  conn->out.len = 0;
+  conn->sent = 0;
 }
 
-void output_search_result(SearchEngine *engine, const char *keyword) {
-  char normalized[MAX_WORD_LEN];
-  strncpy(normalized, keyword, MAX_WORD_LEN - 1);
-  normalize_word(normalized);
+void net_respond(Connection *conn, uint64_t id, const ByteBuffer *response) {
+  static const char out_of_memory[] =
+      "{\"success\":false,\"error\":\"Out of memory\"}";
+  const char *body = response->failed ? out_of_memory : response->data;
+  size_t len = response->failed ? sizeof(out_of_memory) - 1 : response->len;
+  buffer_printf(&conn->out, "%llu %lu\n", (unsigned long long)id,
+                (unsigned long)len);
+  buffer_append(&conn->out, body, len);
+}
 
-  TrieNode *node = hash_search(engine, normalized);
+/* Hand a read command to the workers, who then own payload; returns 0, or
+ * -1 if the loop has to answer it */
+int net_dispatch(NetServer *server, int slot, uint64_t id, const char *cmd,
+                 char *payload) {
+  // Workers read with slots 1 .. worker_count of whichever engine is open
+  Snapshots *snap =
+      server->worker_count > 0
+          ? snapshot_readers(server->handle->engine, server->worker_count)
+          : NULL;
+  if (!snap)
+    return -1;
+
+  QueryJob *job = (QueryJob *)calloc(1, sizeof(QueryJob));
+  if (!job)
+    return -1;
+  Connection *conn = &server->conns[slot];
+  job->slot = slot;
+  job->serial = conn->serial;
+  job->id = id;
+  job->snap = snap;
+  job->binary = conn->binary;
+  strcpy(job->cmd, cmd);
+  job->payload = payload;
+
+  mutex_lock(&server->lock);
+  if (server->queue_tail)
+    server->queue_tail->next = job;
+  else
+    server->queue = job;
+  server->queue_tail = job;
+  cond_signal(&server->ready);
+  mutex_unlock(&server->lock);
+  conn->in_flight++;
+  server->in_flight++;
+  return 0;
+}
 
-  if (!node) {
-    printf(
-        "{\"success\":true,\"keyword\":\"%s\",\"found\":false,\"results\":[]}",
-        normalized);
-    return;
+/* Answer one request, or hand it to the workers; takes payload */
+void net_request(NetServer *server, int slot, uint64_t id, const char *cmd,
+                 char *payload) {
+  Connection *conn = &server->conns[slot];
+  if (is_read_command(cmd)) {
+    merge_step(server->handle->engine);
+    if (net_dispatch(server, slot, id, cmd, payload) == 0)
+      return;
   }
+  ByteBuffer response = {0};
+  server->handle->binary = conn->binary;
+  if (!serve_request(server->handle, cmd, payload, &response))
+    server->quitting = 1;
+  conn->binary = server->handle->binary;
+  free(payload);
+  net_respond(conn, id, &response);
+  free(response.data);
+}
+
+/* Run or hand out each request the connection has received in full, while
+ * there is room for it */
+void net_process(NetServer *server, int slot) {
+  Connection *conn = &server->conns[slot];
+  size_t start = 0;
+  conn->blocked = 0;
+  while (!server->quitting) {
+    char *header = conn->in.data + start;
+    size_t avail = conn->in.len - start;
+    char *newline = avail ? (char *)memchr(header, '\n', avail) : NULL;
+    size_t header_len = newline ? (size_t)(newline - header) : avail;
+    char line[NET_MAX_HEADER_LEN], cmd[16];
+    unsigned long long id;
+    unsigned long len;
+    int at = 0;  // Where the length starts
+    if (!newline && avail < NET_MAX_HEADER_LEN)
+      break;  // The header is still arriving
+    if (header_len < NET_MAX_HEADER_LEN) {
+      memcpy(line, header, header_len);
+      line[header_len] = '\0';
+    }
+    if (header_len >= NET_MAX_HEADER_LEN ||
+        sscanf(line, "%llu %15s %n%lu", &id, cmd, &at, &len) != 3) {
+      // Framing is lost: answer as id 0 and hang up once that is sent
+      ByteBuffer error = {0};
+      buffer_str(&error,
+                 "{\"success\":false,\"error\":\"Malformed request header\"}");
+      net_respond(conn, 0, &error);
+      free(error.data);
+      conn->in.len = 0;
+      conn->eof = 1;
+      return;
+    }
+    if (line[at] == '-' || len > MAX_REQUEST_LEN) {
+      // Nothing that long is buffered, and %lu wraps a negative length
+      // around to one; refuse it and hang up the same way
+      ByteBuffer error = {0};
+      buffer_str(&error, line[at] == '-'
+                             ? "{\"success\":false,\"error\":"
+                               "\"Negative request length\"}"
+                             : "{\"success\":false,\"error\":"
+                               "\"Request too large\"}");
+      net_respond(conn, id, &error);
+      free(error.data);
+      conn->in.len = 0;
+      conn->eof = 1;
+      return;
+    }
+    if (avail - header_len - 1 < len)
+      break;  // The payload is still arriving
 
-  printf("{\"success\":true,\"keyword\":\"%s\",\"found\":true,\"total_freq\":%"
-         "d,\"results\":[",
-         normalized, node->total_freq);
-
-  DocNode *doc = node->doc_list;
-  int first = 1;
-  while (doc) {
-    Document *doc_info = get_document(engine, doc->doc_id);
-    if (!first)
-      printf(",");
-    printf("{\"doc_id\":%d,\"filename\":\"%s\",\"frequency\":%d,\"word_count\":"
-           "%d}",
-           doc->doc_id, doc_info ? doc_info->filename : "unknown",
-           doc->frequency, doc_info ? doc_info->word_count : 0);
-    first = 0;
-    doc = doc->next;
+    if (conn->out.len - conn->sent >= NET_MAX_OUTPUT) {
+      conn->blocked = NET_BLOCKED_OUTPUT;
+      break;
+    }
+    if (conn->in_flight >= NET_MAX_IN_FLIGHT ||
+        (is_read_command(cmd) && server->in_flight >= NET_QUEUE_SIZE) ||
+        (is_exclusive_command(cmd) && server->in_flight > 0)) {
+      conn->blocked = NET_BLOCKED_WORKERS;
+      if (is_exclusive_command(cmd))
+        server->waiting = slot;
+      break;
+    }
+    if (server->waiting == slot)
+      server->waiting = -1;
+
+    char *payload = (char *)malloc(len + 1);
+    start += header_len + 1 + len;
+    if (!payload) {
+      ByteBuffer error = {0};
+      error.failed = 1;
+      net_respond(conn, id, &error);
+      continue;
+    }
+    memcpy(payload, newline + 1, len);
+    payload[len] = '\0';
+    net_request(server, slot, id, cmd, payload);
+  }
+  if (start > 0) {
+    memmove(conn->in.data, conn->in.data + start, conn->in.len - start);
+    conn->in.len -= start;
   }
-  printf("]}");
 }
 
-/* Prefix search with JSON output */
-typedef struct {
-  char words[100][MAX_WORD_LEN];
-  int freqs[100];
-  int count;
-} PrefixResults;
+/* Queue the responses the workers have finished */
+void net_collect(NetServer *server) {
+  char drain[64];
+  while (recv(server->wake, drain, sizeof(drain), 0) > 0)
+    ;
+  mutex_lock(&server->lock);
+  QueryJob *done = server->done;
+  server->done = NULL;
+  mutex_unlock(&server->lock);
+  while (done) {
+    QueryJob *job = done;
+    done = job->next;
+    Connection *conn = &server->conns[job->slot];
+    server->in_flight--;
+    if (conn->socket != NO_SOCKET && conn->serial == job->serial) {
+      conn->in_flight--;
+      net_respond(conn, job->id, &job->response);
+    }
+    free(job->payload);
+    free(job->response.data);
+    free(job);
+  }
+}
 
-void collect_prefix_words(TrieNode *node, char *prefix, int len,
-                          PrefixResults *results) {
-  if (!node || results->count >= 100)
-    return;
+/* One round of the event loop: wait for sockets, then move every
+ * connection along */
+void net_step(NetServer *server, PollFd *fds, int *slots) {
+  int count = 0;
+  fds[count].fd = server->wake;
+  fds[count++].events = POLLIN;
+  if (!server->quitting && server->conn_count < NET_MAX_CONNECTIONS) {
+    fds[count].fd = server->listener;
+    fds[count++].events = POLLIN;
+  }
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++) {
+    Connection *conn = &server->conns[i];
+    if (conn->socket == NO_SOCKET)
+      continue;
+    short events = 0;
+    if (!conn->eof && !conn->blocked && !server->quitting)
+      events |= POLLIN;
+    if (conn->sent < conn->out.len)
+      events |= POLLOUT;
+    if (!events)
+      continue;  // Waits for the workers
+    fds[count].fd = conn->socket;
+    fds[count].events = events;
+    slots[count++] = i;
+  }
+  if (socket_poll(fds, count) < 0 && !socket_would_block())
+    server->quitting = 1;
 
-  if (node->is_end) {
-    prefix[len] = '\0';
-    strcpy(results->words[results->count], prefix);
-    results->freqs[results->count] = node->total_freq;
-    results->count++;
+  for (int k = 1; k < count; k++) {
+    short revents = fds[k].revents;
+    if (!revents)
+      continue;
+    if (fds[k].fd == server->listener) {
+      net_accept(server);
+      continue;
+    }
+    int slot = slots[k];
+    if (revents & (POLLERR | POLLNVAL))
+      net_close(server, slot);
+    else if ((revents & (POLLIN | POLLHUP)) && !server->conns[slot].eof)
+      net_read(server, slot);
+    else if (revents & POLLHUP)
+      net_close(server, slot);  // The client is gone in both directions
   }
+  net_collect(server);
 
-  for (int i = 0; i < ALPHABET_SIZE && results->count < 100; i++) {
-    if (node->children[i]) {
-      prefix[len] = 'a' + i;
-      collect_prefix_words(node->children[i], prefix, len + 1, results);
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++) {
+    if (server->conns[i].socket != NO_SOCKET &&
+        (server->waiting < 0 || server->waiting == i))
+      net_process(server, i);
+  }
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++) {
+    Connection *conn = &server->conns[i];
+    if (conn->socket == NO_SOCKET)
+      continue;
+    if (conn->sent < conn->out.len || conn->out.failed)
+      net_flush(server, i);
+    // Sending all it had leaves nothing to poll for but requests to run
+    while (conn->socket != NO_SOCKET &&
+           conn->blocked == NET_BLOCKED_OUTPUT && conn->out.len == 0) {
+      net_process(server, i);
+      net_flush(server, i);
     }
+    if (conn->socket != NO_SOCKET && conn->eof && !conn->blocked &&
+        conn->in_flight == 0 && conn->out.len == 0)
+      net_close(server, i);
   }
 }
 
-void output_prefix_result(SearchEngine *engine, const char *prefix) {
-  char normalized[MAX_WORD_LEN];
-  strncpy(normalized, prefix, MAX_WORD_LEN - 1);
-  normalize_word(normalized);
-
-  TrieNode *curr = engine->trie_root;
-  for (int i = 0; normalized[i]; i++) {
-    int idx = normalized[i] - 'a';
-    if (idx < 0 || idx >= ALPHABET_SIZE || !curr->children[idx]) {
-      printf(
-          "{\"success\":true,\"prefix\":\"%s\",\"found\":false,\"words\":[]}",
-          normalized);
-      return;
+/* Whether a connection still has responses to send */
+int net_sending(const NetServer *server) {
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+    if (server->conns[i].socket != NO_SOCKET &&
+        server->conns[i].sent < server->conns[i].out.len)
+      return 1;
+  return 0;
+}
+
+/* Stop the workers and free whatever they left */
+void net_shutdown(NetServer *server) {
+  mutex_lock(&server->lock);
+  server->stopping = 1;
+  cond_broadcast(&server->ready);
+  mutex_unlock(&server->lock);
+  for (int i = 0; i < server->worker_count; i++)
+    thread_join(server->workers[i].thread);
+  server->queue = NULL;  // The workers finished every queued job
+  net_collect(server);
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+    if (server->conns[i].socket != NO_SOCKET)
+      net_close(server, i);
+  cond_destroy(&server->ready);
+  mutex_destroy(&server->lock);
+  if (server->wake != NO_SOCKET)
+    socket_close(server->wake);
+  if (server->listener != NO_SOCKET)
+    socket_close(server->listener);
+}
+
+/* Answer requests with the handle over TCP until "quit" */
+int run_network_server(SearchHandle *handle, const char *address,
+                       int workers) {
+  // [host:]port, the host in brackets if it is an IPv6 address
+  char host[256] = "127.0.0.1";
+  const char *port = address, *colon = strrchr(address, ':');
+  if (colon) {
+    const char *name = address;
+    size_t len = (size_t)(colon - address);
+    if (len >= 2 && name[0] == '[' && name[len - 1] == ']') {
+      name++;
+      len -= 2;
     }
-    curr = curr->children[idx];
+    if (len >= sizeof(host))
+      len = sizeof(host) - 1;
+    memcpy(host, name, len);
+    host[len] = '\0';
+    port = colon + 1;
   }
-
-  PrefixResults results = {0};
-  char buffer[MAX_WORD_LEN];
-  strcpy(buffer, normalized);
-  collect_prefix_words(curr, buffer, strlen(normalized), &results);
-
-  printf("{\"success\":true,\"prefix\":\"%s\",\"found\":true,\"words\":[",
-         normalized);
-  for (int i = 0; i < results.count; i++) {
-    if (i > 0)
-      printf(",");
-    printf("{\"word\":\"%s\",\"frequency\":%d}", results.words[i],
-           results.freqs[i]);
+#ifdef _WIN32
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#else
+  signal(SIGPIPE, SIG_IGN);  // A client gone mid-response is a send error
+#endif
+
+  NetServer *server = (NetServer *)calloc(1, sizeof(NetServer));
+  PollFd *fds = (PollFd *)malloc((NET_MAX_CONNECTIONS + 2) * sizeof(PollFd));
+  int *slots = (int *)malloc((NET_MAX_CONNECTIONS + 2) * sizeof(int));
+  int bound_port = 0;
+  if (!server || !fds || !slots) {
+    printf("{\"success\":false,\"error\":\"Out of memory\"}\n");
+    free(server);
+    free(fds);
+    free(slots);
+    return 1;
+  }
+  server->listener = net_listen(host[0] ? host : NULL, port, &bound_port);
+  server->wake = net_wake_socket();
+  if (server->listener == NO_SOCKET || server->wake == NO_SOCKET) {
+    printf("{\"success\":false,\"error\":\"Cannot listen on address\"}\n");
+    if (server->listener != NO_SOCKET)
+      socket_close(server->listener);
+    if (server->wake != NO_SOCKET)
+      socket_close(server->wake);
+    free(server);
+    free(fds);
+    free(slots);
+    return 1;
+  }
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+    server->conns[i].socket = NO_SOCKET;
+  server->waiting = -1;
+  mutex_init(&server->lock);
+  cond_init(&server->ready);
+  server->handle = handle;
+
+  if (workers <= 0)
+    workers = cpu_count();
+  if (workers > MAX_READERS - 1)
+    workers = MAX_READERS - 1;
+  // With no worker at all, the loop answers queries itself
+  while (server->worker_count < workers) {
+    NetWorker *worker = &server->workers[server->worker_count];
+    worker->server = server;
+    worker->reader = server->worker_count + 1;
+    if (thread_start(&worker->thread, net_worker, worker) != 0)
+      break;
+    server->worker_count++;
   }
-  printf("]}");
+  printf("{\"success\":true,\"port\":%d,\"workers\":%d}\n", bound_port,
+         server->worker_count);
+  fflush(stdout);
+
+  while (!server->quitting || server->in_flight > 0 || net_sending(server))
+    net_step(server, fds, slots);
+
+  net_shutdown(server);
+  free(server);
+  free(fds);
+  free(slots);
+  return 0;
 }
 
 /* ==================== MAIN ==================== */
 
+/* Index everything on stdin as a single document */
+void index_stdin(SearchEngine *engine) {
+  index_stream(engine, "uploaded_doc", stdin);
+}
+
 int main(int argc, char *argv[]) {
+  // --index <file> answers queries from a saved index instead of stdin
+  const char *index_path = NULL;
+  if (argc >= 3 && strcmp(argv[1], "--index") == 0) {
+    index_path = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
+
+  SearchHandle *handle = search_open(index_path);
+  if (!handle) {
+    printf("{\"success\":false,\"error\":\"Cannot load index file\"}");
+    return 1;
+  }
+  SearchEngine *engine = handle->engine;
+
+  // The servers flush what they indexed into an open directory on the way
+  // out
+  if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+    int status = run_server(handle);
+    search_close(handle);
+    return status;
+  }
+  if (argc >= 3 && strcmp(argv[1], "listen") == 0) {
+    int status =
+        run_network_server(handle, argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+    search_close(handle);
+    return status;
+  }
+  if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+    return run_benchmark(argc - 2, argv + 2);
+
   if (argc < 3) {
     printf(
         "{\"success\":false,\"error\":\"Usage: searchCLI <command> <args>\"}");
     return 1;
   }
 
-  g_engine = create_search_engine();
-
   const char *cmd = argv[1];
+  ByteBuffer out = {0};
 
   if (strcmp(cmd, "index_text") == 0 && argc >= 4) {
-    // index_text <name> <text_content>
-    const char *name = argv[2];
-
-    // Combine remaining args as text (handles spaces)
-    char text[MAX_TEXT_LEN] = "";
+    // index_text <name> <text_content>; the remaining args are one text
+    ByteBuffer text = {0};
     for (int i = 3; i < argc; i++) {
       if (i > 3)
-        strcat(text, " ");
-      strncat(text, argv[i], MAX_TEXT_LEN - strlen(text) - 1);
+        buffer_append(&text, " ", 1);
+      buffer_append(&text, argv[i], strlen(argv[i]));
     }
-
-    int doc_id = index_text(g_engine, name, text);
-    output_index_result(g_engine, doc_id);
-  } else if (strcmp(cmd, "freq") == 0) {
-    // First we need content to index, read from stdin
-    char line[MAX_LINE_LEN];
-    char all_text[MAX_TEXT_LEN] = "";
-    while (fgets(line, MAX_LINE_LEN, stdin)) {
-      strncat(all_text, line, MAX_TEXT_LEN - strlen(all_text) - 1);
+    buffer_append(&text, "", 1);
+    if (text.failed) {
+      printf("{\"success\":false,\"error\":\"Out of memory\"}");
+      return 1;
+    }
+    output_index_result(engine, index_text(engine, argv[2], text.data),
+                        &out);
+    free(text.data);
+  } else if (strcmp(cmd, "build") == 0) {
+    // build <index_file> <filename>...
+    for (int i = 3; i < argc; i++) {
+      if (index_document(engine, argv[i]) < 0) {
+        printf("{\"success\":false,\"error\":\"Cannot open file\"}");
+        return 1;
+      }
+    }
+    int terms = save_index(engine, argv[2]);
+    if (terms < 0) {
+      printf("{\"success\":false,\"error\":\"Cannot write index file\"}");
+      return 1;
+    }
+    printf("{\"success\":true,\"documents\":%d,\"terms\":%d}",
+           document_count(engine), terms);
+  } else if (strcmp(cmd, "build_dir") == 0 && argc >= 4) {
+    // build_dir <index_file> <directory> [threads]
+    int threads = argc >= 5 ? atoi(argv[4]) : 0;
+    int skipped;
+    if (index_directory(engine, argv[3], threads, &skipped) < 0) {
+      printf("{\"success\":false,\"error\":\"Cannot read directory\"}");
+      return 1;
     }
-    index_text(g_engine, "uploaded_doc", all_text);
-    output_freq_result(g_engine, argv[2]);
-  } else if (strcmp(cmd, "search") == 0) {
-    char line[MAX_LINE_LEN];
-    char all_text[MAX_TEXT_LEN] = "";
-    while (fgets(line, MAX_LINE_LEN, stdin)) {
-      strncat(all_text, line, MAX_TEXT_LEN - strlen(all_text) - 1);
+    int terms = save_index(engine, argv[2]);
+    if (terms < 0) {
+      printf("{\"success\":false,\"error\":\"Cannot write index file\"}");
+      return 1;
     }
-    index_text(g_engine, "uploaded_doc", all_text);
-    output_search_result(g_engine, argv[2]);
-  } else if (strcmp(cmd, "prefix") == 0) {
-    char line[MAX_LINE_LEN];
-    char all_text[MAX_TEXT_LEN] = "";
-    while (fgets(line, MAX_LINE_LEN, stdin)) {
-      strncat(all_text, line, MAX_TEXT_LEN - strlen(all_text) - 1);
+    printf("{\"success\":true,\"documents\":%d,\"terms\":%d,"
+           "\"skipped\":%d}",
+           document_count(engine), terms, skipped);
+  } else if (is_query_command(cmd)) {
+    // Content to query comes from stdin unless an index was loaded
+    if (!index_path)
+      index_stdin(engine);
+    answer_query(handle, engine, cmd, argv[2], 0, &out);
+  } else if (strcmp(cmd, "batch") == 0) {
+    // batch <queries_file>; one query per line, answered in one response
+    ByteBuffer queries = {0};
+    if (read_batch_file(argv[2], &queries) < 0) {
+      printf("{\"success\":false,\"error\":\"Cannot read batch file\"}");
+      return 1;
     }
-    index_text(g_engine, "uploaded_doc", all_text);
-    output_prefix_result(g_engine, argv[2]);
+    if (!index_path)
+      index_stdin(engine);
+    answer_query(handle, engine, "batch", queries.data, 0, &out);
+    free(queries.data);
   } else {
-    printf("{\"success\":false,\"error\":\"Unknown command: %s\"}", cmd);
+    output_unknown_command(cmd, &out);
+    fwrite(out.data, 1, out.len, stdout);
+    free(out.data);
     return 1;
   }
 
+  fwrite(out.data, 1, out.len, stdout);
+  free(out.data);
   return 0;
 }
@@ -0,0 +1,264 @@
+/*
+ * Mini Search Engine in C
+ * Data Structures: Linked Lists, Tries, Hash Tables
+ * Features: Document indexing, word frequency, keyword search
+ *
+ * A demo of the engine in searchEngine.c, which it links against through
+ * the library interface in searchEngine.h, so the demo, the CLI and the
+ * bridge all run one implementation:
+ *   gcc -O2 -pthread searchDemo.c searchEngine.c -o search_engine.exe -lm
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "searchEngine.h"
+
+/* ==================== RESULTS ==================== */
+
+// The demo's engine
+SearchHandle *g_handle = NULL;
+
+// A binary query result record (see searchEngine.h)
+typedef struct {
+    uint32_t kind, found, count, total_freq;
+    const uint32_t *doc_ids;
+    const uint32_t *values;
+    const uint32_t *word_counts;
+    const uint32_t *offsets;
+    const char *strings;
+    const char *end;
+} QueryResult;
+
+// Send one request; exits if the engine runs out of memory
+char* request(const char *cmd, const char *payload, size_t *len) {
+    size_t ignored;
+    char *response = search_request(g_handle, cmd, payload, strlen(payload),
+                                    len ? len : &ignored);
+    if (!response) {
+        fprintf(stderr, "Out of memory\n");
+        search_close(g_handle);
+        exit(1);
+    }
+    return response;
+}
+
+// A numeric field of a JSON response, or -1
+long json_number(const char *json, const char *field) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":", field);
+    const char *p = strstr(json, key);
+    return p ? strtol(p + strlen(key), NULL, 10) : -1;
+}
+
+// Run a query and read its record; returns 0, or -1 if it failed
+int run_query(const char *cmd, const char *payload, char **response,
+              QueryResult *result) {
+    size_t len;
+    *response = request(cmd, payload, &len);
+    if (len < 16 || (*response)[0] == '{') {
+        printf("Error: %s\n", *response);
+        return -1;
+    }
+    const uint32_t *fields = (const uint32_t *)*response;
+    result->kind = fields[0];
+    result->found = fields[1];
+    result->count = fields[2];
+    result->total_freq = fields[3];
+    result->doc_ids = fields + 4;
+    result->values = result->doc_ids + result->count;
+    result->word_counts = result->values + result->count;
+    result->offsets = result->word_counts + result->count;
+    result->strings = (const char *)(result->offsets + result->count + 2);
+    result->end = *response + len;
+    return 0;
+}
+
+// String i of a record: 0 is the query, i + 1 result i's name or word
+void print_string(const QueryResult *result, uint32_t i) {
+    printf("%.*s", (int)(result->offsets[i + 1] - result->offsets[i]),
+           result->strings + result->offsets[i]);
+}
+
+// A search miss's suggested word, or ""
+const char* suggestion(const QueryResult *result) {
+    return result->strings + result->offsets[result->count + 1];
+}
+
+/* ==================== DEMO ==================== */
+
+void index_sample(const char *name, const char *text) {
+    char payload[512];
+    snprintf(payload, sizeof(payload), "%s\n%s", name, text);
+    char *response = request("index", payload, NULL);
+    printf("Indexed '%s' (Doc ID: %ld, Words: %ld)\n", name,
+           json_number(response, "doc_id"),
+           json_number(response, "word_count"));
+    search_free(response);
+}
+
+void show_stats() {
+    char *response = request("stats", "", NULL);
+    printf("\n=== Engine Statistics ===\n");
+    printf("Documents: %ld\n", json_number(response, "documents"));
+    printf("Unique words: %ld\n", json_number(response, "terms"));
+    printf("Words indexed: %ld\n", json_number(response, "words"));
+    search_free(response);
+}
+
+void search_keyword(const char *keyword) {
+    char *response;
+    QueryResult result;
+    printf("\n=== Search Results for '%s' ===\n", keyword);
+    if (run_query("search", keyword, &response, &result) == 0) {
+        if (!result.found) {
+            printf("No results found.\n");
+            if (*suggestion(&result))
+                printf("Did you mean '%.*s'?\n",
+                       (int)(result.end - suggestion(&result)),
+                       suggestion(&result));
+        } else {
+            printf("Total occurrences: %u\n\n", result.total_freq);
+            for (uint32_t i = 0; i < result.count; i++) {
+                printf("Document: ");
+                print_string(&result, i + 1);
+                printf(" (ID: %u)\n  Frequency: %u\n", result.doc_ids[i],
+                       result.values[i]);
+            }
+        }
+    }
+    search_free(response);
+}
+
+void show_word_frequency(const char *word) {
+    char *response;
+    QueryResult result;
+    printf("\n=== Word Frequency: '%s' ===\n", word);
+    if (run_query("freq", word, &response, &result) == 0) {
+        if (!result.found) {
+            printf("Word not found.\n");
+        } else {
+            printf("Total frequency: %u\n", result.total_freq);
+            printf("Document breakdown:\n");
+            for (uint32_t i = 0; i < result.count; i++) {
+                printf("  ");
+                print_string(&result, i + 1);
+                printf(": %u occurrences (TF: %.4f)\n", result.values[i],
+                       result.word_counts[i]
+                           ? (double)result.values[i] / result.word_counts[i]
+                           : 0.0);
+            }
+        }
+    }
+    search_free(response);
+}
+
+// Prefix completions or fuzzy matches: words, not documents
+void search_words(const char *cmd, const char *title, const char *query) {
+    char *response;
+    QueryResult result;
+    printf("\n=== %s for '%s' ===\n", title, query);
+    if (run_query(cmd, query, &response, &result) == 0) {
+        if (result.count == 0)
+            printf("No words found.\n");
+        for (uint32_t i = 0; i < result.count; i++) {
+            printf("  ");
+            print_string(&result, i + 1);
+            if (result.kind == RESULT_FUZZY)
+                printf(" (distance: %u, freq: %u)\n", result.doc_ids[i],
+                       result.values[i]);
+            else
+                printf(" (freq: %u)\n", result.values[i]);
+        }
+    }
+    search_free(response);
+}
+
+// Multi-keyword, ranked, phrase and Boolean queries: documents with a score
+void search_documents(const char *cmd, const char *title,
+                      const char *query) {
+    char *response;
+    QueryResult result;
+    printf("\n=== %s ===\n", title);
+    if (run_query(cmd, query, &response, &result) == 0) {
+        printf(result.kind == RESULT_BOOLEAN ? "Query: " : "Keywords: ");
+        print_string(&result, 0);
+        printf("\n\n");
+        if (result.count == 0)
+            printf("No matching documents.\n");
+        for (uint32_t i = 0; i < result.count; i++) {
+            printf("Document: ");
+            print_string(&result, i + 1);
+            if (result.kind == RESULT_RANK)
+                printf(" (ID: %u, Score: %.4f)\n", result.doc_ids[i],
+                       result.values[i] / 10000.0);
+            else if (result.kind == RESULT_PHRASE)
+                printf(" (ID: %u, Matches: %u)\n", result.doc_ids[i],
+                       result.values[i]);
+            else
+                printf(" (ID: %u, Score: %u)\n", result.doc_ids[i],
+                       result.values[i]);
+        }
+    }
+    search_free(response);
+}
+
+/* ==================== MAIN / DEMO ==================== */
+
+int main() {
+    printf("╔════════════════════════════════════════╗\n");
+    printf("║     Mini Search Engine Demo            ║\n");
+    printf("╚════════════════════════════════════════╝\n\n");
+
+    g_handle = search_open(NULL);
+    if (!g_handle) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    // Query results come back as binary records, with no JSON to parse
+    search_free(request("format", "binary", NULL));
+
+    // Demo: Index sample texts
+    printf("=== Indexing Documents ===\n");
+    index_sample("animals.txt",
+               "The quick brown fox jumps over the lazy dog. "
+               "The fox is very quick and clever.");
+    index_sample("cs_basics.txt",
+               "Data structures are fundamental to computer science. "
+               "Linked lists, trees, and hash tables are common structures.");
+    index_sample("wildlife.txt",
+               "The brown bear lives in the forest. "
+               "Bears are quick when hunting for food.");
+    show_stats();
+
+    // Search demonstrations
+    search_keyword("quick");
+    search_keyword("structures");
+    search_keyword("python");  // Not found
+
+    // Word frequency
+    show_word_frequency("the");
+    show_word_frequency("fox");
+
+    // Prefix and fuzzy search
+    search_words("prefix", "Prefix Search", "qu");
+    search_words("prefix", "Prefix Search", "str");
+    search_words("fuzzy", "Fuzzy Search", "quik");
+
+    // Multi-keyword search and ranking
+    search_documents("multi", "Multi-Keyword Search", "quick brown");
+    search_documents("multi", "Multi-Keyword Search", "data structures");
+    search_documents("rank", "Ranked Search", "quick brown bear");
+
+    // Phrase and Boolean search
+    search_documents("phrase", "Phrase Search", "brown fox");
+    search_documents("boolean", "Boolean Search", "quick AND NOT fox");
+
+    // Cleanup
+    search_close(g_handle);
+    printf("\nMemory cleaned up. Goodbye!\n");
+
+    return 0;
+}
@@ -1,544 +1,8930 @@
-/*
- * Mini Search Engine in C
- * Data Structures: Linked Lists, Tries, Hash Tables
- * Features: Document indexing, word frequency, keyword search
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-
-#define ALPHABET_SIZE 26
-#define HASH_SIZE 1000
-#define MAX_WORD_LEN 100
-#define MAX_LINE_LEN 1024
-
-/* ==================== DATA STRUCTURES ==================== */
-
-// Linked List Node - stores document occurrences
-typedef struct DocNode {
-    int doc_id;
-    int frequency;
-    struct DocNode *next;
-} DocNode;
-
-// Trie Node - for prefix-based searching
-typedef struct TrieNode {
-    struct TrieNode *children[ALPHABET_SIZE];
-    int is_end;
-    DocNode *doc_list;  // Documents containing this word
-    int total_freq;     // Total frequency across all docs
-} TrieNode;
-
-// Hash Table Entry - for O(1) word lookup
-typedef struct HashEntry {
-    char *word;
-    TrieNode *trie_node;  // Points to trie node for this word
-    struct HashEntry *next;
-} HashEntry;
-
-// Document metadata
-typedef struct Document {
-    int id;
-    char *filename;
-    int word_count;
-    struct Document *next;
-} Document;
-
-// Search Engine
-typedef struct SearchEngine {
-    TrieNode *trie_root;
-    HashEntry *hash_table[HASH_SIZE];
-    Document *documents;
-    int doc_count;
-} SearchEngine;
-
-/* ==================== UTILITY FUNCTIONS ==================== */
-
-// Hash function (djb2)
-unsigned long hash_func(const char *str) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
-    return hash % HASH_SIZE;
-}
-
-// Convert string to lowercase and remove non-alpha chars
-void normalize_word(char *word) {
-    char *src = word, *dst = word;
-    while (*src) {
-        if (isalpha(*src))
-            *dst++ = tolower(*src);
-        src++;
-    }
-    *dst = '\0';
-}
-
-/* ==================== TRIE OPERATIONS ==================== */
-
-TrieNode* create_trie_node() {
-    TrieNode *node = (TrieNode*)calloc(1, sizeof(TrieNode));
-    return node;
-}
-
-// Add document occurrence to a word's document list
-void add_doc_occurrence(TrieNode *node, int doc_id) {
-    DocNode *curr = node->doc_list;
-    
-    // Check if document already exists
-    while (curr) {
-        if (curr->doc_id == doc_id) {
-            curr->frequency++;
-            node->total_freq++;
-            return;
-        }
-        curr = curr->next;
-    }
-    
-    // Add new document node
-    DocNode *new_node = (DocNode*)malloc(sizeof(DocNode));
-    new_node->doc_id = doc_id;
-    new_node->frequency = 1;
-    new_node->next = node->doc_list;
-    node->doc_list = new_node;
-    node->total_freq++;
-}
-
-// Insert word into trie
-TrieNode* trie_insert(TrieNode *root, const char *word, int doc_id) {
-    TrieNode *curr = root;
-    
-    for (int i = 0; word[i]; i++) {
-        int idx = word[i] - 'a';
-        if (idx < 0 || idx >= ALPHABET_SIZE) continue;
-        
-        if (!curr->children[idx])
-            curr->children[idx] = create_trie_node();
-        curr = curr->children[idx];
-    }
-    
-    curr->is_end = 1;
-    add_doc_occurrence(curr, doc_id);
-    return curr;
-}
-
-// Search word in trie
-TrieNode* trie_search(TrieNode *root, const char *word) {
-    TrieNode *curr = root;
-    
-    for (int i = 0; word[i]; i++) {
-        int idx = word[i] - 'a';
-        if (idx < 0 || idx >= ALPHABET_SIZE) return NULL;
-        if (!curr->children[idx]) return NULL;
-        curr = curr->children[idx];
-    }
-    
-    return curr->is_end ? curr : NULL;
-}
-
-// Find all words with given prefix (for autocomplete)
-void trie_prefix_helper(TrieNode *node, char *prefix, int len) {
-    if (!node) return;
-    
-    if (node->is_end) {
-        prefix[len] = '\0';
-        printf("  %s (freq: %d)\n", prefix, node->total_freq);
-    }
-    
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i]) {
-            prefix[len] = 'a' + i;
-            trie_prefix_helper(node->children[i], prefix, len + 1);
-        }
-    }
-}
-
-void trie_prefix_search(TrieNode *root, const char *prefix) {
-    TrieNode *curr = root;
-    char buffer[MAX_WORD_LEN];
-    strcpy(buffer, prefix);
-    int len = strlen(prefix);
-    
-    for (int i = 0; prefix[i]; i++) {
-        int idx = prefix[i] - 'a';
-        if (idx < 0 || idx >= ALPHABET_SIZE || !curr->children[idx]) {
-            printf("No words found with prefix '%s'\n", prefix);
-            return;
-        }
-        curr = curr->children[idx];
-    }
-    
-    printf("Words with prefix '%s':\n", prefix);
-    trie_prefix_helper(curr, buffer, len);
-}
-
-/* ==================== HASH TABLE OPERATIONS ==================== */
-
-void hash_insert(SearchEngine *engine, const char *word, TrieNode *trie_node) {
-    unsigned long idx = hash_func(word);
-    
-    // Check if already exists
-    HashEntry *curr = engine->hash_table[idx];
-    while (curr) {
-        if (strcmp(curr->word, word) == 0)
-            return;  // Already indexed
-        curr = curr->next;
-    }
-    
-    // Insert new entry
-    HashEntry *entry = (HashEntry*)malloc(sizeof(HashEntry));
-    entry->word = strdup(word);
-    entry->trie_node = trie_node;
-    entry->next = engine->hash_table[idx];
-    engine->hash_table[idx] = entry;
-}
-
-TrieNode* hash_search(SearchEngine *engine, const char *word) {
-    unsigned long idx = hash_func(word);
-    HashEntry *curr = engine->hash_table[idx];
-    
-    while (curr) {
-        if (strcmp(curr->word, word) == 0)
-            return curr->trie_node;
-        curr = curr->next;
-    }
-    return NULL;
-}
-
-/* ==================== SEARCH ENGINE OPERATIONS ==================== */
-
-SearchEngine* create_search_engine() {
-    SearchEngine *engine = (SearchEngine*)calloc(1, sizeof(SearchEngine));
-    engine->trie_root = create_trie_node();
-    return engine;
-}
-
-// Add document to engine
-void add_document(SearchEngine *engine, const char *filename) {
-    Document *doc = (Document*)malloc(sizeof(Document));
-    doc->id = engine->doc_count++;
-    doc->filename = strdup(filename);
-    doc->word_count = 0;
-    doc->next = engine->documents;
-    engine->documents = doc;
-}
-
-// Get document by ID
-Document* get_document(SearchEngine *engine, int doc_id) {
-    Document *curr = engine->documents;
-    while (curr) {
-        if (curr->id == doc_id) return curr;
-        curr = curr->next;
-    }
-    return NULL;
-}
-
-// Index a single word
-void index_word(SearchEngine *engine, const char *word, int doc_id) {
-    char normalized[MAX_WORD_LEN];
-    strncpy(normalized, word, MAX_WORD_LEN - 1);
-    normalized[MAX_WORD_LEN - 1] = '\0';
-    normalize_word(normalized);
-    
-    if (strlen(normalized) < 2) return;  // Skip very short words
-    
-    TrieNode *node = trie_insert(engine->trie_root, normalized, doc_id);
-    hash_insert(engine, normalized, node);
-}
-
-// Index document from file
-int index_document(SearchEngine *engine, const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: Cannot open file '%s'\n", filename);
-        return -1;
-    }
-    
-    add_document(engine, filename);
-    int doc_id = engine->doc_count - 1;
-    
-    char line[MAX_LINE_LEN];
-    char word[MAX_WORD_LEN];
-    int word_count = 0;
-    
-    while (fgets(line, MAX_LINE_LEN, file)) {
-        char *token = strtok(line, " \t\n\r.,;:!?\"'()[]{}");
-        while (token) {
-            index_word(engine, token, doc_id);
-            word_count++;
-            token = strtok(NULL, " \t\n\r.,;:!?\"'()[]{}");
-        }
-    }
-    
-    // Update document word count
-    Document *doc = get_document(engine, doc_id);
-    if (doc) doc->word_count = word_count;
-    
-    fclose(file);
-    printf("Indexed '%s' (Doc ID: %d, Words: %d)\n", filename, doc_id, word_count);
-    return doc_id;
-}
-
-// Index from string (for demo purposes)
-int index_text(SearchEngine *engine, const char *name, const char *text) {
-    add_document(engine, name);
-    int doc_id = engine->doc_count - 1;
-    
-    char *text_copy = strdup(text);
-    char *token = strtok(text_copy, " \t\n\r.,;:!?\"'()[]{}");
-    int word_count = 0;
-    
-    while (token) {
-        index_word(engine, token, doc_id);
-        word_count++;
-        token = strtok(NULL, " \t\n\r.,;:!?\"'()[]{}");
-    }
-    
-    Document *doc = get_document(engine, doc_id);
-    if (doc) doc->word_count = word_count;
-    
-    free(text_copy);
-    printf("Indexed '%s' (Doc ID: %d, Words: %d)\n", name, doc_id, word_count);
-    return doc_id;
-}
-
-/* ==================== SEARCH FUNCTIONS ==================== */
-
-// Search for exact keyword
-void search_keyword(SearchEngine *engine, const char *keyword) {
-    char normalized[MAX_WORD_LEN];
-    strncpy(normalized, keyword, MAX_WORD_LEN - 1);
-    normalize_word(normalized);
-    
-    printf("\n=== Search Results for '%s' ===\n", normalized);
-    
-    // Use hash table for O(1) lookup
-    TrieNode *node = hash_search(engine, normalized);
-    
-    if (!node) {
-        printf("No results found.\n");
-        return;
-    }
-    
-    printf("Total occurrences: %d\n\n", node->total_freq);
-    
-    DocNode *doc = node->doc_list;
-    while (doc) {
-        Document *doc_info = get_document(engine, doc->doc_id);
-        printf("Document: %s (ID: %d)\n", 
-               doc_info ? doc_info->filename : "Unknown", doc->doc_id);
-        printf("  Frequency: %d\n", doc->frequency);
-        doc = doc->next;
-    }
-}
-
-// Search with prefix matching
-void search_prefix(SearchEngine *engine, const char *prefix) {
-    char normalized[MAX_WORD_LEN];
-    strncpy(normalized, prefix, MAX_WORD_LEN - 1);
-    normalize_word(normalized);
-    
-    printf("\n=== Prefix Search for '%s' ===\n", normalized);
-    trie_prefix_search(engine->trie_root, normalized);
-}
-
-// Multi-keyword AND search
-void search_multi(SearchEngine *engine, char *keywords[], int count) {
-    printf("\n=== Multi-Keyword Search ===\n");
-    printf("Keywords: ");
-    for (int i = 0; i < count; i++)
-        printf("%s ", keywords[i]);
-    printf("\n\n");
-    
-    // Find documents containing ALL keywords
-    int *doc_scores = (int*)calloc(engine->doc_count, sizeof(int));
-    int *doc_matches = (int*)calloc(engine->doc_count, sizeof(int));
-    
-    for (int i = 0; i < count; i++) {
-        char normalized[MAX_WORD_LEN];
-        strncpy(normalized, keywords[i], MAX_WORD_LEN - 1);
-        normalize_word(normalized);
-        
-        TrieNode *node = hash_search(engine, normalized);
-        if (!node) {
-            printf("'%s' not found in any document.\n", normalized);
-            free(doc_scores);
-            free(doc_matches);
-            return;
-        }
-        
-        DocNode *doc = node->doc_list;
-        while (doc) {
-            doc_matches[doc->doc_id]++;
-            doc_scores[doc->doc_id] += doc->frequency;
-            doc = doc->next;
-        }
-    }
-    
-    // Display results (documents with all keywords)
-    int found = 0;
-    for (int i = 0; i < engine->doc_count; i++) {
-        if (doc_matches[i] == count) {
-            Document *doc_info = get_document(engine, i);
-            printf("Document: %s (ID: %d, Score: %d)\n",
-                   doc_info ? doc_info->filename : "Unknown", i, doc_scores[i]);
-            found = 1;
-        }
-    }
-    
-    if (!found)
-        printf("No documents contain all keywords.\n");
-    
-    free(doc_scores);
-    free(doc_matches);
-}
-
-// Display word frequency statistics
-void show_word_frequency(SearchEngine *engine, const char *word) {
-    char normalized[MAX_WORD_LEN];
-    strncpy(normalized, word, MAX_WORD_LEN - 1);
-    normalize_word(normalized);
-    
-    TrieNode *node = hash_search(engine, normalized);
-    
-    printf("\n=== Word Frequency: '%s' ===\n", normalized);
-    
-    if (!node) {
-        printf("Word not found.\n");
-        return;
-    }
-    
-    printf("Total frequency: %d\n", node->total_freq);
-    printf("Document breakdown:\n");
-    
-    DocNode *doc = node->doc_list;
-    while (doc) {
-        Document *doc_info = get_document(engine, doc->doc_id);
-        float tf = doc_info ? (float)doc->frequency / doc_info->word_count : 0;
-        printf("  %s: %d occurrences (TF: %.4f)\n",
-               doc_info ? doc_info->filename : "Unknown",
-               doc->frequency, tf);
-        doc = doc->next;
-    }
-}
-
-// List all indexed documents
-void list_documents(SearchEngine *engine) {
-    printf("\n=== Indexed Documents ===\n");
-    Document *doc = engine->documents;
-    while (doc) {
-        printf("ID: %d | File: %s | Words: %d\n",
-               doc->id, doc->filename, doc->word_count);
-        doc = doc->next;
-    }
-    printf("Total: %d documents\n", engine->doc_count);
-}
-
-/* ==================== MEMORY CLEANUP ==================== */
-
-void free_doc_list(DocNode *node) {
-    while (node) {
-        DocNode *next = node->next;
-        free(node);
-        node = next;
-    }
-}
-
-void free_trie(TrieNode *node) {
-    if (!node) return;
-    for (int i = 0; i < ALPHABET_SIZE; i++)
-        free_trie(node->children[i]);
-    free_doc_list(node->doc_list);
-    free(node);
-}
-
-void free_search_engine(SearchEngine *engine) {
-    // Free trie
-    free_trie(engine->trie_root);
-    
-    // Free hash table
-    for (int i = 0; i < HASH_SIZE; i++) {
-        HashEntry *curr = engine->hash_table[i];
-        while (curr) {
-            HashEntry *next = curr->next;
-            free(curr->word);
-            free(curr);
-            curr = next;
-        }
-    }
-    
-    // Free document list
-    Document *doc = engine->documents;
-    while (doc) {
-        Document *next = doc->next;
-        free(doc->filename);
-        free(doc);
-        doc = next;
-    }
-    
-    free(engine);
-}
-
-/* ==================== MAIN / DEMO ==================== */
-
-int main() {
-    printf("╔════════════════════════════════════════╗\n");
-    printf("║     Mini Search Engine Demo            ║\n");
-    printf("╚════════════════════════════════════════╝\n\n");
-    
-    SearchEngine *engine = create_search_engine();
-    
-    // Demo: Index sample texts
-    const char *doc1 = "The quick brown fox jumps over the lazy dog. "
-                       "The fox is very quick and clever.";
-    
-    const char *doc2 = "Data structures are fundamental to computer science. "
-                       "Linked lists, trees, and hash tables are common structures.";
-    
-    const char *doc3 = "The brown bear lives in the forest. "
-                       "Bears are quick when hunting for food.";
-    
-    printf("=== Indexing Documents ===\n");
-    index_text(engine, "animals.txt", doc1);
-    index_text(engine, "cs_basics.txt", doc2);
-    index_text(engine, "wildlife.txt", doc3);
-    
-    // List documents
-    list_documents(engine);
-    
-    // Search demonstrations
-    search_keyword(engine, "quick");
-    search_keyword(engine, "structures");
-    search_keyword(engine, "python");  // Not found
-    
-    // Word frequency
-    show_word_frequency(engine, "the");
-    show_word_frequency(engine, "fox");
-    
-    // Prefix search
-    search_prefix(engine, "qu");
-    search_prefix(engine, "str");
-    
-    // Multi-keyword search
-    char *keywords1[] = {"quick", "brown"};
-    search_multi(engine, keywords1, 2);
-    
-    char *keywords2[] = {"data", "structures"};
-    search_multi(engine, keywords2, 2);
-    
-    // Interactive mode hint
-    printf("\n=== Extension Ideas ===\n");
-    printf("1. Add interactive CLI with menu\n");
-    printf("2. Index files from directory\n");
-    printf("3. Add TF-IDF ranking\n");
-    printf("4. Implement phrase search\n");
-    printf("5. Add Boolean operators (AND/OR/NOT)\n");
-    
-    // Cleanup
-    free_search_engine(engine);
-    printf("\nMemory cleaned up. Goodbye!\n");
-    
-    return 0;
-}
\ No newline at end of file
+/*
+ * The search engine: indexing, index files and segments, queries, the
+ * requests every front end answers, and the C interface of searchEngine.h
+ * (see LIBRARY API). searchCLI.c links against it for the command line
+ * and its servers, searchDemo.c for a demo, and built as a shared library
+ * it serves any language with a C foreign function interface:
+ *
+ *   gcc -O2 -pthread searchCLI.c searchEngine.c -o searchCLI.exe -lm
+ *   gcc -O2 -pthread -shared -fPIC searchEngine.c -o libsearch.so -lm
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <winsock2.h>  // Before windows.h, which would pull in winsock 1
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "searchInternal.h"
+
+#define MAX_WORD_LEN 100
+#define MAX_QUERY_TERMS 32
+#define SKIP_INTERVAL 64  // Postings per skip block
+#define ARENA_CLASSES 48  // Recycled block sizes, 1 << class bytes
+#define MAX_SEGMENTS 16     // Index files one engine reads at once
+
+/* Tuning for a deployment, each overridable at build time (e.g.
+ * -DFLUSH_WORDS=4194304); unlike the limits above, none of them changes
+ * index files */
+#ifndef HASH_INITIAL_SIZE
+#define HASH_INITIAL_SIZE 1024  // Slots; always a power of two
+#endif
+#ifndef READ_CHUNK_SIZE
+#define READ_CHUNK_SIZE 65536  // Bytes per read while indexing a file
+#endif
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE (1 << 20)
+#endif
+#ifndef MERGE_FACTOR
+#define MERGE_FACTOR 4  // Segments per merge, and the size ratio of tiers
+#endif
+#ifndef MERGE_FLOOR
+#define MERGE_FLOOR (1 << 20)  // Segments below this many bytes share a tier
+#endif
+#ifndef FLUSH_WORDS
+#define FLUSH_WORDS (1 << 20)  // In-memory words that trigger a flush
+#endif
+#if HASH_INITIAL_SIZE < 2 || (HASH_INITIAL_SIZE & (HASH_INITIAL_SIZE - 1))
+#error "HASH_INITIAL_SIZE must be a power of two"
+#endif
+#if MERGE_FACTOR < 2 || MERGE_FACTOR > MAX_SEGMENTS
+#error "MERGE_FACTOR must be from 2 to MAX_SEGMENTS"
+#endif
+
+/* ==================== DATA STRUCTURES ==================== */
+
+/*
+ * Engine-owned allocator. Trie nodes are bump-allocated from large chunks;
+ * growable arrays (child blocks, postings, skips) take power-of-two blocks,
+ * and a block they outgrow waits on a free list for the next array that
+ * size. Nothing is freed alone: arena_free drops every chunk at once.
+ */
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;  // Usable bytes after this header
+} ArenaChunk;
+
+typedef struct Arena {
+  ArenaChunk *chunks;
+  char *bump;  // Unused tail of the newest shared chunk
+  size_t bump_left;
+  void *free_blocks[ARENA_CLASSES];  // Released blocks, linked through them
+} Arena;
+
+/*
+ * Posting list: ascending doc_ids stored as varint (doc_id gap, frequency)
+ * pairs in one growable buffer. The newest posting stays unencoded in
+ * last_doc/last_freq, so repeat occurrences in the document being indexed
+ * are a single increment. Documents must be added in ascending id order.
+ *
+ * Every SKIP_INTERVAL encoded postings start a new block, and a skip entry
+ * records where, so a cursor can seek forward without decoding every gap.
+ *
+ * Word positions (token numbers within the document) live in a second
+ * buffer: per posting, frequency varints, the first position absolute and
+ * the rest gaps from the one before. Only phrase and proximity queries read
+ * them; skip entries record where each block's positions start, so those
+ * queries seek through them too, and other queries never touch them.
+ */
+typedef struct SkipEntry {
+  uint32_t doc_id;  // Last doc_id before the block; its gap base
+  uint32_t offset;  // Block start, in bytes into the encoded postings
+  uint32_t position_offset;  // Block start, in bytes into the positions
+  uint32_t reserved;         // Zero
+} SkipEntry;
+
+typedef struct PostingList {
+  unsigned char *data;
+  uint32_t len;
+  uint32_t cap;
+  int doc_count;     // Postings, including the open one
+  int last_doc;      // Open posting; valid when doc_count > 0
+  int last_freq;
+  int prev_doc;      // Last doc_id encoded into data
+  SkipEntry *skips;  // posting_skip_count entries
+  unsigned char *positions;
+  uint32_t positions_len;
+  uint32_t positions_cap;
+  uint32_t open_positions;  // Where the open posting's positions start
+  int last_position;        // Latest position of the open posting
+} PostingList;
+
+/*
+ * Reads a posting list's encoded bytes, then its open posting. Positions
+ * are not decoded as postings go by; the cursor only counts the position
+ * varints it would have to pass before the current posting's, and passes
+ * them if posting_cursor_positions asks.
+ */
+typedef struct PostingCursor {
+  const unsigned char *start;
+  const unsigned char *pos;
+  const unsigned char *end;
+  uint32_t doc_id;  // Last decoded doc_id
+  int open_doc;     // -1 once consumed or absent
+  int open_freq;
+  const SkipEntry *skips;
+  uint32_t skip_count;
+  uint32_t next_skip;  // First entry a seek may still jump to
+  const unsigned char *positions_start;  // NULL without positions
+  const unsigned char *positions;        // Next unread position byte
+  const unsigned char *positions_end;
+  uint32_t positions_skip;  // Varints before the current posting's
+  uint32_t last_freq;       // Current posting's frequency, until read
+  const unsigned char *bitmap;  // Presence bits instead of postings, or NULL
+  uint32_t bitmap_base;         // doc_id of bit 0
+  uint32_t bitmap_bits;
+  uint32_t bitmap_next;         // First bit not yet looked at
+  uint32_t bitmap_freq;         // Frequency every set bit reports
+} PostingCursor;
+
+/*
+ * Radix trie node: each edge carries a run of characters, so chains of
+ * single-child nodes collapse into one. Children live in a single block of
+ * child_cap pointers followed by child_cap first-character keys, kept sorted
+ * so lookups scan a few contiguous bytes instead of chasing pointers. The
+ * block is a power-of-two arena block, and child_cap is however many fit.
+ */
+typedef struct TrieNode {
+  struct TrieNode **children;
+  struct TrieNode *parent;
+  PostingList postings;
+  int total_freq;
+  int max_freq;   // Highest encoded frequency; the open posting may exceed it
+  int best_freq;  // No word at or below this node has a higher total_freq
+  unsigned short child_count;
+  unsigned short child_cap;
+  unsigned short label_len;
+  unsigned char is_end;
+  char label[];  // Edge label from the parent (not NUL-terminated)
+} TrieNode;
+
+#define CHILD_KEYS(node)                                                      \
+  ((unsigned char *)((node)->children + (node)->child_cap))
+
+/* Strings stored back to back, NUL-terminated, addressed by offset */
+typedef struct StringPool {
+  char *data;
+  size_t len;
+  size_t cap;
+} StringPool;
+
+/*
+ * Open-addressing term table with Robin Hood linear probing. Slots keep the
+ * full hash inline so most mismatches never touch the key, and every key
+ * lives in one contiguous string pool addressed by offset.
+ */
+typedef struct HashSlot {
+  uint32_t hash;
+  uint32_t word_offset;  // Into the string pool
+  TrieNode *trie_node;   // NULL marks an empty slot
+} HashSlot;
+
+typedef struct HashTable {
+  HashSlot *slots;
+  uint32_t capacity;
+  uint32_t count;
+  StringPool pool;
+} HashTable;
+
+/* Entry in the dense document table, indexed by doc_id */
+typedef struct Document {
+  uint32_t name_offset;  // Into the engine's name pool
+  int word_count;        // Document length, the norm for TF scoring
+} Document;
+
+/*
+ * Binary index file, queried in place after mmap:
+ *
+ *   IndexHeader
+ *   IndexTerm[term_count]    sorted by word, so a prefix is a range
+ *   postings                 per-term varint (gap, frequency) pairs, or
+ *                            a bitmap (see TERM_BITMAP)
+ *   positions                per-term position varints, as in PostingList
+ *   SkipEntry[skip_count]    per-term skip entries, as in PostingList
+ *   uint32_t[2 * leaves]     max tree over term total_freq (see below)
+ *   IndexDoc[doc_count]      indexed by doc_id - doc_base
+ *   string pool              NUL-terminated words and filenames
+ *
+ * Integers are fixed width in host byte order (byte_order rejects foreign
+ * files); every section starts on an 8-byte boundary.
+ *
+ * The max tree is an implicit binary heap: slot leaves + i holds term i's
+ * total_freq (0 past term_count), every slot below leaves holds the larger
+ * of its two children, and leaves is the smallest power of two >= term_count.
+ *
+ * A file holds the documents doc_base .. doc_base + doc_count - 1; postings
+ * carry those doc_ids unchanged. A TERM_BITMAP term stores one bit per
+ * document instead, bit i of uint32_t word i / 32 for doc_id doc_base + i;
+ * it has no skips, its positions hold a count varint before each set bit's
+ * position varints, and every document reports max_freq, the term's mean
+ * frequency. A standalone index starts at 0, while a
+ * segment in an index directory (see SEGMENTS) starts where the one before
+ * it ends.
+ */
+#define INDEX_MAGIC "MSEINDEX"
+#define INDEX_VERSION 11
+#define INDEX_BYTE_ORDER 0x01020304u
+
+typedef struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t doc_count;
+  uint32_t term_count;
+  uint32_t doc_base;       // doc_id of docs[0]
+  uint32_t reserved;       // Zero
+  uint64_t total_words;    // Sum of word_count, for the BM25 average
+  uint64_t postings_size;  // Bytes
+  uint64_t terms_offset;
+  uint64_t postings_offset;
+  uint64_t positions_size;  // Bytes
+  uint64_t positions_offset;
+  uint64_t skips_offset;
+  uint64_t skip_count;
+  uint64_t freq_tree_offset;
+  uint64_t docs_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+} IndexHeader;
+
+typedef struct IndexTerm {
+  uint32_t word_offset;  // Into the string pool
+  uint32_t total_freq;
+  uint32_t doc_freq;         // Number of postings
+  uint32_t postings_len;     // Encoded bytes
+  uint64_t postings_offset;  // Into the postings section
+  uint64_t skips_index;      // First of (doc_freq - 1) / SKIP_INTERVAL
+  uint32_t max_freq;         // Highest frequency in any posting
+  float min_len_ratio;       // Lowest word_count / frequency of any posting
+  uint64_t positions_offset;  // Into the positions section
+  uint32_t positions_len;     // Encoded bytes
+  uint32_t flags;             // TERM_BITMAP, or zero
+} IndexTerm;
+
+#define TERM_BITMAP 1u
+
+typedef struct IndexDoc {
+  uint32_t name_offset;  // Into the string pool
+  uint32_t word_count;
+} IndexDoc;
+
+typedef struct MappedIndex {
+  void *base;
+  size_t size;
+  const IndexHeader *header;
+  const IndexTerm *terms;
+  const unsigned char *postings;
+  const unsigned char *positions;
+  const SkipEntry *skips;
+  const uint32_t *freq_tree;
+  const IndexDoc *docs;
+  const char *strings;
+  int refs;           // Held by the engine and the versions readers see
+  int heap;           // base is an index image in memory, not a mapping
+  char *unlink_path;  // File removed once the last reference is dropped
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} MappedIndex;
+
+struct SearchEngine {
+  Arena arena;  // Trie nodes, child blocks and posting lists
+  TrieNode *trie_root;
+  HashTable hash_table;
+  Document *documents;  // In-memory documents, starting at doc_id doc_base
+  int doc_base;
+  int doc_cap;
+  StringPool doc_names;
+  int doc_count;         // All documents, mapped and deleted ones included
+  uint64_t total_words;  // Sum of in-memory word counts
+  // Mapped index files in doc_id order; together they own doc_ids below
+  // doc_base
+  MappedIndex *segments[MAX_SEGMENTS];
+  int segment_count;
+  uint64_t *deleted;  // Tombstone bitmap over doc_ids
+  size_t deleted_cap;  // In 64-bit words
+  int deleted_count;
+  uint64_t deleted_words;  // Sum of the deleted documents' word counts
+  struct IndexDir *dir;    // Index directory the engine flushes to, or NULL
+  struct SegmentMerge *merge;  // Running background merge, or NULL
+  uint64_t generation;         // Bumped by every change queries can see
+  struct Snapshots *snapshots;  // Versions published to readers, or NULL
+  const struct StopWords *stop_words;  // Left out of documents and queries,
+                                       // or NULL; not owned
+  int bitmap_terms;  // Whether index files get bitmap terms
+};
+
+/* ==================== UTF-8 FOLDING ==================== */
+
+/*
+ * Words are UTF-8. A token keeps its ASCII letters, lowercased, and every
+ * byte from 0x80 up; fold_word then decodes the latter and folds each code
+ * point. Latin letters lose their diacritics, down to ASCII where there is
+ * a base letter ("Café" is "cafe", "ß" is "ss"), Greek and Cyrillic are
+ * lowercased (Greek without accents, polytonic letters included, so
+ * "Ἀθῆναι" is "αθηναι"), fullwidth letters become ASCII, and
+ * combining marks, punctuation, symbols and emoji are dropped, as ASCII
+ * digits are. Anything else, CJK included, stays as it is, and malformed
+ * bytes are dropped. No code point folds to more bytes than it takes, so
+ * folding works in place, and all-ASCII words skip it entirely.
+ *
+ * The tables were generated from the Unicode character database (NFKD
+ * decomposition without combining marks, then lowercasing) by
+ * tools/gen_fold_tables.py.
+ */
+/* Latin-1 Supplement and Latin Extended-A and -B, U+00A0 .. U+024F: what
+ * each code point folds to; "" drops it and NULL keeps it as it is */
+const char *const fold_latin[0x24F - 0xA0 + 1] = {
+  "", "", "", "", "", "", "", "", "", "", "a", "", "", "", "", "", "", "", "",
+  "", "", NULL, "", "", "", "", "o", "", "", "", "", "", "a", "a", "a", "a",
+  "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i", "d", "n", "o",
+  "o", "o", "o", "o", "", "o", "u", "u", "u", "u", "y", "th", "ss", "a", "a",
+  "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i", "d",
+  "n", "o", "o", "o", "o", "o", "", "o", "u", "u", "u", "u", "y", "th", "y",
+  "a", "a", "a", "a", "a", "a", "c", "c", "c", "c", "c", "c", "c", "c", "d",
+  "d", "d", "d", "e", "e", "e", "e", "e", "e", "e", "e", "e", "e", "g", "g",
+  "g", "g", "g", "g", "g", "g", "h", "h", "h", "h", "i", "i", "i", "i", "i",
+  "i", "i", "i", "i", "i", "ij", "ij", "j", "j", "k", "k", "k", "l", "l", "l",
+  "l", "l", "l", "l", "l", "l", "l", "n", "n", "n", "n", "n", "n", "n", "n",
+  "n", "o", "o", "o", "o", "o", "o", "oe", "oe", "r", "r", "r", "r", "r", "r",
+  "s", "s", "s", "s", "s", "s", "s", "s", "t", "t", "t", "t", "t", "t", "u",
+  "u", "u", "u", "u", "u", "u", "u", "u", "u", "u", "u", "w", "w", "y", "y",
+  "y", "z", "z", "z", "z", "z", "z", "s", NULL, "\xc9\x93", "\xc6\x83", NULL,
+  "\xc6\x85", NULL, "\xc9\x94", "\xc6\x88", NULL, "\xc9\x96", "\xc9\x97",
+  "\xc6\x8c", NULL, NULL, "\xc7\x9d", "\xc9\x99", "\xc9\x9b", "\xc6\x92",
+  NULL, "\xc9\xa0", "\xc9\xa3", NULL, "\xc9\xa9", "\xc9\xa8", "\xc6\x99",
+  NULL, NULL, NULL, "\xc9\xaf", "\xc9\xb2", NULL, "\xc9\xb5", "o", "o",
+  "\xc6\xa3", NULL, "\xc6\xa5", NULL, "\xca\x80", "\xc6\xa8", NULL,
+  "\xca\x83", NULL, NULL, "\xc6\xad", NULL, "\xca\x88", "u", "u", "\xca\x8a",
+  "\xca\x8b", "\xc6\xb4", NULL, "\xc6\xb6", NULL, "\xca\x92", "\xc6\xb9",
+  NULL, NULL, NULL, "\xc6\xbd", NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  "dz", "dz", "dz", "lj", "lj", "lj", "nj", "nj", "nj", "a", "a", "i", "i",
+  "o", "o", "u", "u", "u", "u", "u", "u", "u", "u", "u", "u", NULL, "a", "a",
+  "a", "a", "\xc7\xa3", NULL, "\xc7\xa5", NULL, "g", "g", "k", "k", "o", "o",
+  "o", "o", "\xc7\xaf", NULL, "j", "dz", "dz", "dz", "g", "g", "\xc6\x95",
+  "\xc6\xbf", "n", "n", "a", "a", "\xc7\xbd", NULL, "\xc7\xbf", NULL, "a",
+  "a", "a", "a", "e", "e", "e", "e", "i", "i", "i", "i", "o", "o", "o", "o",
+  "r", "r", "r", "r", "u", "u", "u", "u", "s", "s", "t", "t", "\xc8\x9d",
+  NULL, "h", "h", "\xc6\x9e", NULL, "\xc8\xa3", NULL, "\xc8\xa5", NULL, "a",
+  "a", "e", "e", "o", "o", "o", "o", "o", "o", "o", "o", "y", "y", NULL, NULL,
+  NULL, NULL, NULL, NULL, NULL, "\xc8\xbc", NULL, "\xc6\x9a", NULL, NULL,
+  NULL, "\xc9\x82", NULL, "\xc6\x80", "\xca\x89", "\xca\x8c", "\xc9\x87",
+  NULL, "\xc9\x89", NULL, "\xc9\x8b", NULL, "\xc9\x8d", NULL, "\xc9\x8f",
+  NULL,
+};
+
+/* Latin Extended Additional, U+1E00 .. U+1EFF, as fold_latin */
+const char *const fold_latin_additional[0x1EFF - 0x1E00 + 1] = {
+  "a", "a", "b", "b", "b", "b", "b", "b", "c", "c", "d", "d", "d", "d", "d",
+  "d", "d", "d", "d", "d", "e", "e", "e", "e", "e", "e", "e", "e", "e", "e",
+  "f", "f", "g", "g", "h", "h", "h", "h", "h", "h", "h", "h", "h", "h", "i",
+  "i", "i", "i", "k", "k", "k", "k", "k", "k", "l", "l", "l", "l", "l", "l",
+  "l", "l", "m", "m", "m", "m", "m", "m", "n", "n", "n", "n", "n", "n", "n",
+  "n", "o", "o", "o", "o", "o", "o", "o", "o", "p", "p", "p", "p", "r", "r",
+  "r", "r", "r", "r", "r", "r", "s", "s", "s", "s", "s", "s", "s", "s", "s",
+  "s", "t", "t", "t", "t", "t", "t", "t", "t", "u", "u", "u", "u", "u", "u",
+  "u", "u", "u", "u", "v", "v", "v", "v", "w", "w", "w", "w", "w", "w", "w",
+  "w", "w", "w", "x", "x", "x", "x", "y", "y", "z", "z", "z", "z", "z", "z",
+  "h", "t", "w", "y", "a", "s", NULL, NULL, "ss", NULL, "a", "a", "a", "a",
+  "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a",
+  "a", "a", "a", "a", "a", "e", "e", "e", "e", "e", "e", "e", "e", "e", "e",
+  "e", "e", "e", "e", "e", "e", "i", "i", "i", "i", "o", "o", "o", "o", "o",
+  "o", "o", "o", "o", "o", "o", "o", "o", "o", "o", "o", "o", "o", "o", "o",
+  "o", "o", "o", "o", "u", "u", "u", "u", "u", "u", "u", "u", "u", "u", "u",
+  "u", "u", "u", "y", "y", "y", "y", "y", "y", "y", "y", "\xe1\xbb\xbb", NULL,
+  "\xe1\xbb\xbd", NULL, "\xe1\xbb\xbf", NULL,
+};
+
+/* Greek and Cyrillic, U+0370 .. U+04FF: the lowercase code point, without
+ * Greek accents; 0 drops it */
+const uint16_t fold_greek_cyrillic[0x4FF - 0x370 + 1] = {
+  0x371, 0x371, 0x373, 0x373, 0x2B9, 0, 0x377, 0x377, 0, 0, 0x37A, 0x37B,
+  0x37C, 0x37D, 0, 0x3F3, 0, 0, 0, 0, 0, 0, 0x3B1, 0, 0x3B5, 0x3B7, 0x3B9, 0,
+  0x3BF, 0, 0x3C5, 0x3C9, 0x3B9, 0x3B1, 0x3B2, 0x3B3, 0x3B4, 0x3B5, 0x3B6,
+  0x3B7, 0x3B8, 0x3B9, 0x3BA, 0x3BB, 0x3BC, 0x3BD, 0x3BE, 0x3BF, 0x3C0, 0x3C1,
+  0, 0x3C3, 0x3C4, 0x3C5, 0x3C6, 0x3C7, 0x3C8, 0x3C9, 0x3B9, 0x3C5, 0x3B1,
+  0x3B5, 0x3B7, 0x3B9, 0x3C5, 0x3B1, 0x3B2, 0x3B3, 0x3B4, 0x3B5, 0x3B6, 0x3B7,
+  0x3B8, 0x3B9, 0x3BA, 0x3BB, 0x3BC, 0x3BD, 0x3BE, 0x3BF, 0x3C0, 0x3C1, 0x3C3,
+  0x3C3, 0x3C4, 0x3C5, 0x3C6, 0x3C7, 0x3C8, 0x3C9, 0x3B9, 0x3C5, 0x3BF, 0x3C5,
+  0x3C9, 0x3D7, 0x3D0, 0x3D1, 0x3D2, 0x3D2, 0x3D2, 0x3D5, 0x3D6, 0x3D7, 0x3D9,
+  0x3D9, 0x3DB, 0x3DB, 0x3DD, 0x3DD, 0x3DF, 0x3DF, 0x3E1, 0x3E1, 0x3E3, 0x3E3,
+  0x3E5, 0x3E5, 0x3E7, 0x3E7, 0x3E9, 0x3E9, 0x3EB, 0x3EB, 0x3ED, 0x3ED, 0x3EF,
+  0x3EF, 0x3F0, 0x3F1, 0x3F2, 0x3F3, 0x3B8, 0x3F5, 0, 0x3F8, 0x3F8, 0x3F2,
+  0x3FB, 0x3FB, 0x3FC, 0x37B, 0x37C, 0x37D, 0x450, 0x451, 0x452, 0x453, 0x454,
+  0x455, 0x456, 0x457, 0x458, 0x459, 0x45A, 0x45B, 0x45C, 0x45D, 0x45E, 0x45F,
+  0x430, 0x431, 0x432, 0x433, 0x434, 0x435, 0x436, 0x437, 0x438, 0x439, 0x43A,
+  0x43B, 0x43C, 0x43D, 0x43E, 0x43F, 0x440, 0x441, 0x442, 0x443, 0x444, 0x445,
+  0x446, 0x447, 0x448, 0x449, 0x44A, 0x44B, 0x44C, 0x44D, 0x44E, 0x44F, 0x430,
+  0x431, 0x432, 0x433, 0x434, 0x435, 0x436, 0x437, 0x438, 0x439, 0x43A, 0x43B,
+  0x43C, 0x43D, 0x43E, 0x43F, 0x440, 0x441, 0x442, 0x443, 0x444, 0x445, 0x446,
+  0x447, 0x448, 0x449, 0x44A, 0x44B, 0x44C, 0x44D, 0x44E, 0x44F, 0x450, 0x451,
+  0x452, 0x453, 0x454, 0x455, 0x456, 0x457, 0x458, 0x459, 0x45A, 0x45B, 0x45C,
+  0x45D, 0x45E, 0x45F, 0x461, 0x461, 0x463, 0x463, 0x465, 0x465, 0x467, 0x467,
+  0x469, 0x469, 0x46B, 0x46B, 0x46D, 0x46D, 0x46F, 0x46F, 0x471, 0x471, 0x473,
+  0x473, 0x475, 0x475, 0x477, 0x477, 0x479, 0x479, 0x47B, 0x47B, 0x47D, 0x47D,
+  0x47F, 0x47F, 0x481, 0x481, 0, 0, 0, 0, 0, 0, 0, 0, 0x48B, 0x48B, 0x48D,
+  0x48D, 0x48F, 0x48F, 0x491, 0x491, 0x493, 0x493, 0x495, 0x495, 0x497, 0x497,
+  0x499, 0x499, 0x49B, 0x49B, 0x49D, 0x49D, 0x49F, 0x49F, 0x4A1, 0x4A1, 0x4A3,
+  0x4A3, 0x4A5, 0x4A5, 0x4A7, 0x4A7, 0x4A9, 0x4A9, 0x4AB, 0x4AB, 0x4AD, 0x4AD,
+  0x4AF, 0x4AF, 0x4B1, 0x4B1, 0x4B3, 0x4B3, 0x4B5, 0x4B5, 0x4B7, 0x4B7, 0x4B9,
+  0x4B9, 0x4BB, 0x4BB, 0x4BD, 0x4BD, 0x4BF, 0x4BF, 0x4CF, 0x4C2, 0x4C2, 0x4C4,
+  0x4C4, 0x4C6, 0x4C6, 0x4C8, 0x4C8, 0x4CA, 0x4CA, 0x4CC, 0x4CC, 0x4CE, 0x4CE,
+  0x4CF, 0x4D1, 0x4D1, 0x4D3, 0x4D3, 0x4D5, 0x4D5, 0x4D7, 0x4D7, 0x4D9, 0x4D9,
+  0x4DB, 0x4DB, 0x4DD, 0x4DD, 0x4DF, 0x4DF, 0x4E1, 0x4E1, 0x4E3, 0x4E3, 0x4E5,
+  0x4E5, 0x4E7, 0x4E7, 0x4E9, 0x4E9, 0x4EB, 0x4EB, 0x4ED, 0x4ED, 0x4EF, 0x4EF,
+  0x4F1, 0x4F1, 0x4F3, 0x4F3, 0x4F5, 0x4F5, 0x4F7, 0x4F7, 0x4F9, 0x4F9, 0x4FB,
+  0x4FB, 0x4FD, 0x4FD, 0x4FF, 0x4FF,
+};
+
+/* Greek Extended, U+1F00 .. U+1FFF: the basic lowercase Greek letter,
+ * without breathings, accents or iota subscript; 0 drops it */
+const uint16_t fold_greek_extended[0x1FFF - 0x1F00 + 1] = {
+  0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1,
+  0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B5, 0x3B5, 0x3B5, 0x3B5, 0x3B5, 0x3B5,
+  0, 0, 0x3B5, 0x3B5, 0x3B5, 0x3B5, 0x3B5, 0x3B5, 0, 0, 0x3B7, 0x3B7, 0x3B7,
+  0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7,
+  0x3B7, 0x3B7, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9,
+  0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3BF, 0x3BF, 0x3BF, 0x3BF,
+  0x3BF, 0x3BF, 0, 0, 0x3BF, 0x3BF, 0x3BF, 0x3BF, 0x3BF, 0x3BF, 0, 0, 0x3C5,
+  0x3C5, 0x3C5, 0x3C5, 0x3C5, 0x3C5, 0x3C5, 0x3C5, 0, 0x3C5, 0, 0x3C5, 0,
+  0x3C5, 0, 0x3C5, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9,
+  0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3B1, 0x3B1, 0x3B5,
+  0x3B5, 0x3B7, 0x3B7, 0x3B9, 0x3B9, 0x3BF, 0x3BF, 0x3C5, 0x3C5, 0x3C9, 0x3C9,
+  0, 0, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1,
+  0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7,
+  0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7, 0x3B7,
+  0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9,
+  0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3C9, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0,
+  0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0x3B1, 0, 0x3B9, 0, 0, 0, 0x3B7,
+  0x3B7, 0x3B7, 0, 0x3B7, 0x3B7, 0x3B5, 0x3B5, 0x3B7, 0x3B7, 0x3B7, 0, 0, 0,
+  0x3B9, 0x3B9, 0x3B9, 0x3B9, 0, 0, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9, 0x3B9,
+  0, 0, 0, 0, 0x3C5, 0x3C5, 0x3C5, 0x3C5, 0x3C1, 0x3C1, 0x3C5, 0x3C5, 0x3C5,
+  0x3C5, 0x3C5, 0x3C5, 0x3C1, 0, 0, 0, 0, 0, 0x3C9, 0x3C9, 0x3C9, 0, 0x3C9,
+  0x3C9, 0x3BF, 0x3BF, 0x3C9, 0x3C9, 0x3C9, 0, 0, 0,
+};
+
+/* Ligatures U+FB00 .. U+FB06 */
+const char *const fold_ligatures[0xFB06 - 0xFB00 + 1] = {
+    "ff", "fi", "fl", "ffi", "ffl", "st", "st"};
+
+/* Non-letter ranges words leave out */
+const uint32_t fold_dropped[][2] = {
+    {0x0080, 0x009F},   // C1 controls
+    {0x0300, 0x036F},   // Combining diacritical marks
+    {0x1AB0, 0x1AFF},   // Combining marks extended
+    {0x1DC0, 0x1DFF},   // Combining marks supplement
+    {0x2000, 0x206F},   // General punctuation and spaces
+    {0x20A0, 0x20FF},   // Currency symbols, combining marks for symbols
+    {0x2190, 0x2BFF},   // Arrows, math operators, box drawing, shapes
+    {0x3000, 0x303F},   // CJK punctuation
+    {0xFE00, 0xFE0F},   // Variation selectors
+    {0xFE20, 0xFE2F},   // Combining half marks
+    {0xFEFF, 0xFEFF},   // Byte order mark
+    {0xFF00, 0xFF20},   // Fullwidth punctuation and digits
+    {0xFF3B, 0xFF40},   // Fullwidth punctuation
+    {0xFF5B, 0xFF65},   // Fullwidth and halfwidth punctuation
+    {0x1F000, 0x1FAFF}, // Emoji and pictographs
+    {0xE0000, 0xE007F}, // Tags
+};
+
+/* Decode the code point at p; returns its length, or 0 if the bytes
+ * there are not well-formed UTF-8 */
+int utf8_decode(const unsigned char *p, const unsigned char *end,
+                uint32_t *code_point) {
+  int len = *p < 0x80   ? 1
+            : *p < 0xc2 ? 0  // Continuation bytes and overlong leads
+            : *p < 0xe0 ? 2
+            : *p < 0xf0 ? 3
+            : *p < 0xf5 ? 4
+                        : 0;
+  if (len == 0 || end - p < len)
+    return 0;
+  uint32_t value = len == 1 ? *p : *p & (0x7fu >> len);
+  for (int i = 1; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80)
+      return 0;
+    value = value << 6 | (p[i] & 0x3f);
+  }
+  // Overlong forms, surrogates and values past U+10FFFF
+  if ((len == 3 && value < 0x800) || (len == 4 && value < 0x10000) ||
+      value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff))
+    return 0;
+  *code_point = value;
+  return len;
+}
+
+/* Write code_point as UTF-8; returns its length */
+int utf8_encode(uint32_t code_point, char *out) {
+  if (code_point < 0x80) {
+    out[0] = (char)code_point;
+    return 1;
+  }
+  if (code_point < 0x800) {
+    out[0] = (char)(0xc0 | code_point >> 6);
+    out[1] = (char)(0x80 | (code_point & 0x3f));
+    return 2;
+  }
+  if (code_point < 0x10000) {
+    out[0] = (char)(0xe0 | code_point >> 12);
+    out[1] = (char)(0x80 | (code_point >> 6 & 0x3f));
+    out[2] = (char)(0x80 | (code_point & 0x3f));
+    return 3;
+  }
+  out[0] = (char)(0xf0 | code_point >> 18);
+  out[1] = (char)(0x80 | (code_point >> 12 & 0x3f));
+  out[2] = (char)(0x80 | (code_point >> 6 & 0x3f));
+  out[3] = (char)(0x80 | (code_point & 0x3f));
+  return 4;
+}
+
+/* Fold one code point from 0x80 up into out; returns the bytes written,
+ * 0 if it is dropped */
+int fold_code_point(uint32_t code_point, char out[4]) {
+  const char *folded = NULL;
+  if (code_point >= 0xA0 && code_point <= 0x24F)
+    folded = fold_latin[code_point - 0xA0];
+  else if (code_point >= 0x1E00 && code_point <= 0x1EFF)
+    folded = fold_latin_additional[code_point - 0x1E00];
+  else if (code_point >= 0xFB00 && code_point <= 0xFB06)
+    folded = fold_ligatures[code_point - 0xFB00];
+  if (folded) {
+    size_t len = strlen(folded);
+    memcpy(out, folded, len);
+    return (int)len;
+  }
+
+  if (code_point >= 0x370 && code_point <= 0x4FF) {
+    code_point = fold_greek_cyrillic[code_point - 0x370];
+    return code_point ? utf8_encode(code_point, out) : 0;
+  }
+  if (code_point >= 0x1F00 && code_point <= 0x1FFF) {
+    code_point = fold_greek_extended[code_point - 0x1F00];
+    return code_point ? utf8_encode(code_point, out) : 0;
+  }
+  if ((code_point >= 0xFF21 && code_point <= 0xFF3A) ||
+      (code_point >= 0xFF41 && code_point <= 0xFF5A)) {
+    out[0] = (char)('a' + (code_point - 0xFF21) % 0x20);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(fold_dropped) / sizeof(fold_dropped[0]); i++)
+    if (code_point >= fold_dropped[i][0] && code_point <= fold_dropped[i][1])
+      return 0;
+  return utf8_encode(code_point, out);
+}
+
+/* Fold the len bytes of a word holding lowercase ASCII letters and bytes
+ * from 0x80 up, in place; returns its new length */
+int fold_word(char *word, int len) {
+  const unsigned char *p = (const unsigned char *)word, *end = p + len;
+  char *dst = word;
+  while (p < end) {
+    if (*p < 0x80) {
+      *dst++ = (char)*p++;
+      continue;
+    }
+    uint32_t code_point;
+    int n = utf8_decode(p, end, &code_point);
+    if (n == 0) {
+      p++;  // Malformed: dropped a byte at a time
+      continue;
+    }
+    p += n;
+    char folded[4];
+    int folded_len = fold_code_point(code_point, folded);
+    memcpy(dst, folded, folded_len);
+    dst += folded_len;
+  }
+  return (int)(dst - word);
+}
+
+/* Whether a normalized word is long enough to index: two characters */
+int word_indexable(const char *word, int len) {
+  int chars = 0;
+  for (int i = 0; i < len && chars < 2; i++)
+    chars += ((unsigned char)word[i] & 0xc0) != 0x80;
+  return chars >= 2;
+}
+
+/* ==================== UTILITY FUNCTIONS ==================== */
+
+uint32_t hash_func(const char *str) {
+  uint32_t hash = 5381;
+  int c;
+  while ((c = (unsigned char)*str++))
+    hash = ((hash << 5) + hash) + c;
+
+  // djb2 alone clusters in the low bits that pick the home slot
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/* Append str to the pool; returns its offset */
+uint32_t pool_add(StringPool *pool, const char *str) {
+  size_t len = strlen(str) + 1;
+  if (pool->len + len > pool->cap) {
+    size_t cap = pool->cap ? pool->cap * 2 : 4096;
+    while (cap < pool->len + len)
+      cap *= 2;
+    pool->data = (char *)realloc(pool->data, cap);
+    pool->cap = cap;
+  }
+  memcpy(pool->data + pool->len, str, len);
+  uint32_t offset = (uint32_t)pool->len;
+  pool->len += len;
+  return offset;
+}
+
+/* Normalize word in place: ASCII letters lowercased, other ASCII bytes
+ * dropped, the rest folded (see UTF-8 FOLDING) */
+void normalize_word(char *word) {
+  const unsigned char *src = (const unsigned char *)word;
+  char *dst = word;
+  int non_ascii = 0;
+  for (; *src; src++) {
+    if ((unsigned)((*src | 0x20) - 'a') < 26) {
+      *dst++ = (char)(*src | 0x20);
+    } else if (*src >= 0x80) {
+      *dst++ = (char)*src;
+      non_ascii = 1;
+    }
+  }
+  *dst = '\0';
+  if (non_ascii)
+    word[fold_word(word, (int)(dst - word))] = '\0';
+}
+
+/* Monotonic time in nanoseconds */
+uint64_t clock_nanos(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency, now;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/* Index of the lowest set bit; x must not be 0 */
+int lowest_bit(uint32_t x) {
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (int)i;
+#else
+  return __builtin_ctz(x);
+#endif
+}
+
+int lowest_bit64(uint64_t x) {
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward64(&i, x);
+  return (int)i;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+int count_bits64(uint64_t x) {
+#if defined(_MSC_VER)
+  return (int)__popcnt64(x);
+#else
+  return __builtin_popcountll(x);
+#endif
+}
+
+/*
+ * Reentrant strtok: returns the next token at *cursor, NUL-terminated in
+ * place, and advances *cursor past it. NULL once the string is exhausted.
+ */
+char *next_token(char **cursor, const char *delims) {
+  char *start = *cursor + strspn(*cursor, delims);
+  if (!*start) {
+    *cursor = start;
+    return NULL;
+  }
+  char *end = start + strcspn(start, delims);
+  if (*end)
+    *end++ = '\0';
+  *cursor = end;
+  return start;
+}
+
+/* ==================== THREADS ==================== */
+
+void mutex_init(Mutex *mutex) {
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+#else
+  pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(Mutex *mutex) {
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(Mutex *mutex) {
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+void mutex_destroy(Mutex *mutex) {
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+void cond_init(CondVar *cond) {
+#ifdef _WIN32
+  InitializeConditionVariable(cond);
+#else
+  pthread_cond_init(cond, NULL);
+#endif
+}
+
+/* Unlock mutex, wait for a signal and lock it again; wakeups can be
+ * spurious, so callers wait in a loop */
+void cond_wait(CondVar *cond, Mutex *mutex) {
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+  pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void cond_signal(CondVar *cond) {
+#ifdef _WIN32
+  WakeConditionVariable(cond);
+#else
+  pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(CondVar *cond) {
+#ifdef _WIN32
+  WakeAllConditionVariable(cond);
+#else
+  pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_destroy(CondVar *cond) {
+#ifdef _WIN32
+  (void)cond;  // Windows condition variables need no cleanup
+#else
+  pthread_cond_destroy(cond);
+#endif
+}
+
+/* Sequentially consistent loads, stores and adds for state shared with
+ * readers that take no lock */
+uint64_t atomic_load_u64(volatile uint64_t *p) {
+#if defined(_MSC_VER)
+  return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)p, 0, 0);
+#else
+  return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void atomic_store_u64(volatile uint64_t *p, uint64_t value) {
+#if defined(_MSC_VER)
+  InterlockedExchange64((volatile LONG64 *)p, (LONG64)value);
+#else
+  __atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Relaxed loads and stores: whole values, with no ordering around them,
+ * for counters that only one thread writes */
+uint64_t atomic_load_relaxed_u64(const volatile uint64_t *p) {
+#if defined(_MSC_VER)
+  return (uint64_t)__iso_volatile_load64((const volatile __int64 *)p);
+#else
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
+}
+
+void atomic_store_relaxed_u64(volatile uint64_t *p, uint64_t value) {
+#if defined(_MSC_VER)
+  __iso_volatile_store64((volatile __int64 *)p, (__int64)value);
+#else
+  __atomic_store_n(p, value, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Returns the value before the add */
+uint64_t atomic_add_u64(volatile uint64_t *p, uint64_t value) {
+#if defined(_MSC_VER)
+  return (uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)p,
+                                            (LONG64)value);
+#else
+  return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void *atomic_load_ptr(void *volatile *p) {
+#if defined(_MSC_VER)
+  return InterlockedCompareExchangePointer(p, NULL, NULL);
+#else
+  return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Returns the previous value */
+void *atomic_exchange_ptr(void *volatile *p, void *value) {
+#if defined(_MSC_VER)
+  return InterlockedExchangePointer(p, value);
+#else
+  return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int cpu_count() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* ==================== METRICS ==================== */
+
+/*
+ * Hot-path counters and timers, built in unless the engine is compiled
+ * with -DSEARCH_METRICS=0, which removes every one of them. Each thread
+ * counts into a slot of its own, claimed on its first event, so counting
+ * is a relaxed load and store of memory no other thread writes, with no
+ * lock or read-modify-write; the stats command sums the slots with relaxed
+ * loads without stopping anyone, so a sum can miss the events of the last
+ * moment. A finished thread's slot, counts and all, goes to
+ * the next thread that needs one, so the sums stay cumulative. Past
+ * MAX_METRIC_THREADS live threads the rest share the last slot, and can
+ * lose counts to each other. The slots are the process's, so a program
+ * with several handles (see LIBRARY API) sees all their counts together.
+ *
+ * Distributions are kept as power-of-two buckets: bucket 0 holds 0 and
+ * bucket k holds [2^(k-1), 2^k), the last one everything above.
+ */
+
+#ifndef SEARCH_METRICS
+#define SEARCH_METRICS 1
+#endif
+
+/* The bucket of value among buckets power-of-two buckets */
+int metric_bucket(uint64_t value, int buckets) {
+  int bucket = 0;
+  while (value > 0 && bucket < buckets - 1) {
+    value >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+#if SEARCH_METRICS
+#define METRIC(statement) statement
+
+#define MAX_METRIC_THREADS 128
+#define PROBE_BUCKETS 8     // Extra slots a hash lookup looked at
+#define LENGTH_BUCKETS 24   // Postings per posting list
+#define LATENCY_BUCKETS 24  // Microseconds per query
+#define QUERY_KINDS 11
+
+/* Query commands timed apart */
+const char *const query_kind_names[QUERY_KINDS] = {
+    "search", "freq", "prefix", "fuzzy",      "multi", "rank",
+    "phrase", "near", "boolean", "term_stats", "batch"};
+
+typedef struct Metrics {
+  uint64_t documents_indexed;
+  uint64_t tokens_indexed;
+  uint64_t index_nanos;  // Between document_begin and document_end
+  uint64_t hash_lookups;
+  uint64_t hash_probes;
+  uint64_t probe_lengths[PROBE_BUCKETS];
+  uint64_t trie_nodes;  // Created
+  uint64_t trie_bytes;  // Allocated for nodes and child blocks
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t queries[QUERY_KINDS];
+  uint64_t query_nanos[QUERY_KINDS];
+  uint64_t query_latency[QUERY_KINDS][LATENCY_BUCKETS];
+} Metrics;
+
+typedef struct MetricSlot {
+  Metrics metrics;
+  void *volatile owner;  // Non-NULL while a thread counts into it
+} MetricSlot;
+
+MetricSlot g_metric_slots[MAX_METRIC_THREADS];
+
+#if defined(_MSC_VER)
+__declspec(thread) MetricSlot *t_metric_slot = NULL;
+#else
+__thread MetricSlot *t_metric_slot = NULL;
+#endif
+
+/* The calling thread's counters, claiming a slot on first use */
+Metrics *thread_metrics() {
+  if (!t_metric_slot) {
+    int i = 0;
+    while (i < MAX_METRIC_THREADS - 1 &&
+           atomic_exchange_ptr(&g_metric_slots[i].owner, (void *)1) != NULL)
+      i++;
+    t_metric_slot = &g_metric_slots[i];
+  }
+  return &t_metric_slot->metrics;
+}
+
+/* Hand the calling thread's slot on as it finishes */
+void release_thread_metrics() {
+  if (t_metric_slot && t_metric_slot != &g_metric_slots[MAX_METRIC_THREADS - 1])
+    atomic_exchange_ptr(&t_metric_slot->owner, NULL);
+  t_metric_slot = NULL;
+}
+
+/* Add n to a counter of the calling thread's slot */
+void metric_add(uint64_t *counter, uint64_t n) {
+  atomic_store_relaxed_u64(counter, atomic_load_relaxed_u64(counter) + n);
+}
+
+/* Every slot's counts added up */
+void sum_metrics(Metrics *total) {
+  uint64_t *sum = (uint64_t *)total;
+  memset(total, 0, sizeof(*total));
+  for (int i = 0; i < MAX_METRIC_THREADS; i++) {
+    const uint64_t *counts = (const uint64_t *)&g_metric_slots[i].metrics;
+    for (size_t j = 0; j < sizeof(Metrics) / sizeof(uint64_t); j++)
+      sum[j] += atomic_load_relaxed_u64(&counts[j]);
+  }
+}
+
+void count_hash_probe(uint32_t probes) {
+  Metrics *m = thread_metrics();
+  metric_add(&m->hash_lookups, 1);
+  metric_add(&m->hash_probes, probes);
+  metric_add(&m->probe_lengths[metric_bucket(probes, PROBE_BUCKETS)], 1);
+}
+
+void count_trie_alloc(size_t bytes, int nodes) {
+  Metrics *m = thread_metrics();
+  metric_add(&m->trie_nodes, (uint64_t)nodes);
+  metric_add(&m->trie_bytes, bytes);
+}
+
+/* Time a query of command cmd that started at started */
+void count_query(const char *cmd, uint64_t started) {
+  uint64_t nanos = clock_nanos() - started;
+  for (int k = 0; k < QUERY_KINDS; k++) {
+    if (strcmp(cmd, query_kind_names[k]) == 0) {
+      Metrics *m = thread_metrics();
+      metric_add(&m->queries[k], 1);
+      metric_add(&m->query_nanos[k], nanos);
+      metric_add(
+          &m->query_latency[k][metric_bucket(nanos / 1000, LATENCY_BUCKETS)],
+          1);
+      return;
+    }
+  }
+}
+#else
+#define METRIC(statement)
+#endif
+
+/* ==================== ARENA ==================== */
+
+/* Link a new chunk of size usable bytes into the arena */
+char *arena_chunk(Arena *arena, size_t size) {
+  ArenaChunk *chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + size);
+  if (!chunk)
+    return NULL;
+  chunk->next = arena->chunks;
+  chunk->size = size;
+  arena->chunks = chunk;
+  return (char *)(chunk + 1);
+}
+
+/* size bytes, 8-byte aligned; only freed with the whole arena */
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  if (size > ARENA_CHUNK_SIZE / 4)
+    return arena_chunk(arena, size);  // Big blocks get a chunk of their own
+  if (size > arena->bump_left) {
+    arena->bump = arena_chunk(arena, ARENA_CHUNK_SIZE);
+    arena->bump_left = arena->bump ? ARENA_CHUNK_SIZE : 0;
+    if (!arena->bump)
+      return NULL;
+  }
+  void *p = arena->bump;
+  arena->bump += size;
+  arena->bump_left -= size;
+  return p;
+}
+
+/* Free-list index for a power-of-two block size of at least 8 */
+int arena_class(size_t size) {
+  int cls = 3;
+  while (((size_t)1 << cls) < size)
+    cls++;
+  return cls;
+}
+
+/* A block of size bytes (a power of two, at least 8), recycled if possible */
+void *arena_block(Arena *arena, size_t size) {
+  int cls = arena_class(size);
+  void *block = arena->free_blocks[cls];
+  if (block) {
+    arena->free_blocks[cls] = *(void **)block;
+    return block;
+  }
+  return arena_alloc(arena, size);
+}
+
+void arena_release(Arena *arena, void *block, size_t size) {
+  int cls = arena_class(size);
+  *(void **)block = arena->free_blocks[cls];
+  arena->free_blocks[cls] = block;
+}
+
+/* Move the first used bytes of block (old_size bytes, or NULL) to one of
+ * new_size bytes */
+void *arena_resize(Arena *arena, void *block, size_t old_size,
+                   size_t new_size, size_t used) {
+  void *grown = arena_block(arena, new_size);
+  if (block) {
+    if (grown)
+      memcpy(grown, block, used);
+    arena_release(arena, block, old_size);
+  }
+  return grown;
+}
+
+/* Take over everything other owns; other is left empty */
+void arena_adopt(Arena *arena, Arena *other) {
+  if (other->chunks) {
+    ArenaChunk *tail = other->chunks;
+    while (tail->next)
+      tail = tail->next;
+    tail->next = arena->chunks;
+    arena->chunks = other->chunks;
+  }
+  for (int cls = 0; cls < ARENA_CLASSES; cls++) {
+    void **tail = &other->free_blocks[cls];
+    while (*tail)
+      tail = (void **)*tail;
+    *tail = arena->free_blocks[cls];
+    arena->free_blocks[cls] = other->free_blocks[cls];
+  }
+  memset(other, 0, sizeof(*other));
+}
+
+void arena_free(Arena *arena) {
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  memset(arena, 0, sizeof(*arena));
+}
+
+/* ==================== POSTING LISTS ==================== */
+
+/* LEB128: 7 bits per byte, high bit set on all but the last */
+int varint_put(unsigned char *out, uint32_t value) {
+  int n = 0;
+  while (value >= 0x80) {
+    out[n++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (unsigned char)value;
+  return n;
+}
+
+/* Returns the byte after the varint, or NULL if it runs past end */
+const unsigned char *varint_get(const unsigned char *p,
+                                const unsigned char *end, uint32_t *value) {
+  uint32_t result = 0;
+  for (int shift = 0; p < end && shift < 35; shift += 7) {
+    unsigned char byte = *p++;
+    result |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * The byte after the next n varints, or end if they run past it. A varint
+ * ends at each byte with the high bit clear, so SSE2 counts the ends among
+ * 16 bytes at once until the one it needs is near.
+ */
+const unsigned char *varint_skip(const unsigned char *p,
+                                 const unsigned char *end, uint32_t n) {
+#ifdef HAVE_SSE2
+  while (n >= 16 && end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    uint32_t ends = ~(uint32_t)_mm_movemask_epi8(v) & 0xffff;
+#if defined(_MSC_VER)
+    n -= (uint32_t)__popcnt(ends);
+#else
+    n -= (uint32_t)__builtin_popcount(ends);
+#endif
+    p += 16;
+  }
+#endif
+  for (; n > 0 && p < end; p++)
+    n -= !(*p & 0x80);
+  return n > 0 ? end : p;
+}
+
+/* Varints in the len bytes at p */
+uint32_t varint_count(const unsigned char *p, uint32_t len) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < len; i++)
+    count += !(p[i] & 0x80);
+  return count;
+}
+
+/* Decode up to count positions of one posting into out; returns how many */
+uint32_t positions_decode(const unsigned char *p, const unsigned char *end,
+                          uint32_t count, uint32_t *out) {
+  uint32_t n = 0, position = 0, gap;
+  while (n < count && (p = varint_get(p, end, &gap))) {
+    position += gap;
+    out[n++] = position;
+  }
+  return n;
+}
+
+/* Append a posting's position bytes */
+void posting_add_positions(Arena *arena, PostingList *list,
+                           const unsigned char *bytes, uint32_t n) {
+  if (list->positions_len + n > list->positions_cap) {
+    uint32_t cap = list->positions_cap ? list->positions_cap * 2 : 16;
+    while (cap < list->positions_len + n)
+      cap *= 2;
+    list->positions = (unsigned char *)arena_resize(
+        arena, list->positions, list->positions_cap, cap,
+        list->positions_len);
+    list->positions_cap = cap;
+  }
+  memcpy(list->positions + list->positions_len, bytes, n);
+  list->positions_len += n;
+}
+
+/* Record position in the open posting, which it must not precede */
+void posting_add_position(Arena *arena, PostingList *list, int position) {
+  unsigned char bytes[5];
+  int n = varint_put(bytes, (uint32_t)(position - list->last_position));
+  posting_add_positions(arena, list, bytes, (uint32_t)n);
+  list->last_position = position;
+}
+
+/* Skip entries so far: one per block after the first, open posting aside */
+uint32_t posting_skip_count(const PostingList *list) {
+  return list->doc_count > 1 ? (uint32_t)(list->doc_count - 2) / SKIP_INTERVAL
+                             : 0;
+}
+
+/* Encode the open posting so a new one can take its place */
+void posting_flush(Arena *arena, PostingList *list) {
+  if (list->len + 10 > list->cap) {
+    uint32_t cap = list->cap ? list->cap * 2 : 16;
+    list->data = (unsigned char *)arena_resize(arena, list->data, list->cap,
+                                               cap, list->len);
+    list->cap = cap;
+  }
+
+  // The posting being encoded opens a block every SKIP_INTERVAL postings
+  uint32_t encoded = (uint32_t)list->doc_count - 1;
+  if (encoded > 0 && encoded % SKIP_INTERVAL == 0) {
+    uint32_t count = encoded / SKIP_INTERVAL - 1;
+    if ((count & (count - 1)) == 0)  // Capacity doubles at powers of two
+      list->skips = (SkipEntry *)arena_resize(
+          arena, list->skips, count * sizeof(SkipEntry),
+          (count ? count * 2 : 1) * sizeof(SkipEntry),
+          count * sizeof(SkipEntry));
+    list->skips[count].doc_id = (uint32_t)list->prev_doc;
+    list->skips[count].offset = list->len;
+    list->skips[count].position_offset = list->open_positions;
+    list->skips[count].reserved = 0;
+  }
+
+  list->len += varint_put(list->data + list->len,
+                          (uint32_t)(list->last_doc - list->prev_doc));
+  list->len += varint_put(list->data + list->len, (uint32_t)list->last_freq);
+  list->prev_doc = list->last_doc;
+}
+
+/* One occurrence at position, which follows the document's earlier ones */
+void add_doc_occurrence(Arena *arena, TrieNode *node, int doc_id,
+                        int position) {
+  PostingList *list = &node->postings;
+  node->total_freq++;
+
+  // Fast path: still inside the document being indexed
+  if (list->doc_count > 0 && list->last_doc == doc_id) {
+    list->last_freq++;
+    posting_add_position(arena, list, position);
+    return;
+  }
+
+  if (list->doc_count > 0) {
+    if (list->last_freq > node->max_freq)
+      node->max_freq = list->last_freq;
+    posting_flush(arena, list);
+  }
+  list->last_doc = doc_id;
+  list->last_freq = 1;
+  list->doc_count++;
+  list->open_positions = list->positions_len;
+  list->last_position = 0;
+  posting_add_position(arena, list, position);
+}
+
+/* Append a whole posting with its encoded positions; doc_id must follow
+ * every doc already listed */
+void add_doc_posting(Arena *arena, TrieNode *node, int doc_id, int frequency,
+                     const unsigned char *positions, uint32_t positions_len) {
+  PostingList *list = &node->postings;
+  node->total_freq += frequency;
+  if (list->doc_count > 0) {
+    if (list->last_freq > node->max_freq)
+      node->max_freq = list->last_freq;
+    posting_flush(arena, list);
+  }
+  list->last_doc = doc_id;
+  list->last_freq = frequency;
+  list->doc_count++;
+  list->open_positions = list->positions_len;
+  posting_add_positions(arena, list, positions, positions_len);
+}
+
+void posting_cursor_init(PostingCursor *cursor, const unsigned char *data,
+                         uint32_t len) {
+  cursor->start = data;
+  cursor->pos = data;
+  cursor->end = data + len;
+  cursor->doc_id = 0;
+  cursor->open_doc = -1;
+  cursor->open_freq = 0;
+  cursor->skips = NULL;
+  cursor->skip_count = 0;
+  cursor->next_skip = 0;
+  cursor->positions_start = NULL;
+  cursor->positions = NULL;
+  cursor->positions_end = NULL;
+  cursor->positions_skip = 0;
+  cursor->last_freq = 0;
+  cursor->bitmap = NULL;
+}
+
+/* A cursor over bits presence bits at data, set for doc_ids from base on,
+ * each reported with frequency; it has no skips */
+void posting_cursor_init_bitmap(PostingCursor *cursor,
+                                const unsigned char *data, uint32_t bits,
+                                uint32_t base, uint32_t frequency) {
+  posting_cursor_init(cursor, NULL, 0);
+  cursor->bitmap = data;
+  cursor->bitmap_base = base;
+  cursor->bitmap_bits = bits;
+  cursor->bitmap_next = 0;
+  cursor->bitmap_freq = frequency;
+}
+
+/* Set bits of a bitmap from bit lo up to, not including, bit hi */
+uint32_t bitmap_count(const unsigned char *bitmap, uint32_t lo, uint32_t hi) {
+  uint32_t count = 0;
+  while (lo < hi) {
+    uint32_t word, next = lo / 32 * 32 + 32;
+    memcpy(&word, bitmap + lo / 32 * 4, sizeof(word));
+    word &= ~0u << lo % 32;
+    if (hi < next)
+      word &= ~(~0u << hi % 32);
+    count += (uint32_t)count_bits64(word);
+    lo = next;
+  }
+  return count;
+}
+
+/* First set bit of a bitmap cursor at or after bit from. With positions,
+ * positions_skip counts the set bits passed whose positions were not read,
+ * and last_freq is 1 until the current one's are. */
+int posting_bitmap_next(PostingCursor *cursor, uint32_t from,
+                        uint32_t *doc_id, uint32_t *frequency) {
+  while (from < cursor->bitmap_bits) {
+    uint32_t word;
+    memcpy(&word, cursor->bitmap + from / 32 * 4, sizeof(word));
+    word &= ~0u << from % 32;
+    if (word) {
+      from = from / 32 * 32 + (uint32_t)lowest_bit(word);
+      if (from >= cursor->bitmap_bits)
+        break;
+      if (cursor->positions) {
+        cursor->positions_skip +=
+            cursor->last_freq +
+            bitmap_count(cursor->bitmap, cursor->bitmap_next, from);
+        cursor->last_freq = 1;
+      }
+      cursor->bitmap_next = from + 1;
+      *doc_id = cursor->bitmap_base + from;
+      *frequency = cursor->bitmap_freq;
+      return 1;
+    }
+    from = from / 32 * 32 + 32;
+  }
+  cursor->bitmap_next = cursor->bitmap_bits;
+  return 0;
+}
+
+/* Let the cursor read positions from the len bytes at data */
+void posting_cursor_init_positions(PostingCursor *cursor,
+                                   const unsigned char *data, uint32_t len) {
+  cursor->positions_start = data;
+  cursor->positions = data;
+  cursor->positions_end = data + len;
+}
+
+void posting_cursor_init_list(PostingCursor *cursor, const PostingList *list) {
+  posting_cursor_init(cursor, list->data, list->len);
+  if (list->doc_count > 0) {
+    cursor->open_doc = list->last_doc;
+    cursor->open_freq = list->last_freq;
+  }
+  cursor->skips = list->skips;
+  cursor->skip_count = posting_skip_count(list);
+  posting_cursor_init_positions(cursor, list->positions, list->positions_len);
+}
+
+/* posting_cursor_positions on a bitmap cursor: each set bit's positions
+ * follow their count, so passing a bit reads the count and skips the rest */
+uint32_t posting_bitmap_positions(PostingCursor *cursor,
+                                  const unsigned char **start) {
+  const unsigned char *p = cursor->positions, *end = cursor->positions_end;
+  const unsigned char *block = p;
+  uint32_t blocks = cursor->positions_skip + cursor->last_freq, count;
+  cursor->positions_skip = 0;
+  cursor->last_freq = 0;
+  *start = p;
+  if (!p || blocks == 0)
+    return 0;
+  for (uint32_t i = 0; i < blocks; i++) {
+    block = varint_get(p, end, &count);
+    if (!block) {
+      cursor->positions = end;  // Truncated data
+      return 0;
+    }
+    p = varint_skip(block, end, count);
+  }
+  cursor->positions = p;
+  *start = block;
+  return (uint32_t)(p - block);
+}
+
+/* The encoded positions of the posting the cursor last produced: sets
+ * *start and returns their length, 0 after the first call for that
+ * posting or on a cursor without positions */
+uint32_t posting_cursor_positions(PostingCursor *cursor,
+                                  const unsigned char **start) {
+  if (cursor->bitmap)
+    return posting_bitmap_positions(cursor, start);
+  const unsigned char *p = cursor->positions, *end = cursor->positions_end;
+  if (p) {
+    p = varint_skip(p, end, cursor->positions_skip);
+    cursor->positions = varint_skip(p, end, cursor->last_freq);
+  }
+  cursor->positions_skip = 0;
+  cursor->last_freq = 0;
+  *start = p;
+  return p ? (uint32_t)(cursor->positions - p) : 0;
+}
+
+int posting_cursor_next(PostingCursor *cursor, uint32_t *doc_id,
+                        uint32_t *frequency) {
+  if (cursor->bitmap)
+    return posting_bitmap_next(cursor, cursor->bitmap_next, doc_id, frequency);
+  if (cursor->pos < cursor->end) {
+    uint32_t gap, freq;
+    const unsigned char *p = varint_get(cursor->pos, cursor->end, &gap);
+    if (p)
+      p = varint_get(p, cursor->end, &freq);
+    if (p) {
+      cursor->pos = p;
+      cursor->doc_id += gap;
+      *doc_id = cursor->doc_id;
+      *frequency = freq;
+      cursor->positions_skip += cursor->last_freq;
+      cursor->last_freq = freq;
+      return 1;
+    }
+    cursor->pos = cursor->end;  // Truncated data
+  }
+  if (cursor->open_doc >= 0) {
+    *doc_id = (uint32_t)cursor->open_doc;
+    *frequency = (uint32_t)cursor->open_freq;
+    cursor->open_doc = -1;
+    cursor->positions_skip += cursor->last_freq;
+    cursor->last_freq = (uint32_t)cursor->open_freq;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * First remaining posting with doc_id >= target. Gallops over the skip
+ * entries to the last block that starts below target, jumps there if that
+ * is ahead of the cursor, then decodes forward.
+ */
+int posting_cursor_seek(PostingCursor *cursor, uint32_t target,
+                        uint32_t *doc_id, uint32_t *frequency) {
+  if (cursor->bitmap) {
+    uint32_t from = target > cursor->bitmap_base ? target - cursor->bitmap_base
+                                                 : 0;
+    return posting_bitmap_next(cursor,
+                               from > cursor->bitmap_next ? from
+                                                          : cursor->bitmap_next,
+                               doc_id, frequency);
+  }
+  const SkipEntry *skips = cursor->skips;
+  uint32_t lo = cursor->next_skip, count = cursor->skip_count;
+  if (lo < count && skips[lo].doc_id < target) {
+    uint32_t step = 1;
+    while (lo + step < count && skips[lo + step].doc_id < target) {
+      lo += step;
+      step *= 2;
+    }
+    uint32_t hi = lo + step < count ? lo + step : count;
+    while (hi - lo > 1) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (skips[mid].doc_id < target)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    cursor->next_skip = lo + 1;
+    const unsigned char *block = cursor->start + skips[lo].offset;
+    if (skips[lo].offset <= (size_t)(cursor->end - cursor->start) &&
+        block > cursor->pos) {
+      cursor->pos = block;
+      cursor->doc_id = skips[lo].doc_id;
+      if (cursor->positions_start) {
+        size_t size = (size_t)(cursor->positions_end -
+                               cursor->positions_start);
+        cursor->positions = skips[lo].position_offset <= size
+                                ? cursor->positions_start +
+                                      skips[lo].position_offset
+                                : cursor->positions_end;
+        cursor->positions_skip = 0;
+        cursor->last_freq = 0;
+      }
+    }
+  }
+
+  while (posting_cursor_next(cursor, doc_id, frequency))
+    if (*doc_id >= target)
+      return 1;
+  return 0;
+}
+
+/* ==================== TRIE OPERATIONS ==================== */
+
+TrieNode *create_trie_node(Arena *arena, const char *label, int label_len) {
+  size_t size = offsetof(TrieNode, label) + label_len;
+  if (size < sizeof(TrieNode))
+    size = sizeof(TrieNode);
+  TrieNode *node = (TrieNode *)arena_alloc(arena, size);
+  METRIC(count_trie_alloc(size, 1));
+  memset(node, 0, size);
+  memcpy(node->label, label, label_len);
+  node->label_len = (unsigned short)label_len;
+  return node;
+}
+
+/* Child whose label starts with c; *pos gets its slot or insertion point */
+TrieNode *trie_child(TrieNode *node, unsigned char c, int *pos) {
+  unsigned char *keys = CHILD_KEYS(node);
+  int i = 0;
+  while (i < node->child_count && keys[i] < c)
+    i++;
+  if (pos)
+    *pos = i;
+  return i < node->child_count && keys[i] == c ? node->children[i] : NULL;
+}
+
+/* Bytes in node's child block: the power of two its child_cap came from */
+size_t child_block_size(const TrieNode *node) {
+  size_t size = 16;
+  while (size / (sizeof(TrieNode *) + 1) < node->child_cap)
+    size *= 2;
+  return size;
+}
+
+void trie_add_child(Arena *arena, TrieNode *node, int pos, TrieNode *child) {
+  if (node->child_count == node->child_cap) {
+    size_t size = node->child_cap ? child_block_size(node) * 2 : 16;
+    int cap = (int)(size / (sizeof(TrieNode *) + 1));
+    TrieNode **block = (TrieNode **)arena_block(arena, size);
+    METRIC(count_trie_alloc(size, 0));
+    if (node->child_count) {
+      memcpy(block, node->children, node->child_count * sizeof(TrieNode *));
+      memcpy(block + cap, CHILD_KEYS(node), node->child_count);
+      arena_release(arena, node->children, child_block_size(node));
+    }
+    node->children = block;
+    node->child_cap = (unsigned short)cap;
+  }
+
+  unsigned char *keys = CHILD_KEYS(node);
+  int tail = node->child_count - pos;
+  memmove(node->children + pos + 1, node->children + pos,
+          tail * sizeof(TrieNode *));
+  memmove(keys + pos + 1, keys + pos, tail);
+  node->children[pos] = child;
+  keys[pos] = (unsigned char)child->label[0];
+  node->child_count++;
+}
+
+/* Word node for word, created (with empty postings) if missing */
+TrieNode *trie_insert(Arena *arena, TrieNode *root, const char *word) {
+  TrieNode *curr = root;
+  const char *rest = word;
+
+  while (*rest) {
+    int pos;
+    TrieNode *child = trie_child(curr, (unsigned char)*rest, &pos);
+    if (!child) {
+      int len = strlen(rest);
+      child = create_trie_node(arena, rest, len);
+      child->parent = curr;
+      trie_add_child(arena, curr, pos, child);
+      curr = child;
+      break;
+    }
+
+    int common = 1;
+    while (common < child->label_len && rest[common] == child->label[common])
+      common++;
+
+    if (common < child->label_len) {
+      // Split the edge; child keeps its identity below the new node
+      TrieNode *mid = create_trie_node(arena, child->label, common);
+      child->label_len -= common;
+      memmove(child->label, child->label + common, child->label_len);
+      curr->children[pos] = mid;
+      trie_add_child(arena, mid, 0, child);
+      mid->parent = curr;
+      mid->best_freq = child->best_freq;
+      child->parent = mid;
+      child = mid;
+    }
+
+    curr = child;
+    rest += common;
+  }
+
+  curr->is_end = 1;
+  return curr;
+}
+
+/*
+ * Lift best_freq toward the root after node's total_freq grew. Bounds are
+ * raised with a quarter of headroom, so most occurrences stop at the word's
+ * own node instead of touching its parent.
+ */
+void trie_raise_best(TrieNode *node) {
+  int freq = node->total_freq;
+  if (freq <= node->best_freq)
+    return;
+  freq = freq < INT_MAX / 2 ? freq + freq / 4 + 1 : INT_MAX;
+  while (node && node->best_freq < freq) {
+    node->best_freq = freq;
+    node = node->parent;
+  }
+}
+
+/* Recompute every best_freq below node; returns node's */
+int trie_update_best(TrieNode *node) {
+  int best = node->total_freq;
+  for (int i = 0; i < node->child_count; i++) {
+    int child = trie_update_best(node->children[i]);
+    if (child > best)
+      best = child;
+  }
+  node->best_freq = best;
+  return best;
+}
+
+TrieNode *trie_search(TrieNode *root, const char *word) {
+  TrieNode *curr = root;
+  while (*word) {
+    TrieNode *child = trie_child(curr, (unsigned char)*word, NULL);
+    if (!child || strncmp(child->label, word, child->label_len) != 0)
+      return NULL;
+    word += child->label_len;
+    curr = child;
+  }
+  return curr->is_end ? curr : NULL;
+}
+
+/*
+ * Find the subtree holding every word that starts with prefix. path receives
+ * the characters spelled down to the returned node, which may run past the
+ * prefix when it ends inside an edge label. Returns NULL if no word matches.
+ */
+TrieNode *trie_find_prefix(TrieNode *root, const char *prefix, char *path,
+                           int *path_len) {
+  TrieNode *curr = root;
+  const char *rest = prefix;
+  int len = 0;
+
+  while (*rest) {
+    TrieNode *child = trie_child(curr, (unsigned char)*rest, NULL);
+    if (!child)
+      return NULL;
+    int i = 1;
+    while (i < child->label_len && rest[i] && rest[i] == child->label[i])
+      i++;
+    if (i < child->label_len && rest[i])
+      return NULL;
+    memcpy(path + len, child->label, child->label_len);
+    len += child->label_len;
+    rest += i;
+    curr = child;
+  }
+
+  path[len] = '\0';
+  *path_len = len;
+  return curr;
+}
+
+/* ==================== HASH TABLE OPERATIONS ==================== */
+
+void hash_init(HashTable *table) {
+  table->capacity = HASH_INITIAL_SIZE;
+  table->slots = (HashSlot *)calloc(table->capacity, sizeof(HashSlot));
+}
+
+/* Distance of slot i from the home slot of the hash it holds */
+uint32_t hash_probe_distance(const HashTable *table, uint32_t i,
+                             uint32_t hash) {
+  return (i - (hash & (table->capacity - 1))) & (table->capacity - 1);
+}
+
+HashSlot *hash_find(HashTable *table, const char *word, uint32_t hash) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t i = hash & mask;
+  for (uint32_t dist = 0;; dist++, i = (i + 1) & mask) {
+    HashSlot *slot = &table->slots[i];
+    // Robin Hood order: a richer slot means the word would already be here
+    if (!slot->trie_node || hash_probe_distance(table, i, slot->hash) < dist) {
+      METRIC(count_hash_probe(dist));
+      return NULL;
+    }
+    if (slot->hash == hash &&
+        strcmp(table->pool.data + slot->word_offset, word) == 0) {
+      METRIC(count_hash_probe(dist));
+      return slot;
+    }
+  }
+}
+
+void hash_place(HashTable *table, HashSlot entry) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t i = entry.hash & mask;
+  for (uint32_t dist = 0;; dist++, i = (i + 1) & mask) {
+    HashSlot *slot = &table->slots[i];
+    if (!slot->trie_node) {
+      *slot = entry;
+      return;
+    }
+    uint32_t slot_dist = hash_probe_distance(table, i, slot->hash);
+    if (slot_dist < dist) {
+      HashSlot displaced = *slot;
+      *slot = entry;
+      entry = displaced;
+      dist = slot_dist;
+    }
+  }
+}
+
+void hash_grow(HashTable *table) {
+  HashSlot *old = table->slots;
+  uint32_t old_capacity = table->capacity;
+
+  table->capacity *= 2;
+  table->slots = (HashSlot *)calloc(table->capacity, sizeof(HashSlot));
+  for (uint32_t i = 0; i < old_capacity; i++)
+    if (old[i].trie_node)
+      hash_place(table, old[i]);
+  free(old);
+}
+
+void hash_insert(SearchEngine *engine, const char *word, TrieNode *trie_node) {
+  HashTable *table = &engine->hash_table;
+  uint32_t hash = hash_func(word);
+  if (hash_find(table, word, hash))
+    return;
+
+  // Keep the load factor under 0.8 so probe runs stay short
+  if ((table->count + 1) * 5 > table->capacity * 4)
+    hash_grow(table);
+
+  HashSlot entry = {hash, pool_add(&table->pool, word), trie_node};
+  hash_place(table, entry);
+  table->count++;
+}
+
+TrieNode *hash_search(SearchEngine *engine, const char *word) {
+  HashSlot *slot = hash_find(&engine->hash_table, word, hash_func(word));
+  return slot ? slot->trie_node : NULL;
+}
+
+void hash_free(HashTable *table) {
+  free(table->slots);
+  free(table->pool.data);
+}
+
+/* ==================== STOP WORDS ==================== */
+
+/*
+ * Words too common to be worth indexing, left out of the index and out of
+ * queries while a stop word list is set (see the stopwords server
+ * command). A list is a perfect hash, built by hash and displace: a word's
+ * hash picks its bucket, and every bucket has a displacement, chosen
+ * biggest bucket first, that sends each of its words to an empty slot of
+ * their own. A lookup is one hash, one slot and one strcmp.
+ *
+ * The built-in English list below was generated the same way, ahead of
+ * time, by tools/gen_stop_words.py, so using it costs nothing at startup;
+ * build_stop_words makes a table for any other.
+ */
+
+#define MAX_STOP_WORDS 4096
+
+typedef struct StopWords {
+  uint32_t count;
+  uint32_t slot_mask;
+  uint32_t bucket_count;
+  const uint16_t *displacements;  // Per bucket
+  const char *const *slots;       // A word, or NULL
+  void *storage;                  // Owned tables and words, or NULL
+} StopWords;
+
+#define DEFAULT_STOP_WORDS 122
+#define DEFAULT_STOP_SLOTS 256
+#define DEFAULT_STOP_BUCKETS 31
+
+const uint16_t default_stop_displacements[DEFAULT_STOP_BUCKETS] = {
+  8, 2, 8, 2, 1, 1, 3, 0, 0, 5, 0, 7, 10, 5, 0, 2, 1, 6, 1, 1, 1, 1, 1, 1, 4,
+  1, 1, 0, 0, 2, 6,
+};
+
+const char *const default_stop_slots[DEFAULT_STOP_SLOTS] = {
+  NULL, NULL, NULL, NULL, "about", NULL, "just", "during", NULL, "below",
+  NULL, NULL, "been", NULL, "through", "very", NULL, NULL, NULL, NULL, NULL,
+  "other", "yourselves", "at", NULL, NULL, "had", "between", "itself", NULL,
+  NULL, "this", NULL, "not", "which", NULL, NULL, "can", "the", "himself",
+  NULL, NULL, NULL, NULL, NULL, "is", NULL, "some", "both", "it", NULL, NULL,
+  NULL, NULL, NULL, NULL, "to", NULL, NULL, NULL, NULL, "on", NULL, "them",
+  NULL, NULL, NULL, "while", "themselves", NULL, "having", "him", "or", NULL,
+  "yours", NULL, "down", NULL, "off", "all", "in", NULL, "my", "no", "am",
+  "and", "than", NULL, "our", "she", NULL, NULL, NULL, NULL, "was", "such",
+  "these", "when", NULL, NULL, NULL, NULL, NULL, "for", "above", "too",
+  "will", NULL, "you", "as", NULL, NULL, NULL, NULL, NULL, NULL, "nor", NULL,
+  NULL, "did", NULL, "only", "your", "myself", "with", "me", NULL, NULL,
+  "under", "those", "herself", NULL, NULL, NULL, "ours", NULL, "her", "up",
+  "here", "hers", NULL, "until", "yourself", "by", "there", "has", "were",
+  NULL, NULL, NULL, NULL, NULL, "out", NULL, "do", "where", NULL, "from",
+  NULL, "further", NULL, "once", "being", NULL, NULL, NULL, NULL, "should",
+  NULL, NULL, NULL, "they", "over", NULL, NULL, "of", NULL, NULL, "few",
+  "theirs", NULL, "that", NULL, "after", "more", "are", NULL, "what", NULL,
+  "most", NULL, NULL, NULL, NULL, NULL, "why", NULL, NULL, NULL, NULL, NULL,
+  "because", "into", "be", NULL, "if", "we", NULL, "against", NULL, NULL,
+  NULL, "its", NULL, NULL, "then", "now", NULL, "have", "each", NULL, "own",
+  NULL, NULL, NULL, "so", "ourselves", "but", NULL, "doing", NULL, NULL, NULL,
+  NULL, NULL, "how", NULL, NULL, "before", "he", "same", NULL, "whom", "any",
+  "does", NULL, "an", NULL, NULL, "again", NULL, "his", "their", "who", NULL,
+  NULL,
+};
+
+const StopWords default_stop_words = {
+    DEFAULT_STOP_WORDS,         DEFAULT_STOP_SLOTS - 1, DEFAULT_STOP_BUCKETS,
+    default_stop_displacements, default_stop_slots,     NULL};
+
+uint32_t stop_word_slot(uint32_t hash, uint32_t displacement) {
+  uint32_t h = hash ^ (displacement * 0x9E3779B9u);
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 12;
+  h *= 0x297a2d39u;
+  h ^= h >> 15;
+  return h;
+}
+
+int stop_words_find(const StopWords *list, const char *word) {
+  uint32_t hash = hash_func(word);
+  uint32_t displacement = list->displacements[hash % list->bucket_count];
+  const char *slot =
+      list->slots[stop_word_slot(hash, displacement) & list->slot_mask];
+  return slot && strcmp(slot, word) == 0;
+}
+
+/* Whether word, normalized, is on list; a NULL list leaves out nothing */
+int is_stop_word(const StopWords *list, const char *word) {
+  return list && stop_words_find(list, word);
+}
+
+int compare_words(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Give every bucket a displacement that sends its words to empty slots;
+ * returns 0, or -1 if some bucket has none or memory runs out */
+int place_stop_words(const char *const *words, uint32_t count,
+                     uint32_t slot_count, uint32_t bucket_count,
+                     const char **slots, uint16_t *displacements) {
+  uint32_t *bucket_of = (uint32_t *)malloc(
+      ((size_t)count + 2 * (size_t)bucket_count) * sizeof(uint32_t));
+  if (!bucket_of)
+    return -1;
+  uint32_t *sizes = bucket_of + count, *order = sizes + bucket_count;
+  memset(sizes, 0, bucket_count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i++) {
+    bucket_of[i] = hash_func(words[i]) % bucket_count;
+    sizes[bucket_of[i]]++;
+  }
+
+  // Biggest buckets first, while the most slots are free
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    uint32_t j = b;
+    while (j > 0 && sizes[order[j - 1]] < sizes[b]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = b;
+  }
+
+  uint32_t mask = slot_count - 1, d = 0;
+  for (uint32_t k = 0; k < bucket_count && d <= UINT16_MAX; k++) {
+    uint32_t b = order[k];
+    for (d = 0; d <= UINT16_MAX; d++) {
+      uint32_t i = 0;
+      while (i < count &&
+             (bucket_of[i] != b ||
+              !slots[stop_word_slot(hash_func(words[i]), d) & mask])) {
+        if (bucket_of[i] == b)
+          slots[stop_word_slot(hash_func(words[i]), d) & mask] = words[i];
+        i++;
+      }
+      if (i == count)
+        break;
+      // A slot was taken; take this displacement's words back out
+      for (uint32_t j = 0; j < i; j++)
+        if (bucket_of[j] == b)
+          slots[stop_word_slot(hash_func(words[j]), d) & mask] = NULL;
+    }
+    displacements[b] = (uint16_t)d;
+  }
+  free(bucket_of);
+  return d <= UINT16_MAX ? 0 : -1;
+}
+
+/* A table for the whitespace-separated words in text, normalized, without
+ * duplicates or words too short to index; NULL if there are more than
+ * MAX_STOP_WORDS or memory runs out */
+StopWords *build_stop_words(const char *text) {
+  char *copy = strdup(text);
+  const char **words = (const char **)malloc(MAX_STOP_WORDS * sizeof(char *));
+  uint32_t count = 0;
+  size_t chars = 0;
+  char *cursor = copy, *token;
+  while (copy && words && (token = next_token(&cursor, " \t\r\n"))) {
+    normalize_word(token);
+    if (!word_indexable(token, (int)strlen(token)))
+      continue;
+    if (count == MAX_STOP_WORDS) {
+      count = UINT32_MAX;
+      break;
+    }
+    words[count++] = token;
+    chars += strlen(token) + 1;
+  }
+  if (!copy || !words || count == UINT32_MAX) {
+    free(copy);
+    free(words);
+    return NULL;
+  }
+
+  qsort(words, count, sizeof(char *), compare_words);
+  uint32_t distinct = 0;
+  for (uint32_t i = 0; i < count; i++)
+    if (distinct == 0 || strcmp(words[i], words[distinct - 1]) != 0)
+      words[distinct++] = words[i];
+
+  // Slots for twice the words keep displacements small
+  uint32_t slot_count = 8;
+  while (slot_count < 2 * distinct)
+    slot_count *= 2;
+  uint32_t bucket_count = distinct > 4 ? (distinct + 3) / 4 : 1;
+  StopWords *list = (StopWords *)malloc(sizeof(StopWords));
+  char *storage = (char *)calloc(1, slot_count * sizeof(char *) +
+                                        bucket_count * sizeof(uint16_t) +
+                                        chars);
+  const char **slots = (const char **)storage;
+  uint16_t *displacements = (uint16_t *)(slots + slot_count);
+  char *pool = (char *)(displacements + bucket_count);
+  for (uint32_t i = 0; storage && i < distinct; i++) {
+    size_t len = strlen(words[i]) + 1;
+    memcpy(pool, words[i], len);
+    words[i] = pool;
+    pool += len;
+  }
+  if (!list || !storage ||
+      place_stop_words(words, distinct, slot_count, bucket_count, slots,
+                       displacements) < 0) {
+    free(list);
+    free(storage);
+    list = NULL;
+  } else {
+    list->count = distinct;
+    list->slot_mask = slot_count - 1;
+    list->bucket_count = bucket_count;
+    list->displacements = displacements;
+    list->slots = slots;
+    list->storage = storage;
+  }
+  free(copy);
+  free(words);
+  return list;
+}
+
+void free_stop_words(const StopWords *list) {
+  if (list && list->storage) {
+    free(list->storage);
+    free((void *)list);
+  }
+}
+
+/* ==================== SEARCH ENGINE ==================== */
+
+SearchEngine *create_search_engine() {
+  SearchEngine *engine = (SearchEngine *)calloc(1, sizeof(SearchEngine));
+  engine->trie_root = create_trie_node(&engine->arena, "", 0);
+  hash_init(&engine->hash_table);
+  return engine;
+}
+
+void add_document(SearchEngine *engine, const char *filename) {
+  int slot = engine->doc_count - engine->doc_base;
+  if (slot == engine->doc_cap) {
+    engine->doc_cap = engine->doc_cap ? engine->doc_cap * 2 : 16;
+    engine->documents = (Document *)realloc(
+        engine->documents, engine->doc_cap * sizeof(Document));
+  }
+  engine->documents[slot].name_offset = pool_add(&engine->doc_names, filename);
+  engine->documents[slot].word_count = 0;
+  engine->doc_count++;
+  engine->generation++;
+}
+
+/* In-memory document by id, or NULL (mapped documents live in the file) */
+Document *get_document(SearchEngine *engine, int doc_id) {
+  if (doc_id < engine->doc_base || doc_id >= engine->doc_count)
+    return NULL;
+  return &engine->documents[doc_id - engine->doc_base];
+}
+
+/* Documents numbered so far, deleted ones included */
+int document_count(const SearchEngine *engine) {
+  return engine->doc_count;
+}
+
+int document_deleted(const SearchEngine *engine, int doc_id) {
+  size_t word = (size_t)doc_id / 64;
+  return word < engine->deleted_cap &&
+         (engine->deleted[word] >> doc_id % 64 & 1);
+}
+
+/* Add one occurrence of word, which is already normalized, at the given
+ * token position of the document */
+void index_word(SearchEngine *engine, const char *word, int doc_id,
+                int position) {
+  // Known words skip the trie walk entirely
+  TrieNode *node = hash_search(engine, word);
+  if (!node) {
+    node = trie_insert(&engine->arena, engine->trie_root, word);
+    hash_insert(engine, word, node);
+  }
+  add_doc_occurrence(&engine->arena, node, doc_id, position);
+  trie_raise_best(node);
+}
+
+/* Bytes that end a token; NUL too, as it ended C-string text */
+const unsigned char token_delims[256] = {
+    [0] = 1,    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, ['.'] = 1,
+    [','] = 1,  [';'] = 1, [':'] = 1,  ['!'] = 1,  ['?'] = 1,  ['"'] = 1,
+    ['\''] = 1, ['('] = 1, [')'] = 1,  ['['] = 1,  [']'] = 1,  ['{'] = 1,
+    ['}'] = 1};
+
+/*
+ * Streaming tokenizer: text arrives in chunks of any size and is scanned in
+ * place. Only the word being built is kept between chunks, so a token split
+ * across a chunk boundary just continues, and nothing else is copied. A
+ * token is normalized as normalize_word does from its first MAX_WORD_LEN - 1
+ * bytes; only one that kept any byte from 0x80 up goes through fold_word.
+ */
+typedef struct Tokenizer {
+  SearchEngine *engine;
+  int doc_id;
+  int word_count;  // Tokens so far, including ones too short to index
+  int in_token;
+  int raw_len;  // Bytes of the current token looked at
+  int len;      // Normalized bytes in word
+  int non_ascii;  // Whether word holds bytes from 0x80 up, still unfolded
+  char word[MAX_WORD_LEN];
+#if SEARCH_METRICS
+  uint64_t started;  // When the document began
+#endif
+} Tokenizer;
+
+void tokenizer_emit(Tokenizer *tok) {
+  if (tok->non_ascii)
+    tok->len = fold_word(tok->word, tok->len);
+  tok->word[tok->len] = '\0';
+  if (word_indexable(tok->word, tok->len) &&
+      !is_stop_word(tok->engine->stop_words, tok->word))
+    index_word(tok->engine, tok->word, tok->doc_id, tok->word_count);
+  tok->word_count++;
+  tok->in_token = 0;
+  tok->raw_len = 0;
+  tok->len = 0;
+  tok->non_ascii = 0;
+}
+
+/*
+ * Vector classification of TOKEN_BLOCK bytes at a time: bit i of delims,
+ * kept and non_ascii describes byte i, and lowered receives the bytes with
+ * ASCII letters lowercased. A token keeps its ASCII letters and its bytes
+ * from 0x80 up, which the sign bit alone picks out. One kernel is picked at
+ * compile time; without any, every byte takes the scalar loop in
+ * tokenizer_feed.
+ *
+ * The pshufb kernels look each byte's low and high nibble up in two
+ * 16-entry tables and AND the results, nonzero exactly for delimiters:
+ * high nibbles 0x0, 0x2, 0x3 and {0x5, 0x7} get one bit each, and a low
+ * nibble's entry holds the bits of the rows that contain it. Plain SSE2
+ * has no byte shuffle and compares against the set directly.
+ */
+#if defined(HAVE_AVX2) || defined(HAVE_SSSE3) || defined(HAVE_SSE2) ||     \
+    defined(HAVE_NEON)
+#define TOKEN_BLOCK 32
+#define DELIM_LOW_NIBBLES                                                     \
+  3, 2, 2, 0, 0, 0, 0, 2, 2, 3, 5, 12, 2, 9, 2, 4
+#define DELIM_HIGH_NIBBLES 1, 0, 2, 4, 0, 8, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0
+#endif
+
+#if defined(HAVE_AVX2)
+void token_classify(const unsigned char *p, uint32_t *delims,
+                    uint32_t *kept, uint32_t *non_ascii,
+                    unsigned char *lowered) {
+  const __m256i low_table = _mm256_setr_epi8(DELIM_LOW_NIBBLES,
+                                             DELIM_LOW_NIBBLES);
+  const __m256i high_table = _mm256_setr_epi8(DELIM_HIGH_NIBBLES,
+                                              DELIM_HIGH_NIBBLES);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i v = _mm256_loadu_si256((const __m256i *)p);
+  __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+  __m256i high = _mm256_shuffle_epi8(
+      high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+  __m256i delim = _mm256_cmpeq_epi8(_mm256_and_si256(low, high),
+                                    _mm256_setzero_si256());
+  // Setting 0x20 lowercases A-Z; the result is a-z only for letters
+  const __m256i case_bit = _mm256_set1_epi8(0x20);
+  __m256i lower = _mm256_or_si256(v, case_bit);
+  __m256i letter = _mm256_and_si256(
+      _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+  _mm256_storeu_si256((__m256i *)lowered,
+                      _mm256_or_si256(v, _mm256_and_si256(letter, case_bit)));
+  *delims = ~(uint32_t)_mm256_movemask_epi8(delim);
+  *non_ascii = (uint32_t)_mm256_movemask_epi8(v);
+  *kept = (uint32_t)_mm256_movemask_epi8(letter) | *non_ascii;
+}
+#elif defined(HAVE_SSSE3) || defined(HAVE_SSE2)
+uint32_t token_classify16(const unsigned char *p, uint32_t *kept,
+                          uint32_t *non_ascii, unsigned char *lowered) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+#if defined(HAVE_SSSE3)
+  const __m128i low_table = _mm_setr_epi8(DELIM_LOW_NIBBLES);
+  const __m128i high_table = _mm_setr_epi8(DELIM_HIGH_NIBBLES);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i low = _mm_shuffle_epi8(low_table, _mm_and_si128(v, nibble));
+  __m128i high = _mm_shuffle_epi8(
+      high_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+  __m128i not_delim =
+      _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+  uint32_t delims = ~(uint32_t)_mm_movemask_epi8(not_delim) & 0xffff;
+#else
+  // x in [lo, lo + span] as unsigned bytes: min(x - lo, span) == x - lo
+#define BYTE_RANGE(x, lo, span)                                               \
+  _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(x, _mm_set1_epi8(lo)),            \
+                              _mm_set1_epi8(span)),                          \
+                 _mm_sub_epi8(x, _mm_set1_epi8(lo)))
+#define BYTE_IS(x, c) _mm_cmpeq_epi8(x, _mm_set1_epi8(c))
+  __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));  // [ ] to { }
+  __m128i d = _mm_or_si128(BYTE_RANGE(v, '\t', 1), BYTE_RANGE(v, ' ', 2));
+  d = _mm_or_si128(d, BYTE_RANGE(v, '\'', 2));
+  d = _mm_or_si128(d, BYTE_RANGE(v, ':', 1));
+  d = _mm_or_si128(d, _mm_or_si128(BYTE_IS(v, 0), BYTE_IS(v, '\r')));
+  d = _mm_or_si128(d, _mm_or_si128(BYTE_IS(v, ','), BYTE_IS(v, '.')));
+  d = _mm_or_si128(d, BYTE_IS(v, '?'));
+  d = _mm_or_si128(d, _mm_or_si128(BYTE_IS(folded, '{'), BYTE_IS(folded, '}')));
+#undef BYTE_RANGE
+#undef BYTE_IS
+  uint32_t delims = (uint32_t)_mm_movemask_epi8(d);
+#endif
+  // Setting 0x20 lowercases A-Z; the result is a-z only for letters
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  __m128i lower = _mm_or_si128(v, case_bit);
+  __m128i letter =
+      _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+  _mm_storeu_si128((__m128i *)lowered,
+                   _mm_or_si128(v, _mm_and_si128(letter, case_bit)));
+  *non_ascii = (uint32_t)_mm_movemask_epi8(v);
+  *kept = (uint32_t)_mm_movemask_epi8(letter) | *non_ascii;
+  return delims;
+}
+
+void token_classify(const unsigned char *p, uint32_t *delims,
+                    uint32_t *kept, uint32_t *non_ascii,
+                    unsigned char *lowered) {
+  uint32_t upper_kept, upper_non_ascii;
+  *delims = token_classify16(p, kept, non_ascii, lowered) |
+            token_classify16(p + 16, &upper_kept, &upper_non_ascii,
+                             lowered + 16)
+                << 16;
+  *kept |= upper_kept << 16;
+  *non_ascii |= upper_non_ascii << 16;
+}
+#elif defined(HAVE_NEON)
+/* Bit i of the result for each byte i of v that is all ones */
+uint32_t neon_movemask(uint8x16_t v) {
+  static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                      1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t bits = vandq_u8(v, vld1q_u8(weights));
+  return vaddv_u8(vget_low_u8(bits)) |
+         (uint32_t)vaddv_u8(vget_high_u8(bits)) << 8;
+}
+
+uint32_t token_classify16(const unsigned char *p, uint32_t *kept,
+                          uint32_t *non_ascii, unsigned char *lowered) {
+  static const uint8_t low_nibbles[16] = {DELIM_LOW_NIBBLES};
+  static const uint8_t high_nibbles[16] = {DELIM_HIGH_NIBBLES};
+  uint8x16_t v = vld1q_u8(p);
+  uint8x16_t low = vqtbl1q_u8(vld1q_u8(low_nibbles), vandq_u8(v, vdupq_n_u8(0x0f)));
+  uint8x16_t high = vqtbl1q_u8(vld1q_u8(high_nibbles), vshrq_n_u8(v, 4));
+  uint8x16_t delim = vtstq_u8(low, high);
+  // Setting 0x20 lowercases A-Z; the result is a-z only for letters
+  uint8x16_t case_bit = vdupq_n_u8(0x20);
+  uint8x16_t lower = vorrq_u8(v, case_bit);
+  uint8x16_t letter = vcleq_u8(vsubq_u8(lower, vdupq_n_u8('a')), vdupq_n_u8(25));
+  vst1q_u8(lowered, vorrq_u8(v, vandq_u8(letter, case_bit)));
+  *non_ascii = neon_movemask(vcltq_s8(vreinterpretq_s8_u8(v), vdupq_n_s8(0)));
+  *kept = neon_movemask(letter) | *non_ascii;
+  return neon_movemask(delim);
+}
+
+void token_classify(const unsigned char *p, uint32_t *delims,
+                    uint32_t *kept, uint32_t *non_ascii,
+                    unsigned char *lowered) {
+  uint32_t upper_kept, upper_non_ascii;
+  *delims = token_classify16(p, kept, non_ascii, lowered) |
+            token_classify16(p + 16, &upper_kept, &upper_non_ascii,
+                             lowered + 16)
+                << 16;
+  *kept |= upper_kept << 16;
+  *non_ascii |= upper_non_ascii << 16;
+}
+#endif
+
+#ifdef TOKEN_BLOCK
+/* Run the tokenizer over one classified block */
+void tokenizer_block(Tokenizer *tok, const unsigned char *lowered,
+                     uint32_t delims, uint32_t kept, uint32_t non_ascii) {
+  int pos = 0;
+  while (pos < TOKEN_BLOCK) {
+    if (!tok->in_token) {
+      uint32_t starts = ~delims >> pos;
+      if (!starts)
+        return;
+      pos += lowest_bit(starts);
+      tok->in_token = 1;
+    }
+
+    uint32_t ends = delims >> pos;
+    int end = ends ? pos + lowest_bit(ends) : TOKEN_BLOCK;
+    int take = end - pos;
+    if (take > MAX_WORD_LEN - 1 - tok->raw_len)
+      take = MAX_WORD_LEN - 1 - tok->raw_len;
+    if (take > 0) {
+      uint32_t span = take == 32 ? 0xffffffffu : (1u << take) - 1;
+      uint32_t run = kept >> pos & span;
+      if (non_ascii >> pos & run)
+        tok->non_ascii = 1;
+      if (run == span) {
+        memcpy(tok->word + tok->len, lowered + pos, take);
+        tok->len += take;
+      } else {
+        for (; run; run &= run - 1)
+          tok->word[tok->len++] = (char)lowered[pos + lowest_bit(run)];
+      }
+      tok->raw_len += take;
+    }
+
+    if (end == TOKEN_BLOCK)
+      return;  // The token may go on in the next block
+    tokenizer_emit(tok);
+    pos = end;
+  }
+}
+#endif
+
+/* Scalar reference path, also used for the bytes after the last block */
+void tokenizer_feed(Tokenizer *tok, const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data, *end = p + size;
+#ifdef TOKEN_BLOCK
+  unsigned char lowered[TOKEN_BLOCK];
+  for (; end - p >= TOKEN_BLOCK; p += TOKEN_BLOCK) {
+    uint32_t delims, kept, non_ascii;
+    token_classify(p, &delims, &kept, &non_ascii, lowered);
+    tokenizer_block(tok, lowered, delims, kept, non_ascii);
+  }
+#endif
+  while (p < end) {
+    if (!tok->in_token) {
+      while (p < end && token_delims[*p])
+        p++;
+      if (p == end)
+        return;
+      tok->in_token = 1;
+    }
+    for (; p < end && !token_delims[*p]; p++) {
+      if (tok->raw_len < MAX_WORD_LEN - 1) {
+        tok->raw_len++;
+        if ((unsigned)((*p | 0x20) - 'a') < 26) {
+          tok->word[tok->len++] = (char)(*p | 0x20);
+        } else if (*p >= 0x80) {
+          tok->word[tok->len++] = (char)*p;
+          tok->non_ascii = 1;
+        }
+      }
+    }
+    if (p < end)
+      tokenizer_emit(tok);  // The token ended inside this chunk
+  }
+}
+
+/* Add a document whose text is then fed through tok */
+void document_begin(SearchEngine *engine, const char *name, Tokenizer *tok) {
+  add_document(engine, name);
+  memset(tok, 0, sizeof(*tok));
+  tok->engine = engine;
+  tok->doc_id = engine->doc_count - 1;
+  METRIC(tok->started = clock_nanos());
+}
+
+/* Flush the last token and record the document length; returns its id */
+int document_end(Tokenizer *tok) {
+  if (tok->in_token)
+    tokenizer_emit(tok);
+  Document *doc = get_document(tok->engine, tok->doc_id);
+  if (doc)
+    doc->word_count = tok->word_count;
+  tok->engine->total_words += tok->word_count;
+#if SEARCH_METRICS
+  Metrics *m = thread_metrics();
+  metric_add(&m->documents_indexed, 1);
+  metric_add(&m->tokens_indexed, (uint64_t)tok->word_count);
+  metric_add(&m->index_nanos, clock_nanos() - tok->started);
+#endif
+  return tok->doc_id;
+}
+
+int index_text(SearchEngine *engine, const char *name, const char *text) {
+  Tokenizer tok;
+  document_begin(engine, name, &tok);
+  tokenizer_feed(&tok, text, strlen(text));
+  return document_end(&tok);
+}
+
+/* Index the rest of file as one document, a chunk at a time */
+int index_stream(SearchEngine *engine, const char *name, FILE *file) {
+  char *chunk = (char *)malloc(READ_CHUNK_SIZE);
+  if (!chunk)
+    return -1;
+
+  Tokenizer tok;
+  document_begin(engine, name, &tok);
+  size_t n;
+  while ((n = fread(chunk, 1, READ_CHUNK_SIZE, file)) > 0)
+    tokenizer_feed(&tok, chunk, n);
+
+  free(chunk);
+  return document_end(&tok);
+}
+
+int index_document(SearchEngine *engine, const char *filename) {
+  FILE *file = fopen(filename, "rb");
+  if (!file)
+    return -1;
+
+  int doc_id = index_stream(engine, filename, file);
+  fclose(file);
+  return doc_id;
+}
+
+/* ==================== BINARY INDEX FILE ==================== */
+
+const char *index_string(const MappedIndex *idx, uint32_t offset) {
+  return offset < idx->header->strings_size ? idx->strings + offset : "";
+}
+
+int index_section_ok(const MappedIndex *idx, uint64_t offset, uint64_t count,
+                     size_t elem_size) {
+  if (offset % 8 != 0 || offset > idx->size)
+    return 0;
+  return count <= (idx->size - offset) / elem_size;
+}
+
+/* Leaf count of the max tree over term_count terms */
+uint64_t freq_tree_leaves(uint64_t term_count) {
+  uint64_t leaves = 1;
+  while (leaves < term_count)
+    leaves *= 2;
+  return leaves;
+}
+
+/* Check the header and section bounds; per-entry offsets are checked on use */
+int validate_index(MappedIndex *idx) {
+  const IndexHeader *h = (const IndexHeader *)idx->base;
+  if (idx->size < sizeof(IndexHeader) ||
+      memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != INDEX_VERSION || h->byte_order != INDEX_BYTE_ORDER ||
+      h->doc_count > (uint32_t)INT_MAX - h->doc_base)
+    return 0;
+
+  if (!index_section_ok(idx, h->terms_offset, h->term_count,
+                        sizeof(IndexTerm)) ||
+      !index_section_ok(idx, h->postings_offset, h->postings_size, 1) ||
+      !index_section_ok(idx, h->positions_offset, h->positions_size, 1) ||
+      !index_section_ok(idx, h->skips_offset, h->skip_count,
+                        sizeof(SkipEntry)) ||
+      !index_section_ok(idx, h->freq_tree_offset,
+                        2 * freq_tree_leaves(h->term_count),
+                        sizeof(uint32_t)) ||
+      !index_section_ok(idx, h->docs_offset, h->doc_count, sizeof(IndexDoc)) ||
+      !index_section_ok(idx, h->strings_offset, h->strings_size, 1) ||
+      h->strings_size == 0)
+    return 0;
+
+  const char *base = (const char *)idx->base;
+  idx->header = h;
+  idx->terms = (const IndexTerm *)(base + h->terms_offset);
+  idx->postings = (const unsigned char *)(base + h->postings_offset);
+  idx->positions = (const unsigned char *)(base + h->positions_offset);
+  idx->skips = (const SkipEntry *)(base + h->skips_offset);
+  idx->freq_tree = (const uint32_t *)(base + h->freq_tree_offset);
+  idx->docs = (const IndexDoc *)(base + h->docs_offset);
+  idx->strings = base + h->strings_offset;
+  return idx->strings[h->strings_size - 1] == '\0';
+}
+
+void unmap_index(MappedIndex *idx) {
+  if (!idx)
+    return;
+  if (idx->heap) {
+    free(idx->base);
+    free(idx);
+    return;
+  }
+#ifdef _WIN32
+  if (idx->base)
+    UnmapViewOfFile(idx->base);
+  if (idx->mapping)
+    CloseHandle(idx->mapping);
+  if (idx->file && idx->file != INVALID_HANDLE_VALUE)
+    CloseHandle(idx->file);
+#else
+  if (idx->base)
+    munmap(idx->base, idx->size);
+#endif
+  free(idx);
+}
+
+MappedIndex *map_index(const char *path) {
+  MappedIndex *idx = (MappedIndex *)calloc(1, sizeof(MappedIndex));
+
+#ifdef _WIN32
+  idx->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if (idx->file != INVALID_HANDLE_VALUE && GetFileSizeEx(idx->file, &size) &&
+      size.QuadPart > 0) {
+    idx->size = (size_t)size.QuadPart;
+    idx->mapping =
+        CreateFileMappingA(idx->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (idx->mapping)
+      idx->base = MapViewOfFile(idx->mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+#else
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    idx->size = (size_t)st.st_size;
+    idx->base = mmap(NULL, idx->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (idx->base == MAP_FAILED)
+      idx->base = NULL;
+  }
+  if (fd >= 0)
+    close(fd);
+#endif
+
+  if (!idx->base || !validate_index(idx)) {
+    unmap_index(idx);
+    return NULL;
+  }
+  idx->refs = 1;
+  return idx;
+}
+
+/* Drop a reference to a segment, unmapping it (and removing a file that a
+ * merge replaced) once nothing uses it */
+void release_index(MappedIndex *idx) {
+  if (!idx || --idx->refs > 0)
+    return;
+  char *path = idx->unlink_path;
+  unmap_index(idx);
+  if (path) {
+    remove(path);
+    free(path);
+  }
+}
+
+/* Size of a TERM_BITMAP term's postings over bits documents */
+size_t bitmap_bytes(uint32_t bits) {
+  return ((size_t)bits + 31) / 32 * sizeof(uint32_t);
+}
+
+/* Whether a term's postings and positions lie inside their sections */
+int index_term_ok(const MappedIndex *idx, const IndexTerm *term) {
+  uint64_t postings_size = idx->header->postings_size;
+  uint64_t positions_size = idx->header->positions_size;
+  if ((term->flags & TERM_BITMAP) &&
+      term->postings_len < bitmap_bytes(idx->header->doc_count))
+    return 0;
+  return term->postings_offset <= postings_size &&
+         term->postings_len <= postings_size - term->postings_offset &&
+         term->positions_offset <= positions_size &&
+         term->positions_len <= positions_size - term->positions_offset;
+}
+
+/* A term's skip entries, or NULL (and *count 0) if they are out of range */
+const SkipEntry *index_term_skips(const MappedIndex *idx,
+                                  const IndexTerm *term, uint32_t *count) {
+  uint32_t n = term->doc_freq > 0 ? (term->doc_freq - 1) / SKIP_INTERVAL : 0;
+  *count = 0;
+  if ((term->flags & TERM_BITMAP) ||
+      term->skips_index > idx->header->skip_count ||
+      n > idx->header->skip_count - term->skips_index)
+    return NULL;
+  *count = n;
+  return idx->skips + term->skips_index;
+}
+
+/* Position of the first term >= word in the sorted term array */
+uint32_t index_lower_bound(const MappedIndex *idx, const char *word) {
+  uint32_t lo = 0, hi = idx->header->term_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strcmp(index_string(idx, idx->terms[mid].word_offset), word) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+const IndexTerm *index_find_term(const MappedIndex *idx, const char *word) {
+  uint32_t i = index_lower_bound(idx, word);
+  if (i >= idx->header->term_count ||
+      strcmp(index_string(idx, idx->terms[i].word_offset), word) != 0)
+    return NULL;
+
+  return index_term_ok(idx, &idx->terms[i]) ? &idx->terms[i] : NULL;
+}
+
+/* Map a standalone index file into an empty engine; returns its document
+ * count */
+int load_index(SearchEngine *engine, const char *path) {
+  if (engine->doc_count > 0 || engine->segment_count > 0)
+    return -1;
+
+  MappedIndex *idx = map_index(path);
+  if (!idx)
+    return -1;
+  if (idx->header->doc_base != 0) {
+    unmap_index(idx);
+    return -1;
+  }
+
+  engine->segments[engine->segment_count++] = idx;
+  engine->doc_base = (int)idx->header->doc_count;
+  engine->doc_count = engine->doc_base;
+  return engine->doc_count;
+}
+
+/* ==================== TERM LOOKUP ==================== */
+
+/* A term's postings across the segments and the in-memory trie */
+typedef struct TermRef {
+  const IndexTerm *mapped[MAX_SEGMENTS];  // Per segment, NULL where absent
+  TrieNode *node;
+  int total_freq;
+} TermRef;
+
+/*
+ * Reads a term's postings one source at a time: the segments in doc_id
+ * order, then memory. Deleted documents are skipped, and so are mapped
+ * doc_ids outside their segment, which only a corrupt file holds.
+ */
+typedef struct PostingIter {
+  const SearchEngine *engine;
+  const TermRef *ref;  // Must outlive the iterator
+  int source;          // Segment the cursor reads; segment_count for memory
+  uint32_t doc_begin;  // doc_id range of the source
+  uint32_t doc_end;
+  PostingCursor cursor;
+} PostingIter;
+
+int lookup_term(SearchEngine *engine, const char *word, TermRef *ref) {
+  int found = 0;
+  ref->total_freq = 0;
+  for (int s = 0; s < engine->segment_count; s++) {
+    ref->mapped[s] = index_find_term(engine->segments[s], word);
+    if (ref->mapped[s]) {
+      ref->total_freq += (int)ref->mapped[s]->total_freq;
+      found = 1;
+    }
+  }
+  ref->node = hash_search(engine, word);
+  if (ref->node) {
+    ref->total_freq += ref->node->total_freq;
+    found = 1;
+  }
+  return found;
+}
+
+/* Number of postings, deleted documents included until a merge drops them */
+uint32_t term_doc_freq(const SearchEngine *engine, const TermRef *ref) {
+  uint32_t doc_freq = ref->node ? (uint32_t)ref->node->postings.doc_count : 0;
+  for (int s = 0; s < engine->segment_count; s++)
+    if (ref->mapped[s])
+      doc_freq += ref->mapped[s]->doc_freq;
+  return doc_freq;
+}
+
+/* Move the cursor to the first source from s on that holds the term */
+void posting_iter_source(PostingIter *it, int s) {
+  const SearchEngine *engine = it->engine;
+  for (; s < engine->segment_count; s++) {
+    const IndexTerm *term = it->ref->mapped[s];
+    if (!term)
+      continue;
+    const MappedIndex *idx = engine->segments[s];
+    if (term->flags & TERM_BITMAP) {
+      posting_cursor_init_bitmap(&it->cursor,
+                                 idx->postings + term->postings_offset,
+                                 idx->header->doc_count, idx->header->doc_base,
+                                 term->max_freq);
+    } else {
+      posting_cursor_init(&it->cursor, idx->postings + term->postings_offset,
+                          term->postings_len);
+      it->cursor.skips = index_term_skips(idx, term, &it->cursor.skip_count);
+    }
+    posting_cursor_init_positions(&it->cursor,
+                                  idx->positions + term->positions_offset,
+                                  term->positions_len);
+    it->source = s;
+    it->doc_begin = idx->header->doc_base;
+    it->doc_end = idx->header->doc_base + idx->header->doc_count;
+    return;
+  }
+
+  posting_cursor_init(&it->cursor, NULL, 0);
+  if (s == engine->segment_count && it->ref->node)
+    posting_cursor_init_list(&it->cursor, &it->ref->node->postings);
+  it->source = s;
+  it->doc_begin = (uint32_t)engine->doc_base;
+  it->doc_end = UINT32_MAX;
+}
+
+void posting_iter_init(SearchEngine *engine, const TermRef *ref,
+                       PostingIter *it) {
+  it->engine = engine;
+  it->ref = ref;
+  posting_iter_source(it, 0);
+}
+
+/* Whether the posting the cursor just produced may be reported */
+int posting_iter_keep(const PostingIter *it, uint32_t id) {
+  return id >= it->doc_begin && id < it->doc_end &&
+         !document_deleted(it->engine, (int)id);
+}
+
+int posting_next(PostingIter *it, int *doc_id, int *frequency) {
+  uint32_t id, freq;
+  for (;;) {
+    while (posting_cursor_next(&it->cursor, &id, &freq)) {
+      if (posting_iter_keep(it, id)) {
+        *doc_id = (int)id;
+        *frequency = (int)freq;
+        return 1;
+      }
+    }
+    if (it->source >= it->engine->segment_count)
+      return 0;
+    posting_iter_source(it, it->source + 1);
+  }
+}
+
+/* First remaining posting with doc_id >= target, using the skip entries */
+int posting_advance(PostingIter *it, int target, int *doc_id,
+                    int *frequency) {
+  // Segments that end at or before target have nothing left to give
+  while (it->source < it->engine->segment_count &&
+         it->doc_end <= (uint32_t)target)
+    posting_iter_source(it, it->source + 1);
+
+  uint32_t id, freq;
+  if (posting_cursor_seek(&it->cursor, (uint32_t)target, &id, &freq)) {
+    do {
+      if (posting_iter_keep(it, id)) {
+        *doc_id = (int)id;
+        *frequency = (int)freq;
+        return 1;
+      }
+    } while (posting_cursor_next(&it->cursor, &id, &freq));
+  }
+  // Later sources start past this one, so past target too
+  return posting_next(it, doc_id, frequency);
+}
+
+/* Encoded positions of the posting just returned; see
+ * posting_cursor_positions */
+uint32_t posting_positions(PostingIter *it, const unsigned char **start) {
+  return posting_cursor_positions(&it->cursor, start);
+}
+
+/* Segment holding doc_id, or NULL for in-memory and unknown ids */
+const MappedIndex *document_segment(const SearchEngine *engine,
+                                    int doc_id) {
+  if (doc_id < 0 || doc_id >= engine->doc_base)
+    return NULL;
+  int lo = 0, hi = engine->segment_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (engine->segments[mid]->header->doc_base <= (uint32_t)doc_id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return NULL;
+  const MappedIndex *idx = engine->segments[lo - 1];
+  return (uint32_t)doc_id - idx->header->doc_base < idx->header->doc_count
+             ? idx
+             : NULL;
+}
+
+const char *document_name(SearchEngine *engine, int doc_id) {
+  const MappedIndex *idx = document_segment(engine, doc_id);
+  if (idx)
+    return index_string(
+        idx, idx->docs[doc_id - idx->header->doc_base].name_offset);
+  Document *doc = get_document(engine, doc_id);
+  return doc ? engine->doc_names.data + doc->name_offset : NULL;
+}
+
+int document_word_count(SearchEngine *engine, int doc_id) {
+  const MappedIndex *idx = document_segment(engine, doc_id);
+  if (idx)
+    return (int)idx->docs[doc_id - idx->header->doc_base].word_count;
+  Document *doc = get_document(engine, doc_id);
+  return doc ? doc->word_count : 0;
+}
+
+/* ==================== INDEX WRITER ==================== */
+
+/* Make room for n more bytes; returns where they go, or NULL if memory
+ * runs out */
+char *buffer_reserve(ByteBuffer *buf, size_t n) {
+  if (buf->len + n > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + n)
+      cap *= 2;
+    char *data = (char *)realloc(buf->data, cap);
+    if (!data) {
+      buf->failed = 1;
+      return NULL;
+    }
+    buf->data = data;
+    buf->cap = cap;
+  }
+  return buf->data + buf->len;
+}
+
+/* Append n bytes (zeroed when src is NULL); returns their offset */
+size_t buffer_append(ByteBuffer *buf, const void *src, size_t n) {
+  size_t offset = buf->len;
+  char *dst = n > 0 ? buffer_reserve(buf, n) : NULL;
+  if (!dst)
+    return offset;
+  if (src)
+    memcpy(dst, src, n);
+  else
+    memset(dst, 0, n);
+  buf->len += n;
+  return offset;
+}
+
+typedef struct TermEntry {
+  const char *word;
+  TrieNode *node;
+} TermEntry;
+
+/*
+ * With bitmap terms on, a term in at least one of every BITMAP_DENSITY
+ * documents of a file of BITMAP_MIN_DOCS or more is written as a bitmap:
+ * a bit per document is smaller than its varint pairs and scans without
+ * decoding, at the cost of its skips and of exact per-document frequencies
+ * for queries. Its positions stay, each set bit's behind their count, so
+ * phrase and proximity queries and merges still see every occurrence.
+ */
+#define BITMAP_MIN_DOCS 256
+#define BITMAP_DENSITY 8
+
+/*
+ * Replace the varint postings just written for term, over documents base
+ * .. base + bits - 1, by a bitmap, dropping its skips and putting each
+ * posting's frequency before its positions; the mean frequency stands in
+ * for every document's, and min_words is the shortest of them. Leaves the
+ * term as it is if memory runs out.
+ */
+void bitmap_term(IndexTerm *term, ByteBuffer *postings, ByteBuffer *positions,
+                 ByteBuffer *skips, uint32_t bits, uint32_t base,
+                 uint32_t min_words) {
+  uint32_t *words = (uint32_t *)calloc(bitmap_bytes(bits), 1);
+  ByteBuffer counted = {0};
+  if (!words || postings->failed || positions->failed) {
+    free(words);
+    return;
+  }
+  const unsigned char *p =
+      (const unsigned char *)postings->data + term->postings_offset;
+  const unsigned char *end = (const unsigned char *)postings->data +
+                             postings->len;
+  const unsigned char *q =
+      (const unsigned char *)positions->data + term->positions_offset;
+  const unsigned char *q_end =
+      (const unsigned char *)positions->data + positions->len;
+  uint32_t doc_id = 0, gap, frequency;
+  while (p && p < end) {
+    p = varint_get(p, end, &gap);
+    if (p)
+      p = varint_get(p, end, &frequency);
+    doc_id += gap;
+    if (p && doc_id - base < bits) {
+      words[(doc_id - base) / 32] |= 1u << (doc_id - base) % 32;
+      unsigned char count[5];
+      const unsigned char *next = varint_skip(q, q_end, frequency);
+      buffer_append(&counted, count, varint_put(count, frequency));
+      buffer_append(&counted, q, (size_t)(next - q));
+      q = next;
+    }
+  }
+  if (counted.failed) {
+    free(words);
+    free(counted.data);
+    return;
+  }
+
+  postings->len = term->postings_offset;
+  positions->len = term->positions_offset;
+  skips->len = term->skips_index * sizeof(SkipEntry);
+  buffer_append(postings, words, bitmap_bytes(bits));
+  buffer_append(positions, counted.data, counted.len);
+  free(words);
+  free(counted.data);
+  term->flags |= TERM_BITMAP;
+  term->max_freq = (term->total_freq + term->doc_freq / 2) / term->doc_freq;
+  if (term->max_freq == 0)
+    term->max_freq = 1;
+  term->min_len_ratio = (float)min_words / term->max_freq;
+}
+
+int compare_term_entries(const void *a, const void *b) {
+  return strcmp(((const TermEntry *)a)->word, ((const TermEntry *)b)->word);
+}
+
+#define INDEX_SECTIONS 7
+
+/* An index assembled in memory: the header, then its sections in order */
+typedef struct IndexImage {
+  IndexHeader header;
+  // Terms, postings, positions, skips, tree, docs, strings
+  ByteBuffer sections[INDEX_SECTIONS];
+} IndexImage;
+
+void free_index_image(IndexImage *image) {
+  for (int k = 0; k < INDEX_SECTIONS; k++)
+    free(image->sections[k].data);
+}
+
+/*
+ * Assemble the documents from first_doc on, with their postings from the
+ * segments and from memory, as one index. Deleted documents lose their
+ * postings, and terms left without any are dropped. With compact, deleted
+ * documents also leave the document table and the rest are renumbered
+ * from 0 (first_doc must be 0); otherwise doc_ids are kept and the index
+ * starts at first_doc. Returns 0, or -1 if memory runs out.
+ */
+int build_index(SearchEngine *engine, int first_doc, int compact,
+                IndexImage *image) {
+  // Segments that end after first_doc hold some of the documents
+  int first_segment = engine->segment_count;
+  while (first_segment > 0) {
+    const IndexHeader *h = engine->segments[first_segment - 1]->header;
+    if (h->doc_base + h->doc_count <= (uint32_t)first_doc)
+      break;
+    first_segment--;
+  }
+
+  // In-memory terms in word order, to merge with the sorted mapped terms
+  const HashTable *table = &engine->hash_table;
+  size_t entry_count = 0;
+  TermEntry *entries =
+      (TermEntry *)malloc((table->count + 1) * sizeof(TermEntry));
+  int *new_ids = compact ? (int *)malloc((engine->doc_count + 1) * sizeof(int))
+                         : NULL;
+  if (!entries || (compact && !new_ids)) {
+    free(entries);
+    free(new_ids);
+    return -1;
+  }
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].trie_node) {
+      entries[entry_count].word =
+          table->pool.data + table->slots[i].word_offset;
+      entries[entry_count].node = table->slots[i].trie_node;
+      entry_count++;
+    }
+  }
+  qsort(entries, entry_count, sizeof(TermEntry), compare_term_entries);
+
+  int live_docs = 0;
+  for (int id = 0; compact && id < engine->doc_count; id++)
+    new_ids[id] = document_deleted(engine, id) ? -1 : live_docs++;
+
+  ByteBuffer terms = {0}, postings = {0}, positions = {0}, skips = {0};
+  ByteBuffer docs = {0}, strings = {0};
+  uint32_t next[MAX_SEGMENTS] = {0};  // Per segment, the next term to merge
+  size_t j = 0;
+
+  for (;;) {
+    // The smallest word any source has left
+    const char *word = NULL;
+    for (int s = first_segment; s < engine->segment_count; s++) {
+      const MappedIndex *idx = engine->segments[s];
+      if (next[s] < idx->header->term_count) {
+        const char *w = index_string(idx, idx->terms[next[s]].word_offset);
+        if (!word || strcmp(w, word) < 0)
+          word = w;
+      }
+    }
+    if (j < entry_count && (!word || strcmp(entries[j].word, word) < 0))
+      word = entries[j].word;
+    if (!word)
+      break;
+
+    TermRef ref;
+    memset(&ref, 0, sizeof(ref));
+    for (int s = first_segment; s < engine->segment_count; s++) {
+      const MappedIndex *idx = engine->segments[s];
+      if (next[s] < idx->header->term_count &&
+          strcmp(index_string(idx, idx->terms[next[s]].word_offset), word) ==
+              0) {
+        const IndexTerm *mt = &idx->terms[next[s]++];
+        if (index_term_ok(idx, mt))
+          ref.mapped[s] = mt;
+      }
+    }
+    if (j < entry_count && strcmp(entries[j].word, word) == 0)
+      ref.node = entries[j++].node;
+
+    IndexTerm term = {0};
+    term.postings_offset = postings.len;
+    term.positions_offset = positions.len;
+    term.skips_index = skips.len / sizeof(SkipEntry);
+
+    // Re-encode through the iterator so gaps continue across the sources
+    PostingIter it;
+    posting_iter_init(engine, &ref, &it);
+    int doc_id, frequency, prev_doc = 0;
+    uint32_t min_words = UINT32_MAX;
+    while (posting_next(&it, &doc_id, &frequency)) {
+      if (doc_id < first_doc)
+        continue;
+      int out_id = compact ? new_ids[doc_id] : doc_id;
+      if (term.doc_freq > 0 && out_id <= prev_doc)
+        continue;  // Out of order, only possible in a corrupt mapped list
+      if (term.doc_freq > 0 && term.doc_freq % SKIP_INTERVAL == 0) {
+        SkipEntry skip = {
+            (uint32_t)prev_doc, (uint32_t)(postings.len - term.postings_offset),
+            (uint32_t)(positions.len - term.positions_offset), 0};
+        buffer_append(&skips, &skip, sizeof(skip));
+      }
+      // Positions are relative to the document, so they copy unchanged
+      const unsigned char *doc_positions;
+      uint32_t positions_len = posting_positions(&it, &doc_positions);
+      if (it.cursor.bitmap && positions_len > 0)
+        frequency = (int)varint_count(doc_positions, positions_len);
+      unsigned char pair[10];
+      int n = varint_put(pair, (uint32_t)(out_id - prev_doc));
+      n += varint_put(pair + n, (uint32_t)frequency);
+      buffer_append(&postings, pair, n);
+      buffer_append(&positions, doc_positions, positions_len);
+      prev_doc = out_id;
+      term.total_freq += (uint32_t)frequency;
+      term.doc_freq++;
+
+      // Score bound inputs, now that every document length is final
+      uint32_t word_count = (uint32_t)document_word_count(engine, doc_id);
+      float ratio = (float)word_count / frequency;
+      if (word_count < min_words)
+        min_words = word_count;
+      if ((uint32_t)frequency > term.max_freq)
+        term.max_freq = (uint32_t)frequency;
+      if (term.doc_freq == 1 || ratio < term.min_len_ratio)
+        term.min_len_ratio = ratio;
+    }
+    if (term.doc_freq == 0)
+      continue;  // Every posting was deleted
+    uint32_t span = compact ? (uint32_t)live_docs
+                            : (uint32_t)(engine->doc_count - first_doc);
+    if (engine->bitmap_terms && span >= BITMAP_MIN_DOCS &&
+        (uint64_t)term.doc_freq * BITMAP_DENSITY >= span)
+      bitmap_term(&term, &postings, &positions, &skips, span,
+                  compact ? 0 : (uint32_t)first_doc, min_words);
+    term.postings_len = (uint32_t)(postings.len - term.postings_offset);
+    term.positions_len = (uint32_t)(positions.len - term.positions_offset);
+    term.word_offset =
+        (uint32_t)buffer_append(&strings, word, strlen(word) + 1);
+
+    buffer_append(&terms, &term, sizeof(term));
+  }
+  free(entries);
+
+  // Max tree over the finished terms
+  ByteBuffer tree = {0};
+  size_t term_total = terms.len / sizeof(IndexTerm);
+  size_t leaves = (size_t)freq_tree_leaves(term_total);
+  buffer_append(&tree, NULL, 2 * leaves * sizeof(uint32_t));
+  if (!tree.failed && !terms.failed) {
+    uint32_t *slots = (uint32_t *)tree.data;
+    const IndexTerm *written = (const IndexTerm *)terms.data;
+    for (size_t t = 0; t < term_total; t++)
+      slots[leaves + t] = written[t].total_freq;
+    for (size_t t = leaves - 1; t > 0; t--)
+      slots[t] = slots[2 * t] > slots[2 * t + 1] ? slots[2 * t]
+                                                 : slots[2 * t + 1];
+  }
+
+  // Document table, indexed by doc_id - doc_base
+  uint64_t total_words = 0;
+  for (int id = first_doc; id < engine->doc_count; id++) {
+    if (compact && new_ids[id] < 0)
+      continue;
+    const char *name = document_name(engine, id);
+    if (!name)
+      name = "unknown";
+    IndexDoc doc = {0};
+    doc.name_offset = (uint32_t)buffer_append(&strings, name, strlen(name) + 1);
+    doc.word_count = (uint32_t)document_word_count(engine, id);
+    total_words += doc.word_count;
+    buffer_append(&docs, &doc, sizeof(doc));
+  }
+  free(new_ids);
+  if (strings.len == 0)
+    buffer_append(&strings, "", 1);
+
+  // Other element sizes are multiples of 8; only the varint sections need
+  // padding
+  size_t postings_size = postings.len, positions_size = positions.len;
+  buffer_append(&postings, NULL, (8 - postings.len % 8) % 8);
+  buffer_append(&positions, NULL, (8 - positions.len % 8) % 8);
+
+  IndexHeader header = {0};
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.byte_order = INDEX_BYTE_ORDER;
+  header.doc_count = (uint32_t)(docs.len / sizeof(IndexDoc));
+  header.term_count = (uint32_t)(terms.len / sizeof(IndexTerm));
+  header.doc_base = compact ? 0 : (uint32_t)first_doc;
+  header.total_words = total_words;
+  header.postings_size = postings_size;
+  header.terms_offset = sizeof(IndexHeader);
+  header.postings_offset = header.terms_offset + terms.len;
+  header.positions_size = positions_size;
+  header.positions_offset = header.postings_offset + postings.len;
+  header.skips_offset = header.positions_offset + positions.len;
+  header.skip_count = skips.len / sizeof(SkipEntry);
+  header.freq_tree_offset = header.skips_offset + skips.len;
+  header.docs_offset = header.freq_tree_offset + tree.len;
+  header.strings_offset = header.docs_offset + docs.len;
+  header.strings_size = strings.len;
+
+  ByteBuffer *parts[INDEX_SECTIONS] = {&terms, &postings, &positions, &skips,
+                                       &tree,  &docs,     &strings};
+  int failed = strings.len > UINT32_MAX;
+  image->header = header;
+  for (int k = 0; k < INDEX_SECTIONS; k++) {
+    image->sections[k] = *parts[k];
+    failed |= parts[k]->failed;
+  }
+  if (failed) {
+    free_index_image(image);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write an index (see build_index) to path. The file is written next to
+ * path and renamed over it, so readers never see a partial index. Returns
+ * the number of terms written, or -1.
+ */
+int write_index(SearchEngine *engine, const char *path, int first_doc,
+                int compact) {
+  IndexImage image;
+  if (build_index(engine, first_doc, compact, &image) < 0)
+    return -1;
+
+  int result = -1;
+  char *tmp_path = (char *)malloc(strlen(path) + 5);
+  FILE *file = NULL;
+  if (tmp_path) {
+    sprintf(tmp_path, "%s.tmp", path);
+    file = fopen(tmp_path, "wb");
+  }
+  if (file) {
+    int ok = fwrite(&image.header, sizeof(image.header), 1, file) == 1;
+    for (int k = 0; k < INDEX_SECTIONS && ok; k++) {
+      const ByteBuffer *section = &image.sections[k];
+      ok = section->len == 0 ||
+           fwrite(section->data, 1, section->len, file) == section->len;
+    }
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    if (ok)
+      remove(path);
+#endif
+    if (ok && rename(tmp_path, path) == 0)
+      result = (int)image.header.term_count;
+    else
+      remove(tmp_path);
+  }
+
+  free(tmp_path);
+  free_index_image(&image);
+  return result;
+}
+
+/* Build an index (see build_index) as a segment held in memory, laid out
+ * exactly like the file */
+MappedIndex *image_index(SearchEngine *engine, int first_doc) {
+  IndexImage image;
+  if (build_index(engine, first_doc, 0, &image) < 0)
+    return NULL;
+
+  size_t size = sizeof(IndexHeader);
+  for (int k = 0; k < INDEX_SECTIONS; k++)
+    size += image.sections[k].len;
+  MappedIndex *idx = (MappedIndex *)calloc(1, sizeof(MappedIndex));
+  char *base = (char *)malloc(size);
+  if (idx && base) {
+    size_t offset = sizeof(IndexHeader);
+    memcpy(base, &image.header, sizeof(IndexHeader));
+    for (int k = 0; k < INDEX_SECTIONS; k++) {
+      if (image.sections[k].len > 0)
+        memcpy(base + offset, image.sections[k].data, image.sections[k].len);
+      offset += image.sections[k].len;
+    }
+  }
+  free_index_image(&image);
+  if (!idx || !base) {
+    free(idx);
+    free(base);
+    return NULL;
+  }
+
+  idx->base = base;
+  idx->size = size;
+  idx->heap = 1;
+  if (!validate_index(idx)) {
+    unmap_index(idx);
+    return NULL;
+  }
+  idx->refs = 1;
+  return idx;
+}
+
+/* Write the whole engine, compacted, to path as a standalone index */
+int save_index(SearchEngine *engine, const char *path) {
+  return write_index(engine, path, 0, 1);
+}
+
+/* ==================== MEMORY CLEANUP ==================== */
+
+/* The trie and its postings live in the arena, so this is a few bulk frees */
+void free_search_engine(SearchEngine *engine) {
+  arena_free(&engine->arena);
+  for (int s = 0; s < engine->segment_count; s++)
+    release_index(engine->segments[s]);
+
+  hash_free(&engine->hash_table);
+
+  free(engine->documents);
+  free(engine->doc_names.data);
+  free(engine->deleted);
+
+  free(engine);
+}
+
+/* ==================== PARALLEL INDEXING ==================== */
+
+/*
+ * Directory builds split the files into contiguous ranges of roughly equal
+ * bytes, one per worker thread. Every worker indexes its range into a
+ * private shard (trie, hash table, postings, documents), so the hot path
+ * takes no locks. Worker 0 indexes straight into the target engine; the
+ * other shards are merged after the join:
+ *
+ *   1. documents are appended in shard order, so doc_ids follow file order
+ *   2. shard terms are looked up in the target in parallel (read only);
+ *      the misses are inserted by parallel workers, each owning the
+ *      subtrees of a set of first bytes, then hashed serially
+ *   3. postings are appended by parallel workers, each owning the terms
+ *      whose hash falls in its partition, so no node is shared
+ *   4. the shards are freed in parallel
+ */
+
+#if SEARCH_METRICS
+typedef struct ThreadStart {
+  ThreadFunc *func;
+  void *arg;
+} ThreadStart;
+
+/* Run a thread's function, then hand its metric slot on */
+THREAD_FUNC thread_main(void *arg) {
+  ThreadStart start = *(ThreadStart *)arg;
+  free(arg);
+#ifdef _WIN32
+  DWORD result = start.func(start.arg);
+#else
+  void *result = start.func(start.arg);
+#endif
+  release_thread_metrics();
+  return result;
+}
+#endif
+
+int thread_start(Thread *thread, ThreadFunc *func, void *arg) {
+#if SEARCH_METRICS
+  ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
+  if (!start)
+    return -1;
+  start->func = func;
+  start->arg = arg;
+  func = thread_main;
+  arg = start;
+#endif
+#ifdef _WIN32
+  *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+  int started = *thread != NULL;
+#else
+  int started = pthread_create(thread, NULL, func, arg) == 0;
+#endif
+  METRIC(if (!started) free(arg));
+  return started ? 0 : -1;
+}
+
+void thread_join(Thread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+typedef struct FileEntry {
+  char *path;
+  uint64_t size;
+} FileEntry;
+
+typedef struct FileList {
+  FileEntry *files;
+  int count;
+  int cap;
+} FileList;
+
+void file_list_add(FileList *list, const char *path, uint64_t size) {
+  if (list->count == list->cap) {
+    list->cap = list->cap ? list->cap * 2 : 64;
+    list->files =
+        (FileEntry *)realloc(list->files, list->cap * sizeof(FileEntry));
+  }
+  list->files[list->count].path = strdup(path);
+  list->files[list->count].size = size;
+  list->count++;
+}
+
+/* Collect regular files under dir, recursively; skips dot entries */
+int list_files(const char *dir, FileList *list) {
+  char path[4096];
+#ifdef _WIN32
+  WIN32_FIND_DATAA entry;
+  snprintf(path, sizeof(path), "%s/*", dir);
+  HANDLE find = FindFirstFileA(path, &entry);
+  if (find == INVALID_HANDLE_VALUE)
+    return -1;
+  do {
+    if (entry.cFileName[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry.cFileName);
+    if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      list_files(path, list);
+    else
+      file_list_add(list, path,
+                    ((uint64_t)entry.nFileSizeHigh << 32) |
+                        entry.nFileSizeLow);
+  } while (FindNextFileA(find, &entry));
+  FindClose(find);
+#else
+  DIR *d = opendir(dir);
+  if (!d)
+    return -1;
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      list_files(path, list);
+    else if (S_ISREG(st.st_mode))
+      file_list_add(list, path, (uint64_t)st.st_size);
+  }
+  closedir(d);
+#endif
+  return 0;
+}
+
+int compare_file_entries(const void *a, const void *b) {
+  return strcmp(((const FileEntry *)a)->path, ((const FileEntry *)b)->path);
+}
+
+typedef struct IndexShard {
+  SearchEngine *engine;    // Private index; NULL once merged away
+  SearchEngine *target;    // Engine the shard is merged into
+  const FileEntry *files;  // This worker's contiguous range
+  int file_count;
+  int skipped;             // Files that could not be opened
+  int doc_base;            // Target doc_id of the shard's doc_id 0
+  TrieNode **targets;      // Per hash slot, the merged target node
+  int first_miss[256];     // Per first byte, a slot the target lacks
+} IndexShard;
+
+/* Terms new to the target, waiting for their hash table entry */
+typedef struct NewTerms {
+  const char **words;
+  TrieNode **nodes;
+  int count;
+  int cap;
+} NewTerms;
+
+typedef struct MergeTask {
+  IndexShard *shards;
+  int shard_count;
+  uint32_t part;
+  uint32_t parts;
+  NewTerms added;
+  Arena arena;  // Target nodes and postings this task allocates
+} MergeTask;
+
+void new_terms_add(NewTerms *terms, const char *word, TrieNode *node) {
+  if (terms->count == terms->cap) {
+    terms->cap = terms->cap ? terms->cap * 2 : 256;
+    terms->words =
+        (const char **)realloc(terms->words, terms->cap * sizeof(char *));
+    terms->nodes =
+        (TrieNode **)realloc(terms->nodes, terms->cap * sizeof(TrieNode *));
+  }
+  terms->words[terms->count] = word;
+  terms->nodes[terms->count] = node;
+  terms->count++;
+}
+
+/* Target node for a term the target lacked, shared by later shards */
+TrieNode *merge_new_term(SearchEngine *engine, Arena *arena, const char *word,
+                         NewTerms *added) {
+  TrieNode *node = trie_search(engine->trie_root, word);
+  if (!node) {
+    node = trie_insert(arena, engine->trie_root, word);
+    new_terms_add(added, word, node);
+  }
+  return node;
+}
+
+THREAD_FUNC index_shard_worker(void *arg) {
+  IndexShard *shard = (IndexShard *)arg;
+  for (int i = 0; i < shard->file_count; i++)
+    if (index_document(shard->engine, shard->files[i].path) < 0)
+      shard->skipped++;
+  return 0;
+}
+
+/* Phase 2a: resolve shard terms the target already has */
+THREAD_FUNC resolve_terms_worker(void *arg) {
+  IndexShard *shard = (IndexShard *)arg;
+  if (!shard->targets)
+    return 0;
+  HashTable *table = &shard->engine->hash_table;
+  for (int b = 0; b < 256; b++)
+    shard->first_miss[b] = -1;
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    if (!table->slots[i].trie_node)
+      continue;
+    const char *word = table->pool.data + table->slots[i].word_offset;
+    shard->targets[i] = hash_search(shard->target, word);
+    if (!shard->targets[i] && shard->first_miss[(unsigned char)*word] < 0)
+      shard->first_miss[(unsigned char)*word] = (int)i;
+  }
+  return 0;
+}
+
+/*
+ * Phase 2c: insert the missing terms whose first byte falls in this task's
+ * partition. Each partition only edits the subtrees below its own root
+ * children, and 2b created every root child beforehand.
+ */
+THREAD_FUNC insert_terms_worker(void *arg) {
+  MergeTask *task = (MergeTask *)arg;
+  for (int s = 1; s < task->shard_count; s++) {
+    IndexShard *shard = &task->shards[s];
+    HashTable *table = &shard->engine->hash_table;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+      if (!table->slots[i].trie_node)
+        continue;
+      // Ownership first: other partitions write their own targets[i]
+      const char *word = table->pool.data + table->slots[i].word_offset;
+      if ((unsigned char)*word % task->parts != task->part ||
+          shard->targets[i])
+        continue;
+      shard->targets[i] =
+          merge_new_term(shard->target, &task->arena, word, &task->added);
+    }
+  }
+  return 0;
+}
+
+/* Phase 3: append postings of the terms in this task's hash partition */
+THREAD_FUNC merge_postings_worker(void *arg) {
+  MergeTask *task = (MergeTask *)arg;
+  for (int s = 1; s < task->shard_count; s++) {
+    IndexShard *shard = &task->shards[s];
+    HashTable *table = &shard->engine->hash_table;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+      HashSlot *slot = &table->slots[i];
+      if (!slot->trie_node || slot->hash % task->parts != task->part)
+        continue;
+      PostingCursor cursor;
+      posting_cursor_init_list(&cursor, &slot->trie_node->postings);
+      uint32_t doc_id, frequency;
+      while (posting_cursor_next(&cursor, &doc_id, &frequency)) {
+        const unsigned char *positions;
+        uint32_t len = posting_cursor_positions(&cursor, &positions);
+        add_doc_posting(&task->arena, shard->targets[i],
+                        shard->doc_base + (int)doc_id, (int)frequency,
+                        positions, len);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Phase 3b: postings from many partitions land under one root child, so
+ * best_freq is rebuilt (exactly) per root child once they are all in
+ */
+THREAD_FUNC merge_bounds_worker(void *arg) {
+  MergeTask *task = (MergeTask *)arg;
+  TrieNode *root = task->shards[0].engine->trie_root;
+  for (int i = 0; i < root->child_count; i++)
+    if (CHILD_KEYS(root)[i] % task->parts == task->part)
+      trie_update_best(root->children[i]);
+  return 0;
+}
+
+/* Phase 4 */
+THREAD_FUNC free_shard_worker(void *arg) {
+  IndexShard *shard = (IndexShard *)arg;
+  free(shard->targets);
+  if (shard->engine)
+    free_search_engine(shard->engine);
+  return 0;
+}
+
+/* Run func over args on up to count threads; the caller runs the first */
+void run_parallel(ThreadFunc *func, void *args, size_t arg_size, int count) {
+  Thread *threads = (Thread *)calloc(count, sizeof(Thread));
+  int *started = (int *)calloc(count, sizeof(int));
+  for (int i = 1; i < count; i++)
+    started[i] =
+        thread_start(&threads[i], func, (char *)args + i * arg_size) == 0;
+  func(args);
+  for (int i = 1; i < count; i++) {
+    if (started[i])
+      thread_join(threads[i]);
+    else
+      func((char *)args + i * arg_size);  // Could not spawn; run inline
+  }
+  free(started);
+  free(threads);
+}
+
+void merge_shards(SearchEngine *engine, IndexShard *shards, int count) {
+  if (count < 2)
+    return;
+
+  // Phase 1: documents, in shard order
+  for (int s = 1; s < count; s++) {
+    SearchEngine *shard = shards[s].engine;
+    shards[s].doc_base = engine->doc_count;
+    for (int d = 0; d < shard->doc_count; d++) {
+      add_document(engine,
+                   shard->doc_names.data + shard->documents[d].name_offset);
+      get_document(engine, engine->doc_count - 1)->word_count =
+          shard->documents[d].word_count;
+    }
+    engine->total_words += shard->total_words;
+    shards[s].target = engine;
+    shards[s].targets = (TrieNode **)calloc(shard->hash_table.capacity,
+                                            sizeof(TrieNode *));
+  }
+
+  // Phase 2: dictionary
+  run_parallel(resolve_terms_worker, shards, sizeof(IndexShard), count);
+
+  MergeTask *tasks = (MergeTask *)calloc(count, sizeof(MergeTask));
+  for (int p = 0; p < count; p++) {
+    tasks[p].shards = shards;
+    tasks[p].shard_count = count;
+    tasks[p].part = (uint32_t)p;
+    tasks[p].parts = (uint32_t)count;
+  }
+
+  // 2b: root children are shared, so create the missing ones up front
+  for (int s = 1; s < count; s++) {
+    HashTable *table = &shards[s].engine->hash_table;
+    for (int b = 0; b < 256; b++) {
+      int i = shards[s].first_miss[b];
+      if (i < 0 || trie_child(engine->trie_root, (unsigned char)b, NULL))
+        continue;
+      const char *word = table->pool.data + table->slots[i].word_offset;
+      shards[s].targets[i] = merge_new_term(engine, &engine->arena, word,
+                                            &tasks[b % count].added);
+    }
+  }
+  run_parallel(insert_terms_worker, tasks, sizeof(MergeTask), count);
+
+  // 2d: the hash table is shared too
+  for (int p = 0; p < count; p++) {
+    NewTerms *added = &tasks[p].added;
+    for (int t = 0; t < added->count; t++)
+      hash_insert(engine, added->words[t], added->nodes[t]);
+    free(added->words);
+    free(added->nodes);
+  }
+
+  // Phase 3: postings
+  run_parallel(merge_postings_worker, tasks, sizeof(MergeTask), count);
+  run_parallel(merge_bounds_worker, tasks, sizeof(MergeTask), count);
+  for (int p = 0; p < count; p++)
+    arena_adopt(&engine->arena, &tasks[p].arena);
+  free(tasks);
+  TrieNode *root = engine->trie_root;
+  for (int i = 0; i < root->child_count; i++)
+    if (root->children[i]->best_freq > root->best_freq)
+      root->best_freq = root->children[i]->best_freq;
+
+  // Phase 4: shard 0 is the target itself
+  shards[0].engine = NULL;
+  run_parallel(free_shard_worker, shards, sizeof(IndexShard), count);
+}
+
+/*
+ * Index every regular file under dir into engine on threads workers
+ * (0 = one per CPU). Files are indexed in path order, so doc_ids do not
+ * depend on the thread count. Returns the number of documents added, or -1
+ * if dir cannot be read; *skipped gets the files that could not be opened.
+ */
+int index_directory(SearchEngine *engine, const char *dir, int threads,
+                    int *skipped) {
+  FileList list = {0};
+  if (list_files(dir, &list) < 0)
+    return -1;
+  qsort(list.files, list.count, sizeof(FileEntry), compare_file_entries);
+
+  if (threads <= 0)
+    threads = cpu_count();
+  if (threads > list.count)
+    threads = list.count;
+  if (threads < 1)
+    threads = 1;
+
+  uint64_t total = 0;
+  for (int i = 0; i < list.count; i++)
+    total += list.files[i].size;
+
+  // Contiguous ranges of about total / threads bytes each
+  IndexShard *shards = (IndexShard *)calloc(threads, sizeof(IndexShard));
+  int next = 0;
+  uint64_t seen = 0;
+  for (int s = 0; s < threads; s++) {
+    uint64_t goal = total / threads * (s + 1);
+    int first = next;
+    // Leave at least one file for each remaining shard
+    int last = list.count - (threads - s - 1);
+    if (s == threads - 1)
+      next = list.count;
+    else
+      while (next < last && (next == first || seen < goal))
+        seen += list.files[next++].size;
+    shards[s].engine = s == 0 ? engine : create_search_engine();
+    shards[s].engine->stop_words = engine->stop_words;
+    shards[s].files = list.files + first;
+    shards[s].file_count = next - first;
+  }
+
+  int before = engine->doc_count;
+  run_parallel(index_shard_worker, shards, sizeof(IndexShard), threads);
+  merge_shards(engine, shards, threads);
+
+  *skipped = 0;
+  for (int s = 0; s < threads; s++)
+    *skipped += shards[s].skipped;
+  free(shards);
+  for (int i = 0; i < list.count; i++)
+    free(list.files[i].path);
+  free(list.files);
+  return engine->doc_count - before;
+}
+
+/* ==================== SEGMENTS ==================== */
+
+/*
+ * An index directory holds immutable segment files, each an index file over
+ * the next contiguous range of doc_ids, plus two small files:
+ *
+ *   segments  the commit: "MSESEGMENTS <next number>", then one
+ *             "<number> <doc_base> <doc_count>" line per segment file
+ *             segment_<number>.idx, in doc_id order
+ *   deletes   append-only log of deleted doc_ids (uint32_t, host order)
+ *
+ * New documents go to the in-memory segment, which flush_segment writes out
+ * as a new segment file once it holds FLUSH_WORDS words (or when asked);
+ * the commit is then replaced by rename, so a crash loses at most the
+ * unflushed documents. Deleting a document sets its tombstone bit and logs
+ * it; queries skip tombstoned postings and merges drop them. Doc_ids never
+ * change, so tombstones stay valid across flushes and merges. Term
+ * statistics (total_freq, doc_freq) count deleted documents until a merge
+ * drops their postings.
+ *
+ * Merge policy: segments fall into tiers by file size, each MERGE_FACTOR
+ * times larger than the one below (everything under MERGE_FLOOR bytes is
+ * tier 0). Once MERGE_FACTOR adjacent segments share a tier, a background
+ * thread merges them into one segment of the next tier, which replaces them
+ * when the thread is done. A document is rewritten once per tier, so an
+ * update costs about the size of the delta rather than of the corpus. One
+ * merge runs at a time.
+ *
+ * An engine without an index directory keeps the same structure in memory:
+ * flushes and merges produce index images on the heap instead of files,
+ * and nothing is committed.
+ */
+
+typedef struct SegmentMerge {
+  SearchEngine *view;  // Private engine over the input segments
+  int first;           // Inputs are segments[first .. first + count - 1]
+  int count;
+  uint32_t number;  // Output segment file, with an index directory
+  char *path;       // Its path, or NULL to merge into an index image
+  Thread thread;
+  Mutex lock;  // Guards done and output
+  int done;
+  MappedIndex *output;  // The merged segment, NULL if the merge failed
+} SegmentMerge;
+
+typedef struct IndexDir {
+  char *path;
+  uint32_t next_number;            // For the next segment file
+  uint32_t numbers[MAX_SEGMENTS];  // File number of each engine segment
+  FILE *deletes;                   // Tombstone log, opened on first use
+} IndexDir;
+
+void index_dir_path(const IndexDir *dir, const char *name, char *out,
+                    size_t size) {
+  snprintf(out, size, "%s/%s", dir->path, name);
+}
+
+void segment_path(const IndexDir *dir, uint32_t number, char *out,
+                  size_t size) {
+  snprintf(out, size, "%s/segment_%06u.idx", dir->path, number);
+}
+
+/* Replace the commit file with the engine's current segments */
+int commit_index_dir(SearchEngine *engine) {
+  const IndexDir *dir = engine->dir;
+  char path[4096], tmp_path[4096];
+  index_dir_path(dir, "segments", path, sizeof(path));
+  index_dir_path(dir, "segments.tmp", tmp_path, sizeof(tmp_path));
+  FILE *file = fopen(tmp_path, "w");
+  if (!file)
+    return -1;
+  fprintf(file, "MSESEGMENTS %u\n", dir->next_number);
+  for (int s = 0; s < engine->segment_count; s++) {
+    const IndexHeader *h = engine->segments[s]->header;
+    fprintf(file, "%u %u %u\n", dir->numbers[s], h->doc_base, h->doc_count);
+  }
+  int ok = !ferror(file);
+  ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+  if (ok)
+    remove(path);
+#endif
+  if (ok && rename(tmp_path, path) == 0)
+    return 0;
+  remove(tmp_path);
+  return -1;
+}
+
+/* Rewrite the tombstone log from the bitmap */
+int rewrite_deletes(SearchEngine *engine) {
+  IndexDir *dir = engine->dir;
+  char path[4096], tmp_path[4096];
+  index_dir_path(dir, "deletes", path, sizeof(path));
+  index_dir_path(dir, "deletes.tmp", tmp_path, sizeof(tmp_path));
+  if (dir->deletes) {
+    fclose(dir->deletes);
+    dir->deletes = NULL;
+  }
+  FILE *file = fopen(tmp_path, "wb");
+  if (!file)
+    return -1;
+  int ok = 1;
+  for (int id = 0; id < engine->doc_count && ok; id++) {
+    uint32_t value = (uint32_t)id;
+    if (document_deleted(engine, id))
+      ok = fwrite(&value, sizeof(value), 1, file) == 1;
+  }
+  ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+  if (ok)
+    remove(path);
+#endif
+  if (ok && rename(tmp_path, path) == 0)
+    return 0;
+  remove(tmp_path);
+  return -1;
+}
+
+/* Set doc_id's tombstone bit; returns 1 if it was live, 0 if already
+ * deleted, -1 for an unknown id */
+int mark_deleted(SearchEngine *engine, int doc_id) {
+  if (doc_id < 0 || doc_id >= engine->doc_count)
+    return -1;
+  if (document_deleted(engine, doc_id))
+    return 0;
+  size_t word = (size_t)doc_id / 64;
+  if (word >= engine->deleted_cap) {
+    size_t cap = engine->deleted_cap ? engine->deleted_cap * 2 : 16;
+    while (cap <= word)
+      cap *= 2;
+    uint64_t *bits = (uint64_t *)realloc(engine->deleted, cap * 8);
+    if (!bits)
+      return -1;
+    memset(bits + engine->deleted_cap, 0, (cap - engine->deleted_cap) * 8);
+    engine->deleted = bits;
+    engine->deleted_cap = cap;
+  }
+  engine->deleted[word] |= 1ull << doc_id % 64;
+  engine->deleted_count++;
+  engine->deleted_words += (uint64_t)document_word_count(engine, doc_id);
+  engine->generation++;
+  return 1;
+}
+
+/* Delete a document, logging it if the engine has an index directory;
+ * returns as mark_deleted */
+int delete_document(SearchEngine *engine, int doc_id) {
+  int result = mark_deleted(engine, doc_id);
+  IndexDir *dir = engine->dir;
+  if (result == 1 && dir) {
+    if (!dir->deletes) {
+      char path[4096];
+      index_dir_path(dir, "deletes", path, sizeof(path));
+      dir->deletes = fopen(path, "ab");
+    }
+    uint32_t value = (uint32_t)doc_id;
+    if (dir->deletes) {
+      fwrite(&value, sizeof(value), 1, dir->deletes);
+      fflush(dir->deletes);
+    }
+  }
+  return result;
+}
+
+/* Drop the in-memory segment once it is safely in a segment file */
+void reset_memory_segment(SearchEngine *engine) {
+  arena_free(&engine->arena);
+  hash_free(&engine->hash_table);
+  memset(&engine->hash_table, 0, sizeof(engine->hash_table));
+  hash_init(&engine->hash_table);
+  engine->trie_root = create_trie_node(&engine->arena, "", 0);
+  engine->doc_base = engine->doc_count;
+  engine->doc_names.len = 0;
+  engine->total_words = 0;
+}
+
+/* Tier of a segment under the merge policy */
+int merge_tier(const MappedIndex *idx) {
+  int tier = 0;
+  for (size_t size = idx->size; size >= MERGE_FLOOR; size /= MERGE_FACTOR)
+    tier++;
+  return tier;
+}
+
+/* The newest run of MERGE_FACTOR adjacent segments in one tier (any newest
+ * MERGE_FACTOR with force); returns its length, or 0 if there is none */
+int merge_pick(const SearchEngine *engine, int force, int *first) {
+  for (int i = engine->segment_count - MERGE_FACTOR; i >= 0; i--) {
+    int tier = merge_tier(engine->segments[i]), k = 1;
+    while (k < MERGE_FACTOR && merge_tier(engine->segments[i + k]) == tier)
+      k++;
+    if (k == MERGE_FACTOR) {
+      *first = i;
+      return MERGE_FACTOR;
+    }
+  }
+  if (force && engine->segment_count >= MERGE_FACTOR) {
+    *first = engine->segment_count - MERGE_FACTOR;
+    return MERGE_FACTOR;
+  }
+  return 0;
+}
+
+THREAD_FUNC merge_worker(void *arg) {
+  SegmentMerge *merge = (SegmentMerge *)arg;
+  SearchEngine *view = merge->view;
+  int first_doc = (int)view->segments[0]->header->doc_base;
+  MappedIndex *output;
+  if (merge->path)
+    output = write_index(view, merge->path, first_doc, 0) >= 0
+                 ? map_index(merge->path)
+                 : NULL;
+  else
+    output = image_index(view, first_doc);
+  mutex_lock(&merge->lock);
+  merge->output = output;
+  merge->done = 1;
+  mutex_unlock(&merge->lock);
+  return 0;
+}
+
+void free_segment_merge(SegmentMerge *merge) {
+  free_search_engine(merge->view);
+  mutex_destroy(&merge->lock);
+  free(merge->path);
+  free(merge);
+}
+
+/* Start merging what the policy picks; returns 1 if a merge started */
+int merge_start(SearchEngine *engine, int force) {
+  IndexDir *dir = engine->dir;
+  int first, count;
+  if (engine->merge || !(count = merge_pick(engine, force, &first)))
+    return 0;
+
+  // The inputs are immutable, and the tombstones are copied, so the thread
+  // shares nothing the engine still changes
+  SearchEngine *view = create_search_engine();
+  for (int k = 0; k < count; k++) {
+    view->segments[k] = engine->segments[first + k];
+    view->segments[k]->refs++;
+  }
+  view->segment_count = count;
+  const IndexHeader *last = view->segments[count - 1]->header;
+  view->doc_base = (int)(last->doc_base + last->doc_count);
+  view->doc_count = view->doc_base;
+  view->bitmap_terms = engine->bitmap_terms;
+  if (engine->deleted_cap > 0) {
+    view->deleted = (uint64_t *)malloc(engine->deleted_cap * 8);
+    if (view->deleted) {
+      memcpy(view->deleted, engine->deleted, engine->deleted_cap * 8);
+      view->deleted_cap = engine->deleted_cap;
+    }
+  }
+
+  SegmentMerge *merge = (SegmentMerge *)calloc(1, sizeof(SegmentMerge));
+  merge->view = view;
+  merge->first = first;
+  merge->count = count;
+  mutex_init(&merge->lock);
+  if (dir) {
+    char path[4096];
+    merge->number = dir->next_number++;
+    segment_path(dir, merge->number, path, sizeof(path));
+    merge->path = strdup(path);
+  }
+  if ((engine->deleted_cap > 0 && !view->deleted) ||
+      thread_start(&merge->thread, merge_worker, merge) != 0) {
+    free_segment_merge(merge);
+    return 0;
+  }
+  engine->merge = merge;
+  return 1;
+}
+
+/* Swap a finished merge in for its inputs; with wait, block until the
+ * running merge is done */
+void merge_finish(SearchEngine *engine, int wait) {
+  IndexDir *dir = engine->dir;
+  SegmentMerge *merge = engine->merge;
+  if (!merge)
+    return;
+  if (!wait) {
+    mutex_lock(&merge->lock);
+    int done = merge->done;
+    mutex_unlock(&merge->lock);
+    if (!done)
+      return;
+  }
+  thread_join(merge->thread);
+  engine->merge = NULL;
+  MappedIndex *idx = merge->output;
+  if (!idx) {
+    if (merge->path)
+      remove(merge->path);
+    free_segment_merge(merge);
+    return;
+  }
+
+  MappedIndex *inputs[MAX_SEGMENTS];
+  uint32_t numbers[MAX_SEGMENTS];
+  int first = merge->first, count = merge->count;
+  int total = engine->segment_count;
+  memcpy(inputs, engine->segments, total * sizeof(MappedIndex *));
+  engine->segments[first] = idx;
+  for (int s = first + count; s < total; s++)
+    engine->segments[s - count + 1] = inputs[s];
+  engine->segment_count = total - count + 1;
+  if (dir) {
+    memcpy(numbers, dir->numbers, total * sizeof(uint32_t));
+    dir->numbers[first] = merge->number;
+    for (int s = first + count; s < total; s++)
+      dir->numbers[s - count + 1] = numbers[s];
+  }
+
+  if (dir && commit_index_dir(engine) < 0) {
+    memcpy(engine->segments, inputs, total * sizeof(MappedIndex *));
+    memcpy(dir->numbers, numbers, total * sizeof(uint32_t));
+    engine->segment_count = total;
+    idx->unlink_path = merge->path;
+    merge->path = NULL;
+    release_index(idx);
+    free_segment_merge(merge);
+    return;
+  }
+  free_segment_merge(merge);
+
+  // Versions readers still hold may use the inputs; the last one to let go
+  // unmaps them and removes their files
+  for (int k = first; k < first + count; k++) {
+    if (dir) {
+      char path[4096];
+      segment_path(dir, numbers[k], path, sizeof(path));
+      inputs[k]->unlink_path = strdup(path);
+    }
+    release_index(inputs[k]);
+  }
+  engine->generation++;
+}
+
+/* Install a finished merge and start the next one the policy wants */
+void merge_step(SearchEngine *engine) {
+  merge_finish(engine, 0);
+  merge_start(engine, 0);
+}
+
+/* Seal the in-memory segment: write it to the index directory, or to an
+ * index image without one. Returns the segment count, or -1 */
+int flush_segment(SearchEngine *engine) {
+  IndexDir *dir = engine->dir;
+  merge_finish(engine, 0);
+  if (engine->doc_count == engine->doc_base)
+    return engine->segment_count;
+  if (engine->segment_count == MAX_SEGMENTS) {
+    merge_start(engine, 1);
+    merge_finish(engine, 1);
+    if (engine->segment_count == MAX_SEGMENTS)
+      return -1;
+  }
+
+  char path[4096];
+  MappedIndex *idx;
+  if (dir) {
+    segment_path(dir, dir->next_number, path, sizeof(path));
+    if (write_index(engine, path, engine->doc_base, 0) < 0)
+      return -1;
+    idx = map_index(path);
+    if (!idx) {
+      remove(path);
+      return -1;
+    }
+    dir->numbers[engine->segment_count] = dir->next_number++;
+  } else {
+    idx = image_index(engine, engine->doc_base);
+    if (!idx)
+      return -1;
+  }
+  engine->segments[engine->segment_count++] = idx;
+  if (dir && commit_index_dir(engine) < 0) {
+    engine->segments[--engine->segment_count] = NULL;
+    unmap_index(idx);
+    remove(path);
+    return -1;
+  }
+
+  reset_memory_segment(engine);
+  engine->generation++;
+  merge_start(engine, 0);
+  return engine->segment_count;
+}
+
+/* Flush once the in-memory segment has grown past FLUSH_WORDS */
+void flush_if_full(SearchEngine *engine) {
+  if (engine->total_words >= FLUSH_WORDS)
+    flush_segment(engine);
+}
+
+/* Detach the index directory */
+void close_index_dir(SearchEngine *engine) {
+  IndexDir *dir = engine->dir;
+  if (!dir)
+    return;
+  if (dir->deletes)
+    fclose(dir->deletes);
+  free(dir->path);
+  free(dir);
+  engine->dir = NULL;
+}
+
+/* Read the commit and map its segments; returns 0 or -1 */
+int read_index_dir(SearchEngine *engine, FILE *commit) {
+  IndexDir *dir = engine->dir;
+  if (fscanf(commit, "MSESEGMENTS %u", &dir->next_number) != 1)
+    return -1;
+  uint32_t number, base, count;
+  while (fscanf(commit, "%u %u %u", &number, &base, &count) == 3) {
+    if (engine->segment_count == MAX_SEGMENTS ||
+        base != (uint32_t)engine->doc_count || number >= dir->next_number)
+      return -1;
+    char path[4096];
+    segment_path(dir, number, path, sizeof(path));
+    MappedIndex *idx = map_index(path);
+    if (!idx)
+      return -1;
+    dir->numbers[engine->segment_count] = number;
+    engine->segments[engine->segment_count++] = idx;
+    if (idx->header->doc_base != base || idx->header->doc_count != count)
+      return -1;
+    engine->doc_count = (int)(base + count);
+  }
+  return feof(commit) ? 0 : -1;
+}
+
+/* Replay the tombstone log, dropping ids no segment holds (documents that
+ * were deleted before they were flushed) and any torn tail */
+void read_deletes(SearchEngine *engine) {
+  char path[4096];
+  index_dir_path(engine->dir, "deletes", path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return;
+  uint32_t id;
+  size_t n;
+  int stale = 0;
+  while ((n = fread(&id, 1, sizeof(id), file)) == sizeof(id))
+    if (mark_deleted(engine, id <= INT_MAX ? (int)id : -1) < 0)
+      stale = 1;
+  fclose(file);
+  if (stale || n != 0)
+    rewrite_deletes(engine);
+}
+
+/*
+ * Attach an empty engine to the index directory at path, mapping its
+ * segments and replaying its tombstones. With create, a directory without
+ * a commit is started empty. Returns the document count, or -1.
+ */
+int open_index_dir(SearchEngine *engine, const char *path, int create) {
+  if (engine->doc_count > 0 || engine->segment_count > 0 || engine->dir)
+    return -1;
+
+  IndexDir *dir = (IndexDir *)calloc(1, sizeof(IndexDir));
+  dir->path = strdup(path);
+  engine->dir = dir;
+
+  char commit_path[4096];
+  index_dir_path(dir, "segments", commit_path, sizeof(commit_path));
+  FILE *commit = fopen(commit_path, "r");
+  int ok;
+  if (commit) {
+    ok = read_index_dir(engine, commit) == 0;
+    fclose(commit);
+  } else if (create) {
+    // An existing directory is fine; the commit write reports real errors
+#ifdef _WIN32
+    CreateDirectoryA(path, NULL);
+#else
+    mkdir(path, 0777);
+#endif
+    ok = commit_index_dir(engine) == 0;
+  } else {
+    ok = 0;
+  }
+
+  if (!ok) {
+    close_index_dir(engine);
+    for (int s = 0; s < engine->segment_count; s++)
+      release_index(engine->segments[s]);
+    engine->segment_count = 0;
+    engine->doc_count = 0;
+    return -1;
+  }
+  engine->doc_base = engine->doc_count;
+  read_deletes(engine);
+  return engine->doc_count;
+}
+
+/* Load path into an empty engine, as an index directory if it is one and
+ * as a standalone index file otherwise */
+int open_index(SearchEngine *engine, const char *path) {
+  int docs = load_index(engine, path);
+  return docs >= 0 ? docs : open_index_dir(engine, path, 0);
+}
+
+/* ==================== SNAPSHOTS ==================== */
+
+/*
+ * Reader threads query immutable versions of the engine while the writer
+ * keeps indexing. A version is a read-only engine over the writer's
+ * segments and a copy of its tombstones; the in-memory segment is left out,
+ * so snapshot_refresh first seals it into a segment and then publishes the
+ * new version with a single pointer store.
+ *
+ * Reclamation is epoch based. A reader stores the global epoch in its slot
+ * before loading the current version and clears the slot when done, so
+ * acquiring and releasing are a few atomic loads and stores that never
+ * wait. A replaced version is tagged with the epoch the writer moves past
+ * when retiring it; once every busy slot shows a later epoch, no reader can
+ * still hold it, and the writer frees it along with the segments no other
+ * version (or the writer) references. Segment references are only counted
+ * by the writer, in publish and reclaim.
+ *
+ * Slot 0 belongs to the writer thread, for its own queries.
+ */
+
+typedef struct EngineVersion {
+  SearchEngine *view;
+  uint64_t retired_epoch;      // Global epoch when it was replaced
+  struct EngineVersion *next;  // In the retired list
+} EngineVersion;
+
+typedef struct ReaderSlot {
+  volatile uint64_t epoch;  // Epoch the reader entered in; 0 while idle
+  char pad[56];             // One slot per cache line
+} ReaderSlot;
+
+struct Snapshots {
+  void *volatile current;         // EngineVersion readers acquire
+  volatile uint64_t epoch;        // Starts at 1
+  volatile uint64_t reader_count; // Slots handed out
+  uint64_t published;             // Engine generation of current
+  EngineVersion *retired;         // Replaced, not yet freed
+  ReaderSlot readers[MAX_READERS];
+};
+
+/* A read-only engine over the segments, with the tombstones they need */
+SearchEngine *snapshot_view(SearchEngine *engine) {
+  SearchEngine *view = create_search_engine();
+  for (int s = 0; s < engine->segment_count; s++) {
+    view->segments[s] = engine->segments[s];
+    view->segments[s]->refs++;
+  }
+  view->segment_count = engine->segment_count;
+  view->doc_base = engine->doc_base;
+  view->doc_count = engine->doc_base;
+  view->stop_words = engine->stop_words;
+
+  size_t words = ((size_t)engine->doc_base + 63) / 64;
+  if (words > engine->deleted_cap)
+    words = engine->deleted_cap;
+  if (words > 0) {
+    view->deleted = (uint64_t *)malloc(words * 8);
+    if (!view->deleted) {
+      free_search_engine(view);
+      return NULL;
+    }
+    memcpy(view->deleted, engine->deleted, words * 8);
+    if (engine->doc_base % 64 && words == (size_t)engine->doc_base / 64 + 1)
+      view->deleted[words - 1] &= (1ull << engine->doc_base % 64) - 1;
+    view->deleted_cap = words;
+  }
+  view->deleted_count = engine->deleted_count;
+  view->deleted_words = engine->deleted_words;
+  for (int id = engine->doc_base; id < engine->doc_count; id++) {
+    if (document_deleted(engine, id)) {
+      view->deleted_count--;
+      view->deleted_words -= (uint64_t)document_word_count(engine, id);
+    }
+  }
+  view->generation = engine->generation;
+  return view;
+}
+
+/* Free the retired versions no reader can still hold */
+void snapshot_reclaim(Snapshots *snap) {
+  uint64_t oldest = UINT64_MAX;
+  uint64_t readers = atomic_load_u64(&snap->reader_count);
+  for (uint64_t r = 0; r < readers && r < MAX_READERS; r++) {
+    uint64_t epoch = atomic_load_u64(&snap->readers[r].epoch);
+    if (epoch != 0 && epoch < oldest)
+      oldest = epoch;
+  }
+  EngineVersion **link = &snap->retired;
+  while (*link) {
+    EngineVersion *version = *link;
+    if (version->retired_epoch < oldest) {
+      *link = version->next;
+      free_search_engine(version->view);
+      free(version);
+    } else {
+      link = &version->next;
+    }
+  }
+}
+
+/* Make the engine's segments and tombstones the current version; returns
+ * 0 or -1 */
+int snapshot_publish(SearchEngine *engine) {
+  Snapshots *snap = engine->snapshots;
+  SearchEngine *view = snapshot_view(engine);
+  EngineVersion *version =
+      view ? (EngineVersion *)calloc(1, sizeof(EngineVersion)) : NULL;
+  if (!version) {
+    if (view)
+      free_search_engine(view);
+    return -1;
+  }
+  version->view = view;
+
+  EngineVersion *old =
+      (EngineVersion *)atomic_exchange_ptr(&snap->current, version);
+  snap->published = engine->generation;
+  if (old) {
+    // Readers that enter from now on see the new version
+    old->retired_epoch = atomic_add_u64(&snap->epoch, 1);
+    old->next = snap->retired;
+    snap->retired = old;
+  }
+  snapshot_reclaim(snap);
+  return 0;
+}
+
+/* Seal what the writer indexed and publish it if anything changed since
+ * the current version; returns 0 or -1 */
+int snapshot_refresh(SearchEngine *engine) {
+  Snapshots *snap = engine->snapshots;
+  if (!snap) {
+    snap = (Snapshots *)calloc(1, sizeof(Snapshots));
+    if (!snap)
+      return -1;
+    snap->epoch = 1;
+    snap->reader_count = 1;
+    engine->snapshots = snap;
+  }
+  if (engine->doc_count > engine->doc_base && flush_segment(engine) < 0)
+    return -1;
+  if (snap->current && snap->published == engine->generation)
+    return 0;
+  return snapshot_publish(engine);
+}
+
+/* Claim a reader slot for the calling thread; returns it, or -1 */
+int snapshot_reader(Snapshots *snap) {
+  uint64_t slot = atomic_add_u64(&snap->reader_count, 1);
+  return slot < MAX_READERS ? (int)slot : -1;
+}
+
+/* The engine's versions, refreshed, with reader slots 1 .. readers claimed
+ * for threads of a caller's own; NULL if publishing fails */
+Snapshots *snapshot_readers(SearchEngine *engine, int readers) {
+  if (snapshot_refresh(engine) < 0)
+    return NULL;
+  Snapshots *snap = engine->snapshots;
+  while (atomic_load_u64(&snap->reader_count) <= (uint64_t)readers)
+    snapshot_reader(snap);
+  return snap;
+}
+
+/* The current version, which stays valid until snapshot_release, or NULL
+ * before the first publish */
+SearchEngine *snapshot_acquire(Snapshots *snap, int reader) {
+  atomic_store_u64(&snap->readers[reader].epoch,
+                   atomic_load_u64(&snap->epoch));
+  EngineVersion *version = (EngineVersion *)atomic_load_ptr(&snap->current);
+  return version ? version->view : NULL;
+}
+
+void snapshot_release(Snapshots *snap, int reader) {
+  atomic_store_u64(&snap->readers[reader].epoch, 0);
+}
+
+/* Free every version; no reader may still hold one */
+void free_snapshots(Snapshots *snap) {
+  if (!snap)
+    return;
+  EngineVersion *current = (EngineVersion *)snap->current;
+  if (current) {
+    current->next = snap->retired;
+    snap->retired = current;
+  }
+  while (snap->retired) {
+    EngineVersion *version = snap->retired;
+    snap->retired = version->next;
+    free_search_engine(version->view);
+    free(version);
+  }
+  free(snap);
+}
+
+/* Wait for a running merge, drop the published versions and the index
+ * directory, and free the engine */
+void close_engine(SearchEngine *engine) {
+  merge_finish(engine, 1);
+  free_snapshots(engine->snapshots);
+  close_index_dir(engine);
+  free_search_engine(engine);
+}
+
+/* ==================== INTERSECTION ==================== */
+
+/*
+ * AND queries intersect terms rarest first, so the work tracks the rarest
+ * term rather than the corpus: its postings become the candidate list, and
+ * each further term filters it. A term at most DENSE_RATIO times longer
+ * than the candidates is decoded and merged with a SIMD lower-bound scan;
+ * a longer one is probed per candidate through its skip entries.
+ */
+#define DENSE_RATIO 16
+
+/* Decoded postings, in doc_id order */
+typedef struct PostingArray {
+  uint32_t *docs;
+  uint32_t *freqs;
+  uint32_t count;
+} PostingArray;
+
+/* Decode up to cap postings; cap bounds the work on a corrupt doc_freq */
+void posting_array_load(SearchEngine *engine, const TermRef *ref,
+                        uint32_t cap, PostingArray *out) {
+  out->docs = (uint32_t *)malloc((cap + 1) * sizeof(uint32_t));
+  out->freqs = (uint32_t *)malloc((cap + 1) * sizeof(uint32_t));
+  out->count = 0;
+  PostingIter it;
+  posting_iter_init(engine, ref, &it);
+  int doc_id, frequency;
+  while (out->count < cap && posting_next(&it, &doc_id, &frequency)) {
+    out->docs[out->count] = (uint32_t)doc_id;
+    out->freqs[out->count] = (uint32_t)frequency;
+    out->count++;
+  }
+}
+
+void posting_array_free(PostingArray *array) {
+  free(array->docs);
+  free(array->freqs);
+}
+
+/* Index of the first of values[from..n) that is >= key, or n */
+uint32_t lower_bound_from(const uint32_t *values, uint32_t n, uint32_t from,
+                          uint32_t key) {
+  uint32_t i = from;
+#ifdef HAVE_SSE2
+  // SSE2 only compares signed lanes; flipping the top bit orders unsigned
+  const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+  const __m128i below = _mm_set1_epi32((int)((key - 1) ^ 0x80000000u));
+  while (key > 0 && i + 4 <= n) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+    __m128i ge = _mm_cmpgt_epi32(_mm_xor_si128(v, bias), below);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(ge));
+    if (mask) {
+      while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+      }
+      return i;
+    }
+    i += 4;
+  }
+#endif
+  while (i < n && values[i] < key)
+    i++;
+  return i;
+}
+
+/* A term's decoded postings in shared, decoding them on first use; shared
+ * queries of a batch reuse them */
+const PostingArray *posting_array_shared(SearchEngine *engine,
+                                         const TermRef *ref, uint32_t cap,
+                                         PostingArray *shared) {
+  if (!shared->docs)
+    posting_array_load(engine, ref, cap, shared);
+  return shared;
+}
+
+/* Keep the candidates that term also contains, adding its frequency */
+void intersect_dense(SearchEngine *engine, const TermRef *ref,
+                     uint32_t cap, PostingArray *shared, PostingArray *cand) {
+  PostingArray loaded = {NULL, NULL, 0};
+  const PostingArray *other = &loaded;
+  if (shared)
+    other = posting_array_shared(engine, ref, cap, shared);
+  else
+    posting_array_load(engine, ref, cap, &loaded);
+  uint32_t kept = 0, j = 0;
+  for (uint32_t i = 0; i < cand->count && j < other->count; i++) {
+    j = lower_bound_from(other->docs, other->count, j, cand->docs[i]);
+    if (j < other->count && other->docs[j] == cand->docs[i]) {
+      cand->docs[kept] = cand->docs[i];
+      cand->freqs[kept] = cand->freqs[i] + other->freqs[j];
+      kept++;
+    }
+  }
+  cand->count = kept;
+  posting_array_free(&loaded);
+}
+
+void intersect_sparse(SearchEngine *engine, const TermRef *ref,
+                      PostingArray *cand) {
+  PostingIter it;
+  posting_iter_init(engine, ref, &it);
+  uint32_t kept = 0;
+  int doc_id = -1, frequency = 0;
+  for (uint32_t i = 0; i < cand->count; i++) {
+    int target = (int)cand->docs[i];
+    if (doc_id < target && !posting_advance(&it, target, &doc_id, &frequency))
+      break;
+    if (doc_id == target) {
+      cand->docs[kept] = cand->docs[i];
+      cand->freqs[kept] = cand->freqs[i] + (uint32_t)frequency;
+      kept++;
+    }
+  }
+  cand->count = kept;
+}
+
+/*
+ * Documents containing every term, ascending, with summed frequencies.
+ * shared, if not NULL, holds per term NULL or a PostingArray that the
+ * term's postings are decoded into if they need decoding at all, and read
+ * from if already there. The caller frees the result with
+ * posting_array_free.
+ */
+void intersect_terms(SearchEngine *engine, const TermRef *terms,
+                     PostingArray *const *shared, int count,
+                     PostingArray *result) {
+  int order[MAX_QUERY_TERMS];
+  uint32_t df[MAX_QUERY_TERMS];
+  for (int i = 0; i < count; i++) {
+    // No valid list is longer than the document table
+    df[i] = term_doc_freq(engine, &terms[i]);
+    if (df[i] > (uint32_t)engine->doc_count)
+      df[i] = (uint32_t)engine->doc_count;
+    int j = i;
+    while (j > 0 && df[order[j - 1]] > df[i]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+
+  int first = order[0];
+  PostingArray *first_shared = shared ? shared[first] : NULL;
+  if (first_shared) {
+    const PostingArray *docs =
+        posting_array_shared(engine, &terms[first], df[first], first_shared);
+    result->docs = (uint32_t *)malloc((docs->count + 1) * sizeof(uint32_t));
+    result->freqs = (uint32_t *)malloc((docs->count + 1) * sizeof(uint32_t));
+    memcpy(result->docs, docs->docs, docs->count * sizeof(uint32_t));
+    memcpy(result->freqs, docs->freqs, docs->count * sizeof(uint32_t));
+    result->count = docs->count;
+  } else {
+    posting_array_load(engine, &terms[first], df[first], result);
+  }
+  for (int k = 1; k < count && result->count > 0; k++) {
+    int t = order[k];
+    if (df[t] / DENSE_RATIO <= result->count)
+      intersect_dense(engine, &terms[t], df[t], shared ? shared[t] : NULL,
+                      result);
+    else
+      intersect_sparse(engine, &terms[t], result);
+  }
+}
+
+/* ==================== PHRASES ==================== */
+
+/*
+ * Phrase and proximity queries first intersect their terms' documents like
+ * AND queries, without reading a single position. Each term then gets an
+ * iterator that seeks to those documents alone and decodes only their
+ * positions, and per document the position lists are merged.
+ *
+ * A phrase matches wherever its words sit at their offsets from the first
+ * one. A proximity query with distance k matches wherever one occurrence of
+ * each word fits in k + 1 consecutive positions, in any order. A document's
+ * frequency is its number of matches.
+ */
+#define NEAR_DISTANCE 8  // Proximity distance when the query gives none
+
+typedef struct PositionList {
+  uint32_t *values;  // Ascending
+  uint32_t count;
+  uint32_t cap;
+} PositionList;
+
+/* Decode the positions of the posting it just returned; returns 0 if
+ * memory runs out */
+int position_list_load(PostingIter *it, PositionList *list) {
+  const unsigned char *start;
+  uint32_t len = posting_positions(it, &start);
+  // Every varint takes a byte at least, which bounds a corrupt frequency
+  if (len > list->cap) {
+    uint32_t *grown =
+        (uint32_t *)realloc(list->values, (size_t)len * sizeof(uint32_t));
+    if (!grown)
+      return 0;
+    list->values = grown;
+    list->cap = len;
+  }
+  list->count = positions_decode(start, start + len, len, list->values);
+  return 1;
+}
+
+/* Phrase matches, driven by the word with the fewest positions */
+uint32_t phrase_matches(const PositionList *lists, const int *offsets,
+                        int count) {
+  int rare = 0;
+  for (int i = 1; i < count; i++)
+    if (lists[i].count < lists[rare].count)
+      rare = i;
+
+  uint32_t next[MAX_QUERY_TERMS] = {0}, matches = 0;
+  for (uint32_t r = 0; r < lists[rare].count; r++) {
+    uint32_t position = lists[rare].values[r];
+    if (position < (uint32_t)offsets[rare])
+      continue;
+    uint32_t start = position - (uint32_t)offsets[rare];
+    int matched = 1;
+    for (int i = 0; i < count && matched; i++) {
+      if (i == rare)
+        continue;
+      uint32_t target = start + (uint32_t)offsets[i];
+      const PositionList *list = &lists[i];
+      while (next[i] < list->count && list->values[next[i]] < target)
+        next[i]++;
+      if (next[i] == list->count)
+        return matches;  // No later start can match this word
+      matched = list->values[next[i]] == target;
+    }
+    matches += matched;
+  }
+  return matches;
+}
+
+/* Windows of at most distance + 1 positions holding every word: each step
+ * looks at the window from the lowest current position to the highest,
+ * then moves the lowest on */
+uint32_t near_matches(const PositionList *lists, int count,
+                      uint32_t distance) {
+  uint32_t next[MAX_QUERY_TERMS] = {0}, matches = 0;
+  for (int i = 0; i < count; i++)
+    if (lists[i].count == 0)
+      return 0;
+  for (;;) {
+    int low = 0;
+    uint32_t high = lists[0].values[next[0]];
+    for (int i = 1; i < count; i++) {
+      uint32_t value = lists[i].values[next[i]];
+      if (value < lists[low].values[next[low]])
+        low = i;
+      if (value > high)
+        high = value;
+    }
+    matches += high - lists[low].values[next[low]] <= distance;
+    if (++next[low] == lists[low].count)
+      return matches;
+  }
+}
+
+/* Split a phrase into normalized words and their offsets from the first
+ * one. Tokens are counted the way the tokenizer counts them, so one too
+ * short to index, or a stop word, still holds its place; returns the
+ * number of words */
+int parse_phrase(const char *query, const StopWords *stop_words,
+                 char words[][MAX_WORD_LEN], int offsets[]) {
+  const unsigned char *p = (const unsigned char *)query;
+  int count = 0, position = 0, first = 0;
+  while (count < MAX_QUERY_TERMS) {
+    while (*p && token_delims[*p])
+      p++;
+    if (!*p)
+      break;
+    int raw_len = 0, len = 0, non_ascii = 0;
+    for (; !token_delims[*p]; p++) {
+      if (raw_len < MAX_WORD_LEN - 1) {
+        raw_len++;
+        if ((unsigned)((*p | 0x20) - 'a') < 26) {
+          words[count][len++] = (char)(*p | 0x20);
+        } else if (*p >= 0x80) {
+          words[count][len++] = (char)*p;
+          non_ascii = 1;
+        }
+      }
+    }
+    if (non_ascii)
+      len = fold_word(words[count], len);
+    words[count][len] = '\0';
+    if (word_indexable(words[count], len) &&
+        !is_stop_word(stop_words, words[count])) {
+      if (count == 0)
+        first = position;
+      offsets[count++] = position - first;
+    }
+    position++;
+  }
+  return count;
+}
+
+/*
+ * Documents where the terms match as a phrase at offsets, or, with
+ * offsets NULL, within distance of each other, ascending, with their match
+ * counts. shared is as for intersect_terms. The caller frees the result
+ * with posting_array_free.
+ */
+void match_positions(SearchEngine *engine, const TermRef *terms,
+                     PostingArray *const *shared, int count,
+                     const int *offsets, uint32_t distance,
+                     PostingArray *result) {
+  intersect_terms(engine, terms, shared, count, result);
+
+  PostingIter its[MAX_QUERY_TERMS];
+  PositionList lists[MAX_QUERY_TERMS];
+  int current[MAX_QUERY_TERMS];
+  for (int i = 0; i < count; i++) {
+    posting_iter_init(engine, &terms[i], &its[i]);
+    memset(&lists[i], 0, sizeof(lists[i]));
+    current[i] = -1;
+  }
+
+  uint32_t kept = 0;
+  for (uint32_t c = 0; c < result->count; c++) {
+    int target = (int)result->docs[c], loaded = 1, frequency;
+    for (int i = 0; i < count && loaded; i++) {
+      if (current[i] < target &&
+          !posting_advance(&its[i], target, &current[i], &frequency))
+        current[i] = INT_MAX;
+      loaded = current[i] == target && position_list_load(&its[i], &lists[i]);
+    }
+    uint32_t matches = 0;
+    if (loaded)
+      matches = offsets ? phrase_matches(lists, offsets, count)
+                        : near_matches(lists, count, distance);
+    if (matches > 0) {
+      result->docs[kept] = result->docs[c];
+      result->freqs[kept] = matches;
+      kept++;
+    }
+  }
+  result->count = kept;
+
+  for (int i = 0; i < count; i++)
+    free(lists[i].values);
+}
+
+/* ==================== RANKING ==================== */
+
+/*
+ * BM25 top-K retrieval over the OR of the query terms, evaluated document
+ * at a time with MaxScore. Terms are sorted by their score upper bound; once
+ * the K-th best score beats the summed bounds of the weakest terms, those
+ * terms become non-essential: they can no longer place a document on their
+ * own, so candidates come only from the essential terms and the rest are
+ * probed (through their skip entries) only while the candidate can still
+ * make the top K.
+ *
+ * Documents rank by their score as reported, in ten-thousandths, then by
+ * doc_id, and a score sums its terms in query order. Shards scoring with
+ * the same corpus statistics then give each document the same score as
+ * one engine would, and a coordinator merging their top K on the reported
+ * scores and doc_ids gets the single engine's top K.
+ */
+#ifndef BM25_K1
+#define BM25_K1 1.2  // Term frequency saturation
+#endif
+#ifndef BM25_B
+#define BM25_B 0.75  // Document length normalization
+#endif
+#define RANK_TOP_K 10
+
+/* Corpus statistics behind the scores. An engine holding one shard of a
+ * corpus is given the whole corpus's, so that every shard scores a
+ * document as a single engine holding all of them would. */
+typedef struct RankStats {
+  double doc_count;
+  double avg_len;
+} RankStats;
+
+typedef struct RankCursor {
+  PostingIter it;
+  int doc_id;  // Current posting; INT_MAX once exhausted
+  int frequency;
+  double idf;
+  double max_score;  // Upper bound of this term's contribution
+  int term;          // Position in the query, the order scores sum in
+} RankCursor;
+
+typedef struct ScoredDoc {
+  double score;
+  int doc_id;
+} ScoredDoc;
+
+/* Words in all of the engine's documents, deleted ones included */
+uint64_t indexed_word_count(const SearchEngine *engine) {
+  uint64_t words = engine->total_words;
+  for (int s = 0; s < engine->segment_count; s++)
+    words += engine->segments[s]->header->total_words;
+  return words;
+}
+
+/* Words in the engine's live documents */
+uint64_t live_word_count(const SearchEngine *engine) {
+  return indexed_word_count(engine) - engine->deleted_words;
+}
+
+RankStats make_rank_stats(double doc_count, double words) {
+  RankStats stats;
+  stats.doc_count = doc_count;
+  stats.avg_len = doc_count > 0 ? words / doc_count : 0;
+  if (stats.avg_len <= 0)
+    stats.avg_len = 1;
+  return stats;
+}
+
+/*
+ * Every document, deleted ones included, as doc_freq counts them until a
+ * merge drops their postings: a live count could fall below doc_freq and
+ * turn the idf negative
+ */
+RankStats rank_stats(SearchEngine *engine) {
+  return make_rank_stats(engine->doc_count,
+                         (double)indexed_word_count(engine));
+}
+
+/* Never negative, even for statistics a coordinator got wrong: MaxScore
+ * needs bounds that only grow as terms are added */
+double bm25_idf(const RankStats *stats, uint32_t doc_freq) {
+  double doc_count = stats->doc_count > doc_freq ? stats->doc_count : doc_freq;
+  return log(1 + (doc_count - doc_freq + 0.5) / (doc_freq + 0.5));
+}
+
+/* A score as reported, to the nearest ten-thousandth */
+double reported_score(double score) {
+  return floor(score * 10000.0 + 0.5) / 10000.0;
+}
+
+double bm25_tf(const RankStats *stats, double frequency, double word_count) {
+  return frequency * (BM25_K1 + 1) /
+         (frequency +
+          BM25_K1 * (1 - BM25_B + BM25_B * word_count / stats->avg_len));
+}
+
+/*
+ * Largest bm25_tf over postings whose frequency is at most max_freq and
+ * whose word_count / frequency is at least min_len_ratio. bm25_tf grows
+ * with frequency and shrinks with the ratio, so the bound is both extremes
+ * at once.
+ */
+double bm25_tf_bound(const RankStats *stats, double max_freq,
+                     double min_len_ratio) {
+  if (max_freq <= 0)
+    return 0;
+  return (BM25_K1 + 1) /
+         (1 + BM25_K1 * ((1 - BM25_B) / max_freq +
+                         BM25_B * min_len_ratio / stats->avg_len));
+}
+
+/* Upper bound of a term's tf factor across the mapped and memory lists */
+double term_tf_bound(const SearchEngine *engine, const RankStats *stats,
+                     const TermRef *ref) {
+  double bound = 0;
+  for (int s = 0; s < engine->segment_count; s++) {
+    const IndexTerm *term = ref->mapped[s];
+    if (!term)
+      continue;
+    double mapped = bm25_tf_bound(stats, term->max_freq, term->min_len_ratio);
+    if (mapped > bound)
+      bound = mapped;
+  }
+  if (ref->node) {
+    // No length is kept per list; a document is at least as long as the
+    // term's frequency in it, so the ratio is at least 1
+    int max_freq = ref->node->max_freq;
+    if (ref->node->postings.last_freq > max_freq)
+      max_freq = ref->node->postings.last_freq;
+    double memory = bm25_tf_bound(stats, max_freq, 1);
+    if (memory > bound)
+      bound = memory;
+  }
+  return bound * (1 + 1e-9);  // Headroom for rounding in the real scores
+}
+
+void rank_cursor_next(RankCursor *cursor) {
+  if (!posting_next(&cursor->it, &cursor->doc_id, &cursor->frequency))
+    cursor->doc_id = INT_MAX;
+}
+
+void rank_cursor_advance(RankCursor *cursor, int target) {
+  if (cursor->doc_id < target &&
+      !posting_advance(&cursor->it, target, &cursor->doc_id,
+                       &cursor->frequency))
+    cursor->doc_id = INT_MAX;
+}
+
+/* Heap order: lower score first, and the higher doc_id among equals */
+int scored_worse(const ScoredDoc *a, const ScoredDoc *b) {
+  return a->score < b->score || (a->score == b->score && a->doc_id > b->doc_id);
+}
+
+/* Keep the k best in a min-heap; returns 1 if doc made it in */
+int top_k_push(ScoredDoc *heap, int *size, int k, ScoredDoc doc) {
+  int i;
+  if (*size < k) {
+    i = (*size)++;
+    while (i > 0 && scored_worse(&doc, &heap[(i - 1) / 2])) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+  } else if (scored_worse(&heap[0], &doc)) {
+    i = 0;
+    for (;;) {
+      int child = 2 * i + 1;
+      if (child >= k)
+        break;
+      if (child + 1 < k && scored_worse(&heap[child + 1], &heap[child]))
+        child++;
+      if (!scored_worse(&heap[child], &doc))
+        break;
+      heap[i] = heap[child];
+      i = child;
+    }
+  } else {
+    return 0;
+  }
+  heap[i] = doc;
+  return 1;
+}
+
+int compare_scored_desc(const void *a, const void *b) {
+  const ScoredDoc *x = (const ScoredDoc *)a, *y = (const ScoredDoc *)b;
+  if (scored_worse(x, y))
+    return 1;
+  return scored_worse(y, x) ? -1 : 0;
+}
+
+int compare_rank_cursors(const void *a, const void *b) {
+  double x = ((const RankCursor *)a)->max_score;
+  double y = ((const RankCursor *)b)->max_score;
+  return (x > y) - (x < y);
+}
+
+/*
+ * The k best documents for terms by BM25, best first, into results
+ * (room for k). Returns how many were found. global, if not NULL, holds
+ * the corpus statistics to score with and doc_freqs the terms' document
+ * counts in that corpus; otherwise the engine's own are used.
+ */
+int rank_terms(SearchEngine *engine, const TermRef *terms, int count, int k,
+               const RankStats *global, const uint32_t *doc_freqs,
+               ScoredDoc *results) {
+  RankStats stats = global ? *global : rank_stats(engine);
+  RankCursor cursors[MAX_QUERY_TERMS];
+  double prefix[MAX_QUERY_TERMS];  // Summed bounds of cursors[0..i]
+  for (int i = 0; i < count; i++) {
+    RankCursor *c = &cursors[i];
+    posting_iter_init(engine, &terms[i], &c->it);
+    c->idf = bm25_idf(&stats, global ? doc_freqs[i]
+                                     : term_doc_freq(engine, &terms[i]));
+    c->max_score = c->idf * term_tf_bound(engine, &stats, &terms[i]);
+    c->term = i;
+    rank_cursor_next(c);
+  }
+  qsort(cursors, count, sizeof(RankCursor), compare_rank_cursors);
+  for (int i = 0; i < count; i++)
+    prefix[i] = cursors[i].max_score + (i > 0 ? prefix[i - 1] : 0);
+
+  int size = 0;
+  double threshold = 0;  // Score to beat once the heap is full
+  int essential = 0;     // cursors[essential..] supply the candidates
+  while (k > 0 && essential < count) {
+    int doc_id = INT_MAX;
+    for (int i = essential; i < count; i++)
+      if (cursors[i].doc_id < doc_id)
+        doc_id = cursors[i].doc_id;
+    if (doc_id == INT_MAX)
+      break;
+
+    double word_count = document_word_count(engine, doc_id);
+    double score = 0, part[MAX_QUERY_TERMS];
+    for (int i = essential; i < count; i++) {
+      part[i] = 0;
+      if (cursors[i].doc_id == doc_id) {
+        part[i] = cursors[i].idf *
+                  bm25_tf(&stats, cursors[i].frequency, word_count);
+        score += part[i];
+        rank_cursor_next(&cursors[i]);
+      }
+    }
+    int i = essential - 1;
+    for (; i >= 0; i--) {
+      if (score + prefix[i] <= threshold)
+        break;  // Cannot reach the top k any more
+      part[i] = 0;
+      rank_cursor_advance(&cursors[i], doc_id);
+      if (cursors[i].doc_id == doc_id) {
+        part[i] = cursors[i].idf *
+                  bm25_tf(&stats, cursors[i].frequency, word_count);
+        score += part[i];
+      }
+    }
+    if (i >= 0)
+      continue;
+
+    // Sum in query order, so a score depends neither on which terms were
+    // essential when its document came up nor on the engine's own bounds
+    double by_term[MAX_QUERY_TERMS];
+    for (int j = 0; j < count; j++)
+      by_term[cursors[j].term] = part[j];
+    score = 0;
+    for (int j = 0; j < count; j++)
+      score += by_term[j];
+    // A document below the threshold cannot round above it, so the
+    // pruning above still holds
+    ScoredDoc doc = {reported_score(score), doc_id};
+    if (top_k_push(results, &size, k, doc) && size == k) {
+      threshold = results[0].score;
+      while (essential < count && prefix[essential] <= threshold)
+        essential++;
+    }
+  }
+
+  qsort(results, size, sizeof(ScoredDoc), compare_scored_desc);
+  return size;
+}
+
+/* ==================== COMPLETION ==================== */
+
+/*
+ * Frequency-ranked prefix completion. Trie nodes cache best_freq and the
+ * index file carries a max tree over term frequencies, so both are walked
+ * best-first: the frontier pops words in final order, and a walk that has
+ * produced K words never looks at the rest of the subtree.
+ */
+#define PREFIX_TOP_K 100
+
+typedef struct Completion {
+  char word[MAX_WORD_LEN];
+  int frequency;
+} Completion;
+
+/* Frontier entry: a subtree still to expand, or one word to report */
+typedef struct CompletionEntry {
+  uint32_t bound;        // No word reachable from here is more frequent
+  uint32_t key;          // Trie: path offset in paths; index: first term
+  uint32_t slot;         // Index: max tree slot, a single term from leaves
+  const TrieNode *node;  // Trie: subtree to expand, NULL for a word
+} CompletionEntry;
+
+typedef struct CompletionWalk {
+  CompletionEntry *heap;
+  int count;
+  int cap;
+  StringPool paths;           // Trie walks: the path of every entry
+  const MappedIndex *mapped;  // Set for index walks
+  uint32_t leaves;
+} CompletionWalk;
+
+/*
+ * Pop order: higher bound first, then the earlier word. A subtree's path
+ * (or first term) comes no later than any word inside it, so no word is
+ * popped ahead of one that outranks it.
+ */
+int completion_before(const CompletionWalk *walk, const CompletionEntry *a,
+                      const CompletionEntry *b) {
+  if (a->bound != b->bound)
+    return a->bound > b->bound;
+  if (walk->mapped)
+    return a->key < b->key;
+  return strcmp(walk->paths.data + a->key, walk->paths.data + b->key) < 0;
+}
+
+void completion_push(CompletionWalk *walk, CompletionEntry entry) {
+  if (walk->count == walk->cap) {
+    walk->cap = walk->cap ? walk->cap * 2 : 64;
+    walk->heap = (CompletionEntry *)realloc(
+        walk->heap, walk->cap * sizeof(CompletionEntry));
+  }
+  int i = walk->count++;
+  while (i > 0 && completion_before(walk, &entry, &walk->heap[(i - 1) / 2])) {
+    walk->heap[i] = walk->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  walk->heap[i] = entry;
+}
+
+CompletionEntry completion_pop(CompletionWalk *walk) {
+  CompletionEntry top = walk->heap[0];
+  CompletionEntry last = walk->heap[--walk->count];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= walk->count)
+      break;
+    if (child + 1 < walk->count &&
+        completion_before(walk, &walk->heap[child + 1], &walk->heap[child]))
+      child++;
+    if (!completion_before(walk, &walk->heap[child], &last))
+      break;
+    walk->heap[i] = walk->heap[child];
+    i = child;
+  }
+  if (walk->count > 0)
+    walk->heap[i] = last;
+  return top;
+}
+
+void trie_walk_push(CompletionWalk *walk, const TrieNode *node,
+                    const char *path) {
+  CompletionEntry entry = {(uint32_t)node->best_freq,
+                           pool_add(&walk->paths, path), 0, node};
+  completion_push(walk, entry);
+}
+
+void index_walk_push(CompletionWalk *walk, uint32_t slot) {
+  uint32_t first = slot;
+  while (first < walk->leaves)
+    first *= 2;
+  CompletionEntry entry = {walk->mapped->freq_tree[slot], first - walk->leaves,
+                           slot, NULL};
+  completion_push(walk, entry);
+}
+
+/* Walk the words below node, whose path from the root is path */
+void trie_walk_init(CompletionWalk *walk, const TrieNode *node,
+                    const char *path) {
+  memset(walk, 0, sizeof(*walk));
+  if (node->best_freq > 0)
+    trie_walk_push(walk, node, path);
+}
+
+/* Position just past the last term from lo on that starts with prefix */
+uint32_t index_prefix_end(const MappedIndex *idx, uint32_t lo,
+                          const char *prefix) {
+  size_t len = strlen(prefix);
+  uint32_t hi = idx->header->term_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strncmp(index_string(idx, idx->terms[mid].word_offset), prefix,
+                len) == 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Walk the mapped terms starting with prefix, from the tree slots that
+ * exactly cover their range */
+void index_walk_init(CompletionWalk *walk, const MappedIndex *idx,
+                     const char *prefix) {
+  memset(walk, 0, sizeof(*walk));
+  walk->mapped = idx;
+  walk->leaves = (uint32_t)freq_tree_leaves(idx->header->term_count);
+  uint32_t lo = index_lower_bound(idx, prefix);
+  uint64_t l = (uint64_t)lo + walk->leaves;
+  uint64_t r = (uint64_t)index_prefix_end(idx, lo, prefix) + walk->leaves;
+  for (; l < r; l /= 2, r /= 2) {
+    if (l & 1) {
+      if (idx->freq_tree[l] > 0)
+        index_walk_push(walk, (uint32_t)l);
+      l++;
+    }
+    if (r & 1) {
+      r--;
+      if (idx->freq_tree[r] > 0)
+        index_walk_push(walk, (uint32_t)r);
+    }
+  }
+}
+
+/* Next word in rank order; *word stays valid until the walk moves on */
+int completion_next(CompletionWalk *walk, const char **word, int *frequency) {
+  while (walk->count > 0) {
+    CompletionEntry entry = completion_pop(walk);
+
+    if (walk->mapped) {
+      if (entry.slot >= walk->leaves) {
+        *word = index_string(walk->mapped,
+                             walk->mapped->terms[entry.key].word_offset);
+        *frequency = (int)entry.bound;
+        return 1;
+      }
+      for (uint32_t c = 2 * entry.slot; c <= 2 * entry.slot + 1; c++)
+        if (walk->mapped->freq_tree[c] > 0)
+          index_walk_push(walk, c);
+      continue;
+    }
+
+    const TrieNode *node = entry.node;
+    if (!node) {
+      *word = walk->paths.data + entry.key;
+      *frequency = (int)entry.bound;
+      return 1;
+    }
+
+    // The pool may move as children are added, so extend a copy
+    char path[MAX_WORD_LEN];
+    size_t len = strlen(walk->paths.data + entry.key);
+    memcpy(path, walk->paths.data + entry.key, len);
+    if (node->is_end && node->total_freq > 0) {
+      CompletionEntry self = {(uint32_t)node->total_freq, entry.key, 0, NULL};
+      completion_push(walk, self);
+    }
+    for (int i = 0; i < node->child_count; i++) {
+      const TrieNode *child = node->children[i];
+      if (child->best_freq <= 0 || len + child->label_len >= MAX_WORD_LEN)
+        continue;
+      memcpy(path + len, child->label, child->label_len);
+      path[len + child->label_len] = '\0';
+      trie_walk_push(walk, child, path);
+    }
+  }
+  return 0;
+}
+
+void completion_walk_free(CompletionWalk *walk) {
+  free(walk->heap);
+  free(walk->paths.data);
+}
+
+/* Place word in rank order among the best limit kept so far */
+void completion_insert(Completion *out, int *count, int limit,
+                       const char *word, int frequency) {
+  int i = *count;
+  if (i == limit) {
+    const Completion *worst = &out[limit - 1];
+    if (frequency < worst->frequency ||
+        (frequency == worst->frequency && strcmp(word, worst->word) >= 0))
+      return;
+    i--;
+  } else {
+    (*count)++;
+  }
+  while (i > 0 && (frequency > out[i - 1].frequency ||
+                   (frequency == out[i - 1].frequency &&
+                    strcmp(word, out[i - 1].word) < 0))) {
+    out[i] = out[i - 1];
+    i--;
+  }
+  strncpy(out[i].word, word, MAX_WORD_LEN - 1);
+  out[i].word[MAX_WORD_LEN - 1] = '\0';
+  out[i].frequency = frequency;
+}
+
+/*
+ * The limit most frequent words starting with prefix, ties in word order;
+ * returns how many were found. A word in several segments (or in a segment
+ * and in memory) counts their sum, which no single walk sees, so the walks
+ * are merged the way the threshold algorithm does: every word met is
+ * looked up in full, and pulling stops once the K-th total outranks what
+ * an unseen word could still reach, the sum of the walks' latest
+ * frequencies.
+ */
+int complete_prefix(SearchEngine *engine, const char *prefix, int limit,
+                    Completion *out) {
+  CompletionWalk walks[MAX_SEGMENTS + 1];
+  int walk_count = 0;
+  for (int s = 0; s < engine->segment_count; s++)
+    index_walk_init(&walks[walk_count++], engine->segments[s], prefix);
+  char path[MAX_WORD_LEN];
+  int path_len;
+  TrieNode *node = trie_find_prefix(engine->trie_root, prefix, path, &path_len);
+  if (node)
+    trie_walk_init(&walks[walk_count++], node, path);
+
+  // A walk with nothing below the prefix adds nothing to any total
+  int live[MAX_SEGMENTS + 1], live_count = 0;
+  for (int s = 0; s < walk_count; s++)
+    if (walks[s].count > 0)
+      live[live_count++] = s;
+
+  const char *word;
+  int frequency, count = 0;
+  if (live_count == 1) {
+    while (count < limit &&
+           completion_next(&walks[live[0]], &word, &frequency))
+      completion_insert(out, &count, limit, word, frequency);
+  } else if (live_count > 1) {
+    char latest[MAX_SEGMENTS + 1][MAX_WORD_LEN];
+    int latest_freq[MAX_SEGMENTS + 1], done[MAX_SEGMENTS + 1] = {0};
+    int open = live_count;
+    while (open > 0) {
+      for (int s = 0; s < live_count; s++) {
+        if (done[s])
+          continue;
+        if (!completion_next(&walks[live[s]], &word, &frequency)) {
+          done[s] = 1;
+          open--;
+          continue;
+        }
+        strncpy(latest[s], word, MAX_WORD_LEN - 1);
+        latest[s][MAX_WORD_LEN - 1] = '\0';
+        latest_freq[s] = frequency;
+
+        int seen = 0;
+        for (int i = 0; i < count && !seen; i++)
+          seen = strcmp(out[i].word, latest[s]) == 0;
+        TermRef ref;
+        if (!seen && lookup_term(engine, latest[s], &ref))
+          completion_insert(out, &count, limit, latest[s], ref.total_freq);
+      }
+
+      // An unseen word trails every open walk's latest word, so it can
+      // only tie the threshold by sorting after the latest of them
+      int threshold = 0;
+      const char *last = "";
+      for (int s = 0; s < live_count; s++) {
+        if (done[s])
+          continue;
+        threshold += latest_freq[s];
+        if (strcmp(latest[s], last) > 0)
+          last = latest[s];
+      }
+      if (count == limit) {
+        const Completion *worst = &out[limit - 1];
+        if (worst->frequency > threshold ||
+            (worst->frequency == threshold && strcmp(worst->word, last) <= 0))
+          break;
+      }
+    }
+  }
+
+  for (int s = 0; s < walk_count; s++)
+    completion_walk_free(&walks[s]);
+  return count;
+}
+
+/* ==================== FUZZY MATCHING ==================== */
+
+/*
+ * Words within a small edit distance of a query word, where an edit inserts,
+ * deletes or replaces a byte or swaps two adjacent ones (the usual typos).
+ * The Levenshtein automaton for the query is run over the vocabulary as it
+ * is spelled out: its state after a prefix is the row of edit distances
+ * from that prefix to each prefix of the query, of which only the 2k + 1
+ * cells around the diagonal can stay within distance k, so each character
+ * costs O(k). A subtree is dropped as soon as every cell of its row exceeds
+ * k. The in-memory trie is walked edge by edge; a segment's sorted terms
+ * form the same trie implicitly, each child a range of terms found by
+ * binary search on its next character.
+ */
+#define FUZZY_MAX_DISTANCE 2
+#define FUZZY_TOP_K 10
+
+typedef struct FuzzyMatch {
+  char word[MAX_WORD_LEN];
+  int distance;
+  int frequency;
+  uint32_t doc_count;
+} FuzzyMatch;
+
+typedef struct FuzzyWalk {
+  const char *query;
+  int query_len;
+  int max_distance;
+  char path[MAX_WORD_LEN];
+  uint8_t rows[MAX_WORD_LEN][MAX_WORD_LEN];  // Per depth, its band only
+  FuzzyMatch *matches;
+  int count;
+  int cap;
+} FuzzyWalk;
+
+/* Edits allowed for a query word of len bytes: none for the shortest, one
+ * up to five bytes, then two */
+int fuzzy_auto_distance(size_t len) {
+  return len < 3 ? 0 : len < 6 ? 1 : FUZZY_MAX_DISTANCE;
+}
+
+/* Fill the row for depth from the ones above after reading c (already in
+ * path); returns its lowest cell. Cells off any band are never read, as
+ * they exceed k. */
+int fuzzy_step(FuzzyWalk *walk, int depth, unsigned char c) {
+  const uint8_t *above = walk->rows[depth - 1];
+  uint8_t *row = walk->rows[depth];
+  int k = walk->max_distance, m = walk->query_len;
+  int lo = depth > k ? depth - k : 0;
+  int hi = depth + k < m ? depth + k : m;
+  int best = k + 1;
+  for (int j = lo; j <= hi; j++) {
+    int cost = j == 0 ? depth
+                      : above[j - 1] + ((unsigned char)walk->query[j - 1] != c);
+    if (j < depth + k && above[j] + 1 < cost)
+      cost = above[j] + 1;
+    if (j > lo && row[j - 1] + 1 < cost)
+      cost = row[j - 1] + 1;
+    if (j > 1 && depth > 1 && (unsigned char)walk->query[j - 2] == c &&
+        walk->query[j - 1] == walk->path[depth - 2] &&
+        walk->rows[depth - 2][j - 2] + 1 < cost)
+      cost = walk->rows[depth - 2][j - 2] + 1;
+    row[j] = (uint8_t)(cost <= k ? cost : k + 1);
+    if (row[j] < best)
+      best = row[j];
+  }
+  return best;
+}
+
+/* Note the word spelled to depth if it is within the distance */
+void fuzzy_visit_word(FuzzyWalk *walk, int depth) {
+  int m = walk->query_len, k = walk->max_distance;
+  if (depth - m > k || m - depth > k || walk->rows[depth][m] > k)
+    return;
+  if (walk->count == walk->cap) {
+    int cap = walk->cap ? walk->cap * 2 : 64;
+    FuzzyMatch *grown =
+        (FuzzyMatch *)realloc(walk->matches, cap * sizeof(FuzzyMatch));
+    if (!grown)
+      return;
+    walk->matches = grown;
+    walk->cap = cap;
+  }
+  FuzzyMatch *match = &walk->matches[walk->count++];
+  memcpy(match->word, walk->path, depth);
+  match->word[depth] = '\0';
+  match->distance = walk->rows[depth][m];
+}
+
+void fuzzy_walk_trie(FuzzyWalk *walk, const TrieNode *node, int depth) {
+  if (node->is_end && node->total_freq > 0)
+    fuzzy_visit_word(walk, depth);
+  for (int i = 0; i < node->child_count; i++) {
+    const TrieNode *child = node->children[i];
+    int end = depth, alive = 1;
+    for (int l = 0; l < child->label_len && alive; l++) {
+      if (end + 1 >= MAX_WORD_LEN)
+        break;
+      walk->path[end++] = child->label[l];
+      alive = fuzzy_step(walk, end, (unsigned char)child->label[l]) <=
+              walk->max_distance;
+    }
+    if (alive && end == depth + child->label_len)
+      fuzzy_walk_trie(walk, child, end);
+  }
+}
+
+/* Byte depth of a term's word, or 0 past its end: a corrupt file can hold
+ * terms out of order or shorter than the prefix the walk assumes */
+unsigned char index_word_byte(const MappedIndex *idx, const IndexTerm *term,
+                              int depth) {
+  const char *word = index_string(idx, term->word_offset);
+  for (int i = 0; i < depth; i++)
+    if (word[i] == '\0')
+      return 0;
+  return (unsigned char)word[depth];
+}
+
+/* Walk terms lo .. hi - 1 of a segment, which share their first depth
+ * bytes */
+void fuzzy_walk_index(FuzzyWalk *walk, const MappedIndex *idx, uint32_t lo,
+                      uint32_t hi, int depth) {
+  const IndexTerm *terms = idx->terms;
+  if (index_word_byte(idx, &terms[lo], depth) == 0) {
+    if (terms[lo].total_freq > 0)
+      fuzzy_visit_word(walk, depth);
+    lo++;
+  }
+  while (lo < hi) {
+    unsigned char c = index_word_byte(idx, &terms[lo], depth);
+    // Past the last term whose byte at depth is c
+    uint32_t end = lo + 1, top = hi;
+    while (end < top) {
+      uint32_t mid = end + (top - end) / 2;
+      if (index_word_byte(idx, &terms[mid], depth) <= c)
+        end = mid + 1;
+      else
+        top = mid;
+    }
+    if (depth + 1 < MAX_WORD_LEN) {
+      walk->path[depth] = (char)c;
+      if (fuzzy_step(walk, depth + 1, c) <= walk->max_distance)
+        fuzzy_walk_index(walk, idx, lo, end, depth + 1);
+    }
+    lo = end;
+  }
+}
+
+int fuzzy_match_word_order(const void *a, const void *b) {
+  return strcmp(((const FuzzyMatch *)a)->word, ((const FuzzyMatch *)b)->word);
+}
+
+/* Rank order: nearer, then more frequent, then the earlier word */
+int fuzzy_before(const FuzzyMatch *a, const FuzzyMatch *b) {
+  if (a->distance != b->distance)
+    return a->distance < b->distance;
+  if (a->frequency != b->frequency)
+    return a->frequency > b->frequency;
+  return strcmp(a->word, b->word) < 0;
+}
+
+/* Place match in rank order among the best limit kept so far */
+void fuzzy_insert(FuzzyMatch *out, int *count, int limit,
+                  const FuzzyMatch *match) {
+  int i = *count;
+  if (i == limit) {
+    if (!fuzzy_before(match, &out[limit - 1]))
+      return;
+    i--;
+  } else {
+    (*count)++;
+  }
+  while (i > 0 && fuzzy_before(match, &out[i - 1])) {
+    out[i] = out[i - 1];
+    i--;
+  }
+  out[i] = *match;
+}
+
+/*
+ * The limit words closest to word (normalized) within max_distance edits,
+ * nearest first, then the most frequent; returns how many were found.
+ * Each source is walked on its own and a word met in several of them is
+ * counted once, with its total frequency over all of them.
+ */
+int fuzzy_search(SearchEngine *engine, const char *word, int max_distance,
+                 int limit, FuzzyMatch *out) {
+  int m = (int)strlen(word);
+  FuzzyWalk *walk = (FuzzyWalk *)calloc(1, sizeof(FuzzyWalk));
+  if (!walk || m == 0) {
+    free(walk);
+    return 0;
+  }
+  walk->query = word;
+  walk->query_len = m;
+  walk->max_distance = max_distance;
+  for (int j = 0; j <= m && j <= max_distance; j++)
+    walk->rows[0][j] = (uint8_t)j;
+
+  fuzzy_walk_trie(walk, engine->trie_root, 0);
+  for (int s = 0; s < engine->segment_count; s++)
+    if (engine->segments[s]->header->term_count > 0)
+      fuzzy_walk_index(walk, engine->segments[s], 0,
+                       engine->segments[s]->header->term_count, 0);
+
+  if (walk->count > 1)
+    qsort(walk->matches, walk->count, sizeof(FuzzyMatch),
+          fuzzy_match_word_order);
+  int count = 0;
+  for (int i = 0; i < walk->count; i++) {
+    FuzzyMatch *match = &walk->matches[i];
+    TermRef term;
+    if ((i > 0 && strcmp(match->word, walk->matches[i - 1].word) == 0) ||
+        !lookup_term(engine, match->word, &term) || term.total_freq <= 0)
+      continue;
+    // Documents with the word, deleted ones included until a merge
+    match->frequency = term.total_freq;
+    match->doc_count = term_doc_freq(engine, &term);
+    if (match->doc_count > (uint32_t)engine->doc_count)
+      match->doc_count = (uint32_t)engine->doc_count;
+    fuzzy_insert(out, &count, limit, match);
+  }
+
+  free(walk->matches);
+  free(walk);
+  return count;
+}
+
+/* ==================== SHARED TERMS ==================== */
+
+/*
+ * The queries of a batch look each distinct term up once, in a table
+ * filled before the first of them runs. A term that several of them may
+ * read in full is decoded only once too, by whichever needs it first.
+ */
+typedef struct SharedTerm {
+  char word[MAX_WORD_LEN];  // Empty for a free slot
+  int uses;                 // Queries that may read all its postings
+  int looked_up;
+  int found;
+  TermRef ref;
+  PostingArray postings;    // Decoded on first use when uses > 1
+} SharedTerm;
+
+typedef struct TermTable {
+  SharedTerm *slots;
+  uint32_t cap;  // Power of two
+  uint32_t count;
+} TermTable;
+
+/* The slot holding word, or the free slot where it belongs */
+SharedTerm *term_table_slot(const TermTable *table, const char *word) {
+  uint32_t mask = table->cap - 1;
+  for (uint32_t i = hash_func(word) & mask;; i = (i + 1) & mask) {
+    SharedTerm *slot = &table->slots[i];
+    if (!slot->word[0] || strcmp(slot->word, word) == 0)
+      return slot;
+  }
+}
+
+/* Note that a query names word, reading all its postings if scans; returns
+ * -1 if memory runs out */
+int term_table_add(TermTable *table, const char *word, int scans) {
+  if (!word[0])
+    return 0;
+  if ((table->count + 1) * 2 > table->cap) {
+    TermTable grown = {NULL, table->cap ? table->cap * 2 : 64, table->count};
+    grown.slots = (SharedTerm *)calloc(grown.cap, sizeof(SharedTerm));
+    if (!grown.slots)
+      return -1;
+    for (uint32_t i = 0; i < table->cap; i++)
+      if (table->slots[i].word[0])
+        *term_table_slot(&grown, table->slots[i].word) = table->slots[i];
+    free(table->slots);
+    *table = grown;
+  }
+  SharedTerm *slot = term_table_slot(table, word);
+  if (!slot->word[0]) {
+    strcpy(slot->word, word);
+    table->count++;
+  }
+  slot->uses += scans;
+  return 0;
+}
+
+void term_table_free(TermTable *table) {
+  for (uint32_t i = 0; i < table->cap; i++)
+    posting_array_free(&table->slots[i].postings);
+  free(table->slots);
+}
+
+/*
+ * lookup_term through table, if any: a noted word is looked up once. With
+ * shared, also sets *shared to where the term's postings are decoded for
+ * the batch, or NULL where a query should read them itself.
+ */
+int query_term(SearchEngine *engine, TermTable *table, const char *word,
+               TermRef *ref, PostingArray **shared) {
+  SharedTerm *slot = table && table->cap ? term_table_slot(table, word)
+                                         : NULL;
+  if (shared)
+    *shared = NULL;
+  if (!slot || !slot->word[0])
+    return lookup_term(engine, word, ref);
+  if (!slot->looked_up) {
+    slot->found = lookup_term(engine, word, &slot->ref);
+    slot->looked_up = 1;
+  }
+  *ref = slot->ref;
+  if (shared && slot->found && slot->uses > 1)
+    *shared = &slot->postings;
+  return slot->found;
+}
+
+/* ==================== DOCUMENT SETS ==================== */
+
+/*
+ * Roaring-style sets of doc_ids, for terms too common to walk a posting at
+ * a time. Ids are split by their high 16 bits into containers: one with at
+ * most SET_ARRAY_MAX members is a sorted array of their low 16 bits, a
+ * fuller one a bitmap of all 65536. AND, OR and AND NOT go a container
+ * pair at a time, between two bitmaps a vector of words at a time, and a
+ * result container switches representation as it crosses SET_ARRAY_MAX,
+ * so no container takes more than 8 kB.
+ */
+#define SET_ARRAY_MAX 4096
+#define SET_BITMAP_WORDS 1024  // uint64_t words in a bitmap container
+#define SET_AND 0
+#define SET_OR 1
+#define SET_ANDNOT 2
+
+typedef struct SetContainer {
+  uint32_t key;      // High 16 bits of its doc_ids
+  uint32_t count;    // Members
+  uint16_t *values;  // Array container: ascending low bits
+  uint64_t *words;   // Bitmap container, or NULL
+} SetContainer;
+
+typedef struct DocSet {
+  SetContainer *containers;  // Ascending by key
+  uint32_t count;
+  uint32_t cap;
+  uint64_t members;
+  int failed;  // Memory ran out; the set is incomplete
+} DocSet;
+
+const SetContainer empty_container = {0, 0, NULL, NULL};
+
+void container_free(SetContainer *c) {
+  free(c->values);
+  free(c->words);
+  c->values = NULL;
+  c->words = NULL;
+  c->count = 0;
+}
+
+void docset_free(DocSet *set) {
+  for (uint32_t i = 0; i < set->count; i++)
+    container_free(&set->containers[i]);
+  free(set->containers);
+  memset(set, 0, sizeof(*set));
+}
+
+/* Append an empty container for key, above every key the set has; NULL
+ * if memory runs out */
+SetContainer *docset_append(DocSet *set, uint32_t key) {
+  if (set->count == set->cap) {
+    uint32_t cap = set->cap ? set->cap * 2 : 4;
+    SetContainer *grown = (SetContainer *)realloc(
+        set->containers, (size_t)cap * sizeof(SetContainer));
+    if (!grown) {
+      set->failed = 1;
+      return NULL;
+    }
+    set->containers = grown;
+    set->cap = cap;
+  }
+  SetContainer *c = &set->containers[set->count++];
+  *c = empty_container;
+  c->key = key;
+  return c;
+}
+
+/* Convert an array container to a bitmap; returns 0 or -1 */
+int container_to_bitmap(SetContainer *c) {
+  uint64_t *words = (uint64_t *)calloc(SET_BITMAP_WORDS, sizeof(uint64_t));
+  if (!words)
+    return -1;
+  for (uint32_t i = 0; i < c->count; i++)
+    words[c->values[i] >> 6] |= 1ull << (c->values[i] & 63);
+  free(c->values);
+  c->values = NULL;
+  c->words = words;
+  return 0;
+}
+
+/* Convert a bitmap container to an array; returns 0 or -1 */
+int container_to_array(SetContainer *c) {
+  uint16_t *values = (uint16_t *)malloc((c->count + 1) * sizeof(uint16_t));
+  if (!values)
+    return -1;
+  uint32_t n = 0;
+  for (uint32_t w = 0; w < SET_BITMAP_WORDS; w++)
+    for (uint64_t bits = c->words[w]; bits; bits &= bits - 1)
+      values[n++] = (uint16_t)(w * 64 + (uint32_t)lowest_bit64(bits));
+  free(c->words);
+  c->words = NULL;
+  c->values = values;
+  return 0;
+}
+
+/* Add doc_id, above every member so far */
+void docset_add(DocSet *set, uint32_t doc_id) {
+  SetContainer *c = set->count ? &set->containers[set->count - 1] : NULL;
+  if (!c || c->key != doc_id >> 16)
+    c = docset_append(set, doc_id >> 16);
+  if (!c)
+    return;
+  uint16_t low = (uint16_t)doc_id;
+  if (!c->words && c->count == SET_ARRAY_MAX && container_to_bitmap(c) < 0) {
+    set->failed = 1;
+    return;
+  }
+  if (c->words) {
+    c->words[low >> 6] |= 1ull << (low & 63);
+  } else {
+    // Arrays double from 8 values, growing when count reaches a power of two
+    if (c->count == 0 || (c->count >= 8 && !(c->count & (c->count - 1)))) {
+      uint32_t cap = c->count ? c->count * 2 : 8;
+      uint16_t *grown =
+          (uint16_t *)realloc(c->values, (size_t)cap * sizeof(uint16_t));
+      if (!grown) {
+        set->failed = 1;
+        return;
+      }
+      c->values = grown;
+    }
+    c->values[c->count] = low;
+  }
+  c->count++;
+  set->members++;
+}
+
+/* The live documents holding a term; a bitmap term's set bits are read
+ * without decoding anything */
+void docset_from_term(SearchEngine *engine, const TermRef *ref,
+                      DocSet *set) {
+  PostingIter it;
+  posting_iter_init(engine, ref, &it);
+  int doc_id, frequency;
+  while (!set->failed && posting_next(&it, &doc_id, &frequency))
+    docset_add(set, (uint32_t)doc_id);
+}
+
+/* out = a op b, word by word; returns the members of out */
+uint32_t bitmap_op(int op, const uint64_t *a, const uint64_t *b,
+                   uint64_t *out) {
+  int w = 0;
+#if defined(HAVE_AVX2)
+  for (; w < SET_BITMAP_WORDS; w += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + w));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + w));
+    __m256i r = op == SET_AND  ? _mm256_and_si256(x, y)
+                : op == SET_OR ? _mm256_or_si256(x, y)
+                               : _mm256_andnot_si256(y, x);
+    _mm256_storeu_si256((__m256i *)(out + w), r);
+  }
+#elif defined(HAVE_SSE2)
+  for (; w < SET_BITMAP_WORDS; w += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + w));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + w));
+    __m128i r = op == SET_AND  ? _mm_and_si128(x, y)
+                : op == SET_OR ? _mm_or_si128(x, y)
+                               : _mm_andnot_si128(y, x);
+    _mm_storeu_si128((__m128i *)(out + w), r);
+  }
+#elif defined(HAVE_NEON)
+  for (; w < SET_BITMAP_WORDS; w += 2) {
+    uint64x2_t x = vld1q_u64(a + w), y = vld1q_u64(b + w);
+    vst1q_u64(out + w, op == SET_AND  ? vandq_u64(x, y)
+                       : op == SET_OR ? vorrq_u64(x, y)
+                                      : vbicq_u64(x, y));
+  }
+#endif
+  for (; w < SET_BITMAP_WORDS; w++)
+    out[w] = op == SET_AND  ? a[w] & b[w]
+             : op == SET_OR ? a[w] | b[w]
+                            : a[w] & ~b[w];
+  uint32_t count = 0;
+  for (w = 0; w < SET_BITMAP_WORDS; w++)
+    count += (uint32_t)count_bits64(out[w]);
+  return count;
+}
+
+/* Whether low is a member of c */
+int container_has(const SetContainer *c, uint16_t low) {
+  if (c->words)
+    return (int)(c->words[low >> 6] >> (low & 63)) & 1;
+  uint32_t lo = 0, hi = c->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (c->values[mid] < low)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < c->count && c->values[lo] == low;
+}
+
+/*
+ * out (empty) = a op b. Two arrays merge, an array ANDed with a bitmap (or
+ * one a bitmap is subtracted from) is filtered by bit tests, and anything
+ * else runs bitmap_op, an array first spread into words. Returns 0, or -1
+ * if memory runs out.
+ */
+int container_op(int op, const SetContainer *a, const SetContainer *b,
+                 SetContainer *out) {
+  if (!a->words && !b->words) {
+    uint16_t *values = (uint16_t *)malloc(
+        ((size_t)a->count + b->count + 1) * sizeof(uint16_t));
+    if (!values)
+      return -1;
+    uint32_t i = 0, j = 0, n = 0;
+    while (i < a->count || j < b->count) {
+      int in_a =
+          j == b->count || (i < a->count && a->values[i] <= b->values[j]);
+      int in_b =
+          i == a->count || (j < b->count && b->values[j] <= a->values[i]);
+      uint16_t value = in_a ? a->values[i] : b->values[j];
+      if (op == SET_AND  ? in_a && in_b
+          : op == SET_OR ? 1
+                         : in_a && !in_b)
+        values[n++] = value;
+      i += in_a;
+      j += in_b;
+    }
+    out->values = values;
+    out->count = n;
+    return n > SET_ARRAY_MAX ? container_to_bitmap(out) : 0;
+  }
+
+  const SetContainer *filtered = NULL, *test = NULL;
+  if (op != SET_OR && !a->words) {
+    filtered = a;
+    test = b;
+  } else if (op == SET_AND && !b->words) {
+    filtered = b;
+    test = a;
+  }
+  if (filtered) {
+    uint16_t *values =
+        (uint16_t *)malloc((filtered->count + 1) * sizeof(uint16_t));
+    if (!values)
+      return -1;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < filtered->count; i++)
+      if (container_has(test, filtered->values[i]) == (op == SET_AND))
+        values[n++] = filtered->values[i];
+    out->values = values;
+    out->count = n;
+    return 0;
+  }
+
+  uint64_t spread[SET_BITMAP_WORDS];
+  const SetContainer *array = !a->words ? a : !b->words ? b : NULL;
+  if (array) {
+    memset(spread, 0, sizeof(spread));
+    for (uint32_t i = 0; i < array->count; i++)
+      spread[array->values[i] >> 6] |= 1ull << (array->values[i] & 63);
+  }
+  out->words = (uint64_t *)malloc(SET_BITMAP_WORDS * sizeof(uint64_t));
+  if (!out->words)
+    return -1;
+  out->count = bitmap_op(op, a->words ? a->words : spread,
+                         b->words ? b->words : spread, out->words);
+  return out->count <= SET_ARRAY_MAX ? container_to_array(out) : 0;
+}
+
+/* out (empty) = a op b; out->failed is set if memory runs out */
+void docset_op(int op, const DocSet *a, const DocSet *b, DocSet *out) {
+  uint32_t i = 0, j = 0;
+  out->failed = a->failed || b->failed;
+  while (!out->failed && (i < a->count || j < b->count)) {
+    uint32_t key_a = i < a->count ? a->containers[i].key : UINT32_MAX;
+    uint32_t key_b = j < b->count ? b->containers[j].key : UINT32_MAX;
+    uint32_t key = key_a < key_b ? key_a : key_b;
+    const SetContainer *x = key_a == key ? &a->containers[i++]
+                                         : &empty_container;
+    const SetContainer *y = key_b == key ? &b->containers[j++]
+                                         : &empty_container;
+    if ((op != SET_OR && x->count == 0) || (op == SET_AND && y->count == 0))
+      continue;
+    SetContainer *c = docset_append(out, key);
+    if (c && container_op(op, x, y, c) < 0)
+      out->failed = 1;
+    if (c && !out->failed && c->count == 0) {
+      container_free(c);
+      out->count--;
+    } else if (c) {
+      out->members += c->count;
+    }
+  }
+}
+
+/* First member >= target, looking from container *at on, which is left
+ * at the member's container; returns 0 once there are none */
+int docset_seek(const DocSet *set, uint32_t *at, uint32_t target,
+                uint32_t *doc_id) {
+  for (; *at < set->count; (*at)++) {
+    const SetContainer *c = &set->containers[*at];
+    if (c->key < target >> 16)
+      continue;
+    uint32_t low = c->key == target >> 16 ? target & 0xffff : 0;
+    if (c->words) {
+      uint64_t bits = c->words[low >> 6] & ~0ull << (low & 63);
+      for (uint32_t w = low >> 6; w < SET_BITMAP_WORDS;) {
+        if (bits) {
+          *doc_id = c->key << 16 | (w * 64 + (uint32_t)lowest_bit64(bits));
+          return 1;
+        }
+        if (++w < SET_BITMAP_WORDS)
+          bits = c->words[w];
+      }
+    } else {
+      uint32_t lo = 0, hi = c->count;
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (c->values[mid] < low)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if (lo < c->count) {
+        *doc_id = c->key << 16 | c->values[lo];
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* ==================== BOOLEAN QUERIES ==================== */
+
+/*
+ * A Boolean query is parsed into a tree of lazy iterators over document
+ * ids. Operands are words, "quoted phrases" and words joined by NEAR/k
+ * (NEAR alone means NEAR/NEAR_DISTANCE); NOT binds tightest, then NEAR,
+ * then AND (also implied between adjacent operands), then OR, and
+ * parentheses group. Operators are upper case, so "and" is still a word.
+ *
+ * Every node yields its matches in ascending order through query_advance,
+ * which moves it to its first match at or after a target: leaves wrap a
+ * term's PostingIter, AND leapfrogs its children (each one advanced to the
+ * latest doc_id any other reached) and skips past what its NOT children
+ * match, and OR keeps its children in a min-heap by doc_id. Phrase and NEAR
+ * leaves leapfrog their words, then check positions per candidate. A NOT
+ * outside an AND excludes from every live document. Nothing is decoded
+ * ahead of the match being asked for, so a query holds a few iterators per
+ * node whatever the size of the corpus.
+ *
+ * The exception is common words. Once the corpus has SET_MIN_DOCS
+ * documents, a subtree of two or more words joined by AND, OR and AND NOT,
+ * each in at least one of every SET_DENSITY documents, is evaluated up
+ * front into a DocSet (see DOCUMENT SETS) and iterated from there: a
+ * sparse sibling then probes it with a bit test, and the subtree's own
+ * iterators are only advanced to its matches, for their frequencies.
+ *
+ * An operand with nothing to search for, a stop word (see STOP WORDS) or
+ * a word or phrase with nothing indexable in it, is dropped by the
+ * operator that takes it in, as multi and phrase drop stop words: "the
+ * AND fox" is "fox". A query of nothing else matches nothing.
+ */
+#define QUERY_TERM 1
+#define QUERY_PHRASE 2
+#define QUERY_NEAR 3
+#define QUERY_AND 4
+#define QUERY_OR 5
+#define QUERY_NOT 6  // Only until query_prepare turns it into an AND
+#define QUERY_ALL 7  // Every live document
+#define QUERY_SET 8  // Its one child's matches, from a DocSet
+#define QUERY_NONE 9  // Nothing to search for; only ever the root
+#define MAX_QUERY_NODES (4 * MAX_QUERY_TERMS)
+
+#define QUERY_DONE INT_MAX  // doc_id of an exhausted node
+#define SET_MIN_DOCS 4096
+#define SET_DENSITY 16
+
+typedef struct QueryNode {
+  int type;
+  int doc_id;          // Current match; -1 before the first
+  uint32_t frequency;  // Of the current match (summed term frequencies)
+  uint64_t cost;       // Most matches it can have; AND tries cheap first
+  struct QueryNode **children;
+  int child_count;
+  int child_cap;
+  int excluded;         // AND: trailing children that must not match
+  int *heap;            // OR: child indices, a min-heap by doc_id
+  PositionList *lists;  // Phrase and NEAR: per word, the current positions
+  uint32_t distance;    // NEAR
+  int offset;           // Phrase word: position from the phrase's first
+  int found;            // Term
+  char word[MAX_WORD_LEN];
+  TermRef ref;
+  PostingIter it;
+  DocSet set;       // Set
+  uint32_t set_at;  // Set: container of the current match
+} QueryNode;
+
+typedef struct QueryTree {
+  QueryNode *nodes[MAX_QUERY_NODES];  // Every node, for freeing
+  int count;
+  int terms;
+  QueryNode *root;
+} QueryTree;
+
+QueryNode *query_node(QueryTree *tree, int type) {
+  if (tree->count == MAX_QUERY_NODES)
+    return NULL;
+  QueryNode *node = (QueryNode *)calloc(1, sizeof(QueryNode));
+  if (!node)
+    return NULL;
+  node->type = type;
+  node->doc_id = -1;
+  tree->nodes[tree->count++] = node;
+  return node;
+}
+
+int query_add_child(QueryNode *node, QueryNode *child) {
+  if (node->child_count == node->child_cap) {
+    int cap = node->child_cap ? node->child_cap * 2 : 4;
+    QueryNode **grown = (QueryNode **)realloc(
+        node->children, (size_t)cap * sizeof(QueryNode *));
+    if (!grown)
+      return -1;
+    node->children = grown;
+    node->child_cap = cap;
+  }
+  node->children[node->child_count++] = child;
+  return 0;
+}
+
+void free_query_tree(QueryTree *tree) {
+  for (int i = 0; i < tree->count; i++) {
+    QueryNode *node = tree->nodes[i];
+    for (int c = 0; node->lists && c < node->child_count; c++)
+      free(node->lists[c].values);
+    free(node->lists);
+    free(node->heap);
+    free(node->children);
+    docset_free(&node->set);
+    free(node);
+  }
+  tree->count = 0;
+  tree->root = NULL;
+}
+
+#define QTOK_END 0
+#define QTOK_WORD 1
+#define QTOK_PHRASE 2
+#define QTOK_OPEN 3
+#define QTOK_CLOSE 4
+#define QTOK_NOT 5
+#define QTOK_NEAR 6
+#define QTOK_AND 7
+#define QTOK_OR 8
+
+/* The next token from *cursor: its text is start .. start + len (the
+ * inside of a phrase's quotes), and a NEAR's distance goes in *distance */
+int query_token(const char **cursor, const char **start, size_t *len,
+                uint32_t *distance) {
+  const char *p = *cursor + strspn(*cursor, " \t\r\n");
+  int type;
+  *start = p;
+  *len = 0;
+  if (!*p) {
+    type = QTOK_END;
+  } else if (*p == '(' || *p == ')') {
+    type = *p++ == '(' ? QTOK_OPEN : QTOK_CLOSE;
+  } else if (*p == '"') {
+    *start = ++p;
+    *len = strcspn(p, "\"");
+    p += *len;
+    p += *p == '"';
+    type = QTOK_PHRASE;
+  } else {
+    *len = strcspn(p, " \t\r\n()\"");
+    p += *len;
+    type = QTOK_WORD;
+    if (*len == 3 && memcmp(*start, "AND", 3) == 0)
+      type = QTOK_AND;
+    else if (*len == 2 && memcmp(*start, "OR", 2) == 0)
+      type = QTOK_OR;
+    else if (*len == 3 && memcmp(*start, "NOT", 3) == 0)
+      type = QTOK_NOT;
+    else if (*len >= 4 && memcmp(*start, "NEAR", 4) == 0) {
+      if (*len == 4) {
+        *distance = NEAR_DISTANCE;
+        type = QTOK_NEAR;
+      } else if (*len > 5 && (*start)[4] == '/' &&
+                 strspn(*start + 5, "0123456789") == *len - 5) {
+        unsigned long value = strtoul(*start + 5, NULL, 10);
+        *distance = value < INT_MAX ? (uint32_t)value : INT_MAX;
+        type = QTOK_NEAR;
+      }
+    }
+  }
+  *cursor = p;
+  return type;
+}
+
+/* The leaf for a word or a phrase's text, a QUERY_NONE node if it has
+ * nothing to search for, or NULL with *error set */
+QueryNode *query_leaf(QueryTree *tree, const StopWords *stop_words, int type,
+                      const char *text, size_t len, const char **error) {
+  char words[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  int offsets[MAX_QUERY_TERMS], count = 1;
+  if (type == QTOK_WORD) {
+    size_t n = len < MAX_WORD_LEN - 1 ? len : MAX_WORD_LEN - 1;
+    memcpy(words[0], text, n);
+    words[0][n] = '\0';
+    normalize_word(words[0]);
+    offsets[0] = 0;
+    count = words[0][0] != '\0' && !is_stop_word(stop_words, words[0]);
+  } else {
+    char *phrase = (char *)malloc(len + 1);
+    if (!phrase) {
+      *error = "Out of memory";
+      return NULL;
+    }
+    memcpy(phrase, text, len);
+    phrase[len] = '\0';
+    count = parse_phrase(phrase, stop_words, words, offsets);
+    free(phrase);
+  }
+  if (count == 0) {
+    QueryNode *none = query_node(tree, QUERY_NONE);
+    if (!none)
+      *error = "Query too long";
+    return none;
+  }
+  if (tree->terms + count > MAX_QUERY_TERMS) {
+    *error = "Too many query terms";
+    return NULL;
+  }
+
+  QueryNode *leaf = count > 1 ? query_node(tree, QUERY_PHRASE) : NULL;
+  for (int i = 0; i < count; i++) {
+    QueryNode *term = query_node(tree, QUERY_TERM);
+    if (!term || (leaf && query_add_child(leaf, term) < 0)) {
+      *error = "Query too long";
+      return NULL;
+    }
+    strcpy(term->word, words[i]);
+    term->offset = offsets[i];
+    tree->terms++;
+    if (!leaf)
+      return term;
+  }
+  return leaf;
+}
+
+/* Operands and operators waiting to be combined while a query is parsed */
+typedef struct QueryParser {
+  QueryTree *tree;
+  QueryNode *operands[MAX_QUERY_NODES];
+  int operand_count;
+  int ops[MAX_QUERY_NODES];  // QTOK_ operators and (
+  uint32_t distances[MAX_QUERY_NODES];
+  int op_count;
+  const char *error;
+} QueryParser;
+
+/* Combine the top operands with op; returns -1 with the error set */
+int query_reduce(QueryParser *qp, int op, uint32_t distance) {
+  if (qp->operand_count < (op == QTOK_NOT ? 1 : 2)) {
+    qp->error = "Missing operand";
+    return -1;
+  }
+  QueryNode *right = qp->operands[--qp->operand_count];
+  if (right->type == QUERY_NONE && op != QTOK_NOT)
+    return 0;  // The left operand stands alone
+  if (op == QTOK_NOT) {
+    QueryNode *node = right;
+    if (right->type == QUERY_NONE) {
+      qp->operands[qp->operand_count++] = right;  // Still nothing
+      return 0;
+    }
+    if (right->type == QUERY_NOT) {
+      node = right->children[0];  // NOT NOT a is a
+    } else if (!(node = query_node(qp->tree, QUERY_NOT)) ||
+               query_add_child(node, right) < 0) {
+      qp->error = "Query too long";
+      return -1;
+    }
+    qp->operands[qp->operand_count++] = node;
+    return 0;
+  }
+
+  QueryNode *left = qp->operands[--qp->operand_count];
+  if (left->type == QUERY_NONE) {
+    qp->operands[qp->operand_count++] = right;
+    return 0;
+  }
+  int type = op == QTOK_AND ? QUERY_AND
+             : op == QTOK_OR ? QUERY_OR
+                             : QUERY_NEAR;
+  if (type == QUERY_NEAR &&
+      ((left->type != QUERY_TERM && left->type != QUERY_NEAR) ||
+       (right->type != QUERY_TERM && right->type != QUERY_NEAR))) {
+    qp->error = "NEAR joins single words";
+    return -1;
+  }
+
+  // Chains of one operator flatten into one node
+  QueryNode *node = left->type == type ? left : query_node(qp->tree, type);
+  QueryNode *const *added = right->type == type ? right->children : &right;
+  int add_count = right->type == type ? right->child_count : 1;
+  int failed = !node || (node != left && query_add_child(node, left) < 0);
+  for (int i = 0; i < add_count && !failed; i++) {
+    int repeat = 0;  // A word is near itself; count it once
+    for (int j = 0; type == QUERY_NEAR && j < node->child_count; j++)
+      repeat |= strcmp(node->children[j]->word, added[i]->word) == 0;
+    failed = !repeat && query_add_child(node, added[i]) < 0;
+  }
+  if (failed) {
+    qp->error = "Query too long";
+    return -1;
+  }
+  if (type == QUERY_NEAR) {
+    // A chain's window is its widest
+    if (right->type == QUERY_NEAR && right->distance > distance)
+      distance = right->distance;
+    if (distance > node->distance)
+      node->distance = distance;
+  }
+  qp->operands[qp->operand_count++] = node;
+  return 0;
+}
+
+int query_precedence(int op) {
+  return op == QTOK_OR ? 1 : op == QTOK_AND ? 2 : op == QTOK_NEAR ? 3 : 4;
+}
+
+/* Combine the waiting operators that bind at least as tightly as op, then
+ * push op; returns -1 with the error set */
+int query_push_op(QueryParser *qp, int op, uint32_t distance) {
+  // NOT and ( start something new; nothing before them is complete
+  while (op != QTOK_NOT && op != QTOK_OPEN && qp->op_count > 0 &&
+         qp->ops[qp->op_count - 1] != QTOK_OPEN &&
+         query_precedence(qp->ops[qp->op_count - 1]) >=
+             query_precedence(op)) {
+    qp->op_count--;
+    if (query_reduce(qp, qp->ops[qp->op_count],
+                     qp->distances[qp->op_count]) < 0)
+      return -1;
+  }
+  if (qp->op_count == MAX_QUERY_NODES) {
+    qp->error = "Query too long";
+    return -1;
+  }
+  qp->ops[qp->op_count] = op;
+  qp->distances[qp->op_count] = distance;
+  qp->op_count++;
+  return 0;
+}
+
+/*
+ * Parse query into tree with the shunting-yard algorithm: operands wait on
+ * one stack and operators on another until one that binds less tightly, a
+ * closing parenthesis or the end combines them. Returns 0, or -1 with
+ * *error set; the caller frees the tree with free_query_tree either way.
+ */
+int parse_query(const char *query, const StopWords *stop_words,
+                QueryTree *tree, const char **error) {
+  QueryParser *qp = (QueryParser *)calloc(1, sizeof(QueryParser));
+  memset(tree, 0, sizeof(*tree));
+  *error = "Out of memory";
+  if (!qp)
+    return -1;
+  qp->tree = tree;
+
+  const char *cursor = query;
+  int expect_operand = 1, done = 0;
+  while (!done && !qp->error) {
+    const char *text;
+    size_t len;
+    uint32_t distance = 0;
+    int tok = query_token(&cursor, &text, &len, &distance);
+    switch (tok) {
+    case QTOK_WORD:
+    case QTOK_PHRASE: {
+      QueryNode *leaf =
+          query_leaf(tree, stop_words, tok, text, len, &qp->error);
+      if (!leaf)
+        break;
+      // Adjacent operands, as in "a (b OR c)", are ANDed
+      if (!expect_operand && query_push_op(qp, QTOK_AND, 0) < 0)
+        break;
+      qp->operands[qp->operand_count++] = leaf;
+      expect_operand = 0;
+      break;
+    }
+    case QTOK_OPEN:
+    case QTOK_NOT:
+      if (!expect_operand && query_push_op(qp, QTOK_AND, 0) < 0)
+        break;
+      query_push_op(qp, tok, 0);
+      expect_operand = 1;
+      break;
+    case QTOK_AND:
+    case QTOK_OR:
+    case QTOK_NEAR:
+      if (expect_operand)
+        qp->error = "Missing operand";
+      else
+        query_push_op(qp, tok, distance);
+      expect_operand = 1;
+      break;
+    case QTOK_CLOSE:
+      if (expect_operand) {
+        qp->error = "Missing operand";
+        break;
+      }
+      while (qp->op_count > 0 && qp->ops[qp->op_count - 1] != QTOK_OPEN &&
+             !qp->error) {
+        qp->op_count--;
+        query_reduce(qp, qp->ops[qp->op_count], qp->distances[qp->op_count]);
+      }
+      if (qp->error)
+        break;
+      if (qp->op_count == 0)
+        qp->error = "Unbalanced parentheses";
+      else
+        qp->op_count--;  // The (
+      break;
+    default:  // QTOK_END
+      if (expect_operand) {
+        qp->error = qp->operand_count == 0 && qp->op_count == 0
+                        ? "Empty query"
+                        : "Missing operand";
+        break;
+      }
+      while (qp->op_count > 0 && !qp->error) {
+        qp->op_count--;
+        if (qp->ops[qp->op_count] == QTOK_OPEN)
+          qp->error = "Unbalanced parentheses";
+        else
+          query_reduce(qp, qp->ops[qp->op_count],
+                       qp->distances[qp->op_count]);
+      }
+      tree->root = qp->operands[0];
+      done = 1;
+    }
+  }
+
+  *error = qp->error;
+  free(qp);
+  return *error ? -1 : 0;
+}
+
+/* Render the parsed tree (before query_prepare) in canonical form: every
+ * operator explicit, groups below the top in parentheses */
+void query_render(const QueryNode *node, int top, ByteBuffer *out) {
+  char separator[32];
+  switch (node->type) {
+  case QUERY_NONE:
+    return;
+  case QUERY_TERM:
+    buffer_append(out, node->word, strlen(node->word));
+    return;
+  case QUERY_PHRASE:
+    // An unindexed word in a phrase holds its place as "_"
+    buffer_append(out, "\"", 1);
+    for (int i = 0; i < node->child_count; i++) {
+      const QueryNode *term = node->children[i];
+      for (int gap = i > 0 ? node->children[i - 1]->offset + 1 : 0;
+           i > 0 && gap < term->offset; gap++)
+        buffer_append(out, " _", 2);
+      if (i > 0)
+        buffer_append(out, " ", 1);
+      buffer_append(out, term->word, strlen(term->word));
+    }
+    buffer_append(out, "\"", 1);
+    return;
+  case QUERY_NOT: {
+    // NOT binds tighter than NEAR, so a NEAR operand needs its parentheses
+    // (unless it is one word repeated, as in "a NEAR a")
+    const QueryNode *child = node->children[0];
+    int group = child->type == QUERY_NEAR && child->child_count > 1;
+    buffer_append(out, "NOT (", group ? 5 : 4);
+    query_render(child, 0, out);
+    if (group)
+      buffer_append(out, ")", 1);
+    return;
+  }
+  }
+
+  if (node->type == QUERY_NEAR)
+    snprintf(separator, sizeof(separator), " NEAR/%u ", node->distance);
+  else
+    strcpy(separator, node->type == QUERY_AND ? " AND " : " OR ");
+  if (!top && node->type != QUERY_NEAR)
+    buffer_append(out, "(", 1);
+  for (int i = 0; i < node->child_count; i++) {
+    if (i > 0)
+      buffer_append(out, separator, strlen(separator));
+    query_render(node->children[i], 0, out);
+  }
+  if (!top && node->type != QUERY_NEAR)
+    buffer_append(out, ")", 1);
+}
+
+/*
+ * Look the terms up (through table, if not NULL) and ready every node to
+ * iterate: a NOT becomes an AND that excludes its operand from every live
+ * document, an AND moves its NOT operands to the end as exclusions and
+ * sorts the rest cheapest first. Returns 0, or -1 if memory runs out.
+ */
+int query_prepare(SearchEngine *engine, TermTable *table, QueryTree *tree,
+                  QueryNode *node) {
+  uint64_t doc_count = (uint64_t)engine->doc_count;
+  switch (node->type) {
+  case QUERY_TERM:
+    node->found = query_term(engine, table, node->word, &node->ref, NULL);
+    if (node->found) {
+      posting_iter_init(engine, &node->ref, &node->it);
+      node->cost = term_doc_freq(engine, &node->ref);
+    }
+    return 0;
+  case QUERY_ALL:
+    node->cost = doc_count;
+    return 0;
+  case QUERY_NONE:
+    return 0;
+  case QUERY_PHRASE:
+  case QUERY_NEAR:
+    node->lists =
+        (PositionList *)calloc(node->child_count, sizeof(PositionList));
+    if (!node->lists)
+      return -1;
+    node->cost = UINT64_MAX;
+    for (int i = 0; i < node->child_count; i++) {
+      query_prepare(engine, table, tree, node->children[i]);
+      if (node->children[i]->cost < node->cost)
+        node->cost = node->children[i]->cost;
+    }
+    return 0;
+  case QUERY_OR:
+    node->heap = (int *)malloc(node->child_count * sizeof(int));
+    if (!node->heap)
+      return -1;
+    for (int i = 0; i < node->child_count; i++) {
+      // Every child starts before doc_id 0, so any order is a heap
+      node->heap[i] = i;
+      if (query_prepare(engine, table, tree, node->children[i]) < 0)
+        return -1;
+      node->cost += node->children[i]->cost;
+    }
+    if (node->cost > doc_count)
+      node->cost = doc_count;
+    return 0;
+  case QUERY_NOT: {
+    // Becomes an AND over a lone exclusion, which adds every document
+    QueryNode *inner = query_node(tree, QUERY_NOT);
+    if (!inner)
+      return -1;
+    inner->children = node->children;
+    inner->child_count = node->child_count;
+    inner->child_cap = node->child_cap;
+    node->children = NULL;
+    node->child_count = node->child_cap = 0;
+    node->type = QUERY_AND;
+    if (query_add_child(node, inner) < 0)
+      return -1;
+  }
+  }
+
+  // AND: the operands that must match, then the excluded ones
+  QueryNode *excluded[MAX_QUERY_NODES];
+  int required = 0, excluded_count = 0;
+  for (int i = 0; i < node->child_count; i++) {
+    QueryNode *child = node->children[i];
+    if (child->type == QUERY_NOT)
+      excluded[excluded_count++] = child->children[0];
+    else
+      node->children[required++] = child;
+  }
+  node->child_count = required;
+  if (required == 0) {
+    QueryNode *all = query_node(tree, QUERY_ALL);
+    if (!all || query_add_child(node, all) < 0)
+      return -1;
+    required = 1;
+  }
+  for (int i = 0; i < excluded_count; i++)
+    if (query_add_child(node, excluded[i]) < 0)
+      return -1;
+  node->excluded = excluded_count;
+
+  for (int i = 0; i < node->child_count; i++)
+    if (query_prepare(engine, table, tree, node->children[i]) < 0)
+      return -1;
+  for (int i = 1; i < required; i++) {
+    QueryNode *child = node->children[i];
+    int j = i;
+    while (j > 0 && node->children[j - 1]->cost > child->cost) {
+      node->children[j] = node->children[j - 1];
+      j--;
+    }
+    node->children[j] = child;
+  }
+  node->cost = node->children[0]->cost;
+  return 0;
+}
+
+/* Whether a query this costly walks a dense share of the documents */
+int query_dense(const SearchEngine *engine, uint64_t cost) {
+  return cost >= ((uint64_t)engine->doc_count + SET_DENSITY - 1) / SET_DENSITY;
+}
+
+/* Dense words under node if it can become a set: words (dense, or not
+ * found outside an AND's required ones) joined by AND, OR and AND NOT;
+ * -1 if it cannot */
+int query_set_terms(const SearchEngine *engine, const QueryNode *node) {
+  int terms = 0;
+  switch (node->type) {
+  case QUERY_TERM:
+    if (!node->found)
+      return 0;
+    return query_dense(engine, node->cost) ? 1 : -1;
+  case QUERY_AND:
+  case QUERY_OR:
+    for (int i = 0; i < node->child_count; i++) {
+      const QueryNode *child = node->children[i];
+      int child_terms = query_set_terms(engine, child);
+      if (child_terms < 0 ||
+          (node->type == QUERY_AND && i < node->child_count - node->excluded &&
+           child->type == QUERY_TERM && !child->found))
+        return -1;  // An AND that matches nothing is cheap already
+      terms += child_terms;
+    }
+    return terms;
+  default:  // Positions, or every document
+    return -1;
+  }
+}
+
+/* The documents a prepared node accepted by query_set_terms matches */
+void query_build_set(SearchEngine *engine, const QueryNode *node,
+                     DocSet *out) {
+  if (node->type == QUERY_TERM) {
+    if (node->found)
+      docset_from_term(engine, &node->ref, out);
+    return;
+  }
+  // AND's required children come first, cheapest first, then its exclusions
+  query_build_set(engine, node->children[0], out);
+  for (int i = 1; i < node->child_count && !out->failed; i++) {
+    DocSet child = {0}, combined = {0};
+    query_build_set(engine, node->children[i], &child);
+    int op = node->type == QUERY_OR                  ? SET_OR
+             : i >= node->child_count - node->excluded ? SET_ANDNOT
+                                                       : SET_AND;
+    docset_op(op, out, &child, &combined);
+    docset_free(out);
+    docset_free(&child);
+    *out = combined;
+  }
+}
+
+/*
+ * Put set nodes over the largest subtrees with two or more dense words
+ * that query_set_terms accepts. limit is the cost of the cheapest operand
+ * an enclosing AND requires: below a sparse one, a subtree is only probed
+ * at its few candidates, which beats building its set. Returns 0, or -1 if
+ * memory runs out.
+ */
+int query_use_sets(SearchEngine *engine, QueryTree *tree, QueryNode **slot,
+                   uint64_t limit) {
+  QueryNode *node = *slot;
+  if (engine->doc_count >= SET_MIN_DOCS && query_dense(engine, limit) &&
+      query_set_terms(engine, node) >= 2) {
+    QueryNode *set = query_node(tree, QUERY_SET);
+    if (!set || query_add_child(set, node) < 0)
+      return 0;  // Out of nodes; the subtree stays lazy
+    query_build_set(engine, node, &set->set);
+    if (set->set.failed)
+      return -1;
+    set->cost = set->set.members;
+    *slot = set;
+    return 0;
+  }
+  int required = node->child_count - node->excluded;
+  for (int i = 0; (node->type == QUERY_AND || node->type == QUERY_OR) &&
+                  i < node->child_count;
+       i++) {
+    // Required children are sorted cheapest first
+    uint64_t child_limit = limit;
+    if (node->type == QUERY_AND && (i > 0 || i >= required))
+      child_limit = node->children[0]->cost;
+    else if (node->type == QUERY_AND && required > 1)
+      child_limit = node->children[1]->cost;
+    if (child_limit > limit)
+      child_limit = limit;
+    if (query_use_sets(engine, tree, &node->children[i], child_limit) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Restore the OR heap after the child at heap slot i moved forward */
+void query_heap_sift(QueryNode *node, int i) {
+  int *heap = node->heap, n = node->child_count;
+  for (;;) {
+    int lowest = i, left = 2 * i + 1, right = left + 1;
+    if (left < n && node->children[heap[left]]->doc_id <
+                        node->children[heap[lowest]]->doc_id)
+      lowest = left;
+    if (right < n && node->children[heap[right]]->doc_id <
+                         node->children[heap[lowest]]->doc_id)
+      lowest = right;
+    if (lowest == i)
+      return;
+    int swap = heap[i];
+    heap[i] = heap[lowest];
+    heap[lowest] = swap;
+    i = lowest;
+  }
+}
+
+/* Summed frequency of the OR's children at its current doc_id, which fill
+ * the top of the heap */
+uint32_t query_heap_frequency(const QueryNode *node, int i) {
+  if (i >= node->child_count ||
+      node->children[node->heap[i]]->doc_id != node->doc_id)
+    return 0;
+  return node->children[node->heap[i]]->frequency +
+         query_heap_frequency(node, 2 * i + 1) +
+         query_heap_frequency(node, 2 * i + 2);
+}
+
+/* Whether the words of a phrase or NEAR node, all on the same document,
+ * match there; sets the node's frequency to the number of matches */
+int query_positions_match(QueryNode *node) {
+  int offsets[MAX_QUERY_TERMS];
+  for (int i = 0; i < node->child_count; i++) {
+    if (!position_list_load(&node->children[i]->it, &node->lists[i]))
+      return 0;
+    offsets[i] = node->children[i]->offset;
+  }
+  node->frequency = node->type == QUERY_PHRASE
+                        ? phrase_matches(node->lists, offsets, node->child_count)
+                        : near_matches(node->lists, node->child_count,
+                                       node->distance);
+  return node->frequency > 0;
+}
+
+/* Move node to its first match at or after target; returns its doc_id,
+ * QUERY_DONE once there are no more */
+int query_advance(SearchEngine *engine, QueryNode *node, int target) {
+  if (node->doc_id >= target)
+    return node->doc_id;
+
+  int doc_id, frequency;
+  switch (node->type) {
+  case QUERY_TERM:
+    if (node->found &&
+        posting_advance(&node->it, target, &doc_id, &frequency)) {
+      node->doc_id = doc_id;
+      node->frequency = (uint32_t)frequency;
+    } else {
+      node->doc_id = QUERY_DONE;
+    }
+    return node->doc_id;
+  case QUERY_NONE:
+    node->doc_id = QUERY_DONE;
+    return QUERY_DONE;
+  case QUERY_ALL:
+    doc_id = target;
+    while (doc_id < engine->doc_count && document_deleted(engine, doc_id))
+      doc_id++;
+    node->doc_id = doc_id < engine->doc_count ? doc_id : QUERY_DONE;
+    return node->doc_id;
+  case QUERY_SET: {
+    uint32_t id;
+    if (docset_seek(&node->set, &node->set_at, (uint32_t)target, &id)) {
+      // The subtree matches here too; it only supplies the frequency
+      node->doc_id = (int)id;
+      query_advance(engine, node->children[0], node->doc_id);
+      node->frequency = node->children[0]->frequency;
+    } else {
+      node->doc_id = QUERY_DONE;
+    }
+    return node->doc_id;
+  }
+  case QUERY_OR: {
+    QueryNode **children = node->children;
+    while (children[node->heap[0]]->doc_id < target) {
+      query_advance(engine, children[node->heap[0]], target);
+      query_heap_sift(node, 0);
+    }
+    node->doc_id = children[node->heap[0]]->doc_id;
+    node->frequency =
+        node->doc_id != QUERY_DONE ? query_heap_frequency(node, 0) : 0;
+    return node->doc_id;
+  }
+  }
+
+  // AND, phrase and NEAR: leapfrog the required children to a doc_id they
+  // all reach, then check it against the exclusions or the positions
+  int required = node->child_count - node->excluded;
+  for (int candidate = target;; candidate++) {
+    for (int i = 0, agreed = 0; agreed < required; i = (i + 1) % required) {
+      doc_id = query_advance(engine, node->children[i], candidate);
+      if (doc_id == QUERY_DONE) {
+        node->doc_id = QUERY_DONE;
+        return QUERY_DONE;
+      }
+      agreed = doc_id > candidate ? 1 : agreed + 1;
+      candidate = doc_id;
+    }
+
+    int matched = 1;
+    if (node->type == QUERY_AND) {
+      for (int i = required; i < node->child_count && matched; i++)
+        matched =
+            query_advance(engine, node->children[i], candidate) != candidate;
+      node->frequency = 0;
+      for (int i = 0; i < required; i++)
+        node->frequency += node->children[i]->frequency;
+    } else {
+      matched = query_positions_match(node);
+    }
+    if (matched) {
+      node->doc_id = candidate;
+      return candidate;
+    }
+  }
+}
+
+/* ==================== JSON OUTPUT FUNCTIONS ==================== */
+
+/*
+ * Responses are assembled in a ByteBuffer, so they can be cached and sent
+ * with a single write. Numbers and strings are appended directly;
+ * buffer_printf is left for the rare one-off responses.
+ */
+void buffer_printf(ByteBuffer *buf, const char *fmt, ...) {
+  for (;;) {
+    size_t room = buf->cap - buf->len;
+    va_list args;
+    va_start(args, fmt);
+    char *end = buf->data ? buf->data + buf->len : NULL;
+    int n = vsnprintf(end, room, fmt, args);
+    va_end(args);
+    if (n < 0) {
+      buf->failed = 1;
+      return;
+    }
+    if ((size_t)n < room) {
+      buf->len += (size_t)n;
+      return;
+    }
+    // Grow to fit, then format again
+    if (!buffer_reserve(buf, (size_t)n + 1))
+      return;
+  }
+}
+
+void buffer_str(ByteBuffer *buf, const char *str) {
+  buffer_append(buf, str, strlen(str));
+}
+
+/* Decimal digits, two per division */
+void buffer_uint(ByteBuffer *buf, uint64_t value) {
+  static const char pairs[] = "00010203040506070809"
+                              "10111213141516171819"
+                              "20212223242526272829"
+                              "30313233343536373839"
+                              "40414243444546474849"
+                              "50515253545556575859"
+                              "60616263646566676869"
+                              "70717273747576777879"
+                              "80818283848586878889"
+                              "90919293949596979899";
+  char digits[20];
+  char *p = digits + sizeof(digits);
+  while (value >= 100) {
+    unsigned pair = (unsigned)(value % 100) * 2;
+    value /= 100;
+    *--p = pairs[pair + 1];
+    *--p = pairs[pair];
+  }
+  if (value >= 10) {
+    *--p = pairs[value * 2 + 1];
+    *--p = pairs[value * 2];
+  } else {
+    *--p = (char)('0' + value);
+  }
+  buffer_append(buf, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+void buffer_int(ByteBuffer *buf, int64_t value) {
+  if (value < 0) {
+    buffer_append(buf, "-", 1);
+    buffer_uint(buf, 0 - (uint64_t)value);
+  } else {
+    buffer_uint(buf, (uint64_t)value);
+  }
+}
+
+/* value with four decimals, exactly as printf's "%.4f" prints it */
+void buffer_fixed4(ByteBuffer *buf, double value) {
+  double scaled = fabs(value) * 10000.0;
+  double fraction = scaled - floor(scaled);
+  // Close to a tie the product's own rounding would decide, and printf
+  // rounds the exact value; so do big numbers, infinities and NaN
+  if (!(scaled < 1e9) || fabs(fraction - 0.5) < 1e-6) {
+    buffer_printf(buf, "%.4f", value);
+    return;
+  }
+  uint64_t units = (uint64_t)(scaled + 0.5);
+  if (signbit(value))
+    buffer_append(buf, "-", 1);
+  buffer_uint(buf, units / 10000);
+  unsigned rest = (unsigned)(units % 10000);
+  char decimals[5] = {'.', (char)('0' + rest / 1000),
+                      (char)('0' + rest / 100 % 10),
+                      (char)('0' + rest / 10 % 10), (char)('0' + rest % 10)};
+  buffer_append(buf, decimals, sizeof(decimals));
+}
+
+void json_escape_byte(ByteBuffer *buf, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  const char *named = NULL;
+  switch (c) {
+  case '"':
+    named = "\\\"";
+    break;
+  case '\\':
+    named = "\\\\";
+    break;
+  case '\n':
+    named = "\\n";
+    break;
+  case '\r':
+    named = "\\r";
+    break;
+  case '\t':
+    named = "\\t";
+    break;
+  case '\b':
+    named = "\\b";
+    break;
+  case '\f':
+    named = "\\f";
+    break;
+  }
+  if (named) {
+    buffer_append(buf, named, 2);
+  } else {
+    char code[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+    buffer_append(buf, code, sizeof(code));
+  }
+}
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+/* Bit i for each byte i of the 16 at p that JSON strings cannot hold as
+ * is, or that needs a closer look: a control byte, a quote, a backslash or
+ * a byte from 0x80 up */
+uint32_t json_special16(const unsigned char *p) {
+#if defined(HAVE_SSE2)
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i special = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+      _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v));
+  return (uint32_t)_mm_movemask_epi8(_mm_or_si128(special, v));
+#else
+  uint8x16_t v = vld1q_u8(p);
+  uint8x16_t special =
+      vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                        vceqq_u8(v, vdupq_n_u8('\\'))),
+               vorrq_u8(vcleq_u8(v, vdupq_n_u8(0x1f)),
+                        vcgeq_u8(v, vdupq_n_u8(0x80))));
+  return neon_movemask(special);
+#endif
+}
+#endif
+
+/* The special byte at p (see json_special16): a well-formed UTF-8 sequence
+ * stays in the clean run that starts at *run, anything else ends it and is
+ * escaped, or replaced by U+FFFD if it is not UTF-8; returns the byte
+ * after it */
+const unsigned char *json_escape_special(ByteBuffer *buf,
+                                         const unsigned char **run,
+                                         const unsigned char *p,
+                                         const unsigned char *end) {
+  uint32_t code_point;
+  int len = *p >= 0x80 ? utf8_decode(p, end, &code_point) : 0;
+  if (len > 0)
+    return p + len;
+  buffer_append(buf, *run, (size_t)(p - *run));
+  if (*p >= 0x80)
+    buffer_append(buf, "\xef\xbf\xbd", 3);
+  else
+    json_escape_byte(buf, *p);
+  *run = p + 1;
+  return p + 1;
+}
+
+/* Append str escaped for the inside of a JSON string. Clean runs, found
+ * 16 bytes at a time where SIMD is available, are copied whole; UTF-8
+ * passes through, so names stay readable, and malformed bytes become
+ * U+FFFD, so the response always parses */
+void json_escape(ByteBuffer *buf, const char *str) {
+  const unsigned char *p = (const unsigned char *)str, *run = p;
+  const unsigned char *end = p + strlen(str);
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+  while (end - p >= 16) {
+    uint32_t special = json_special16(p);
+    if (special == 0) {
+      p += 16;
+      continue;
+    }
+    p = json_escape_special(buf, &run, p + lowest_bit(special), end);
+  }
+#endif
+  while (p < end) {
+    if (*p < 0x20 || *p == '"' || *p == '\\' || *p >= 0x80)
+      p = json_escape_special(buf, &run, p, end);
+    else
+      p++;
+  }
+  buffer_append(buf, run, (size_t)(end - run));
+}
+
+void json_string(ByteBuffer *buf, const char *str) {
+  buffer_append(buf, "\"", 1);
+  json_escape(buf, str);
+  buffer_append(buf, "\"", 1);
+}
+
+/* Query results render as JSON or, with binary, as one record whose
+ * layout and RESULT_ kinds are part of the library interface, described
+ * in searchEngine.h */
+
+typedef struct ResultWriter {
+  SearchEngine *engine;
+  ByteBuffer *out;
+  int kind;
+  int binary;
+  uint32_t header[4];     // Binary: kind, found, count, total_freq
+  ByteBuffer columns[4];  // Binary: doc_ids, values, word_counts, offsets
+  ByteBuffer strings;
+  const char *suggestion;  // Search misses: a close word, or NULL
+} ResultWriter;
+
+void result_column(ResultWriter *w, int column, uint32_t value) {
+  buffer_append(&w->columns[column], &value, sizeof(value));
+}
+
+/* Start a result for the normalized keywords (one for single-word
+ * queries) */
+void result_begin(ResultWriter *w, SearchEngine *engine, int kind,
+                  char keywords[][MAX_WORD_LEN], int count, int found,
+                  int total_freq, int binary, ByteBuffer *out) {
+  memset(w, 0, sizeof(*w));
+  w->engine = engine;
+  w->out = out;
+  w->kind = kind;
+  w->binary = binary;
+  if (binary) {
+    w->header[0] = (uint32_t)kind;
+    w->header[1] = (uint32_t)found;
+    w->header[3] = (uint32_t)total_freq;
+    result_column(w, 3, 0);
+    for (int i = 0; i < count; i++) {
+      if (i > 0)
+        buffer_append(&w->strings, " ", 1);
+      buffer_str(&w->strings, keywords[i]);
+    }
+    result_column(w, 3, (uint32_t)w->strings.len);
+    return;
+  }
+
+  buffer_str(out, "{\"success\":true,");
+  if (kind == RESULT_MULTI || kind == RESULT_RANK || kind == RESULT_PHRASE ||
+      kind == RESULT_NEAR) {
+    buffer_str(out, "\"keywords\":[");
+    for (int i = 0; i < count; i++) {
+      if (i > 0)
+        buffer_append(out, ",", 1);
+      json_string(out, keywords[i]);
+    }
+    buffer_append(out, "]", 1);
+  } else {
+    buffer_str(out, kind == RESULT_SEARCH   ? "\"keyword\":"
+                    : kind == RESULT_PREFIX ? "\"prefix\":"
+                                            : "\"word\":");
+    json_string(out, keywords[0]);
+  }
+  buffer_str(out, found ? ",\"found\":true" : ",\"found\":false");
+  if (kind == RESULT_FREQ || (kind == RESULT_SEARCH && found)) {
+    buffer_str(out, ",\"total_freq\":");
+    buffer_int(out, total_freq);
+  }
+  buffer_str(out, kind == RESULT_FREQ ? ",\"documents\":["
+                  : kind == RESULT_PREFIX || kind == RESULT_FUZZY
+                      ? ",\"words\":["
+                      : ",\"results\":[");
+}
+
+/* Start a result for a query echoed as one string */
+void result_begin_query(ResultWriter *w, SearchEngine *engine, int kind,
+                        const char *query, int found, int binary,
+                        ByteBuffer *out) {
+  memset(w, 0, sizeof(*w));
+  w->engine = engine;
+  w->out = out;
+  w->kind = kind;
+  w->binary = binary;
+  if (binary) {
+    w->header[0] = (uint32_t)kind;
+    w->header[1] = (uint32_t)found;
+    result_column(w, 3, 0);
+    buffer_str(&w->strings, query);
+    result_column(w, 3, (uint32_t)w->strings.len);
+    return;
+  }
+
+  buffer_str(out, "{\"success\":true,\"query\":");
+  json_string(out, query);
+  buffer_str(out, found ? ",\"found\":true" : ",\"found\":false");
+  buffer_str(out, ",\"results\":[");
+}
+
+void result_row(ResultWriter *w, int doc_id, const char *text,
+                uint32_t value, int word_count) {
+  result_column(w, 0, (uint32_t)doc_id);
+  result_column(w, 1, value);
+  result_column(w, 2, (uint32_t)word_count);
+  buffer_str(&w->strings, text);
+  result_column(w, 3, (uint32_t)w->strings.len);
+  w->header[2]++;
+}
+
+/* The start of a document's JSON object, through its name */
+void result_doc_json(ResultWriter *w, int doc_id, const char *name) {
+  ByteBuffer *out = w->out;
+  buffer_str(out, w->header[2]++ > 0 ? ",{\"doc_id\":" : "{\"doc_id\":");
+  buffer_int(out, doc_id);
+  buffer_str(out, ",\"filename\":");
+  json_string(out, name);
+}
+
+/* One matching document; value is its frequency, its multi or Boolean
+ * score, or its phrase or near match count */
+void result_doc(ResultWriter *w, int doc_id, uint32_t value) {
+  const char *name = document_name(w->engine, doc_id);
+  if (!name)
+    name = "unknown";
+  int word_count = document_word_count(w->engine, doc_id);
+  if (w->binary) {
+    result_row(w, doc_id, name, value, word_count);
+    return;
+  }
+
+  ByteBuffer *out = w->out;
+  result_doc_json(w, doc_id, name);
+  buffer_str(out, w->kind == RESULT_MULTI || w->kind == RESULT_BOOLEAN
+                      ? ",\"score\":"
+                      : ",\"frequency\":");
+  buffer_uint(out, value);
+  if (w->kind != RESULT_FREQ) {
+    buffer_str(out, ",\"word_count\":");
+    buffer_int(out, word_count);
+  }
+  buffer_append(out, "}", 1);
+}
+
+void result_scored_doc(ResultWriter *w, int doc_id, double score) {
+  const char *name = document_name(w->engine, doc_id);
+  if (!name)
+    name = "unknown";
+  int word_count = document_word_count(w->engine, doc_id);
+  if (w->binary) {
+    double units = score * 10000.0 + 0.5;
+    result_row(w, doc_id, name, units < 4294967295.0 ? (uint32_t)units : 0,
+               word_count);
+    return;
+  }
+
+  ByteBuffer *out = w->out;
+  result_doc_json(w, doc_id, name);
+  buffer_str(out, ",\"score\":");
+  buffer_fixed4(out, score);
+  buffer_str(out, ",\"word_count\":");
+  buffer_int(out, word_count);
+  buffer_append(out, "}", 1);
+}
+
+void result_word(ResultWriter *w, const char *word, int frequency,
+                 uint32_t doc_count) {
+  if (w->binary) {
+    result_row(w, 0, word, (uint32_t)frequency, (int)doc_count);
+    return;
+  }
+
+  ByteBuffer *out = w->out;
+  buffer_str(out, w->header[2]++ > 0 ? ",{\"word\":" : "{\"word\":");
+  json_string(out, word);
+  buffer_str(out, ",\"frequency\":");
+  buffer_int(out, frequency);
+  buffer_str(out, ",\"doc_count\":");
+  buffer_uint(out, doc_count);
+  buffer_append(out, "}", 1);
+}
+
+void result_fuzzy_word(ResultWriter *w, const FuzzyMatch *match) {
+  if (w->binary) {
+    result_row(w, match->distance, match->word, (uint32_t)match->frequency,
+               (int)match->doc_count);
+    return;
+  }
+
+  ByteBuffer *out = w->out;
+  buffer_str(out, w->header[2]++ > 0 ? ",{\"word\":" : "{\"word\":");
+  json_string(out, match->word);
+  buffer_str(out, ",\"distance\":");
+  buffer_int(out, match->distance);
+  buffer_str(out, ",\"frequency\":");
+  buffer_int(out, match->frequency);
+  buffer_str(out, ",\"doc_count\":");
+  buffer_uint(out, match->doc_count);
+  buffer_append(out, "}", 1);
+}
+
+void result_end(ResultWriter *w) {
+  ByteBuffer *out = w->out;
+  if (!w->binary) {
+    buffer_append(out, "]", 1);
+    if (w->suggestion) {
+      buffer_str(out, ",\"did_you_mean\":");
+      json_string(out, w->suggestion);
+    }
+    buffer_append(out, "}", 1);
+    return;
+  }
+
+  buffer_append(out, w->header, sizeof(w->header));
+  for (int c = 0; c < 4; c++) {
+    buffer_append(out, w->columns[c].data, w->columns[c].len);
+    out->failed |= w->columns[c].failed;
+    free(w->columns[c].data);
+  }
+  buffer_append(out, w->strings.data, w->strings.len);
+  out->failed |= w->strings.failed;
+  free(w->strings.data);
+  if (w->suggestion)
+    buffer_str(out, w->suggestion);
+}
+
+void output_index_result(SearchEngine *engine, int doc_id, ByteBuffer *out) {
+  const char *name = document_name(engine, doc_id);
+  buffer_str(out, "{\"success\":true,\"doc_id\":");
+  buffer_int(out, doc_id);
+  buffer_str(out, ",\"filename\":");
+  json_string(out, name ? name : "unknown");
+  buffer_str(out, ",\"word_count\":");
+  buffer_int(out, document_word_count(engine, doc_id));
+  buffer_append(out, "}", 1);
+}
+
+/* Normalize a single-word query */
+void normalize_query_word(const char *word, char normalized[MAX_WORD_LEN]) {
+  strncpy(normalized, word, MAX_WORD_LEN - 1);
+  normalized[MAX_WORD_LEN - 1] = '\0';
+  normalize_word(normalized);
+}
+
+/* Every posting of one word; search and freq differ only in the fields */
+void output_postings_result(SearchEngine *engine, const char *word, int kind,
+                            TermTable *terms, int binary, ByteBuffer *out) {
+  char normalized[MAX_WORD_LEN];
+  normalize_query_word(word, normalized);
+
+  TermRef term;
+  PostingArray *shared;
+  int found = query_term(engine, terms, normalized, &term, &shared);
+  ResultWriter w;
+  result_begin(&w, engine, kind, &normalized, 1, found,
+               found ? term.total_freq : 0, binary, out);
+  FuzzyMatch suggestion;
+  if (kind == RESULT_SEARCH && !found &&
+      fuzzy_search(engine, normalized,
+                   fuzzy_auto_distance(strlen(normalized)), 1,
+                   &suggestion) > 0)
+    w.suggestion = suggestion.word;
+  if (shared) {
+    // No valid list is longer than the document table
+    uint32_t cap = term_doc_freq(engine, &term);
+    if (cap > (uint32_t)engine->doc_count)
+      cap = (uint32_t)engine->doc_count;
+    const PostingArray *postings =
+        posting_array_shared(engine, &term, cap, shared);
+    for (uint32_t i = 0; i < postings->count; i++)
+      result_doc(&w, (int)postings->docs[i], postings->freqs[i]);
+  } else if (found) {
+    PostingIter it;
+    posting_iter_init(engine, &term, &it);
+    int doc_id, frequency;
+    while (posting_next(&it, &doc_id, &frequency))
+      result_doc(&w, doc_id, (uint32_t)frequency);
+  }
+  result_end(&w);
+}
+
+void output_freq_result(SearchEngine *engine, const char *word,
+                        TermTable *terms, int binary, ByteBuffer *out) {
+  output_postings_result(engine, word, RESULT_FREQ, terms, binary, out);
+}
+
+void output_search_result(SearchEngine *engine, const char *keyword,
+                          TermTable *terms, int binary, ByteBuffer *out) {
+  output_postings_result(engine, keyword, RESULT_SEARCH, terms, binary, out);
+}
+
+/* Multi-keyword AND search with JSON output */
+
+/* Split query into normalized keywords, leaving out stop words; returns how
+ * many */
+int parse_keywords(const char *query, const StopWords *stop_words,
+                   char keywords[][MAX_WORD_LEN]) {
+  int count = 0;
+  char *query_copy = strdup(query);
+  char *cursor = query_copy, *token;
+  while (count < MAX_QUERY_TERMS && (token = next_token(&cursor, " \t\n\r"))) {
+    strncpy(keywords[count], token, MAX_WORD_LEN - 1);
+    keywords[count][MAX_WORD_LEN - 1] = '\0';
+    normalize_word(keywords[count]);
+    if (keywords[count][0] && !is_stop_word(stop_words, keywords[count]))
+      count++;
+  }
+  free(query_copy);
+  return count;
+}
+
+void output_multi_result(SearchEngine *engine, const char *query,
+                         TermTable *table, int binary, ByteBuffer *out) {
+  char keywords[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  int count = parse_keywords(query, engine->stop_words, keywords);
+
+  TermRef terms[MAX_QUERY_TERMS];
+  PostingArray *shared[MAX_QUERY_TERMS];
+  int all_found = count > 0;
+  for (int i = 0; i < count && all_found; i++)
+    all_found = query_term(engine, table, keywords[i], &terms[i], &shared[i]);
+
+  PostingArray matches = {NULL, NULL, 0};
+  if (all_found)
+    intersect_terms(engine, terms, shared, count, &matches);
+
+  ResultWriter w;
+  result_begin(&w, engine, RESULT_MULTI, keywords, count, all_found, 0,
+               binary, out);
+  for (uint32_t i = 0; i < matches.count; i++)
+    result_doc(&w, (int)matches.docs[i], matches.freqs[i]);
+  result_end(&w);
+
+  posting_array_free(&matches);
+}
+
+/*
+ * Split a "<keywords>[\n<documents> <words> <doc_freq>...]" rank query
+ * into its normalized keywords and, if the second line is there, the
+ * corpus statistics to score with: the corpus's live documents, their
+ * words, and each distinct keyword's document count in order of first
+ * appearance (as term_stats lists them). Returns the number of keywords;
+ * *global is 0 without statistics, -1 if they are malformed.
+ */
+int parse_rank_query(const char *query, const StopWords *stop_words,
+                     char keywords[][MAX_WORD_LEN], RankStats *stats,
+                     uint32_t *doc_freqs, int *global) {
+  const char *line = strchr(query, '\n');
+  *global = 0;
+  if (!line)
+    return parse_keywords(query, stop_words, keywords);
+  size_t len = (size_t)(line - query);
+  char *words = (char *)malloc(len + 1);
+  if (!words) {
+    *global = -1;
+    return 0;
+  }
+  memcpy(words, query, len);
+  words[len] = '\0';
+  int count = parse_keywords(words, stop_words, keywords);
+  free(words);
+
+  int distinct = 0;
+  for (int i = 0; i < count; i++) {
+    int repeat = 0;
+    for (int j = 0; j < i && !repeat; j++)
+      repeat = strcmp(keywords[i], keywords[j]) == 0;
+    distinct += !repeat;
+  }
+  char *end;
+  double docs = strtod(line + 1, &end), total = strtod(end, &end);
+  int n = 0;
+  for (;; n++) {
+    end += strspn(end, " ");
+    if (!isdigit((unsigned char)*end) || n == distinct)
+      break;
+    unsigned long value = strtoul(end, &end, 10);
+    doc_freqs[n] = value < UINT32_MAX ? (uint32_t)value : UINT32_MAX;
+  }
+  *global = n == distinct && *end == '\0' && docs >= 0 && total >= 0 ? 1 : -1;
+  *stats = make_rank_stats(docs, total);
+  return count;
+}
+
+/* BM25-ranked top RANK_TOP_K documents matching any keyword */
+void output_rank_result(SearchEngine *engine, const char *query,
+                        TermTable *table, int binary, ByteBuffer *out) {
+  char keywords[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  RankStats stats;
+  uint32_t doc_freqs[MAX_QUERY_TERMS], found_freqs[MAX_QUERY_TERMS];
+  int global;
+  int count = parse_rank_query(query, engine->stop_words, keywords, &stats,
+                               doc_freqs, &global);
+  if (global < 0) {
+    buffer_str(out,
+               "{\"success\":false,\"error\":\"Bad corpus statistics\"}");
+    return;
+  }
+
+  // Each distinct term scores once; unknown terms add nothing
+  TermRef terms[MAX_QUERY_TERMS];
+  int found = 0, distinct = 0;
+  for (int i = 0; i < count; i++) {
+    int repeat = 0;
+    for (int j = 0; j < i && !repeat; j++)
+      repeat = strcmp(keywords[i], keywords[j]) == 0;
+    if (repeat)
+      continue;
+    if (query_term(engine, table, keywords[i], &terms[found], NULL))
+      found_freqs[found++] = doc_freqs[distinct];
+    distinct++;
+  }
+
+  ScoredDoc results[RANK_TOP_K];
+  int n = found > 0 ? rank_terms(engine, terms, found, RANK_TOP_K,
+                                 global ? &stats : NULL, found_freqs, results)
+                    : 0;
+
+  ResultWriter w;
+  result_begin(&w, engine, RESULT_RANK, keywords, count, found > 0, 0,
+               binary, out);
+  for (int i = 0; i < n; i++)
+    result_scored_doc(&w, results[i].doc_id, results[i].score);
+  result_end(&w);
+}
+
+/* Split a "[distance] <words>" query into its distinct normalized words;
+ * the distance defaults to NEAR_DISTANCE. Returns the number of words */
+int parse_near_query(const char *query, const StopWords *stop_words,
+                     char words[][MAX_WORD_LEN], uint32_t *distance) {
+  query += strspn(query, " \t\r\n");
+  size_t digits = strspn(query, "0123456789");
+  *distance = NEAR_DISTANCE;
+  if (digits > 0 && (!query[digits] || strchr(" \t\r\n", query[digits]))) {
+    unsigned long value = strtoul(query, NULL, 10);
+    *distance = value < INT_MAX ? (uint32_t)value : INT_MAX;
+    query += digits;
+  }
+
+  int count = parse_keywords(query, stop_words, words), distinct = 0;
+  for (int i = 0; i < count; i++) {
+    int repeat = 0;
+    for (int j = 0; j < distinct && !repeat; j++)
+      repeat = strcmp(words[i], words[j]) == 0;
+    if (!repeat && distinct != i)
+      strcpy(words[distinct], words[i]);
+    distinct += !repeat;
+  }
+  return distinct;
+}
+
+/* Documents matching the words as a phrase at offsets, or with offsets
+ * NULL within distance, with their match counts */
+void output_positional_result(SearchEngine *engine, int kind,
+                              char words[][MAX_WORD_LEN], int count,
+                              const int *offsets, uint32_t distance,
+                              TermTable *table, int binary,
+                              ByteBuffer *out) {
+  TermRef terms[MAX_QUERY_TERMS];
+  PostingArray *shared[MAX_QUERY_TERMS];
+  int all_found = count > 0;
+  for (int i = 0; i < count && all_found; i++)
+    all_found = query_term(engine, table, words[i], &terms[i], &shared[i]);
+
+  PostingArray matches = {NULL, NULL, 0};
+  if (all_found)
+    match_positions(engine, terms, shared, count, offsets, distance,
+                    &matches);
+
+  ResultWriter w;
+  result_begin(&w, engine, kind, words, count, all_found, 0, binary, out);
+  for (uint32_t i = 0; i < matches.count; i++)
+    result_doc(&w, (int)matches.docs[i], matches.freqs[i]);
+  result_end(&w);
+
+  posting_array_free(&matches);
+}
+
+void output_phrase_result(SearchEngine *engine, const char *query,
+                          TermTable *table, int binary, ByteBuffer *out) {
+  char words[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  int offsets[MAX_QUERY_TERMS];
+  int count = parse_phrase(query, engine->stop_words, words, offsets);
+  output_positional_result(engine, RESULT_PHRASE, words, count, offsets, 0,
+                           table, binary, out);
+}
+
+void output_near_result(SearchEngine *engine, const char *query,
+                        TermTable *table, int binary, ByteBuffer *out) {
+  char words[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  uint32_t distance;
+  int count = parse_near_query(query, engine->stop_words, words, &distance);
+  output_positional_result(engine, RESULT_NEAR, words, count, NULL, distance,
+                           table, binary, out);
+}
+
+/* Documents matching a Boolean query, ascending, each scored with the
+ * summed frequencies of the words it matched (match counts for phrases) */
+void output_boolean_result(SearchEngine *engine, const char *query,
+                           TermTable *table, int binary, ByteBuffer *out) {
+  QueryTree tree;
+  const char *error;
+  ByteBuffer canonical = {0};
+  if (parse_query(query, engine->stop_words, &tree, &error) == 0) {
+    query_render(tree.root, 1, &canonical);
+    buffer_append(&canonical, "", 1);
+    if (canonical.failed ||
+        query_prepare(engine, table, &tree, tree.root) < 0 ||
+        query_use_sets(engine, &tree, &tree.root, UINT64_MAX) < 0)
+      error = "Out of memory";
+  }
+  if (error) {
+    buffer_str(out, "{\"success\":false,\"error\":");
+    json_string(out, error);
+    buffer_append(out, "}", 1);
+    free_query_tree(&tree);
+    free(canonical.data);
+    return;
+  }
+
+  QueryNode *root = tree.root;
+  int doc_id = query_advance(engine, root, 0);
+  ResultWriter w;
+  result_begin_query(&w, engine, RESULT_BOOLEAN, canonical.data,
+                     doc_id != QUERY_DONE, binary, out);
+  for (; doc_id != QUERY_DONE; doc_id = query_advance(engine, root, doc_id + 1))
+    result_doc(&w, doc_id, root->frequency);
+  result_end(&w);
+
+  free_query_tree(&tree);
+  free(canonical.data);
+}
+
+/* Split a "<prefix> [limit]" query into the normalized prefix and the
+ * limit, which defaults to (and is capped at) PREFIX_TOP_K */
+int parse_prefix_query(const char *query, char normalized[MAX_WORD_LEN]) {
+  size_t len = strcspn(query, " \t\r\n");
+  int limit = atoi(query + len);
+  if (limit <= 0 || limit > PREFIX_TOP_K)
+    limit = PREFIX_TOP_K;
+  if (len > MAX_WORD_LEN - 1)
+    len = MAX_WORD_LEN - 1;
+  memcpy(normalized, query, len);
+  normalized[len] = '\0';
+  normalize_word(normalized);
+  return limit;
+}
+
+/* Prefix search with JSON output; query is "<prefix> [limit]" */
+void output_prefix_result(SearchEngine *engine, const char *query, int binary,
+                          ByteBuffer *out) {
+  char normalized[MAX_WORD_LEN];
+  int limit = parse_prefix_query(query, normalized);
+
+  Completion *results = (Completion *)malloc(limit * sizeof(Completion));
+  int count = complete_prefix(engine, normalized, limit, results);
+
+  ResultWriter w;
+  result_begin(&w, engine, RESULT_PREFIX, &normalized, 1, count > 0, 0,
+               binary, out);
+  for (int i = 0; i < count; i++) {
+    // Documents with the word, deleted ones included until a merge
+    TermRef term;
+    uint32_t doc_count = 0;
+    if (lookup_term(engine, results[i].word, &term))
+      doc_count = term_doc_freq(engine, &term);
+    if (doc_count > (uint32_t)engine->doc_count)
+      doc_count = (uint32_t)engine->doc_count;
+    result_word(&w, results[i].word, results[i].frequency, doc_count);
+  }
+  result_end(&w);
+  free(results);
+}
+
+/* Split a "<word> [distance]" query into the normalized word and the
+ * distance, which defaults to fuzzy_auto_distance and is capped at
+ * FUZZY_MAX_DISTANCE */
+int parse_fuzzy_query(const char *query, char normalized[MAX_WORD_LEN]) {
+  size_t len = strcspn(query, " \t\r\n");
+  const char *rest = query + len + strspn(query + len, " \t\r\n");
+  if (len > MAX_WORD_LEN - 1)
+    len = MAX_WORD_LEN - 1;
+  memcpy(normalized, query, len);
+  normalized[len] = '\0';
+  normalize_word(normalized);
+  if (!isdigit((unsigned char)*rest))
+    return fuzzy_auto_distance(strlen(normalized));
+  int distance = atoi(rest);
+  return distance < FUZZY_MAX_DISTANCE ? distance : FUZZY_MAX_DISTANCE;
+}
+
+/* Words within a few edits of a word, nearest and most frequent first;
+ * query is "<word> [distance]" */
+void output_fuzzy_result(SearchEngine *engine, const char *query, int binary,
+                         ByteBuffer *out) {
+  char normalized[MAX_WORD_LEN];
+  int distance = parse_fuzzy_query(query, normalized);
+  FuzzyMatch results[FUZZY_TOP_K];
+  int count = fuzzy_search(engine, normalized, distance, FUZZY_TOP_K, results);
+
+  ResultWriter w;
+  result_begin(&w, engine, RESULT_FUZZY, &normalized, 1, count > 0, 0, binary,
+               out);
+  for (int i = 0; i < count; i++)
+    result_fuzzy_word(&w, &results[i]);
+  result_end(&w);
+}
+
+/* A JSON array of power-of-two buckets (see METRICS) */
+void buffer_buckets(ByteBuffer *out, const uint64_t *buckets, int count) {
+  // Trailing empty buckets are left out
+  while (count > 1 && buckets[count - 1] == 0)
+    count--;
+  buffer_append(out, "[", 1);
+  for (int i = 0; i < count; i++) {
+    if (i > 0)
+      buffer_append(out, ",", 1);
+    buffer_uint(out, buckets[i]);
+  }
+  buffer_append(out, "]", 1);
+}
+
+#if SEARCH_METRICS
+/* Nodes, bytes and posting list lengths of the trie below node */
+void trie_metrics(const TrieNode *node, uint64_t *nodes, uint64_t *bytes,
+                  uint64_t *lengths) {
+  size_t size = offsetof(TrieNode, label) + node->label_len;
+  *nodes += 1;
+  *bytes += size < sizeof(TrieNode) ? sizeof(TrieNode) : size;
+  if (node->child_cap)
+    *bytes += child_block_size(node);
+  if (node->postings.doc_count > 0)
+    lengths[metric_bucket(node->postings.doc_count, LENGTH_BUCKETS)]++;
+  for (int i = 0; i < node->child_count; i++)
+    trie_metrics(node->children[i], nodes, bytes, lengths);
+}
+
+/* Upper bound in microseconds of the latency bucket holding quantile q */
+uint64_t latency_quantile(const uint64_t *buckets, uint64_t count, double q) {
+  uint64_t seen = 0;
+  int k = 0;
+  for (; k < LATENCY_BUCKETS - 1; k++) {
+    seen += buckets[k];
+    if (seen >= q * (double)count)
+      break;
+  }
+  return (uint64_t)1 << k;
+}
+
+/*
+ * The engine's counters, summed over every thread, and the shape of its
+ * structures: the trie nodes and hash table words of its in-memory
+ * segment, the documents not yet sealed, and the distribution of posting
+ * list lengths (a word has a list per segment it is in, and one in
+ * memory). Only the writer's engine has an in-memory segment, so this is
+ * measured on the writer thread, never on a snapshot.
+ */
+void output_metrics(SearchEngine *engine, ByteBuffer *out) {
+  Metrics m;
+  sum_metrics(&m);
+  double index_seconds = m.index_nanos / 1e9;
+  buffer_printf(out,
+                "{\"indexing\":{\"documents\":%llu,\"tokens\":%llu,"
+                "\"seconds\":%.6f,\"tokens_per_second\":%.1f}",
+                (unsigned long long)m.documents_indexed,
+                (unsigned long long)m.tokens_indexed, index_seconds,
+                index_seconds > 0 ? m.tokens_indexed / index_seconds : 0.0);
+
+  const HashTable *table = &engine->hash_table;
+  buffer_printf(out,
+                ",\"hash\":{\"words\":%u,\"capacity\":%u,\"lookups\":%llu,"
+                "\"mean_probes\":%.4f,\"probe_lengths\":",
+                table->count, table->capacity,
+                (unsigned long long)m.hash_lookups,
+                m.hash_lookups ? (double)m.hash_probes / m.hash_lookups : 0.0);
+  buffer_buckets(out, m.probe_lengths, PROBE_BUCKETS);
+
+  uint64_t nodes = 0, bytes = 0, lengths[LENGTH_BUCKETS] = {0};
+  trie_metrics(engine->trie_root, &nodes, &bytes, lengths);
+  buffer_printf(out,
+                "},\"trie\":{\"nodes\":%llu,\"bytes\":%llu,"
+                "\"nodes_created\":%llu,\"bytes_allocated\":%llu}",
+                (unsigned long long)nodes, (unsigned long long)bytes,
+                (unsigned long long)m.trie_nodes,
+                (unsigned long long)m.trie_bytes);
+
+  uint64_t lists = 0;
+  for (int s = 0; s < engine->segment_count; s++) {
+    const MappedIndex *idx = engine->segments[s];
+    for (uint32_t t = 0; t < idx->header->term_count; t++)
+      lengths[metric_bucket(idx->terms[t].doc_freq, LENGTH_BUCKETS)]++;
+  }
+  for (int k = 0; k < LENGTH_BUCKETS; k++)
+    lists += lengths[k];
+  buffer_printf(out, ",\"posting_lists\":{\"lists\":%llu,\"lengths\":",
+                (unsigned long long)lists);
+  buffer_buckets(out, lengths, LENGTH_BUCKETS);
+
+  uint64_t lookups = m.cache_hits + m.cache_misses;
+  buffer_printf(out,
+                "},\"cache\":{\"hits\":%llu,\"misses\":%llu,"
+                "\"hit_rate\":%.4f},\"queries\":{",
+                (unsigned long long)m.cache_hits,
+                (unsigned long long)m.cache_misses,
+                lookups ? (double)m.cache_hits / lookups : 0.0);
+  for (int k = 0, listed = 0; k < QUERY_KINDS; k++) {
+    if (m.queries[k] == 0)
+      continue;
+    buffer_printf(out,
+                  "%s\"%s\":{\"count\":%llu,\"mean_us\":%.3f,"
+                  "\"p50_us\":%llu,\"p99_us\":%llu,\"latency_us\":",
+                  listed++ > 0 ? "," : "", query_kind_names[k],
+                  (unsigned long long)m.queries[k],
+                  m.query_nanos[k] / 1e3 / m.queries[k],
+                  (unsigned long long)latency_quantile(m.query_latency[k],
+                                                       m.queries[k], 0.5),
+                  (unsigned long long)latency_quantile(m.query_latency[k],
+                                                       m.queries[k], 0.99));
+    buffer_buckets(out, m.query_latency[k], LATENCY_BUCKETS);
+    buffer_append(out, "}", 1);
+  }
+  buffer_append(out, "}}", 2);
+}
+#endif
+
+/* Distinct words across the segments and memory, counting words whose
+ * every posting is deleted until a merge drops them; each is also added to
+ * words, if not NULL, as a comma-separated JSON string */
+uint64_t distinct_term_count(SearchEngine *engine, ByteBuffer *words) {
+  // The segments' dictionaries are sorted; merge them
+  uint64_t count = 0;
+  uint32_t next[MAX_SEGMENTS] = {0};
+  for (;;) {
+    const char *word = NULL;
+    for (int s = 0; s < engine->segment_count; s++) {
+      const MappedIndex *idx = engine->segments[s];
+      if (next[s] < idx->header->term_count) {
+        const char *w = index_string(idx, idx->terms[next[s]].word_offset);
+        if (!word || strcmp(w, word) < 0)
+          word = w;
+      }
+    }
+    if (!word)
+      break;
+    if (words) {
+      if (count > 0)
+        buffer_append(words, ",", 1);
+      json_string(words, word);
+    }
+    count++;
+    for (int s = 0; s < engine->segment_count; s++) {
+      const MappedIndex *idx = engine->segments[s];
+      if (next[s] < idx->header->term_count &&
+          strcmp(index_string(idx, idx->terms[next[s]].word_offset), word) ==
+              0)
+        next[s]++;
+    }
+  }
+
+  // In-memory words that no segment has
+  const HashTable *table = &engine->hash_table;
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    if (!table->slots[i].trie_node)
+      continue;
+    const char *word = table->pool.data + table->slots[i].word_offset;
+    int mapped = 0;
+    for (int s = 0; s < engine->segment_count && !mapped; s++)
+      mapped = index_find_term(engine->segments[s], word) != NULL;
+    if (mapped)
+      continue;
+    if (words) {
+      if (count > 0)
+        buffer_append(words, ",", 1);
+      json_string(words, word);
+    }
+    count++;
+  }
+  return count;
+}
+
+/* Live documents, distinct words, indexed words and segments of the
+ * engine, and its metrics */
+void output_stats_result(SearchEngine *engine, ByteBuffer *out) {
+  buffer_str(out, "{\"success\":true,\"documents\":");
+  buffer_int(out, engine->doc_count - engine->deleted_count);
+  buffer_str(out, ",\"terms\":");
+  buffer_uint(out, distinct_term_count(engine, NULL));
+  buffer_str(out, ",\"words\":");
+  buffer_uint(out, live_word_count(engine));
+  buffer_str(out, ",\"segments\":");
+  buffer_int(out, engine->segment_count);
+#if SEARCH_METRICS
+  buffer_str(out, ",\"metrics\":");
+  output_metrics(engine, out);
+#endif
+  buffer_append(out, "}", 1);
+}
+
+/* Every distinct word of the engine, in no particular order: what a
+ * coordinator unions over the shards of a corpus to count its distinct
+ * words, which stats can only sum */
+void output_vocabulary_result(SearchEngine *engine, ByteBuffer *out) {
+  buffer_str(out, "{\"success\":true,\"terms\":[");
+  distinct_term_count(engine, out);
+  buffer_append(out, "]}", 2);
+}
+
+/*
+ * Rank statistics of the engine's documents and of each distinct keyword,
+ * in order of first appearance, deleted documents included as rank_stats
+ * counts them so the two agree: what a coordinator sums over the shards of
+ * a corpus to give every shard the whole corpus's (see parse_rank_query),
+ * and the exact totals of words whose shard-local counts it only bounds.
+ */
+void output_term_stats_result(SearchEngine *engine, const char *query,
+                              ByteBuffer *out) {
+  char keywords[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  int count = parse_keywords(query, engine->stop_words, keywords);
+  buffer_str(out, "{\"success\":true,\"documents\":");
+  buffer_int(out, engine->doc_count);
+  buffer_str(out, ",\"words\":");
+  buffer_uint(out, indexed_word_count(engine));
+  buffer_str(out, ",\"terms\":[");
+  for (int i = 0, listed = 0; i < count; i++) {
+    int repeat = 0;
+    for (int j = 0; j < i && !repeat; j++)
+      repeat = strcmp(keywords[i], keywords[j]) == 0;
+    if (repeat)
+      continue;
+    TermRef term;
+    int found = lookup_term(engine, keywords[i], &term);
+    buffer_str(out, listed++ > 0 ? ",{\"word\":" : "{\"word\":");
+    json_string(out, keywords[i]);
+    buffer_str(out, ",\"total_freq\":");
+    buffer_int(out, found ? term.total_freq : 0);
+    buffer_str(out, ",\"doc_freq\":");
+    buffer_uint(out, found ? term_doc_freq(engine, &term) : 0);
+    buffer_append(out, "}", 1);
+  }
+  buffer_append(out, "]}", 2);
+}
+
+void output_unknown_command(const char *cmd, ByteBuffer *out) {
+  buffer_str(out, "{\"success\":false,\"error\":\"Unknown command: ");
+  json_escape(out, cmd);
+  buffer_append(out, "\"}", 2);
+}
+
+/* Commands that only read the engine */
+int is_query_command(const char *cmd) {
+  return strcmp(cmd, "search") == 0 || strcmp(cmd, "freq") == 0 ||
+         strcmp(cmd, "prefix") == 0 || strcmp(cmd, "multi") == 0 ||
+         strcmp(cmd, "rank") == 0 || strcmp(cmd, "phrase") == 0 ||
+         strcmp(cmd, "near") == 0 || strcmp(cmd, "boolean") == 0 ||
+         strcmp(cmd, "fuzzy") == 0 || strcmp(cmd, "term_stats") == 0;
+}
+
+/* Answer one query command, as JSON or a binary record, looking terms up
+ * through terms if not NULL; returns 0 if cmd is not a query */
+int output_query_result(SearchEngine *engine, const char *cmd,
+                        const char *arg, TermTable *terms, int binary,
+                        ByteBuffer *out) {
+  if (strcmp(cmd, "search") == 0)
+    output_search_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "freq") == 0)
+    output_freq_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "prefix") == 0)
+    output_prefix_result(engine, arg, binary, out);
+  else if (strcmp(cmd, "multi") == 0)
+    output_multi_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "rank") == 0)
+    output_rank_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "phrase") == 0)
+    output_phrase_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "near") == 0)
+    output_near_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "boolean") == 0)
+    output_boolean_result(engine, arg, terms, binary, out);
+  else if (strcmp(cmd, "fuzzy") == 0)
+    output_fuzzy_result(engine, arg, binary, out);
+  else if (strcmp(cmd, "term_stats") == 0)
+    output_term_stats_result(engine, arg, out);
+  else
+    return 0;
+  return 1;
+}
+
+/* ==================== QUERY CACHE ==================== */
+
+/*
+ * Finished responses of recent queries, keyed by the command and its
+ * normalized arguments, so "Apple" and "apple!" share an entry (prefix
+ * keys include the limit, near and fuzzy keys the distance, phrase keys
+ * the word offsets and Boolean keys the query's canonical form). Each
+ * entry records the generation of the engine it was computed on; indexing,
+ * deleting, flushing and merging all bump the generation, so an entry from
+ * before any change is a miss and is the first to go when room is needed.
+ *
+ * Replacement is CLOCK: a hit sets the entry's reference bit, and the hand
+ * evicts the first entry whose bit is clear, clearing bits as it passes.
+ * Responses over CACHE_BYTES / 16 are not kept.
+ *
+ * The network server's query workers share one cache, so a lock covers
+ * lookups and inserts; it is never held while a query runs.
+ */
+#define CACHE_ENTRIES 1024
+#define CACHE_BYTES (16 << 20)  // Keys and responses held at once
+#define CACHE_KEY_LEN (64 + MAX_QUERY_TERMS * (MAX_WORD_LEN + 12))
+
+typedef struct CacheEntry {
+  char *key;  // NULL while the entry is free
+  char *response;
+  size_t response_len;
+  uint32_t hash;
+  uint64_t generation;
+  int referenced;
+  int next;  // Next entry in the bucket, or -1
+} CacheEntry;
+
+struct QueryCache {
+  CacheEntry entries[CACHE_ENTRIES];
+  int buckets[CACHE_ENTRIES];  // First entry per key hash, or -1
+  int hand;
+  int count;
+  size_t bytes;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  Mutex lock;
+};
+
+QueryCache *create_query_cache() {
+  QueryCache *cache = (QueryCache *)calloc(1, sizeof(QueryCache));
+  if (!cache)
+    return NULL;
+  for (int i = 0; i < CACHE_ENTRIES; i++)
+    cache->buckets[i] = -1;
+  mutex_init(&cache->lock);
+  return cache;
+}
+
+/* The cache key of a query in one response format; returns its length, 0
+ * for other commands, for rank queries with malformed statistics and for
+ * Boolean queries that fail to parse or whose canonical form does not
+ * fit */
+size_t query_cache_key(const char *cmd, const char *arg,
+                       const StopWords *stop_words, int binary, char *key) {
+  char words[MAX_QUERY_TERMS][MAX_WORD_LEN];
+  int offsets[MAX_QUERY_TERMS];
+  int count, limit = 0, phrase = 0, global = 0;
+  RankStats stats;
+  uint32_t doc_freqs[MAX_QUERY_TERMS];
+  if (strcmp(cmd, "boolean") == 0) {
+    QueryTree tree;
+    const char *error;
+    ByteBuffer canonical = {0};
+    size_t len = (size_t)sprintf(key, "%s%s 0 ", cmd, binary ? "/b" : "");
+    if (parse_query(arg, stop_words, &tree, &error) == 0)
+      query_render(tree.root, 1, &canonical);
+    free_query_tree(&tree);
+    if (error || canonical.failed ||
+        len + canonical.len >= CACHE_KEY_LEN) {
+      free(canonical.data);
+      return 0;
+    }
+    if (canonical.len)  // An empty query renders nothing, leaving data NULL
+      memcpy(key + len, canonical.data, canonical.len);
+    len += canonical.len;
+    key[len] = '\0';
+    free(canonical.data);
+    return len;
+  }
+  if (strcmp(cmd, "search") == 0 || strcmp(cmd, "freq") == 0) {
+    strncpy(words[0], arg, MAX_WORD_LEN - 1);
+    words[0][MAX_WORD_LEN - 1] = '\0';
+    normalize_word(words[0]);
+    count = 1;
+  } else if (strcmp(cmd, "prefix") == 0) {
+    limit = parse_prefix_query(arg, words[0]);
+    count = 1;
+  } else if (strcmp(cmd, "fuzzy") == 0) {
+    limit = parse_fuzzy_query(arg, words[0]);
+    count = 1;
+  } else if (strcmp(cmd, "multi") == 0) {
+    count = parse_keywords(arg, stop_words, words);
+  } else if (strcmp(cmd, "rank") == 0) {
+    count = parse_rank_query(arg, stop_words, words, &stats, doc_freqs,
+                             &global);
+    if (global < 0)
+      return 0;
+  } else if (strcmp(cmd, "phrase") == 0) {
+    count = parse_phrase(arg, stop_words, words, offsets);
+    phrase = 1;
+  } else if (strcmp(cmd, "near") == 0) {
+    uint32_t distance;
+    count = parse_near_query(arg, stop_words, words, &distance);
+    limit = (int)distance;
+  } else {
+    return 0;
+  }
+
+  size_t len =
+      (size_t)sprintf(key, "%s%s %d", cmd, binary ? "/b" : "", limit);
+  for (int i = 0; i < count; i++)
+    len += (size_t)(phrase ? sprintf(key + len, " %s@%d", words[i],
+                                     offsets[i])
+                           : sprintf(key + len, " %s", words[i]));
+  if (global) {
+    // Scores depend on the corpus statistics as much as on the words
+    len += (size_t)sprintf(key + len, " | %.17g %.17g", stats.doc_count,
+                           stats.avg_len);
+    for (int i = 0, distinct = 0; i < count; i++) {
+      int repeat = 0;
+      for (int j = 0; j < i && !repeat; j++)
+        repeat = strcmp(words[i], words[j]) == 0;
+      if (!repeat)
+        len += (size_t)sprintf(key + len, " %u", doc_freqs[distinct++]);
+    }
+  }
+  return len;
+}
+
+/* Free an entry, unlinking it from its bucket */
+void cache_drop(QueryCache *cache, int i) {
+  CacheEntry *entry = &cache->entries[i];
+  int *link = &cache->buckets[entry->hash % CACHE_ENTRIES];
+  while (*link != i)
+    link = &cache->entries[*link].next;
+  *link = entry->next;
+  cache->bytes -= strlen(entry->key) + 1 + entry->response_len;
+  cache->count--;
+  free(entry->key);
+  free(entry->response);
+  entry->key = NULL;
+  entry->response = NULL;
+}
+
+/* Advance the hand to an entry to reuse, evicting it if it is taken */
+int cache_victim(QueryCache *cache, uint64_t generation) {
+  for (;;) {
+    int i = cache->hand;
+    CacheEntry *entry = &cache->entries[i];
+    cache->hand = (i + 1) % CACHE_ENTRIES;
+    if (entry->key && entry->generation == generation && entry->referenced) {
+      entry->referenced = 0;
+      continue;
+    }
+    if (entry->key) {
+      cache_drop(cache, i);
+      cache->evictions++;
+    }
+    return i;
+  }
+}
+
+/* The cached response for key at generation, or NULL */
+const CacheEntry *cache_lookup(QueryCache *cache, const char *key,
+                               uint32_t hash, uint64_t generation) {
+  for (int i = cache->buckets[hash % CACHE_ENTRIES]; i >= 0;
+       i = cache->entries[i].next) {
+    CacheEntry *entry = &cache->entries[i];
+    if (entry->hash != hash || strcmp(entry->key, key) != 0)
+      continue;
+    if (entry->generation != generation) {
+      cache_drop(cache, i);
+      return NULL;
+    }
+    entry->referenced = 1;
+    return entry;
+  }
+  return NULL;
+}
+
+void cache_insert(QueryCache *cache, const char *key, uint32_t hash,
+                  uint64_t generation, const char *response, size_t len) {
+  size_t size = strlen(key) + 1 + len;
+  if (size > CACHE_BYTES / 16)
+    return;
+  int i = cache_victim(cache, generation);
+  while (cache->bytes + size > CACHE_BYTES)
+    i = cache_victim(cache, generation);
+
+  CacheEntry *entry = &cache->entries[i];
+  entry->key = strdup(key);
+  entry->response = (char *)malloc(len);
+  if (!entry->key || !entry->response) {
+    free(entry->key);
+    free(entry->response);
+    entry->key = NULL;
+    entry->response = NULL;
+    return;
+  }
+  memcpy(entry->response, response, len);
+  entry->response_len = len;
+  entry->hash = hash;
+  entry->generation = generation;
+  entry->referenced = 0;
+  entry->next = cache->buckets[hash % CACHE_ENTRIES];
+  cache->buckets[hash % CACHE_ENTRIES] = i;
+  cache->bytes += size;
+  cache->count++;
+}
+
+void free_query_cache(QueryCache *cache) {
+  if (!cache)
+    return;
+  for (int i = 0; i < CACHE_ENTRIES; i++) {
+    free(cache->entries[i].key);
+    free(cache->entries[i].response);
+  }
+  mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+/* Answer a query on engine through cache (JSON and binary responses are
+ * cached apart); returns 0 if cmd is not a query */
+int output_cached_query(QueryCache *cache, SearchEngine *engine,
+                        const char *cmd, const char *arg, TermTable *terms,
+                        int binary, ByteBuffer *out) {
+  METRIC(uint64_t started = clock_nanos());
+  char key[CACHE_KEY_LEN];
+  size_t key_len =
+      cache ? query_cache_key(cmd, arg, engine->stop_words, binary, key) : 0;
+  if (key_len == 0) {
+    int answered = output_query_result(engine, cmd, arg, terms, binary, out);
+    METRIC(count_query(cmd, started));
+    return answered;
+  }
+
+  uint32_t hash = hash_func(key);
+  mutex_lock(&cache->lock);
+  const CacheEntry *entry =
+      cache_lookup(cache, key, hash, engine->generation);
+  if (entry) {
+    cache->hits++;
+    buffer_append(out, entry->response, entry->response_len);
+    mutex_unlock(&cache->lock);
+    METRIC(metric_add(&thread_metrics()->cache_hits, 1));
+    METRIC(count_query(cmd, started));
+    return 1;
+  }
+  cache->misses++;
+  mutex_unlock(&cache->lock);
+
+  size_t start = out->len;
+  output_query_result(engine, cmd, arg, terms, binary, out);
+  mutex_lock(&cache->lock);
+  // Another worker may have answered the same query meanwhile
+  if (!out->failed && !cache_lookup(cache, key, hash, engine->generation))
+    cache_insert(cache, key, hash, engine->generation, out->data + start,
+                 out->len - start);
+  mutex_unlock(&cache->lock);
+  METRIC(metric_add(&thread_metrics()->cache_misses, 1));
+  METRIC(count_query(cmd, started));
+  return 1;
+}
+
+void output_cache_stats(QueryCache *cache, ByteBuffer *out) {
+  if (cache)
+    mutex_lock(&cache->lock);
+  uint64_t hits = cache ? cache->hits : 0, misses = cache ? cache->misses : 0;
+  buffer_printf(out,
+                "{\"success\":true,\"entries\":%d,\"bytes\":%llu,"
+                "\"hits\":%llu,\"misses\":%llu,\"hit_rate\":%.4f,"
+                "\"evictions\":%llu}",
+                cache ? cache->count : 0,
+                (unsigned long long)(cache ? cache->bytes : 0),
+                (unsigned long long)hits, (unsigned long long)misses,
+                hits + misses ? (double)hits / (double)(hits + misses) : 0.0,
+                (unsigned long long)(cache ? cache->evictions : 0));
+  if (cache)
+    mutex_unlock(&cache->lock);
+}
+
+/* ==================== BATCH QUERIES ==================== */
+
+/*
+ * A batch is newline-separated "<command> <argument>" queries, answered
+ * together from one version of the engine:
+ *
+ *   {"success":true,"count":<n>,"results":[<response>,...]}
+ *
+ * or, binary, a record of uint32_t RESULT_BATCH and n, then per query its
+ * response's length and bytes (a result record, or JSON for a line that is
+ * not a query). Every term is noted before the first query runs, so each
+ * is looked up once and a posting list that several queries read in full
+ * is decoded once; repeated queries are answered by the query cache.
+ */
+
+typedef struct BatchQuery {
+  const char *cmd;
+  const char *arg;
+} BatchQuery;
+
+/* Split queries in place, skipping blank lines; returns how many there
+ * are, or -1 if memory runs out. The caller frees *batch */
+int parse_batch(char *queries, BatchQuery **batch) {
+  int count = 0, cap = 0;
+  *batch = NULL;
+  char *cursor = queries, *line;
+  while ((line = next_token(&cursor, "\r\n"))) {
+    line += strspn(line, " \t");
+    if (!line[0])
+      continue;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 16;
+      BatchQuery *grown =
+          (BatchQuery *)realloc(*batch, (size_t)cap * sizeof(BatchQuery));
+      if (!grown) {
+        free(*batch);
+        *batch = NULL;
+        return -1;
+      }
+      *batch = grown;
+    }
+    char *arg = line + strcspn(line, " \t");
+    if (*arg)
+      *arg++ = '\0';
+    (*batch)[count].cmd = line;
+    (*batch)[count].arg = arg;
+    count++;
+  }
+  return count;
+}
+
+/* Note the terms of every query; a term missing after running out of
+ * memory is only looked up once per query */
+void plan_batch(const BatchQuery *batch, int count,
+                const StopWords *stop_words, TermTable *terms) {
+  for (int q = 0; q < count; q++) {
+    const char *cmd = batch[q].cmd;
+    char words[MAX_QUERY_TERMS][MAX_WORD_LEN];
+    int n = 0;
+    if (strcmp(cmd, "search") == 0 || strcmp(cmd, "freq") == 0) {
+      normalize_query_word(batch[q].arg, words[0]);
+      n = 1;
+    } else if (strcmp(cmd, "multi") == 0 || strcmp(cmd, "rank") == 0) {
+      n = parse_keywords(batch[q].arg, stop_words, words);
+    } else if (strcmp(cmd, "phrase") == 0) {
+      int offsets[MAX_QUERY_TERMS];
+      n = parse_phrase(batch[q].arg, stop_words, words, offsets);
+    } else if (strcmp(cmd, "near") == 0) {
+      uint32_t distance;
+      n = parse_near_query(batch[q].arg, stop_words, words, &distance);
+    } else if (strcmp(cmd, "boolean") == 0) {
+      QueryTree tree;
+      const char *error;
+      if (parse_query(batch[q].arg, stop_words, &tree, &error) == 0)
+        for (int i = 0; i < tree.count && n < MAX_QUERY_TERMS; i++)
+          if (tree.nodes[i]->type == QUERY_TERM)
+            strcpy(words[n++], tree.nodes[i]->word);
+      free_query_tree(&tree);
+    }
+    // Ranking and Boolean queries read postings lazily, so only their
+    // lookups are shared
+    int scans = strcmp(cmd, "rank") != 0 && strcmp(cmd, "boolean") != 0;
+    for (int i = 0; i < n; i++) {
+      int repeat = 0;
+      for (int j = 0; j < i && !repeat; j++)
+        repeat = strcmp(words[i], words[j]) == 0;
+      if (!repeat)
+        term_table_add(terms, words[i], scans);
+    }
+  }
+}
+
+/* Answer the batch in queries (split in place) on engine through cache */
+void output_batch_result(QueryCache *cache, SearchEngine *engine,
+                         char *queries, int binary, ByteBuffer *out) {
+  BatchQuery *batch;
+  int count = parse_batch(queries, &batch);
+  if (count < 0) {
+    buffer_str(out, "{\"success\":false,\"error\":\"Out of memory\"}");
+    return;
+  }
+  TermTable terms = {NULL, 0, 0};
+  plan_batch(batch, count, engine->stop_words, &terms);
+
+  if (binary) {
+    uint32_t header[2] = {RESULT_BATCH, (uint32_t)count};
+    buffer_append(out, header, sizeof(header));
+  } else {
+    buffer_str(out, "{\"success\":true,\"count\":");
+    buffer_int(out, count);
+    buffer_str(out, ",\"results\":[");
+  }
+  for (int q = 0; q < count; q++) {
+    size_t length_at = 0;
+    if (binary)
+      length_at = buffer_append(out, NULL, sizeof(uint32_t));
+    else if (q > 0)
+      buffer_append(out, ",", 1);
+    size_t start = out->len;
+    if (!output_cached_query(cache, engine, batch[q].cmd, batch[q].arg,
+                             &terms, binary, out))
+      output_unknown_command(batch[q].cmd, out);
+    if (binary && !out->failed) {
+      uint32_t length = (uint32_t)(out->len - start);
+      memcpy(out->data + length_at, &length, sizeof(length));
+    }
+  }
+  if (!binary)
+    buffer_append(out, "]}", 2);
+
+  term_table_free(&terms);
+  free(batch);
+}
+
+/* Read a whole batch file, NUL-terminated; returns 0 or -1 */
+int read_batch_file(const char *path, ByteBuffer *queries) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return -1;
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    buffer_append(queries, chunk, n);
+  buffer_append(queries, "", 1);
+  int failed = ferror(file) || queries->failed;
+  fclose(file);
+  return failed ? -1 : 0;
+}
+
+/* ==================== REQUESTS ==================== */
+
+/*
+ * Every front end answers the same requests: a command and its payload,
+ * answered with one JSON object, or a binary record for query results
+ * after "format binary" (see ResultWriter). serve frames them on
+ * stdin/stdout, listen over TCP, and search_request passes them in and
+ * out of the library; each runs them on a SearchHandle.
+ *
+ *   index      payload is "<name>\n<text>"
+ *   index_dir  payload is a directory; its files are indexed in parallel
+ *   search     payload is the keyword
+ *   freq       payload is the word
+ *   prefix     payload is "<prefix> [limit]"; most frequent words first
+ *   fuzzy      payload is "<word> [distance]"; words within distance edits
+ *              (at most 2), nearest and most frequent first
+ *   multi      payload is whitespace-separated keywords
+ *   rank       payload is whitespace-separated keywords (BM25 top 10),
+ *              optionally followed by a line of corpus statistics to score
+ *              with (see parse_rank_query)
+ *   term_stats payload is whitespace-separated keywords; document and word
+ *              counts, and each keyword's frequency and document count
+ *   phrase     payload is the phrase; documents holding its words in order
+ *   near       payload is "[distance] <words>"; documents holding every word
+ *              within distance positions of the others
+ *   boolean    payload is a Boolean query (see BOOLEAN QUERIES); matching
+ *              documents ascending, scored by summed frequencies
+ *   batch      payload is newline-separated "<command> <argument>" queries,
+ *              answered in one response (see BATCH QUERIES)
+ *   stats      live documents, distinct words, indexed words, segments
+ *              and metrics (see METRICS; empty payload)
+ *   vocabulary every distinct word (empty payload)
+ *   delete     payload is a doc_id; its document stops matching queries,
+ *              though term statistics count it until a merge drops it
+ *   save       payload is an index file path to write, compacted: deleted
+ *              documents are dropped and the rest renumbered in order
+ *   load       payload is an index file or directory to map (replaces the
+ *              engine)
+ *   open       payload is an index directory, created if missing; new
+ *              documents are flushed to it as segments (replaces the engine)
+ *              save, load and open reject an empty path, and a failed load
+ *              or open keeps the current engine
+ *   flush      seal the in-memory segment now (into the open directory, if
+ *              any)
+ *   cache      query cache size and hit counters (empty payload)
+ *   format     payload is "json" or "binary"; how responses are sent from
+ *              this one on
+ *   stopwords  payload is "default", "none" (or empty) or whitespace-
+ *              separated words; the stop words left out of documents
+ *              indexed from then on and out of queries (see STOP WORDS)
+ *   bitmaps    payload is "on" or "off"; whether index files written from
+ *              then on store dense terms as bitmaps (see INDEX WRITER)
+ *   reset      drop every indexed document (empty payload)
+ *   quit       stop the server (empty payload)
+ *
+ * Queries read the latest published version of the engine, publishing
+ * first if anything changed, exactly as a reader thread would, and go
+ * through the handle's query cache. load, open and reset replace the
+ * handle's engine by one with its stop words and bitmap setting.
+ */
+
+/* Whether cmd only reads the engine and a snapshot can answer it: a query
+ * or a batch. Stats are not one, as they measure the writer's in-memory
+ * trie and hash table, which snapshots leave out */
+int is_read_command(const char *cmd) {
+  return is_query_command(cmd) || strcmp(cmd, "batch") == 0;
+}
+
+/* Answer a read command on engine, the handle's or a version of it,
+ * through the handle's query cache */
+void answer_query(SearchHandle *handle, SearchEngine *engine,
+                  const char *cmd, char *payload, int binary,
+                  ByteBuffer *out) {
+  if (strcmp(cmd, "batch") == 0) {
+    METRIC(uint64_t started = clock_nanos());
+    output_batch_result(handle->cache, engine, payload, binary, out);
+    METRIC(count_query(cmd, started));
+  }
+  else
+    output_cached_query(handle->cache, engine, cmd, payload, NULL, binary,
+                        out);
+}
+
+/* Answer a read command from a snapshot; the writer's engine answers
+ * directly if publishing fails */
+void serve_query(SearchHandle *handle, const char *cmd, char *payload,
+                 ByteBuffer *out) {
+  Snapshots *snap = NULL;
+  SearchEngine *view = NULL;
+  if (snapshot_refresh(handle->engine) == 0) {
+    snap = handle->engine->snapshots;
+    view = snapshot_acquire(snap, 0);
+  }
+  answer_query(handle, view ? view : handle->engine, cmd, payload,
+               handle->binary, out);
+  if (view)
+    snapshot_release(snap, 0);
+}
+
+/* An empty engine with the handle's settings */
+SearchEngine *handle_engine(const SearchHandle *handle) {
+  SearchEngine *engine = create_search_engine();
+  engine->stop_words = handle->stop_words;
+  engine->bitmap_terms = handle->bitmap_terms;
+  return engine;
+}
+
+/* Replace the handle's engine with engine; cached responses go with the
+ * old one */
+void replace_engine(SearchHandle *handle, SearchEngine *engine) {
+  close_engine(handle->engine);
+  handle->engine = engine;
+  free_query_cache(handle->cache);
+  handle->cache = create_query_cache();
+}
+
+/* An engine opened at path, as load (create 0: a file or directory) or open
+ * (create 1: a directory, started if missing) does, or NULL; the current
+ * engine stays in place until the caller swaps the result in */
+SearchEngine *open_engine(SearchHandle *handle, const char *path,
+                          int create) {
+  // A merge still running would commit to a directory the new engine reads
+  merge_finish(handle->engine, 1);
+  SearchEngine *engine = handle_engine(handle);
+  int docs = create ? open_index_dir(engine, path, 1)
+                    : open_index(engine, path);
+  if (docs < 0) {
+    close_engine(engine);
+    return NULL;
+  }
+  return engine;
+}
+
+/* Whether payload names a path: an empty one would put an index
+ * directory's files at the filesystem root */
+int is_path(const char *payload) {
+  return payload[strspn(payload, " \t\r\n")] != '\0';
+}
+
+/* Answer one request on the handle; returns 0 for "quit", otherwise 1 */
+int serve_request(SearchHandle *handle, const char *cmd, char *payload,
+                  ByteBuffer *out) {
+  merge_step(handle->engine);
+  if (is_read_command(cmd)) {
+    serve_query(handle, cmd, payload, out);
+    return 1;
+  }
+
+  if (strcmp(cmd, "index") == 0) {
+    char *text = strchr(payload, '\n');
+    if (text)
+      *text++ = '\0';
+    else
+      text = "";
+    int doc_id = index_text(handle->engine, payload, text);
+    output_index_result(handle->engine, doc_id, out);
+    flush_if_full(handle->engine);
+  } else if (strcmp(cmd, "stats") == 0) {
+    output_stats_result(handle->engine, out);
+  } else if (strcmp(cmd, "vocabulary") == 0) {
+    output_vocabulary_result(handle->engine, out);
+  } else if (strcmp(cmd, "index_dir") == 0) {
+    int skipped;
+    int added = index_directory(handle->engine, payload, 0, &skipped);
+    if (added < 0)
+      buffer_printf(out,
+                    "{\"success\":false,\"error\":\"Cannot read directory\"}");
+    else
+      buffer_printf(out,
+                    "{\"success\":true,\"indexed\":%d,\"skipped\":%d,"
+                    "\"documents\":%d}",
+                    added, skipped, handle->engine->doc_count);
+    flush_if_full(handle->engine);
+  } else if (strcmp(cmd, "delete") == 0) {
+    char *end;
+    long doc_id = strtol(payload, &end, 10);
+    int result = end != payload && doc_id >= 0 && doc_id <= INT_MAX
+                     ? delete_document(handle->engine, (int)doc_id)
+                     : -1;
+    if (result < 0)
+      buffer_printf(out, "{\"success\":false,\"error\":\"Unknown document\"}");
+    else
+      buffer_printf(out, "{\"success\":true,\"doc_id\":%ld,\"deleted\":%s}",
+                    doc_id, result ? "true" : "false");
+  } else if ((strcmp(cmd, "save") == 0 || strcmp(cmd, "load") == 0 ||
+              strcmp(cmd, "open") == 0) &&
+             !is_path(payload)) {
+    buffer_str(out, "{\"success\":false,\"error\":\"Missing path\"}");
+  } else if (strcmp(cmd, "save") == 0) {
+    SearchEngine *engine = handle->engine;
+    int terms = save_index(engine, payload);
+    if (terms < 0)
+      buffer_printf(
+          out, "{\"success\":false,\"error\":\"Cannot write index file\"}");
+    else
+      buffer_printf(out, "{\"success\":true,\"documents\":%d,\"terms\":%d}",
+                    engine->doc_count - engine->deleted_count, terms);
+  } else if (strcmp(cmd, "load") == 0) {
+    SearchEngine *engine = open_engine(handle, payload, 0);
+    if (!engine) {
+      buffer_printf(out,
+                    "{\"success\":false,\"error\":\"Cannot load index file\"}");
+    } else {
+      replace_engine(handle, engine);
+      buffer_printf(out, "{\"success\":true,\"documents\":%d}",
+                    engine->doc_count);
+    }
+  } else if (strcmp(cmd, "open") == 0) {
+    SearchEngine *engine = open_engine(handle, payload, 1);
+    if (!engine) {
+      buffer_printf(
+          out, "{\"success\":false,\"error\":\"Cannot open index directory\"}");
+    } else {
+      replace_engine(handle, engine);
+      buffer_printf(out, "{\"success\":true,\"documents\":%d,\"segments\":%d}",
+                    engine->doc_count, engine->segment_count);
+    }
+  } else if (strcmp(cmd, "flush") == 0) {
+    int segments = flush_segment(handle->engine);
+    if (segments < 0)
+      buffer_printf(out,
+                    "{\"success\":false,\"error\":\"Cannot flush segment\"}");
+    else
+      buffer_printf(out, "{\"success\":true,\"documents\":%d,\"segments\":%d}",
+                    handle->engine->doc_count, segments);
+  } else if (strcmp(cmd, "cache") == 0) {
+    output_cache_stats(handle->cache, out);
+  } else if (strcmp(cmd, "format") == 0) {
+    if (strcmp(payload, "binary") == 0 || strcmp(payload, "json") == 0) {
+      handle->binary = payload[0] == 'b';
+      buffer_str(out, "{\"success\":true,\"format\":");
+      json_string(out, payload);
+      buffer_append(out, "}", 1);
+    } else {
+      buffer_str(out, "{\"success\":false,\"error\":\"Unknown format\"}");
+    }
+  } else if (strcmp(cmd, "stopwords") == 0) {
+    int use_default = strcmp(payload, "default") == 0;
+    int custom = !use_default && strcmp(payload, "none") != 0 &&
+                 payload[strspn(payload, " \t\r\n")];
+    const StopWords *words = custom        ? build_stop_words(payload)
+                             : use_default ? &default_stop_words
+                                           : NULL;
+    if (custom && !words) {
+      buffer_str(
+          out, "{\"success\":false,\"error\":\"Cannot build stop word list\"}");
+    } else {
+      // Published versions point to the old list until the next publish
+      handle->engine->stop_words = words;
+      handle->engine->generation++;
+      free_stop_words(handle->stop_words);  // Leaves the static default
+      handle->stop_words = words;
+      // Cached responses were parsed with the old list
+      free_query_cache(handle->cache);
+      handle->cache = create_query_cache();
+      buffer_printf(out, "{\"success\":true,\"stop_words\":%u}",
+                    words ? words->count : 0);
+    }
+  } else if (strcmp(cmd, "bitmaps") == 0) {
+    if (strcmp(payload, "on") == 0 || strcmp(payload, "off") == 0) {
+      handle->bitmap_terms = payload[1] == 'n';
+      handle->engine->bitmap_terms = handle->bitmap_terms;
+      buffer_printf(out, "{\"success\":true,\"bitmaps\":%s}",
+                    handle->bitmap_terms ? "true" : "false");
+    } else {
+      buffer_str(out, "{\"success\":false,\"error\":\"Unknown setting\"}");
+    }
+  } else if (strcmp(cmd, "reset") == 0) {
+    replace_engine(handle, handle_engine(handle));
+    buffer_printf(out, "{\"success\":true}");
+  } else if (strcmp(cmd, "quit") == 0) {
+    buffer_printf(out, "{\"success\":true}");
+    return 0;
+  } else {
+    output_unknown_command(cmd, out);
+  }
+  return 1;
+}
+
+/* ==================== BENCHMARKS ==================== */
+
+/*
+ * searchCLI bench [documents] [seed] indexes a synthetic corpus and times
+ * the index and query paths, writing the results as one JSON object.
+ * Words are drawn from a Zipfian distribution over BENCH_VOCABULARY words
+ * (rank r has weight 1/r^BENCH_ZIPF_S, roughly as in natural text), and
+ * document lengths are uniform around BENCH_DOC_WORDS. Queries draw their
+ * words the same way, so frequent words are asked for most often. Every
+ * choice comes from the seed: runs with the same arguments index the same
+ * corpus and ask the same queries, and can be compared over time.
+ */
+
+#define BENCH_DOCUMENTS 100000
+#define BENCH_VOCABULARY 200000
+#define BENCH_ZIPF_S 1.0
+#define BENCH_DOC_WORDS 120       // Mean words per document
+#define BENCH_FILE_DOCUMENTS 10000  // Also indexed by streaming from files
+#define BENCH_QUERIES 20000       // Timed queries of each kind
+#define BENCH_PREFIX_LIMIT 10
+#define BENCH_LATENCY_BUCKETS 32  // Nanoseconds per query, up to 2^31
+
+typedef struct BenchCorpus {
+  uint64_t state;  // splitmix64
+  double *cdf;     // cdf[r]: probability of a rank up to r
+  int vocabulary;
+} BenchCorpus;
+
+uint64_t bench_random(BenchCorpus *corpus) {
+  uint64_t z = (corpus->state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n) */
+uint32_t bench_below(BenchCorpus *corpus, uint32_t n) {
+  return (uint32_t)((bench_random(corpus) >> 32) * n >> 32);
+}
+
+int bench_init(BenchCorpus *corpus, int vocabulary, uint64_t seed) {
+  corpus->state = seed;
+  corpus->vocabulary = vocabulary;
+  corpus->cdf = (double *)malloc(vocabulary * sizeof(double));
+  if (!corpus->cdf)
+    return -1;
+  double sum = 0;
+  for (int r = 0; r < vocabulary; r++)
+    corpus->cdf[r] = sum += pow(r + 1, -BENCH_ZIPF_S);
+  for (int r = 0; r < vocabulary; r++)
+    corpus->cdf[r] /= sum;
+  return 0;
+}
+
+/* A Zipfian word rank, 0 the most frequent */
+int bench_rank(BenchCorpus *corpus) {
+  double u = (bench_random(corpus) >> 11) * (1.0 / 9007199254740992.0);
+  int lo = 0, hi = corpus->vocabulary - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (corpus->cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* The word of a rank: its bijective base-26 numeral past the one- and
+ * two-letter words, so frequent words are short and every word indexes;
+ * returns its length */
+int bench_word(int rank, char word[MAX_WORD_LEN]) {
+  uint64_t n = (uint64_t)rank + 26 + 26 * 26 + 1;
+  int len = 0;
+  while (n > 0) {
+    n--;
+    word[len++] = (char)('a' + n % 26);
+    n /= 26;
+  }
+  word[len] = '\0';
+  return len;
+}
+
+/* The next document's text, words separated by spaces; returns its word
+ * count */
+int bench_document(BenchCorpus *corpus, ByteBuffer *text) {
+  int words = BENCH_DOC_WORDS / 2 + (int)bench_below(corpus, BENCH_DOC_WORDS);
+  char word[MAX_WORD_LEN];
+  text->len = 0;
+  for (int i = 0; i < words; i++) {
+    int len = bench_word(bench_rank(corpus), word);
+    word[len] = ' ';
+    buffer_append(text, word, len + 1);
+  }
+  return words;
+}
+
+/* The most memory the process has held at once, in bytes */
+uint64_t bench_peak_rss(void) {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+#ifdef __APPLE__
+  return (uint64_t)usage.ru_maxrss;  // Already bytes
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+int compare_nanos(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* "<name>":{...} throughput of an indexing run */
+void bench_throughput(ByteBuffer *out, const char *name, int documents,
+                      uint64_t words, uint64_t bytes, uint64_t nanos) {
+  double seconds = nanos > 0 ? nanos / 1e9 : 1e-9;
+  buffer_printf(out,
+                "\"%s\":{\"documents\":%d,\"words\":%llu,\"bytes\":%llu,"
+                "\"seconds\":%.6f,\"documents_per_second\":%.1f,"
+                "\"words_per_second\":%.1f,\"megabytes_per_second\":%.3f}",
+                name, documents, (unsigned long long)words,
+                (unsigned long long)bytes, seconds, documents / seconds,
+                words / seconds, bytes / seconds / 1e6);
+}
+
+/* "<name>":{...} latency percentiles of count queries, nearest rank, and
+ * their histogram in power-of-two nanosecond buckets (see METRICS); sorts
+ * nanos */
+void bench_latency(ByteBuffer *out, const char *name, uint64_t *nanos,
+                   int count, uint64_t results) {
+  qsort(nanos, count, sizeof(uint64_t), compare_nanos);
+  uint64_t total = 0;
+  for (int i = 0; i < count; i++)
+    total += nanos[i];
+  double percentiles[] = {0.5, 0.99, 0.999};
+  const char *names[] = {"p50", "p99", "p999"};
+  buffer_printf(out, "\"%s\":{\"queries\":%d,\"mean_results\":%.2f,"
+                "\"mean_us\":%.3f",
+                name, count, (double)results / count, total / 1e3 / count);
+  for (int p = 0; p < 3; p++) {
+    int rank = (int)ceil(percentiles[p] * count) - 1;
+    buffer_printf(out, ",\"%s_us\":%.3f", names[p], nanos[rank] / 1e3);
+  }
+  buffer_printf(out, ",\"max_us\":%.3f,\"latency_ns\":",
+                nanos[count - 1] / 1e3);
+  uint64_t buckets[BENCH_LATENCY_BUCKETS] = {0};
+  for (int i = 0; i < count; i++)
+    buckets[metric_bucket(nanos[i], BENCH_LATENCY_BUCKETS)]++;
+  buffer_buckets(out, buckets, BENCH_LATENCY_BUCKETS);
+  buffer_append(out, "}", 1);
+}
+
+/* Index documents generated texts through document_begin/tokenizer_feed,
+ * as index_text does; returns the words, bytes and nanoseconds taken */
+void bench_index_text(SearchEngine *engine, BenchCorpus *corpus,
+                      int documents, uint64_t *words, uint64_t *bytes,
+                      uint64_t *nanos) {
+  ByteBuffer text = {0};
+  char name[32];
+  *words = *bytes = *nanos = 0;
+  for (int i = 0; i < documents; i++) {
+    *words += bench_document(corpus, &text);
+    *bytes += text.len;
+    snprintf(name, sizeof(name), "doc%d", i);
+    uint64_t start = clock_nanos();
+    Tokenizer tok;
+    document_begin(engine, name, &tok);
+    tokenizer_feed(&tok, text.data, text.len);
+    document_end(&tok);
+    *nanos += clock_nanos() - start;
+  }
+  free(text.data);
+}
+
+/* Index documents generated texts from temporary files, read in chunks
+ * as index_document reads; returns -1 if no file can be created */
+int bench_index_files(SearchEngine *engine, BenchCorpus *corpus,
+                      int documents, uint64_t *words, uint64_t *bytes,
+                      uint64_t *nanos) {
+  ByteBuffer text = {0};
+  char name[32];
+  *words = *bytes = *nanos = 0;
+  for (int i = 0; i < documents; i++) {
+    *words += bench_document(corpus, &text);
+    *bytes += text.len;
+    FILE *file = tmpfile();
+    if (!file) {
+      free(text.data);
+      return -1;
+    }
+    fwrite(text.data, 1, text.len, file);
+    rewind(file);
+    snprintf(name, sizeof(name), "file%d", i);
+    uint64_t start = clock_nanos();
+    index_stream(engine, name, file);
+    *nanos += clock_nanos() - start;
+    fclose(file);
+  }
+  free(text.data);
+  return 0;
+}
+
+/* Time exact lookups, intersections of two or three words and prefix
+ * completions of one to three letters, writing their latencies */
+void bench_queries(SearchEngine *engine, BenchCorpus *corpus,
+                   ByteBuffer *out) {
+  uint64_t *nanos = (uint64_t *)malloc(BENCH_QUERIES * sizeof(uint64_t));
+  char word[MAX_WORD_LEN];
+  uint64_t results = 0;
+
+  for (int q = 0; q < BENCH_QUERIES; q++) {
+    bench_word(bench_rank(corpus), word);
+    uint64_t start = clock_nanos();
+    TrieNode *node = hash_search(engine, word);
+    nanos[q] = clock_nanos() - start;
+    results += node ? (uint64_t)node->postings.doc_count : 0;
+  }
+  bench_latency(out, "hash_search", nanos, BENCH_QUERIES, results);
+
+  results = 0;
+  for (int q = 0; q < BENCH_QUERIES; q++) {
+    char words[3][MAX_WORD_LEN];
+    int count = 2 + (int)bench_below(corpus, 2);
+    for (int i = 0; i < count; i++)
+      bench_word(bench_rank(corpus), words[i]);
+    uint64_t start = clock_nanos();
+    TermRef terms[3];
+    int found = 0;
+    while (found < count && lookup_term(engine, words[found], &terms[found]))
+      found++;
+    PostingArray matches = {NULL, NULL, 0};
+    if (found == count)
+      intersect_terms(engine, terms, NULL, count, &matches);
+    nanos[q] = clock_nanos() - start;
+    results += matches.count;
+    posting_array_free(&matches);
+  }
+  buffer_append(out, ",", 1);
+  bench_latency(out, "search_multi", nanos, BENCH_QUERIES, results);
+
+  results = 0;
+  for (int q = 0; q < BENCH_QUERIES; q++) {
+    int len = bench_word(bench_rank(corpus), word);
+    word[1 + bench_below(corpus, len < 3 ? len : 3)] = '\0';
+    Completion completions[BENCH_PREFIX_LIMIT];
+    uint64_t start = clock_nanos();
+    int count = complete_prefix(engine, word, BENCH_PREFIX_LIMIT, completions);
+    nanos[q] = clock_nanos() - start;
+    results += count;
+  }
+  buffer_append(out, ",", 1);
+  bench_latency(out, "prefix", nanos, BENCH_QUERIES, results);
+  free(nanos);
+}
+
+int run_benchmark(int argc, char *argv[]) {
+  int documents = argc >= 1 ? atoi(argv[0]) : BENCH_DOCUMENTS;
+  uint64_t seed = argc >= 2 ? strtoull(argv[1], NULL, 10) : 1;
+  if (documents <= 0) {
+    printf("{\"success\":false,\"error\":\"Bad document count\"}");
+    return 1;
+  }
+  BenchCorpus corpus;
+  if (bench_init(&corpus, BENCH_VOCABULARY, seed) < 0) {
+    printf("{\"success\":false,\"error\":\"Out of memory\"}");
+    return 1;
+  }
+
+  int file_documents =
+      BENCH_FILE_DOCUMENTS < documents ? BENCH_FILE_DOCUMENTS : documents;
+  ByteBuffer out = {0};
+  buffer_printf(&out,
+                "{\"success\":true,\"config\":{\"documents\":%d,"
+                "\"file_documents\":%d,\"vocabulary\":%d,\"zipf_s\":%.2f,"
+                "\"mean_doc_words\":%d,\"queries\":%d,\"seed\":%llu},",
+                documents, file_documents,
+                BENCH_VOCABULARY, BENCH_ZIPF_S, BENCH_DOC_WORDS,
+                BENCH_QUERIES, (unsigned long long)seed);
+
+  // Memory is measured over the main index alone, built first
+  uint64_t words, bytes, nanos;
+  uint64_t rss_before = bench_peak_rss();
+  SearchEngine *engine = create_search_engine();
+  bench_index_text(engine, &corpus, documents, &words, &bytes, &nanos);
+  uint64_t rss_after = bench_peak_rss();
+  bench_throughput(&out, "index_text", documents, words, bytes, nanos);
+
+  uint64_t terms = distinct_term_count(engine, NULL);
+  buffer_printf(&out,
+                ",\"memory\":{\"terms\":%llu,\"peak_rss_bytes\":%llu,"
+                "\"index_rss_bytes\":%llu,\"bytes_per_term\":%.1f},",
+                (unsigned long long)terms, (unsigned long long)rss_after,
+                (unsigned long long)(rss_after - rss_before),
+                terms ? (double)(rss_after - rss_before) / terms : 0.0);
+
+  buffer_str(&out, "\"queries\":{");
+  bench_queries(engine, &corpus, &out);
+  buffer_str(&out, "},");
+
+  SearchEngine *files = create_search_engine();
+  if (bench_index_files(files, &corpus, file_documents, &words, &bytes,
+                        &nanos) < 0) {
+    printf("{\"success\":false,\"error\":\"Cannot create temporary file\"}");
+    return 1;
+  }
+  bench_throughput(&out, "index_document", file_documents, words, bytes,
+                   nanos);
+  buffer_append(&out, "}", 1);
+
+  fwrite(out.data, 1, out.len, stdout);
+  free(out.data);
+  free_search_engine(files);
+  free_search_engine(engine);
+  free(corpus.cdf);
+  return 0;
+}
+
+/* ==================== LIBRARY API ==================== */
+
+/*
+ * The calls of searchEngine.h. A handle is an engine of its own with what
+ * requests on it share (see REQUESTS); requests run in the caller's
+ * thread, and handles share nothing but the process's metrics, so threads
+ * may each use one at once.
+ */
+
+SearchHandle *search_open(const char *index_path) {
+  SearchHandle *handle = (SearchHandle *)calloc(1, sizeof(SearchHandle));
+  if (!handle)
+    return NULL;
+  handle->engine = create_search_engine();
+  handle->cache = create_query_cache();
+  if (index_path) {
+    SearchEngine *engine =
+        is_path(index_path) ? open_engine(handle, index_path, 0) : NULL;
+    if (!engine) {
+      search_close(handle);
+      return NULL;
+    }
+    replace_engine(handle, engine);
+  }
+  return handle;
+}
+
+char *search_request(SearchHandle *handle, const char *cmd,
+                     const char *payload, size_t payload_len, size_t *len) {
+  char *copy = (char *)malloc(payload_len + 1);  // Requests parse in place
+  if (!copy)
+    return NULL;
+  memcpy(copy, payload, payload_len);
+  copy[payload_len] = '\0';
+  ByteBuffer out = {0};
+  serve_request(handle, cmd, copy, &out);
+  free(copy);
+  if (out.failed || !buffer_reserve(&out, 1)) {
+    free(out.data);
+    return NULL;
+  }
+  out.data[out.len] = '\0';
+  *len = out.len;
+  return out.data;
+}
+
+void search_free(char *response) {
+  free(response);
+}
+
+void search_close(SearchHandle *handle) {
+  if (!handle)
+    return;
+  free_query_cache(handle->cache);
+  if (handle->engine->dir)
+    flush_segment(handle->engine);
+  close_engine(handle->engine);
+  free_stop_words(handle->stop_words);
+  free(handle);
+}
@@ -0,0 +1,81 @@
+/*
+ * The search engine's C interface
+ *
+ * searchEngine.c implements it. A program links it in, as searchCLI.c and
+ * searchDemo.c do, or it is a shared library for any language with a C
+ * foreign function interface, as the bridge uses it (see LIBRARY API in
+ * searchEngine.c):
+ *
+ *   gcc -O2 -pthread searchDemo.c searchEngine.c -o search_engine.exe -lm
+ *   gcc -O2 -pthread -shared -fPIC searchEngine.c -o libsearch.so -lm
+ *
+ * A request is any "searchCLI serve" command with its payload, answered
+ * with the response serve would send, minus its framing. Each handle is an
+ * engine of its own: calls on one handle must not overlap, while
+ * different handles may be used from different threads at once. "quit" is
+ * answered but stops nothing.
+ */
+
+#ifndef SEARCH_ENGINE_H
+#define SEARCH_ENGINE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SearchHandle SearchHandle;
+
+/* Create an engine, empty if index_path is NULL, otherwise over the index
+ * file or directory there as "load" maps it; returns NULL if the index
+ * cannot be read or memory runs out */
+SearchHandle *search_open(const char *index_path);
+
+/* Answer one request; returns the NUL-terminated response, *len bytes
+ * long, to be freed with search_free, or NULL if memory ran out */
+char *search_request(SearchHandle *handle, const char *cmd,
+                     const char *payload, size_t payload_len, size_t *len);
+
+void search_free(char *response);
+
+/* Flush documents not yet in a segment of the open directory, if any, and
+ * drop the engine and the handle; NULL is ignored */
+void search_close(SearchHandle *handle);
+
+/*
+ * After "format binary", query results are answered as one record of
+ * uint32_t fields in host order instead of JSON:
+ *
+ *   kind, found, count, total_freq
+ *   doc_ids[count], values[count], word_counts[count]
+ *   offsets[count + 2]
+ *   strings, string i spanning offsets[i] .. offsets[i + 1]: first the
+ *   normalized query (keywords joined by spaces, or a Boolean query in
+ *   canonical form), then per result its document name, or its word for
+ *   prefix and fuzzy
+ *
+ * kind is a RESULT_ value. values are frequencies, multi and Boolean
+ * scores, rank scores in ten-thousandths (JSON's four decimals), or phrase
+ * and near match counts; prefix and fuzzy results have their word's
+ * document count for word_count, and doc_id 0 or the word's edit distance.
+ * A search that finds nothing may end with a suggested word, the bytes
+ * after the last string. Other commands still answer with JSON, which
+ * starts with '{'.
+ */
+#define RESULT_SEARCH 1
+#define RESULT_FREQ 2
+#define RESULT_MULTI 3
+#define RESULT_RANK 4
+#define RESULT_PREFIX 5
+#define RESULT_BATCH 6  // Several queries' results; see searchEngine.c
+#define RESULT_PHRASE 7
+#define RESULT_NEAR 8
+#define RESULT_BOOLEAN 9
+#define RESULT_FUZZY 10
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
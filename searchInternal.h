@@ -0,0 +1,119 @@
+/*
+ * What searchCLI.c uses of searchEngine.c beyond searchEngine.h: the
+ * handle its servers answer requests on, the engine calls behind its
+ * one-shot commands, and the threads and buffers both share. Private to
+ * the two files; programs using the engine include searchEngine.h only.
+ */
+
+#ifndef SEARCH_INTERNAL_H
+#define SEARCH_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <winsock2.h>  // Before windows.h, which would pull in winsock 1
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "searchEngine.h"
+
+#define MAX_READERS 64  // Threads reading published versions at once
+
+typedef struct SearchEngine SearchEngine;
+typedef struct QueryCache QueryCache;
+typedef struct Snapshots Snapshots;
+
+/*
+ * An engine with what the requests on it share: the responses cached for
+ * it, how query results are answered, and the settings every engine it
+ * is replaced by starts with. Handles share nothing but the process's
+ * metrics, so each can serve a thread of its own.
+ */
+struct SearchHandle {
+  SearchEngine *engine;
+  QueryCache *cache;  // Dropped with the engine that answered; may be NULL
+  int binary;         // Whether query results are sent as binary records
+  const struct StopWords *stop_words;  // Owned; NULL for none
+  int bitmap_terms;  // Whether index files get bitmap terms
+};
+
+/* Growable byte array; failed is set once memory runs out */
+typedef struct ByteBuffer {
+  char *data;
+  size_t len;
+  size_t cap;
+  int failed;
+} ByteBuffer;
+
+char *buffer_reserve(ByteBuffer *buf, size_t n);
+size_t buffer_append(ByteBuffer *buf, const void *src, size_t n);
+void buffer_str(ByteBuffer *buf, const char *str);
+void buffer_printf(ByteBuffer *buf, const char *fmt, ...);
+
+/* THREADS */
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+#define THREAD_FUNC DWORD WINAPI
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE CondVar;
+#else
+typedef pthread_t Thread;
+#define THREAD_FUNC void *
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t CondVar;
+#endif
+
+typedef THREAD_FUNC ThreadFunc(void *arg);
+
+void mutex_init(Mutex *mutex);
+void mutex_lock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+void mutex_destroy(Mutex *mutex);
+void cond_init(CondVar *cond);
+void cond_wait(CondVar *cond, Mutex *mutex);
+void cond_signal(CondVar *cond);
+void cond_broadcast(CondVar *cond);
+void cond_destroy(CondVar *cond);
+int cpu_count();
+int thread_start(Thread *thread, ThreadFunc *func, void *arg);
+void thread_join(Thread thread);
+
+/* ENGINE */
+
+int document_count(const SearchEngine *engine);
+int index_text(SearchEngine *engine, const char *name, const char *text);
+int index_stream(SearchEngine *engine, const char *name, FILE *file);
+int index_document(SearchEngine *engine, const char *filename);
+int index_directory(SearchEngine *engine, const char *dir, int threads,
+                    int *skipped);
+int save_index(SearchEngine *engine, const char *path);
+void merge_step(SearchEngine *engine);
+
+Snapshots *snapshot_readers(SearchEngine *engine, int readers);
+SearchEngine *snapshot_acquire(Snapshots *snap, int reader);
+void snapshot_release(Snapshots *snap, int reader);
+
+/* REQUESTS */
+
+int is_query_command(const char *cmd);
+int is_read_command(const char *cmd);
+int is_path(const char *payload);
+void output_index_result(SearchEngine *engine, int doc_id, ByteBuffer *out);
+void output_unknown_command(const char *cmd, ByteBuffer *out);
+int read_batch_file(const char *path, ByteBuffer *queries);
+void answer_query(SearchHandle *handle, SearchEngine *engine,
+                  const char *cmd, char *payload, int binary,
+                  ByteBuffer *out);
+int serve_request(SearchHandle *handle, const char *cmd, char *payload,
+                  ByteBuffer *out);
+
+/* BENCHMARKS */
+
+int run_benchmark(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,90 @@
+"""'searchCLI serve' and 'searchCLI listen' processes for the tests to
+drive; each test takes the executable as its first argument (default
+./searchCLI.exe)."""
+import json
+import socket
+import subprocess
+import sys
+
+
+def cli_path():
+    """The searchCLI executable named on the command line"""
+    return sys.argv[1] if len(sys.argv) > 1 else './searchCLI.exe'
+
+
+class Engine:
+    """A 'searchCLI serve' process"""
+    def __init__(self, cli):
+        self.proc = subprocess.Popen([cli, 'serve'], stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE)
+
+    def send(self, command, payload=b''):
+        """Send one request; payload is str or bytes"""
+        if isinstance(payload, str):
+            payload = payload.encode('utf-8')
+        self.proc.stdin.write(f"{command} {len(payload)}\n".encode() +
+                              payload)
+        self.proc.stdin.flush()
+
+    def request(self, command, payload=''):
+        """Send one request and parse its JSON response"""
+        self.send(command, payload)
+        return json.loads(self.proc.stdout.readline())
+
+    def close(self):
+        self.request('quit')
+        self.proc.wait()
+
+
+class Listener:
+    """A 'searchCLI listen' process on a free local port"""
+    def __init__(self, cli, workers=4):
+        self.proc = subprocess.Popen([cli, 'listen', '127.0.0.1:0',
+                                      str(workers)], stdout=subprocess.PIPE)
+        self.port = json.loads(self.proc.stdout.readline())['port']
+
+    def connect(self):
+        return Connection(self.port)
+
+    def close(self):
+        """Quit the server; returns its exit status"""
+        conn = self.connect()
+        conn.request('quit')
+        conn.close()
+        return self.proc.wait()
+
+
+class Connection:
+    """One client connection to a listen server"""
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        self.file = self.sock.makefile('rb')
+        self.next_id = 1
+
+    def send(self, request_id, command, payload=b''):
+        """Send one request; payload is str or bytes"""
+        if isinstance(payload, str):
+            payload = payload.encode('utf-8')
+        self.sock.sendall(f"{request_id} {command} {len(payload)}\n".encode()
+                          + payload)
+
+    def receive(self):
+        """The next response as (id, body), or None once the server hung up"""
+        header = self.file.readline().split()
+        if not header:
+            return None
+        return int(header[0]), self.file.read(int(header[1]))
+
+    def request(self, command, payload=''):
+        """Send one request, with nothing else in flight, and parse its JSON
+        response"""
+        request_id = self.next_id
+        self.next_id += 1
+        self.send(request_id, command, payload)
+        response_id, body = self.receive()
+        assert response_id == request_id, (response_id, request_id)
+        return json.loads(body)
+
+    def close(self):
+        self.file.close()
+        self.sock.close()
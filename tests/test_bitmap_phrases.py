@@ -0,0 +1,85 @@
+"""Phrase queries on bitmap terms, checked against a brute-force scan.
+
+With 'bitmaps on', dense words are stored as bitmaps; their positions must
+still decide phrase matches and Boolean phrase leaves, in a flushed
+segment, in a merged one and in a saved index.
+
+    python3 tests/test_bitmap_phrases.py ./searchCLI.exe
+"""
+import os
+import random
+import shutil
+import sys
+import tempfile
+
+from serve_engine import Engine, cli_path
+
+
+def phrase_docs(docs, words):
+    """Doc ids whose text holds words consecutively"""
+    n = len(words)
+    return [doc_id for doc_id, text in enumerate(docs)
+            if any(text[i:i + n] == words for i in range(len(text) - n + 1))]
+
+
+def main():
+    cli = cli_path()
+    random.seed(7)
+    # 'the' is in every document; the rest follow a rough Zipf curve
+    vocab = ['dog', 'cat', 'fox', 'bird', 'fish', 'tree', 'rock', 'lake',
+             'hill', 'road', 'bear', 'wolf', 'deer', 'frog', 'moth', 'owl']
+    weights = [1.0 / (i + 1) for i in range(len(vocab))]
+    docs = []
+    for _ in range(600):
+        words = random.choices(vocab, weights, k=random.randint(3, 30))
+        words.insert(random.randrange(len(words) + 1), 'the')
+        docs.append(words)
+
+    work = tempfile.mkdtemp()
+    failures = 0
+    try:
+        engine = Engine(cli)
+        assert engine.request('bitmaps', 'on')['bitmaps']
+        assert engine.request('open', os.path.join(work, 'idx'))['success']
+        for doc_id, words in enumerate(docs):
+            result = engine.request('index', f"doc{doc_id}\n{' '.join(words)}")
+            assert result['doc_id'] == doc_id, result
+            if doc_id % 150 == 149:
+                engine.request('flush')  # Four segments, merged into one
+        saved = os.path.join(work, 'saved.bin')
+        assert engine.request('save', saved)['success']
+        loaded = Engine(cli)
+        assert loaded.request('load', saved)['success']
+
+        queries = [['dog', 'the'], ['the', 'dog'], ['the', 'owl', 'the'],
+                   ['fox', 'the', 'cat']]
+        queries += [random.sample(vocab[:6], 2) for _ in range(10)]
+        queries += [['the', random.choice(vocab)] for _ in range(10)]
+        for name, target in (('open', engine), ('saved', loaded)):
+            for words in queries:
+                expected = phrase_docs(docs, words)
+                phrase = ' '.join(words)
+                got = [r['doc_id'] for r in
+                       target.request('phrase', phrase)['results']]
+                if got != expected:
+                    failures += 1
+                    print(f"{name} phrase '{phrase}': {len(got)} documents, "
+                          f"expected {len(expected)}")
+                other = random.choice(vocab)
+                expected = [d for d in expected if other in docs[d]]
+                got = [r['doc_id'] for r in target.request(
+                    'boolean', f'"{phrase}" AND {other}')['results']]
+                if got != expected:
+                    failures += 1
+                    print(f"{name} boolean '\"{phrase}\" AND {other}': "
+                          f"{len(got)} documents, expected {len(expected)}")
+        loaded.close()
+        engine.close()
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,153 @@
+"""Boolean queries match and score as a direct evaluation over the
+documents does: random nested AND, OR, NOT, implied AND and quoted
+phrases, written with the fewest parentheses precedence allows, over a
+small corpus answered by lazy iterators and one large enough for common
+words to be evaluated into document sets, with deleted documents in both.
+The canonical form each response echoes must parse back to the same
+query, and NEAR must match as the near command does.
+
+    python3 tests/test_boolean.py ./searchCLI.exe
+"""
+import random
+import sys
+
+from serve_engine import Engine, cli_path
+
+# Common words first, so the large corpus has some in every 16 documents
+VOCAB = ['solar', 'wind', 'power', 'grid', 'energy', 'storage', 'panel',
+         'turbine', 'battery', 'fossil']
+WEIGHTS = [30, 25, 20, 15, 10, 5, 2, 1, 1, 1]
+
+
+def random_query(rng, depth):
+    """A query tree: ('term', word), ('phrase', words), ('not', node),
+    ('and', nodes) or ('or', nodes)"""
+    kind = rng.random()
+    if depth == 0 or kind < 0.35:
+        if rng.random() < 0.2:
+            return ('phrase', rng.choices(VOCAB[:6], k=rng.randint(2, 3)))
+        return ('term', rng.choice(VOCAB))
+    children = [random_query(rng, depth - 1)
+                for _ in range(rng.randint(2, 3))]
+    if kind < 0.7:
+        # Some operands excluded, never twice over: "NOT NOT" is no query
+        children = [('not', child) if child[0] != 'not' and
+                    rng.random() < 0.3 else child for child in children]
+        return ('and', children)
+    if kind < 0.9:
+        return ('or', children)
+    child = random_query(rng, depth - 1)
+    return child if child[0] == 'not' else ('not', child)
+
+
+def render(node, rng):
+    """node as query text, parenthesized only where precedence needs it"""
+    kind = node[0]
+    if kind == 'term':
+        return node[1]
+    if kind == 'phrase':
+        return '"' + ' '.join(node[1]) + '"'
+    if kind == 'not':
+        inner = render(node[1], rng)
+        return 'NOT ' + (inner if node[1][0] in ('term', 'phrase')
+                         else f"({inner})")
+    parts = []
+    for child in node[1]:
+        text = render(child, rng)
+        if child[0] == 'or' or (kind == 'or' and child[0] == 'and' and
+                                rng.random() < 0.5):
+            text = f"({text})"
+        parts.append(text)
+    if kind == 'or':
+        return ' OR '.join(parts)
+    return ''.join(part + (' ' if rng.random() < 0.5 else ' AND ')
+                   for part in parts[:-1]) + parts[-1]
+
+
+def evaluate(node, docs):
+    """{doc_id: score} of node's matches among docs {doc_id: words}"""
+    kind = node[0]
+    if kind == 'term':
+        return {doc_id: words.count(node[1]) for doc_id, words in docs.items()
+                if node[1] in words}
+    if kind == 'phrase':
+        phrase, n = node[1], len(node[1])
+        out = {}
+        for doc_id, words in docs.items():
+            matches = sum(1 for i in range(len(words) - n + 1)
+                          if words[i:i + n] == phrase)
+            if matches:
+                out[doc_id] = matches
+        return out
+    if kind == 'not':
+        excluded = evaluate(node[1], docs)
+        return {doc_id: 0 for doc_id in docs if doc_id not in excluded}
+    results = [evaluate(child, docs) for child in node[1]]
+    if kind == 'or':
+        out = {}
+        for result in results:
+            for doc_id, score in result.items():
+                out[doc_id] = out.get(doc_id, 0) + score
+        return out
+    matched = set(docs)
+    for result in results:
+        matched &= set(result)
+    # Excluded operands score nothing
+    return {doc_id: sum(result[doc_id] for child, result in
+                        zip(node[1], results) if child[0] != 'not')
+            for doc_id in matched}
+
+
+def check_corpus(cli, rng, doc_count, query_count):
+    failures = 0
+    engine = Engine(cli)
+    docs = {}
+    for doc_id in range(doc_count):
+        words = rng.choices(VOCAB, WEIGHTS, k=rng.randint(1, 12))
+        engine.request('index', f"d{doc_id}\n{' '.join(words)}")
+        docs[doc_id] = words
+    for doc_id in rng.sample(range(doc_count), doc_count // 10):
+        engine.request('delete', str(doc_id))
+        del docs[doc_id]
+
+    for _ in range(query_count):
+        tree = random_query(rng, 3)
+        query = render(tree, rng)
+        response = engine.request('boolean', query)
+        expected = sorted(evaluate(tree, docs).items())
+        got = [(doc['doc_id'], doc['score']) for doc in response['results']]
+        if got != expected:
+            failures += 1
+            print(f"{doc_count} docs, boolean {query}: {got[:5]} != "
+                  f"{expected[:5]} ({len(got)} != {len(expected)})")
+        echoed = engine.request('boolean', response['query'])
+        if echoed['results'] != response['results']:
+            failures += 1
+            print(f"canonical {response['query']} of {query} differs")
+
+    for _ in range(query_count // 10):
+        words = rng.sample(VOCAB[:6], 2)
+        distance = rng.randint(1, 5)
+        near = engine.request('near', f"{distance} {' '.join(words)}")
+        boolean = engine.request('boolean',
+                                 f"{words[0]} NEAR/{distance} {words[1]}")
+        if ([(doc['doc_id'], doc['frequency']) for doc in near['results']] !=
+                [(doc['doc_id'], doc['score']) for doc in boolean['results']]):
+            failures += 1
+            print(f"{doc_count} docs, NEAR/{distance} {words} differs from "
+                  f"near")
+    engine.close()
+    return failures
+
+
+def main():
+    cli = cli_path()
+    rng = random.Random(21)
+    failures = check_corpus(cli, rng, 300, 400)
+    failures += check_corpus(cli, rng, 6000, 200)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,93 @@
+"""Search parameters reach the engine as the client wrote them, however
+their URL encodes them: percent escapes, '+' for spaces, and '=' inside a
+value.
+
+    python3 tests/test_bridge_query.py
+
+with searchCLI.exe built next to bridgeServer.py; set SEARCH_SHARDS or
+SEARCH_SHARD_COMMANDS to check a sharded bridge the same way.
+"""
+import json
+import os
+import sys
+import threading
+import urllib.parse
+import urllib.request
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                '..'))
+import bridgeServer  # noqa: E402
+
+DOCUMENTS = [
+    ('science.txt', 'data science with solar power'),
+    ('learning.txt', 'machine learning for energy data'),
+    ('wind.txt', 'learning energy from the solar wind and power lines'),
+    ('markets.txt', 'energy markets = prices'),
+    ('cafe.txt', 'café crème at the cafeteria'),
+]
+
+# Each query with the documents it matches
+SEARCHES = [
+    ('boolean', '(data OR learning) AND NOT machine',
+     ['science.txt', 'wind.txt']),
+    ('boolean', 'energy AND NOT "solar power"',
+     ['learning.txt', 'markets.txt', 'wind.txt']),
+    ('boolean', 'markets AND prices=', ['markets.txt']),
+    ('phrase', 'solar power', ['science.txt']),
+    ('phrase', '"solar power"', ['science.txt']),
+    ('near', '3 solar power', ['science.txt', 'wind.txt']),
+    ('near', 'machine "data"', ['learning.txt']),
+]
+
+# Each prefix with its completions
+COMPLETIONS = [
+    ('café', ['cafe', 'cafeteria']),
+    ('Crè', ['creme']),
+]
+
+# Ways a client encodes a parameter's value
+ENCODINGS = [
+    lambda value: urllib.parse.quote(value, safe=''),
+    urllib.parse.quote_plus,
+    lambda value: urllib.parse.quote(value, safe='=()'),
+]
+
+
+def get(port, path, params):
+    """A bridge response"""
+    url = f"http://localhost:{port}{path}?{params}"
+    with urllib.request.urlopen(url) as response:
+        return json.loads(response.read())
+
+
+def main():
+    for name, content in DOCUMENTS:
+        bridgeServer.engine_state.add_document(name, content)
+    bridgeServer.BridgeHandler.log_message = lambda *args: None
+    server = bridgeServer.ThreadingHTTPServer(('localhost', 0),
+                                              bridgeServer.BridgeHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    port = server.server_address[1]
+
+    failures = 0
+    for search_type, query, expected in SEARCHES:
+        for encode in ENCODINGS:
+            params = f"query={encode(query)}&type={search_type}"
+            got = get(port, '/api/search', params)
+            names = sorted(r['docName'] for r in got.get('results', []))
+            if names != expected:
+                failures += 1
+                print('mismatch', search_type, params, names, got)
+    for prefix, expected in COMPLETIONS:
+        for encode in ENCODINGS:
+            got = get(port, '/api/autocomplete', f"q={encode(prefix)}")
+            if got.get('suggestions') != expected:
+                failures += 1
+                print('mismatch autocomplete', prefix, got)
+    server.shutdown()
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,54 @@
+"""Greek words fold to one term whatever their case, accents and
+breathings, polytonic (Greek Extended) spellings included, and the folding
+tables in searchEngine.c are what tools/gen_fold_tables.py prints.
+
+    python3 tests/test_fold_greek.py ./searchCLI.exe
+"""
+import os
+import subprocess
+import sys
+
+from serve_engine import Engine, cli_path
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+# Spellings of one word each, and the term they fold to
+WORDS = [
+    (['Ἀθῆναι', 'ἀθῆναι', 'Αθήναι', 'ΑΘΗΝΑΙ', 'αθηναι'], 'αθηναι'),
+    (['ᾠδή', 'ῼδη', 'ΩΔΗ'], 'ωδη'),
+    (['Ῥόδος', 'ῥόδος', 'ΡΟΔΟΣ'], 'ροδοσ'),
+]
+
+
+def main():
+    failures = 0
+    engine = Engine(cli_path())
+    docs = []
+    for spellings, term in WORDS:
+        for spelling in spellings:
+            result = engine.request('index', f"{spelling}.txt\n{spelling}")
+            docs.append((result['doc_id'], term))
+    for spellings, term in WORDS:
+        expected = [doc_id for doc_id, t in docs if t == term]
+        for spelling in spellings:
+            result = engine.request('search', spelling)
+            got = [r['doc_id'] for r in result.get('results', [])]
+            if result['keyword'] != term or got != expected:
+                failures += 1
+                print(f"search {spelling}: {result['keyword']} in {got}, "
+                      f"expected {term} in {expected}")
+    engine.close()
+
+    tables = subprocess.run(
+        [sys.executable, os.path.join(ROOT, 'tools', 'gen_fold_tables.py')],
+        capture_output=True, text=True, check=True).stdout
+    with open(os.path.join(ROOT, 'searchEngine.c'), encoding='utf-8') as f:
+        if tables not in f.read():
+            failures += 1
+            print('searchEngine.c does not hold the generated folding tables')
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,82 @@
+"""Fuzzy lookup over a corrupt index file: terms out of order, shorter than
+the prefix the walk assumes, or pointing outside the string pool still get
+an answer, both from fuzzy and from a search miss's did-you-mean. Build
+with -fsanitize=address to see the reads stay in bounds.
+
+    python3 tests/test_fuzzy.py ./searchCLI.exe
+"""
+import os
+import random
+import shutil
+import struct
+import sys
+import tempfile
+
+from serve_engine import Engine, cli_path
+
+# IndexHeader: terms_offset at byte 48, term_count at 20, strings_size at
+# 120; IndexTerm is 56 bytes with word_offset first
+HEADER_TERM_COUNT = 20
+HEADER_TERMS_OFFSET = 48
+HEADER_STRINGS_SIZE = 120
+TERM_SIZE = 56
+
+
+def corrupt(data, seed):
+    """data with some terms' word offsets pointing elsewhere"""
+    data = bytearray(data)
+    term_count, = struct.unpack_from('<I', data, HEADER_TERM_COUNT)
+    terms, = struct.unpack_from('<Q', data, HEADER_TERMS_OFFSET)
+    strings_size, = struct.unpack_from('<Q', data, HEADER_STRINGS_SIZE)
+    rng = random.Random(seed)
+    for _ in range(max(1, term_count // 4)):
+        term = terms + rng.randrange(term_count) * TERM_SIZE
+        offset = rng.choice([0xFFFFFFFF, strings_size - 1,
+                             rng.randrange(strings_size)])
+        struct.pack_into('<I', data, term, offset)
+    return bytes(data)
+
+
+def main():
+    cli = cli_path()
+    work = tempfile.mkdtemp()
+    failures = 0
+    try:
+        engine = Engine(cli)
+        words = ['solar', 'sonar', 'polar', 'solstice', 'sol', 'wind',
+                 'window', 'windows', 'winding', 'a', 'ab', 'abc']
+        for doc_id, word in enumerate(words):
+            engine.request('index', f"d{doc_id}\n{word} {word} energy")
+        saved = os.path.join(work, 'saved.bin')
+        assert engine.request('save', saved)['success']
+        engine.close()
+        with open(saved, 'rb') as f:
+            data = f.read()
+
+        for seed in range(20):
+            path = os.path.join(work, f'corrupt{seed}.bin')
+            with open(path, 'wb') as f:
+                f.write(corrupt(data, seed))
+            engine = Engine(cli)
+            if not engine.request('load', path)['success']:
+                engine.close()
+                continue
+            for query in ('solr', 'windo', 'xyz', 'abcd', 'energi'):
+                for command in ('fuzzy', 'search'):
+                    try:
+                        engine.request(command, query)
+                    except ValueError:
+                        failures += 1
+                        print(f"seed {seed}: {command} {query} failed")
+            engine.close()
+            if engine.proc.returncode != 0:
+                failures += 1
+                print(f"seed {seed}: exit status {engine.proc.returncode}")
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,138 @@
+"""Fuzzy lookup finds exactly the words a brute-force edit distance finds
+(inserts, deletes, replacements and adjacent swaps), ranked nearest, then
+most frequent, then alphabetically, top 10, whether the words live in the
+in-memory trie, a loaded index file, or flushed segments and memory at
+once, a word in several of them counted once. A search miss suggests the
+first of them at the default distance.
+
+    python3 tests/test_fuzzy_matches.py ./searchCLI.exe
+"""
+import random
+import shutil
+import sys
+import tempfile
+
+from serve_engine import Engine, cli_path
+
+TOP_K = 10
+# Few letters, so words have many neighbours
+LETTERS = 'abcde'
+
+
+def distance(a, b):
+    """Edit distance with adjacent swaps (optimal string alignment)"""
+    rows = [list(range(len(b) + 1))]
+    for i in range(1, len(a) + 1):
+        row = [i] + [0] * len(b)
+        for j in range(1, len(b) + 1):
+            row[j] = min(rows[i - 1][j] + 1, row[j - 1] + 1,
+                         rows[i - 1][j - 1] + (a[i - 1] != b[j - 1]))
+            if (i > 1 and j > 1 and a[i - 1] == b[j - 2] and
+                    a[i - 2] == b[j - 1]):
+                row[j] = min(row[j], rows[i - 2][j - 2] + 1)
+        rows.append(row)
+    return rows[-1][-1]
+
+
+def auto_distance(word):
+    return 0 if len(word) < 3 else 1 if len(word) < 6 else 2
+
+
+def expected_matches(word, limit, words, frequency, doc_count):
+    """The ranked (word, distance, frequency, doc_count) within limit"""
+    matches = []
+    for other in words:
+        edits = distance(word, other)
+        if edits <= limit:
+            matches.append((edits, -frequency[other], other))
+    return [(other, edits, frequency[other], doc_count[other])
+            for edits, _, other in sorted(matches)[:TOP_K]]
+
+
+def typo(rng, word):
+    """word with one or two random edits"""
+    for _ in range(rng.randint(1, 2)):
+        i = rng.randrange(len(word) + 1)
+        kind = rng.randrange(4)
+        if kind == 0:
+            word = word[:i] + rng.choice(LETTERS) + word[i:]
+        elif kind == 1 and len(word) > 2 and i < len(word):
+            word = word[:i] + word[i + 1:]
+        elif kind == 2 and i < len(word):
+            word = word[:i] + rng.choice(LETTERS) + word[i + 1:]
+        elif i + 1 < len(word):
+            word = word[:i] + word[i + 1] + word[i] + word[i + 2:]
+    return word
+
+
+def check(engine, rng, what, words, frequency, doc_count):
+    failures = 0
+    vocab = sorted(words)
+    for _ in range(300):
+        word = typo(rng, rng.choice(vocab))
+        limit = rng.choice([None, 0, 1, 2])
+        payload = word if limit is None else f"{word} {limit}"
+        got = [(match['word'], match['distance'], match['frequency'],
+                match['doc_count'])
+               for match in engine.request('fuzzy', payload)['words']]
+        expected = expected_matches(
+            word, auto_distance(word) if limit is None else limit, words,
+            frequency, doc_count)
+        if got != expected:
+            failures += 1
+            print(f"{what} fuzzy {payload}: {got} != {expected}")
+
+        response = engine.request('search', word)
+        nearest = expected_matches(word, auto_distance(word), words,
+                                   frequency, doc_count)
+        suggestion = (nearest[0][0] if nearest and word not in words
+                      else None)
+        if response.get('did_you_mean') != suggestion:
+            failures += 1
+            print(f"{what} search {word}: suggested "
+                  f"{response.get('did_you_mean')}, expected {suggestion}")
+    return failures
+
+
+def main():
+    cli = cli_path()
+    rng = random.Random(22)
+    vocab = sorted({''.join(rng.choices(LETTERS, k=rng.randint(2, 8)))
+                    for _ in range(600)})
+    docs = [rng.choices(vocab, k=rng.randint(1, 20)) for _ in range(800)]
+    frequency, doc_count = {}, {}
+    for words in docs:
+        for word in words:
+            frequency[word] = frequency.get(word, 0) + 1
+        for word in set(words):
+            doc_count[word] = doc_count.get(word, 0) + 1
+    words = set(frequency)
+    failures = 0
+    directory = tempfile.mkdtemp()
+
+    memory = Engine(cli)
+    for doc_id, text in enumerate(docs):
+        memory.request('index', f"d{doc_id}\n{' '.join(text)}")
+    failures += check(memory, rng, 'trie', words, frequency, doc_count)
+    memory.request('save', f"{directory}/corpus.idx")
+    memory.request('load', f"{directory}/corpus.idx")
+    failures += check(memory, rng, 'index file', words, frequency, doc_count)
+    memory.close()
+
+    # Two flushed segments and the in-memory trie, sharing many words
+    mixed = Engine(cli)
+    mixed.request('open', f"{directory}/index")
+    for doc_id, text in enumerate(docs):
+        mixed.request('index', f"d{doc_id}\n{' '.join(text)}")
+        if doc_id in (300, 600):
+            mixed.request('flush')
+    failures += check(mixed, rng, 'segments', words, frequency, doc_count)
+    mixed.close()
+
+    shutil.rmtree(directory)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
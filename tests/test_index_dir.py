@@ -0,0 +1,56 @@
+"""A load or open that fails leaves the engine as it was: its documents
+still match, and an index directory it had open keeps taking documents.
+Empty paths are refused before any file is touched.
+
+    python3 tests/test_index_dir.py ./searchCLI.exe
+"""
+import os
+import shutil
+import sys
+import tempfile
+
+from serve_engine import Engine, cli_path
+
+
+def main():
+    work = tempfile.mkdtemp()
+    failures = 0
+    try:
+        engine = Engine(cli_path())
+        assert engine.request('open', os.path.join(work, 'idx'))['success']
+        engine.request('index', 'a.txt\ncats and dogs')
+        engine.request('flush')
+        engine.request('index', 'b.txt\ncats only')
+
+        missing = os.path.join(work, 'missing', 'idx')
+        for command, path in (('load', '/nonexistent'), ('load', work),
+                              ('open', missing), ('open', ''),
+                              ('open', ' \n'), ('load', ''), ('save', '')):
+            result = engine.request(command, path)
+            if result['success']:
+                failures += 1
+                print(f"{command} {path} succeeded")
+            found = engine.request('search', 'cats')
+            if [r['doc_id'] for r in found['results']] != [0, 1]:
+                failures += 1
+                print(f"after {command} {path}: search cats found "
+                      f"{found['results']}")
+
+        # Still attached to its directory: what it flushes reopens
+        engine.request('index', 'c.txt\ncats again')
+        engine.request('flush')
+        engine.close()
+        reopened = Engine(cli_path())
+        result = reopened.request('open', os.path.join(work, 'idx'))
+        if result.get('documents') != 3:
+            failures += 1
+            print(f"reopened directory: {result}")
+        reopened.close()
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
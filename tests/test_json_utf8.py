@@ -0,0 +1,47 @@
+"""Document names reach JSON intact when they are UTF-8, and as U+FFFD
+where they are not, so every response parses.
+
+    python3 tests/test_json_utf8.py ./searchCLI.exe
+"""
+import json
+import random
+import sys
+
+from serve_engine import Engine, cli_path
+
+
+def main():
+    random.seed(11)
+    engine = Engine(cli_path())
+    # Names long enough to cross the 16-byte SIMD blocks, mixing clean
+    # UTF-8, JSON specials, stray continuation bytes, truncated sequences,
+    # surrogates and bytes that never occur in UTF-8
+    pieces = [b'a', b'Z', b'"', b'\\', b'\x01', b'\x7f', 'é'.encode(),
+              '€'.encode(), '\U0001f600'.encode(), b'\x80', b'\xc3',
+              b'\xe2\x82', b'\xed\xa0\x80', b'\xf0\x9f', b'\xfe', b'\xff']
+    names = [b'bad\xff\xfename', 'café €'.encode()]
+    names += [b''.join(random.choices(pieces, k=random.randint(0, 40)))
+              for _ in range(2000)]
+    failures = 0
+    for name in names:
+        engine.send('index', name + b'\nword')
+        line = engine.proc.stdout.readline()
+        try:
+            got = json.loads(line)['filename']
+        except ValueError:
+            failures += 1
+            print('unparsable response', line[:80])
+            continue
+        # One U+FFFD per malformed byte, where Python folds some runs
+        expected = name.decode('utf-8', 'replace')
+        if got.replace('�', '') != expected.replace('�', '') or \
+                ('�' in got) != ('�' in expected):
+            failures += 1
+            print('name', name, 'came back as', repr(got))
+    engine.close()
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
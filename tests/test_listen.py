@@ -0,0 +1,160 @@
+"""The listen server answers as server mode does: pipelined requests come
+back once each, matched by id whatever their order, with the response
+'searchCLI serve' gives; concurrent clients get the same answers; a
+change acknowledged on one connection is seen by queries on every other;
+"format" applies to its own connection; a malformed header, a negative
+length or an oversized request is refused and its connection closed
+without affecting the rest; and "quit" stops the server.
+
+    python3 tests/test_listen.py ./searchCLI.exe
+"""
+import json
+import random
+import sys
+import threading
+
+from serve_engine import Engine, Listener, cli_path
+
+VOCAB = ['solar', 'wind', 'power', 'grid', 'energy', 'storage', 'panel',
+         'turbine', 'battery', 'cell', 'fossil', 'fuel']
+MAX_REQUEST_LEN = 64 << 20
+
+
+def queries(rng, count):
+    """Random (command, payload) queries of every kind a worker answers"""
+    out = []
+    for _ in range(count):
+        words = ' '.join(rng.sample(VOCAB, rng.randint(1, 3)))
+        out.append(rng.choice([
+            ('search', words.split()[0]),
+            ('freq', words.split()[0]),
+            ('multi', words),
+            ('rank', words),
+            ('term_stats', words),
+            ('phrase', words),
+            ('near', f"4 {words}"),
+            ('boolean', f"({words.replace(' ', ' OR ')}) AND NOT fuel"),
+            ('prefix', words[:2]),
+            ('fuzzy', words.split()[0][:-1] + 'x'),
+            ('batch', f"search {words.split()[0]}\nrank {words}"),
+        ]))
+    return out
+
+
+def main():
+    cli = cli_path()
+    rng = random.Random(29)
+    failures = 0
+
+    def check(what, got, expected):
+        nonlocal failures
+        if got != expected:
+            failures += 1
+            print(f"{what}: {str(got)[:200]} != {str(expected)[:200]}")
+
+    server = Listener(cli)
+    reference = Engine(cli)
+    writer = server.connect()
+    for doc_id in range(400):
+        text = ' '.join(rng.choices(VOCAB, k=rng.randint(1, 30)))
+        writer.request('index', f"d{doc_id}\n{text}")
+        reference.request('index', f"d{doc_id}\n{text}")
+    for doc_id in range(0, 400, 7):
+        writer.request('delete', str(doc_id))
+        reference.request('delete', str(doc_id))
+
+    # Pipelined: more requests than a connection may have running, sent
+    # before reading any answer, with ids up to the largest 64-bit one
+    asked = queries(rng, 600)
+    ids = rng.sample(range(1, 1 << 40), len(asked) - 1) + [(1 << 64) - 1]
+    pipelined = server.connect()
+    sender = threading.Thread(target=lambda: [
+        pipelined.send(request_id, *query)
+        for request_id, query in zip(ids, asked)])
+    sender.start()
+    answers = {}
+    for _ in asked:
+        response = pipelined.receive()
+        if response is None:
+            break
+        if response[0] in answers:
+            check(f"id {response[0]}", 'answered twice', 'once')
+        answers[response[0]] = response[1]
+    sender.join()
+    check('pipelined answers', len(answers), len(asked))
+    for request_id, (command, payload) in zip(ids, asked):
+        if request_id in answers:
+            check(f"{command} {payload!r}", json.loads(answers[request_id]),
+                  reference.request(command, payload))
+    pipelined.close()
+
+    # Concurrent clients, each waiting for its answers
+    asked = queries(rng, 800)
+    expected = [reference.request(command, payload)
+                for command, payload in asked]
+    got = [None] * len(asked)
+
+    def client(first):
+        conn = server.connect()
+        for i in range(first, len(asked), 8):
+            got[i] = conn.request(*asked[i])
+        conn.close()
+    threads = [threading.Thread(target=client, args=(n,)) for n in range(8)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    for i, (command, payload) in enumerate(asked):
+        check(f"concurrent {command} {payload!r}", got[i], expected[i])
+
+    # Changes are seen at once on other connections
+    reader = server.connect()
+    doc_id = writer.request('index', 'new\nzebra solar')['doc_id']
+    reference.request('index', 'new\nzebra solar')
+    check('search after index', reader.request('search', 'zebra'),
+          reference.request('search', 'zebra'))
+    writer.request('delete', str(doc_id))
+    reference.request('delete', str(doc_id))
+    check('search after delete', reader.request('search', 'zebra'),
+          reference.request('search', 'zebra'))
+    check('stop words', writer.request('stopwords', 'solar')['success'], True)
+    reference.request('stopwords', 'solar')
+    check('rank after stopwords', reader.request('rank', 'solar wind'),
+          reference.request('rank', 'solar wind'))
+
+    # Binary responses on one connection only
+    binary = server.connect()
+    binary.request('format', 'binary')
+    binary.send(1, 'search', 'wind')
+    check('binary response', binary.receive()[1][:1] != b'{', True)
+    check('JSON on another connection', reader.request('search', 'wind'),
+          reference.request('search', 'wind'))
+    binary.close()
+
+    # Refused requests close their own connection only
+    for header, request_id, error in [
+            (f"5 search {MAX_REQUEST_LEN + 1}\n", 5, 'Request too large'),
+            ("6 search -5\n", 6, 'Negative request length'),
+            ("5 search\n", 0, 'Malformed request header'),
+            ('x' * 200, 0, 'Malformed request header')]:
+        bad = server.connect()
+        bad.sock.sendall(header.encode())
+        response = bad.receive()
+        check(f"refused {header[:20]!r}",
+              response and (response[0], json.loads(response[1])),
+              (request_id, {'success': False, 'error': error}))
+        check(f"hung up after {header[:20]!r}", bad.receive(), None)
+        bad.close()
+    check('search after refusals', reader.request('search', 'wind'),
+          reference.request('search', 'wind'))
+
+    reader.close()
+    writer.close()
+    reference.close()
+    check('exit status', server.close(), 0)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,67 @@
+"""BM25 ranking after deletes in sealed segments: every score stays
+non-negative, a document matching both keywords outranks one matching
+either, and term_stats counts the documents rank does, so a coordinator's
+summed statistics score the same.
+
+    python3 tests/test_rank_deletes.py ./searchCLI.exe
+"""
+import sys
+
+from serve_engine import Engine, cli_path
+
+DOCUMENTS = ['dog cat', 'dog bird', 'dog fish', 'dog cow', 'cow hen']
+
+
+def check(name, engine):
+    """Failures of one engine holding DOCUMENTS with 0 and 1 deleted"""
+    failures = 0
+    ranked = engine.request('rank', 'dog cow')['results']
+    scores = {r['doc_id']: r['score'] for r in ranked}
+    if sorted(scores) != [2, 3, 4]:
+        failures += 1
+        print(f"{name}: ranked {sorted(scores)}, expected [2, 3, 4]")
+    if any(score < 0 for score in scores.values()):
+        failures += 1
+        print(f"{name}: negative score in {scores}")
+    if scores and max(scores, key=scores.get) != 3:
+        failures += 1
+        print(f"{name}: d3 (dog and cow) is not first in {scores}")
+
+    stats = engine.request('term_stats', 'dog cow')
+    for term in stats['terms']:
+        found = engine.request('search', term['word'])
+        if term['total_freq'] != found['total_freq']:
+            failures += 1
+            print(f"{name}: term_stats {term['word']} total_freq "
+                  f"{term['total_freq']}, search {found['total_freq']}")
+    doc_freqs = ' '.join(str(term['doc_freq']) for term in stats['terms'])
+    given = engine.request(
+        'rank', f"dog cow\n{stats['documents']} {stats['words']} {doc_freqs}")
+    if {r['doc_id']: r['score'] for r in given['results']} != scores:
+        failures += 1
+        print(f"{name}: scores with its own term_stats differ")
+    return failures
+
+
+def main():
+    cli = cli_path()
+    failures = 0
+    # Sealed by an explicit flush, and by the snapshot the first query takes
+    for flush in (True, False):
+        engine = Engine(cli)
+        for doc_id, text in enumerate(DOCUMENTS):
+            assert engine.request('index', f"d{doc_id}\n{text}")['success']
+        if flush:
+            engine.request('flush')
+        else:
+            engine.request('search', 'dog')
+        engine.request('delete', '0')
+        engine.request('delete', '1')
+        failures += check('flush' if flush else 'snapshot', engine)
+        engine.close()
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,63 @@
+"""Ranking a corpus split across shards, as the bridge does, gives one
+engine's top 10 exactly: the same documents, scores and order, near-ties
+and the cutoff included.
+
+    python3 tests/test_rank_shards.py ./searchCLI.exe
+"""
+import random
+import sys
+
+from serve_engine import Engine, cli_path
+
+SHARDS = 3
+
+
+def sharded_rank(shards, query):
+    """The bridge's scatter-gather rank over shards holding every
+    SHARDS-th document, with global doc ids"""
+    stats = [shard.request('term_stats', query) for shard in shards]
+    doc_freqs = [sum(s['terms'][i]['doc_freq'] for s in stats)
+                 for i in range(len(stats[0]['terms']))]
+    corpus = ' '.join(str(n) for n in
+                      [sum(s['documents'] for s in stats),
+                       sum(s['words'] for s in stats)] + doc_freqs)
+    results = []
+    for number, shard in enumerate(shards):
+        for doc in shard.request('rank', f"{query}\n{corpus}")['results']:
+            results.append((doc['doc_id'] * SHARDS + number, doc['score']))
+    results.sort(key=lambda doc: (-doc[1], doc[0]))
+    return results[:10]
+
+
+def main():
+    cli = cli_path()
+    random.seed(5)
+    vocab = ['solar', 'wind', 'power', 'grid', 'energy', 'storage', 'panel',
+             'turbine', 'battery', 'cell']
+    single = Engine(cli)
+    shards = [Engine(cli) for _ in range(SHARDS)]
+    # Few words, so many documents tie or nearly tie
+    for doc_id in range(3000):
+        text = ' '.join(random.choices(vocab, k=random.randint(1, 60)))
+        single.request('index', f"d{doc_id}\n{text}")
+        shards[doc_id % SHARDS].request('index', f"d{doc_id}\n{text}")
+
+    failures = 0
+    queries = [' '.join(random.sample(vocab, random.randint(1, 4)))
+               for _ in range(300)]
+    for query in queries:
+        expected = [(doc['doc_id'], doc['score']) for doc in
+                    single.request('rank', query)['results']]
+        got = sharded_rank(shards, query)
+        if got != expected:
+            failures += 1
+            print(f"rank {query}: {got} != {expected}")
+    single.close()
+    for shard in shards:
+        shard.close()
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
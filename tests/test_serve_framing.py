@@ -0,0 +1,42 @@
+"""Server mode refuses a request header it cannot frame by: a malformed
+one, a negative length or one above MAX_REQUEST_LEN each get their own
+error, and the server stops, as the next request cannot be found. Before
+that, well-formed requests are answered as usual.
+
+    python3 tests/test_serve_framing.py ./searchCLI.exe
+"""
+import json
+import subprocess
+import sys
+
+from serve_engine import cli_path
+
+MAX_REQUEST_LEN = 64 << 20
+
+
+def main():
+    cli = cli_path()
+    failures = 0
+    for header, error in [
+            (b"search -5\n", 'Negative request length'),
+            (b"search -0\n", 'Negative request length'),
+            (f"search {MAX_REQUEST_LEN + 1}\n".encode(), 'Request too large'),
+            (b"search\n", 'Malformed request header'),
+            (b"search five\n", 'Malformed request header')]:
+        requests = b"index 7\nd\nsolar" + header + b"quit 0\n"
+        proc = subprocess.run([cli, 'serve'], input=requests,
+                              stdout=subprocess.PIPE, timeout=30)
+        lines = proc.stdout.splitlines()
+        got = [json.loads(line) for line in lines]
+        expected = [{'success': True, 'doc_id': 0, 'filename': 'd',
+                     'word_count': 1},
+                    {'success': False, 'error': error}]
+        if got != expected or proc.returncode != 1:
+            failures += 1
+            print(f"{header!r}: {got}, exit {proc.returncode}")
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,115 @@
+"""Queries read whole published versions while the writer keeps changing
+the engine. A listen server's writer indexes, deletes and flushes segments
+into an index directory, merging them in the background, while reader
+threads query on worker threads. Every answer must be the state after
+some prefix of the writer's changes, never an earlier one than the same
+reader saw before, and never one missing a change acknowledged before the
+query was sent. Build with -fsanitize=address to see retired versions are
+freed only once no reader holds them.
+
+    python3 tests/test_snapshots.py ./searchCLI.exe
+"""
+import random
+import shutil
+import sys
+import tempfile
+import threading
+
+from serve_engine import Listener, cli_path
+
+OPS = 1500
+READERS = 4
+
+
+def main():
+    cli = cli_path()
+    rng = random.Random(15)
+    failures = 0
+    directory = tempfile.mkdtemp()
+    server = Listener(cli)
+    writer = server.connect()
+    writer.request('open', f"{directory}/index")
+
+    # The writer's changes, and the live documents after each prefix of
+    # them; a flush leaves the state as it was
+    ops, states, live = [], [frozenset()], []
+    for op in range(OPS):
+        if op % 50 == 49:
+            ops.append(('flush', ''))
+        elif live and rng.random() < 0.2:
+            ops.append(('delete', str(live.pop(rng.randrange(len(live))))))
+        else:
+            doc_id = len(ops) - sum(1 for command, _ in ops
+                                    if command != 'index')
+            text = ' '.join(['alpha'] + rng.choices(['beta', 'gamma'], k=5))
+            ops.append(('index', f"d{doc_id}\n{text}"))
+            live.append(doc_id)
+        states.append(frozenset(live))
+    # The prefixes each state is the result of
+    prefixes = {}
+    for done, state in enumerate(states):
+        first, _ = prefixes.get(state, (done, done))
+        prefixes[state] = (first, done)
+
+    acked = 0
+    stop = threading.Event()
+    errors = []
+
+    def reader(number):
+        conn = server.connect()
+        seen = 0
+        queries = 0
+        while not stop.is_set() or queries == 0:
+            before = acked
+            command = 'search' if queries % 2 else 'boolean'
+            response = conn.request(command, 'alpha')
+            queries += 1
+            found = frozenset(doc['doc_id'] for doc in response['results'])
+            if found not in prefixes:
+                errors.append(f"reader {number}: {command} found "
+                              f"{len(found)} documents, no state of the "
+                              f"writer's")
+                break
+            first, last = prefixes[found]
+            if last < seen or last < before:
+                errors.append(f"reader {number}: state after {first}-{last} "
+                              f"changes, having seen {seen} and been told "
+                              f"of {before}")
+            seen = max(seen, first)
+        conn.close()
+
+    threads = [threading.Thread(target=reader, args=(n,))
+               for n in range(READERS)]
+    for thread in threads:
+        thread.start()
+    for done, (command, payload) in enumerate(ops, 1):
+        response = writer.request(command, payload)
+        if not response['success'] or (
+                command == 'index' and
+                f"d{response['doc_id']}" != payload.split('\n')[0]):
+            errors.append(f"{command} {payload[:10]!r}: {response}")
+        acked = done
+    stop.set()
+    for thread in threads:
+        thread.join()
+    for error in errors[:20]:
+        print(error)
+    failures += len(errors)
+
+    final = frozenset(doc['doc_id'] for doc in
+                      writer.request('search', 'alpha')['results'])
+    if final != states[-1]:
+        failures += 1
+        print(f"final search: {len(final)} documents, "
+              f"expected {len(states[-1])}")
+    writer.close()
+    if server.close() != 0:
+        failures += 1
+        print('listen server failed')
+    shutil.rmtree(directory)
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
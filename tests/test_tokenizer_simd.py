@@ -0,0 +1,132 @@
+"""The vector tokenizer kernel splits and lowercases text exactly as the
+scalar loop does. A text shorter than one 32-byte block takes the scalar
+loop only; padded with delimiters to a whole block it takes the kernel
+only, so two engines indexing the one and the other must agree on every
+word, frequency and word count. Long texts shifted across block
+boundaries must also agree with themselves, tokens split between blocks,
+cut at the word length limit or finished in the scalar tail included. A
+build without a kernel checks the scalar loop against itself.
+
+    python3 tests/test_tokenizer_simd.py ./searchCLI.exe
+"""
+import random
+import sys
+
+from serve_engine import Engine, cli_path
+
+BLOCK = 32
+DELIMS = b' \t\n\r.,;:!?"\'()[]{}'
+# Bytes next to the letter ranges and the case bit, which a kernel's range
+# checks could get wrong
+EDGES = b'@[`{\\^_~-0179/*'
+NON_ASCII = ['é', 'ß', 'Ω', 'ἀ', 'Ж']
+RAW = [b'\x80', b'\xbf', b'\xc3', b'\xff']
+
+
+def piece(rng):
+    """A few bytes of text: letters, delimiters, edge bytes, UTF-8 letters
+    or stray high bytes"""
+    kind = rng.random()
+    if kind < 0.55:
+        return bytes(rng.choice(b'abcxyzABCXYZ') for _ in
+                     range(rng.randint(1, 6)))
+    if kind < 0.75:
+        return bytes([rng.choice(DELIMS)])
+    if kind < 0.85:
+        return bytes([rng.choice(EDGES)])
+    if kind < 0.95:
+        return rng.choice(NON_ASCII).encode('utf-8')
+    return rng.choice(RAW)
+
+
+def text(rng, size):
+    """Random text of at most size bytes"""
+    out = b''
+    while True:
+        nxt = piece(rng)
+        if len(out) + len(nxt) > size:
+            return out
+        out += nxt
+
+
+def long_text(rng):
+    """Text spanning several blocks, sometimes with a token longer than the
+    word length limit"""
+    out = text(rng, rng.randint(BLOCK + 1, 10 * BLOCK))
+    if rng.random() < 0.3:
+        run = bytes(rng.choice(b'abAB') for _ in range(rng.randint(90, 150)))
+        cut = rng.randint(0, len(out))
+        out = out[:cut] + run + out[cut:]
+    return out
+
+
+def postings(engine, words):
+    """Each word's search results as (doc_id, frequency, word_count)"""
+    return {word: [(doc['doc_id'], doc['frequency'], doc['word_count'])
+                   for doc in engine.request('search', word)['results']]
+            for word in words}
+
+
+def main():
+    cli = cli_path()
+    rng = random.Random(13)
+    failures = 0
+
+    # Scalar loop against kernel: the same texts, short and block-padded
+    scalar, vector = Engine(cli), Engine(cli)
+    for doc_id in range(2000):
+        body = text(rng, BLOCK - 1)
+        lead = rng.randint(0, BLOCK - len(body))
+        pad = bytes(rng.choice(DELIMS) for _ in range(BLOCK - len(body)))
+        scalar.send('index', b'd\n' + body)
+        vector.send('index', b'd\n' + pad[:lead] + body + pad[lead:])
+        for engine in (scalar, vector):
+            engine.proc.stdout.readline()
+    words = sorted(scalar.request('vocabulary')['terms'])
+    vector_words = sorted(vector.request('vocabulary')['terms'])
+    if words != vector_words:
+        failures += 1
+        print(f"vocabulary: {len(words)} scalar words, "
+              f"{len(vector_words)} vector words, first differences",
+              sorted(set(words) ^ set(vector_words))[:10])
+    expected, got = postings(scalar, words), postings(vector, words)
+    for word in words:
+        if got[word] != expected[word]:
+            failures += 1
+            print(f"search {word!r}: {got[word][:5]} != {expected[word][:5]}")
+    for _ in range(300):
+        phrase = ' '.join(rng.sample(words, 2))
+        if (vector.request('phrase', phrase)['results'] !=
+                scalar.request('phrase', phrase)['results']):
+            failures += 1
+            print(f"phrase {phrase!r} differs")
+    scalar.close()
+    vector.close()
+
+    # Every shift of a long text against a block boundary tokenizes alike
+    shifted = Engine(cli)
+    texts = [long_text(rng) for _ in range(40)]
+    for body in texts:
+        for shift in range(BLOCK):
+            lead = bytes(rng.choice(DELIMS) for _ in range(shift))
+            shifted.request('index', b'd\n' + lead + body)
+    for word, results in postings(
+            shifted, shifted.request('vocabulary')['terms']).items():
+        groups = {}
+        for doc_id, frequency, word_count in results:
+            groups.setdefault(doc_id // BLOCK, set()).add(
+                (frequency, word_count))
+        for group, counts in groups.items():
+            matched = sum(1 for doc in results if doc[0] // BLOCK == group)
+            if len(counts) != 1 or matched != BLOCK:
+                failures += 1
+                print(f"text {group} word {word!r}: found in {matched} of "
+                      f"{BLOCK} shifts as {sorted(counts)}")
+    shifted.close()
+
+    print('failures', failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
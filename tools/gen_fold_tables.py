@@ -0,0 +1,132 @@
+"""Generate the UTF-8 folding tables in searchEngine.c.
+
+Prints fold_latin, fold_latin_additional, fold_greek_cyrillic,
+fold_greek_extended and fold_ligatures, with their comments, from Python's
+Unicode character database; they replace the ones under UTF-8 FOLDING
+there. fold_dropped lists whole blocks and is kept by hand.
+
+A Latin letter folds to its NFKD decomposition without combining marks,
+lowercased, when that is one or two ASCII letters; letters that do not
+decompose but have an ASCII reading (SPECIAL) fold to it; other letters
+are lowercased where that takes no more bytes, and kept otherwise; and
+anything that is not a letter is dropped. Greek and Cyrillic letters are
+lowercased, Greek ones without accents, and final sigma is sigma; the
+polytonic letters of Greek Extended fold the same way, to the basic Greek
+letter under their breathings, accents and iota subscripts.
+
+    python3 tools/gen_fold_tables.py > tables.inc
+
+The tables in the tree come from Unicode 14.0 (Python 3.11).
+"""
+import unicodedata
+
+SPECIAL = {
+    'ß': 'ss', 'ẞ': 'ss', 'æ': 'ae', 'Æ': 'ae', 'œ': 'oe', 'Œ': 'oe',
+    'ø': 'o', 'Ø': 'o', 'đ': 'd', 'Đ': 'd', 'ð': 'd', 'Ð': 'd',
+    'þ': 'th', 'Þ': 'th', 'ł': 'l', 'Ł': 'l', 'ħ': 'h', 'Ħ': 'h',
+    'ı': 'i', 'ĸ': 'k', 'ŋ': 'n', 'Ŋ': 'n', 'ŧ': 't', 'Ŧ': 't',
+    'ŀ': 'l', 'Ŀ': 'l', 'ŉ': 'n', 'ſ': 's',
+}
+
+
+def strip_marks(text, form):
+    """text decomposed in form, without its combining marks"""
+    return ''.join(c for c in unicodedata.normalize(form, text)
+                   if not unicodedata.combining(c))
+
+
+def fold_latin(code_point):
+    """What a Latin code point folds to: "" drops it, None keeps it"""
+    c = chr(code_point)
+    if c in SPECIAL:
+        return SPECIAL[c]
+    if not unicodedata.category(c).startswith('L'):
+        return ''
+    ascii_letters = ''.join(x for x in strip_marks(c, 'NFKD').lower()
+                            if 'a' <= x <= 'z')
+    if ascii_letters and len(ascii_letters) <= 2:
+        return ascii_letters
+    lower = c.lower()
+    if len(lower) == 1 and lower != c and \
+            len(lower.encode('utf-8')) <= len(c.encode('utf-8')):
+        return lower
+    return None
+
+
+def fold_greek_cyrillic(code_point):
+    """The code point a Greek, Cyrillic or Greek Extended one folds to; 0
+    drops it"""
+    c = chr(code_point)
+    category = unicodedata.category(c)
+    if not category.startswith('L'):
+        return 0 if category[0] in 'MSP' or category == 'Cn' else code_point
+    lower = c.lower()
+    if len(lower) != 1:
+        lower = c
+    if code_point < 0x400 or code_point >= 0x1F00:
+        base = strip_marks(lower, 'NFD').lower()
+        if len(base) == 1:
+            lower = base
+        if lower == 'ς':
+            lower = 'σ'
+    return ord(lower)
+
+
+def c_string(text):
+    """text as a C string literal, bytes from 0x80 up as escapes"""
+    return '"' + ''.join(x if x.isascii() else
+                         ''.join(f'\\x{b:02x}' for b in x.encode('utf-8'))
+                         for x in text) + '"'
+
+
+def print_array(items):
+    """Array items, wrapped at 80 columns with a two-space indent"""
+    line = ' '
+    for item in items:
+        if len(line) + len(item) + 2 > 78:
+            print(line)
+            line = ' '
+        line += f' {item},'
+    print(line)
+
+
+def print_string_table(name, lo, hi):
+    print(f'const char *const {name}[0x{hi:X} - 0x{lo:X} + 1] = {{')
+    print_array('NULL' if s is None else c_string(s)
+                for s in map(fold_latin, range(lo, hi + 1)))
+    print('};')
+
+
+def main():
+    print('/* Latin-1 Supplement and Latin Extended-A and -B, U+00A0 .. U+024F:'
+          ' what\n * each code point folds to; "" drops it and NULL keeps it'
+          ' as it is */')
+    print_string_table('fold_latin', 0xA0, 0x24F)
+    print()
+    print('/* Latin Extended Additional, U+1E00 .. U+1EFF, as fold_latin */')
+    print_string_table('fold_latin_additional', 0x1E00, 0x1EFF)
+    print()
+    print('/* Greek and Cyrillic, U+0370 .. U+04FF: the lowercase code point,'
+          ' without\n * Greek accents; 0 drops it */')
+    print('const uint16_t fold_greek_cyrillic[0x4FF - 0x370 + 1] = {')
+    print_array(f'0x{v:03X}' if v else '0'
+                for v in map(fold_greek_cyrillic, range(0x370, 0x500)))
+    print('};')
+    print()
+    print('/* Greek Extended, U+1F00 .. U+1FFF: the basic lowercase Greek'
+          ' letter,\n * without breathings, accents or iota subscript;'
+          ' 0 drops it */')
+    print('const uint16_t fold_greek_extended[0x1FFF - 0x1F00 + 1] = {')
+    print_array(f'0x{v:03X}' if v else '0'
+                for v in map(fold_greek_cyrillic, range(0x1F00, 0x2000)))
+    print('};')
+    print()
+    ligatures = [c_string(strip_marks(chr(cp), 'NFKD'))
+                 for cp in range(0xFB00, 0xFB07)]
+    print('/* Ligatures U+FB00 .. U+FB06 */')
+    print('const char *const fold_ligatures[0xFB06 - 0xFB00 + 1] = {')
+    print('    ' + ', '.join(ligatures) + '};')
+
+
+if __name__ == '__main__':
+    main()
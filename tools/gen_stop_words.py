@@ -0,0 +1,112 @@
+"""Generate the built-in stop word table in searchEngine.c.
+
+Prints the DEFAULT_STOP_* defines and the default_stop_displacements and
+default_stop_slots arrays; they replace the ones under STOP WORDS there.
+The table is a hash and displace perfect hash, placed the way
+place_stop_words places one at runtime, so the hashes below must match
+hash_func and stop_word_slot.
+
+    python3 tools/gen_stop_words.py > table.inc
+"""
+import sys
+
+MASK = 0xffffffff
+
+# The list the engine leaves out by default (stopwords default)
+WORDS = """
+about above after again against all am an and any are as at be because been
+before being below between both but by can did do does doing down during each
+few for from further had has have having he her here hers herself him himself
+his how if in into is it its itself just me more most my myself no nor not now
+of off on once only or other our ours ourselves out over own same she should
+so some such than that the their theirs them themselves then there these they
+this those through to too under until up very was we were what when where
+which while who whom why will with you your yours yourself yourselves
+""".split()
+
+
+def hash_func(word):
+    """djb2 with a finalizer, as hash_func"""
+    h = 5381
+    for c in word.encode('utf-8'):
+        h = ((h << 5) + h + c) & MASK
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & MASK
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & MASK
+    h ^= h >> 16
+    return h
+
+
+def stop_word_slot(h, displacement):
+    """A word's slot hash under a displacement, as stop_word_slot"""
+    h ^= (displacement * 0x9E3779B9) & MASK
+    h ^= h >> 15
+    h = (h * 0x2c1b3c6d) & MASK
+    h ^= h >> 12
+    h = (h * 0x297a2d39) & MASK
+    h ^= h >> 15
+    return h
+
+
+def build(words):
+    """Slot count, per-bucket displacements and slots for words, sized as
+    build_stop_words sizes them: slots at least twice the words, a bucket
+    per four words"""
+    words = sorted(set(w for w in words if len(w) >= 2))
+    slot_count = 8
+    while slot_count < 2 * len(words):
+        slot_count *= 2
+    bucket_count = max(1, (len(words) + 3) // 4)
+    members = [[] for _ in range(bucket_count)]
+    for word in words:
+        members[hash_func(word) % bucket_count].append(word)
+
+    # Biggest buckets first, while the most slots are free
+    order = sorted(range(bucket_count), key=lambda b: (-len(members[b]), b))
+    slots = [None] * slot_count
+    displacements = [0] * bucket_count
+    for b in order:
+        for d in range(1 << 16):
+            taken = [stop_word_slot(hash_func(w), d) & (slot_count - 1)
+                     for w in members[b]]
+            if len(set(taken)) == len(taken) and \
+                    all(slots[s] is None for s in taken):
+                for s, word in zip(taken, members[b]):
+                    slots[s] = word
+                displacements[b] = d
+                break
+        else:
+            sys.exit(f'no displacement places bucket {b}')
+    return words, slot_count, bucket_count, displacements, slots
+
+
+def print_array(items):
+    """Array items, wrapped at 80 columns with a two-space indent"""
+    line = ' '
+    for item in items:
+        if len(line) + len(item) + 2 > 78:
+            print(line)
+            line = ' '
+        line += f' {item},'
+    print(line)
+
+
+def main():
+    words, slot_count, bucket_count, displacements, slots = build(WORDS)
+    print(f'#define DEFAULT_STOP_WORDS {len(words)}')
+    print(f'#define DEFAULT_STOP_SLOTS {slot_count}')
+    print(f'#define DEFAULT_STOP_BUCKETS {bucket_count}')
+    print()
+    print('const uint16_t default_stop_displacements[DEFAULT_STOP_BUCKETS]'
+          ' = {')
+    print_array(str(d) for d in displacements)
+    print('};')
+    print()
+    print('const char *const default_stop_slots[DEFAULT_STOP_SLOTS] = {')
+    print_array(f'"{w}"' if w else 'NULL' for w in slots)
+    print('};')
+
+
+if __name__ == '__main__':
+    main()